@@ -6,7 +6,7 @@
 // their GFX library for this project.
 #include <Arduino.h>
 #include <Adafruit_Protomatter.h>
-#include "simulation.h"
+#include <simulation.h>
 
 // C definitions for the LED matrix and the simulation
 #define matrix_chain_width 64 // total matrix chain width (width of the array)
@@ -0,0 +1,151 @@
+/*
+ Animation stored as one file of display ready frames, so playing it
+ doesn't need a directory lookup, an open and a FAT walk per frame. The
+ file is opened and its index read once, after that every frame is a
+ single multi-sector read. When the file is contiguous on the card (as
+ it is on a freshly formatted card) the reads go straight to the card
+ sectors, bypassing the filesystem.
+
+ Layout, everything little endian:
+ - Header sector (512 bytes): magic "IMPANIM1", width and height (16 bit,
+   must be frameWidth and frameHeight), frame count (16 bit), a spare 16
+   bits, the rest zero.
+ - Index: 8 bytes per frame from byte 512, padded to a whole sector:
+   offset of the frame in the file (32 bit, a multiple of 512), delay
+   before the next frame in milliseconds (16 bit), 16 spare bits.
+ - Frames: width*height RGB565 pixels, row by row from the top left,
+   each one starting on a sector boundary.
+*/
+#pragma once
+#include <Arduino.h>
+#include <SdFat.h> // Adafruit's Fork of SD
+#include <alignedWriter.h> // sdSectorSize
+#include <frameCache.h> // frameWidth and frameHeight
+
+#define animationPackMagic "IMPANIM1"
+#define animationPackExtension ".anim"
+#define animationPackMaxFrames 256
+#define animationPackIndexEntry 8
+#define animationPackFrameSectors ((frameWidth*frameHeight*2+sdSectorSize-1)/sdSectorSize)
+
+class animationPack{
+  private:
+    SdFat32 *SDCard;
+    File32 file;
+    char filePath[frameCachePathLen] = "";
+    uint32_t firstSector = 0; // Sector of the file start, 0 if not contiguous
+    uint16_t frameCount = 0;
+    uint16_t nextFrame = 0;
+    uint32_t frameOffset[animationPackMaxFrames]; // In sectors from the file start
+    uint16_t frameDelay[animationPackMaxFrames]; // Milliseconds
+    uint16_t pixels[animationPackFrameSectors*sdSectorSize/2]; // Last frame read
+
+    int readIndex();
+
+  public:
+    animationPack(SdFat32 *SDOpen) { SDCard = SDOpen; }
+    static bool isPackName(const char *name);
+    int open(const char *path);
+    void close();
+    bool isOpen() { return file.isOpen(); }
+    bool isContiguous() { return firstSector!=0; }
+    const char* path() { return filePath; }
+    // Plays the animation again from its first frame
+    void rewind() { nextFrame = 0; }
+    bool isFinished() { return nextFrame>=frameCount; }
+    const uint16_t* readNextFrame(uint16_t &delayMillis);
+    uint32_t frameBytes() { return animationPackFrameSectors*sdSectorSize; }
+};
+
+// True if the file name has the extension of a pack
+bool animationPack::isPackName(const char *name){
+  size_t len = strlen(name);
+  size_t extLen = strlen(animationPackExtension);
+  return len>extLen && strcasecmp(&name[len-extLen],animationPackExtension)==0;
+}
+
+// Opens the pack and reads its header and index.
+// Returns 0 on success, 1 if it can't be opened or isn't a valid pack.
+int animationPack::open(const char *path){
+  close();
+  if(!file.open(path,O_RDONLY)){
+    return 1;
+  }
+  if(readIndex()){
+    close();
+    return 1;
+  }
+  strncpy(filePath,path,sizeof(filePath)-1);
+  filePath[sizeof(filePath)-1] = '\0';
+  // Frames are only read straight from the card if the file is in one
+  // piece, otherwise through the file
+  uint32_t endSector;
+  if(!file.contiguousRange(&firstSector,&endSector)){
+    firstSector = 0;
+  }
+  return 0;
+}
+
+// Reads the header and the index, checking every frame lies inside the
+// file. Returns 0 if they are valid.
+int animationPack::readIndex(){
+  uint8_t sector[sdSectorSize];
+  if(file.read(sector,sizeof(sector))!=(int)sizeof(sector) ||
+     memcmp(sector,animationPackMagic,8)!=0 ||
+     (sector[8] | (sector[9] << 8))!=frameWidth ||
+     (sector[10] | (sector[11] << 8))!=frameHeight){
+    return 1;
+  }
+  frameCount = sector[12] | (sector[13] << 8);
+  nextFrame = 0;
+  if(frameCount==0 || frameCount>animationPackMaxFrames){
+    return 1;
+  }
+  uint32_t fileSectors = file.fileSize()/sdSectorSize;
+  for(uint16_t i=0;i<frameCount;i++){
+    uint16_t at = (i*animationPackIndexEntry)%sdSectorSize;
+    if(at==0 && file.read(sector,sizeof(sector))!=(int)sizeof(sector)){
+      return 1;
+    }
+    const uint8_t *entry = &sector[at];
+    uint32_t offset = entry[0] | (entry[1] << 8) | ((uint32_t)entry[2] << 16) | ((uint32_t)entry[3] << 24);
+    if(offset%sdSectorSize!=0 || offset/sdSectorSize+animationPackFrameSectors>fileSectors){
+      return 1;
+    }
+    frameOffset[i] = offset/sdSectorSize;
+    frameDelay[i] = entry[4] | (entry[5] << 8);
+  }
+  return 0;
+}
+
+void animationPack::close(){
+  if(file.isOpen()){
+    file.close();
+  }
+  filePath[0] = '\0';
+  firstSector = 0;
+  frameCount = 0;
+  nextFrame = 0;
+}
+
+// Reads the next frame of the animation, one multi-sector read, and sets
+// delayMillis to the time it stays on. Returns NULL if the animation is
+// finished or the read failed.
+const uint16_t* animationPack::readNextFrame(uint16_t &delayMillis){
+  if(!file.isOpen() || nextFrame>=frameCount){
+    return NULL;
+  }
+  uint16_t frame = nextFrame++;
+  bool ok;
+  if(firstSector!=0){
+    ok = SDCard->card()->readSectors(firstSector+frameOffset[frame],(uint8_t*)pixels,animationPackFrameSectors);
+  }else{
+    ok = file.seekSet(frameOffset[frame]*sdSectorSize) &&
+         file.read(pixels,sizeof(pixels))==(int)sizeof(pixels);
+  }
+  if(!ok){
+    return NULL;
+  }
+  delayMillis = frameDelay[frame];
+  return pixels;
+}
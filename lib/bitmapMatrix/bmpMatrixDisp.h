@@ -7,68 +7,26 @@
 #include <sdios.h>
 #include <Adafruit_Protomatter.h>
 #include <SdFat.h> // Adafruit's Fork of SD
-#include <Adafruit_Protomatter.h>
 #include <ErrorsDefs.h> // Show the runtime errors on the matrix
+#include <bmpStreamDecoder.h> // Decodes the image as it is read
+#include <frameCache.h> // Keeps decoded images in RAM
+#include <virtualCanvas.h> // Maps the frames onto the panels
 
-// Variables for decoding the BMP image
-// from the SD card and display them on the matrix
+// Buffer used to read the BMP image from the SD card, one sector at a time
 char fileBuffer[512]={};
 
-// Struct represnting the file header information of the
-// bitmap file. 
-struct bmpFile{
-  // Bitmap File Header
-  uint16_t fileType;
-  uint64_t  fileSize;
-  uint32_t reserved; // 4 bytes of reserved area
-  uint64_t  pixelDataOffset;
-  // End File Header
-  //Bitmap Info Header
-  // These fields are for the BITMAPINFOHEADER type of BMP header
-  // If it is a newer type, then it will ignore the rest of the fields
-  uint64_t  headerSize;
-  uint64_t  imageWidth;
-  uint64_t  imageHeight;
-  uint32_t  planes;
-  uint32_t  bitsPerPixel;
-  uint64_t  compression;
-  uint64_t  imageSize;
-  uint64_t  xPixelsPerMeter;
-  uint64_t  yPixeslPerMeter;
-  uint64_t  totalColors;
-  uint64_t  importantColors;
-  // Ignore all other fields up until headerSize-40
-} bmpFile;
-
-// Struct representing the file format for 32 bits per pixel 
-// bitmap images
-// NOTE: 16bpp and 32bpp images are always stored uncompressed
-union bpp32Format{
-  uint32_t pixelBytes;
-  struct {
-  // Ordering is weird due to Adafruit's
-  // read function "undoing" the LE encoding 
-  // of the bytes when read from the SD card
-  uint8_t blue;
-  uint8_t green;
-  uint8_t red;
-  uint8_t alpha;
-  }fields;
-} bpp32Format;
-// Struct representing the entry in the color table of each color
-// Each entry in the color table will have this
-// as its the 8-bit RLE way of representing color
-typedef union bpp8Format {
-  uint64_t pixelBytes;
-  struct {
-  uint8_t blue;
-  uint8_t green;
-  uint8_t red;
-  uint8_t alpha;
-
-  } fields;
-  
-} bpp8Format;
+// Ordered dither thresholds (4x4 Bayer matrix), in sixteenths of a level
+const uint8_t ditherMatrix[4][4] = {
+  { 0, 8, 2,10},
+  {12, 4,14, 6},
+  { 3,11, 1, 9},
+  {15, 7,13, 5}
+};
+// The thresholds move by a quarter every frame, so over this many frames
+// each pixel sees four of them and averages to its exact level
+#define ditherPhases 4
+// Frame load of a white pixel, see bmpImageDisp::writeFrame()
+#define frameLoadWhite (31*2+63+31*2)
 
 // Class representing a reader for the bitmap image
 // The SD card MUST be initialized before instantiating this class
@@ -81,25 +39,84 @@ class bmpImageDisp{
     bool debugFlg  = false; // debug flag, for development only
     const uint8_t maxBrightness = 255; // max brightness of the LED matrix
     uint8_t matrixBrightness= 125; // Stores the current brightness setting by default the brightness is set to about half
-    char* currentImgPath; // Setting to store the current image path that is being drawn, used in case of brightness change
-    Adafruit_Protomatter* currentMatrix; // Same purpose as above, but stores reference to the protomatter object
+    char currentImgPath[frameCachePathLen] = ""; // Setting to store the current image path that is being drawn, used in case of brightness change
+    Adafruit_Protomatter* currentMatrix = NULL; // Same purpose as above, but stores reference to the protomatter object
+    const uint16_t *currentFrame = NULL; // Frame drawn by prepareFrame(), redrawn like an image
+    frameCache *cache = NULL; // Decoded images, optional
+    virtualCanvas *canvas; // Panels the frames are drawn on
+    bmpStreamDecoder decoder; // Decoder used for images read from the SD card
+    // Statistics of the last displayImage call
+    uint32_t decodeMicros = 0; // Time spent reading and decoding, 0 if it came from the cache
+    uint32_t composeMicros = 0; // Time spent drawing the frame into the matrix buffer
+    uint32_t showMicros = 0; // Time spent in matrix.show()
+    uint32_t readCalls = 0; // SD card reads made
+    uint32_t readBytes = 0; // Bytes read from the SD card
+    // Temporal dithering down to the bit depth of the matrix
+    uint8_t ditherDepth = 0; // Bit depth dithered to, 0 when off
+    uint8_t ditherPhase = 0; // Frames drawn, modulo ditherPhases
+    uint16_t ditherKey = 0xFFFF; // Brightness and depth the tables were made for
+    // Brightness and dither of each channel value at each threshold, red
+    // and blue share a table
+    uint8_t ditherRedBlue[16][32];
+    uint8_t ditherGreen[16][64];
+    // Palette of the frame being drawn at its brightness, and the load of
+    // each color (see writeFrame)
+    uint16_t paletteShown[frameCacheMaxColors];
+    uint16_t paletteLoad[frameCacheMaxColors];
+
+    // Current limit, in units of frame load (see writeFrame)
+    uint32_t loadPerMilliamp = 0;
+    uint32_t loadLimit = 0; // 0 for no limit
+    uint8_t frameBrightness = 0; // Brightness the last frame was drawn at
+    uint32_t frameMilliamps = 0; // Estimated current of the last frame
+
+    void buildDitherTables(uint8_t brightness);
+    void drawPixels(const cachedFrame &frame, uint16_t width, uint16_t height, Adafruit_Protomatter &matrix);
+    uint32_t writeFrame(const cachedFrame &frame, uint16_t width, uint16_t height, uint16_t *out, uint8_t brightness, uint8_t offset);
+    int decodeImage(const char *imgPath, uint16_t *frame, uint16_t width, uint16_t height, Adafruit_Protomatter &matrix);
 
   public: 
-    bmpImageDisp(SdFat32 *SDOpen, bool debugFlg_in);
-    bool imageExists(char *imgPath);
-    void setBrightness(uint8_t brightness);
-    int displayImage(char *imgPath,Adafruit_Protomatter &matrix);
+    bmpImageDisp(SdFat32 *SDOpen, virtualCanvas *canvasIn, bool debugFlg_in);
+    bmpImageDisp(SdFat32 *SDOpen, frameCache *cacheIn, virtualCanvas *canvasIn, bool debugFlg_in);
+    bool imageExists(const char *imgPath);
+    void setBrightness(uint8_t brightness, bool redraw = true);
+    int displayImage(const char *imgPath,Adafruit_Protomatter &matrix);
+    int prepareImage(const char *imgPath,Adafruit_Protomatter &matrix);
+    void prepareFrame(const uint16_t *frame, Adafruit_Protomatter &matrix);
+    void drawFrame(const uint16_t *frame, uint16_t width, uint16_t height, Adafruit_Protomatter &matrix);
+    void drawFrame(const cachedFrame *frame, Adafruit_Protomatter &matrix);
+    void setDither(uint8_t bitDepth) { ditherDepth = bitDepth; }
+    bool isDithering() { return ditherDepth!=0; }
+    int refreshDither(Adafruit_Protomatter &matrix);
+    void setCurrentLimit(uint32_t budgetMilliamps, uint32_t whiteMilliamps);
+    uint32_t lastFrameMilliamps() { return frameMilliamps; }
+    bool lastFrameLimited() { return frameBrightness<matrixBrightness; }
+    uint32_t lastDecodeMicros() { return decodeMicros; }
+    uint32_t lastComposeMicros() { return composeMicros; }
+    uint32_t lastShowMicros() { return showMicros; }
+    uint32_t lastReadCalls() { return readCalls; }
+    uint32_t lastReadBytes() { return readBytes; }
 
 };
 
-// Only valid constructor for now
-bmpImageDisp::bmpImageDisp(SdFat32 *SDOpen, bool debugFlg_in){
+// Constructor without an image cache, every image is read from the SD card
+bmpImageDisp::bmpImageDisp(SdFat32 *SDOpen, virtualCanvas *canvasIn, bool debugFlg_in){
+  debugFlg = debugFlg_in;
+  SDCard = SDOpen;
+  canvas = canvasIn;
+}
+
+// Constructor with an image cache, images are decoded once and then
+// shown from RAM until they are evicted
+bmpImageDisp::bmpImageDisp(SdFat32 *SDOpen, frameCache *cacheIn, virtualCanvas *canvasIn, bool debugFlg_in){
   debugFlg = debugFlg_in;
   SDCard = SDOpen;
+  cache = cacheIn;
+  canvas = canvasIn;
 }
 
 // Check if the image exists, return true if it does, otherwise false.
-bool bmpImageDisp::imageExists(char *imgPath){
+bool bmpImageDisp::imageExists(const char *imgPath){
   if (!SDCard->exists(imgPath)) {
     return false;
   }
@@ -107,27 +124,203 @@ bool bmpImageDisp::imageExists(char *imgPath){
 }
 
 // Set the brightness of the pixels shown. 
-// upon a calling this, the image is redrawn completely
-void bmpImageDisp::setBrightness(uint8_t brightness){
+// upon a calling this, the image is redrawn completely unless redraw
+// is false (when something else is on the matrix)
+void bmpImageDisp::setBrightness(uint8_t brightness, bool redraw){
   matrixBrightness = brightness;
   // Redraw the image currently shown using the new brightness
-  displayImage(currentImgPath,*currentMatrix);
+  if(redraw && currentMatrix!=NULL && currentImgPath[0]!='\0'){
+    displayImage(currentImgPath,*currentMatrix);
+  }else if(redraw && currentMatrix!=NULL && currentFrame!=NULL){
+    drawFrame(currentFrame,frameWidth,frameHeight,*currentMatrix);
+    currentMatrix->show();
+  }
 }
 
-// Reads the image passed and displays it on the protomatter matrix passed.
-// Can read bitmap images that have a bit depth of 32 and 8 bits, bitfield 
-// encoded for the 24 bit images and RLE encoded for the 8 bit images.
-int bmpImageDisp::displayImage(char *imgPath,Adafruit_Protomatter &matrix){
+// Makes the dither tables for the brightness and the bit depth.
+// Protomatter only shows the top ditherDepth bits of each channel, the
+// brightness scaled value is rounded down to one of those levels after
+// adding the threshold, so the levels shown average to the exact value.
+void bmpImageDisp::buildDitherTables(uint8_t brightness){
+  for(uint8_t bits=5;bits<=6;bits++){
+    uint8_t shift = ditherDepth<bits ? bits-ditherDepth : 0;
+    uint16_t maxLevel = ((1<<bits)-1) >> shift;
+    uint32_t unit = (uint32_t)maxBrightness << shift; // One level, scaled by the brightness
+    for(uint8_t t=0;t<16;t++){
+      for(uint8_t i=0;i<(1<<bits);i++){
+        uint32_t level = ((uint32_t)i*brightness*16+t*unit)/(unit*16);
+        uint8_t value = min(level,(uint32_t)maxLevel) << shift;
+        if(bits==5){
+          ditherRedBlue[t][i] = value;
+        }else{
+          ditherGreen[t][i] = value;
+        }
+      }
+    }
+  }
+  ditherKey = (ditherDepth<<8) | brightness;
+}
 
-  // Save the parameters for 
-  currentImgPath = imgPath;
-  currentMatrix = &matrix;
-  
-  // Calculate brightness modifier
-  const float brightnessModifier = ((float)matrixBrightness)/maxBrightness; 
-  Serial.print("brightness: ");
-  Serial.println(brightnessModifier);
+// Draws the image on the matrix again with the next dither phase. Only
+// images in the cache (or frames from prepareFrame) can be redrawn, the
+// others are gone once shown.
+// Returns 0 if it was redrawn.
+int bmpImageDisp::refreshDither(Adafruit_Protomatter &matrix){
+  if(ditherDepth==0){
+    return 1;
+  }
+  if(currentImgPath[0]=='\0' && currentFrame!=NULL){
+    drawFrame(currentFrame,frameWidth,frameHeight,matrix);
+    matrix.show();
+    return 0;
+  }
+  const cachedFrame *frame = (cache!=NULL && currentImgPath[0]!='\0') ? cache->lookup(currentImgPath) : NULL;
+  if(frame==NULL){
+    return 1;
+  }
+  drawFrame(frame,matrix);
+  matrix.show();
+  return 0;
+}
+
+// Sets the most current the panels may draw, 0 for no limit.
+// whiteMilliamps is the current of one panel showing full white at full
+// brightness, the current of a frame is estimated from it.
+void bmpImageDisp::setCurrentLimit(uint32_t budgetMilliamps, uint32_t whiteMilliamps){
+  // Load of a full white display, see writeFrame()
+  uint64_t whiteLoad = (uint64_t)frameLoadWhite*canvasWidth*canvasHeight;
+  loadPerMilliamp = whiteLoad/((uint64_t)whiteMilliamps*panelCount);
+  loadLimit = budgetMilliamps*loadPerMilliamp;
+}
+
+// Copies a full brightness RGB565 frame into the matrix, applying the
+// current brightness and the dither if it is on. The frame is in logical
+// coordinates, each row is written along its runs on the panels. The
+// frame may be the matrix buffer itself if the canvas is direct.
+void bmpImageDisp::drawFrame(const uint16_t *frame, uint16_t width, uint16_t height, Adafruit_Protomatter &matrix){
+  cachedFrame pixels;
+  pixels.pixels = (const uint8_t*)frame;
+  drawPixels(pixels,width,height,matrix);
+}
+
+// Same for a frame of the image cache, its palette is only expanded here
+void bmpImageDisp::drawFrame(const cachedFrame *frame, Adafruit_Protomatter &matrix){
+  drawPixels(*frame,frameWidth,frameHeight,matrix);
+}
+
+// Frames that would draw more than the current limit are written again
+// at the brightness that keeps them under it
+void bmpImageDisp::drawPixels(const cachedFrame &frame, uint16_t width, uint16_t height, Adafruit_Protomatter &matrix){
+  uint8_t offset = ditherPhase*(16/ditherPhases);
+  ditherPhase = (ditherPhase+1)%ditherPhases;
+  uint32_t load = writeFrame(frame,width,height,matrix.getBuffer(),matrixBrightness,offset);
+  frameBrightness = matrixBrightness;
+  if(loadLimit!=0 && load>loadLimit && frame.pixels!=(const uint8_t*)matrix.getBuffer()){
+    // The load scales with the brightness, a frame drawn in place can't
+    // be written twice
+    frameBrightness = ((uint64_t)matrixBrightness*loadLimit)/load;
+    load = writeFrame(frame,width,height,matrix.getBuffer(),frameBrightness,offset);
+  }
+  frameMilliamps = loadPerMilliamp!=0 ? load/loadPerMilliamp : 0;
+}
+
+// Writes the frame into out at the brightness, dithered at the threshold
+// offset if the dither is on. Returns the load of the frame: the sum of
+// the channel values written, red and blue doubled to weigh the same as
+// the 6 bit green (frameLoadWhite for a white pixel).
+uint32_t bmpImageDisp::writeFrame(const cachedFrame &frame, uint16_t width, uint16_t height, uint16_t *out, uint8_t brightness, uint8_t offset){
+  int16_t rows = min((int16_t)height,(int16_t)canvasHeight);
+  int16_t columns = min((int16_t)width,(int16_t)canvasWidth);
+  const uint16_t *colors = (const uint16_t*)frame.pixels;
+  uint32_t load = 0;
+  if(ditherDepth!=0){
+    if(ditherKey!=((ditherDepth<<8) | brightness)){
+      buildDitherTables(brightness);
+    }
+    for(int16_t y=0;y<rows;y++){
+      const uint8_t *thresholds = ditherMatrix[y&3];
+      const canvasRun *runs = canvas->rowRuns(y);
+      for(int16_t tile=0;tile*panelTileWidth<columns;tile++){
+        uint16_t *dst = &out[runs[tile].start];
+        int32_t step = runs[tile].step;
+        int16_t end = min((int16_t)((tile+1)*panelTileWidth),columns);
+        for(int16_t x=tile*panelTileWidth;x<end;x++){
+          uint32_t i = (uint32_t)y*width+x;
+          uint16_t c = frame.bits==16 ? colors[i] : frameCache::pixelAt(&frame,i);
+          uint8_t t = (thresholds[x&3]+offset)&15;
+          uint8_t r = ditherRedBlue[t][c>>11];
+          uint8_t g = ditherGreen[t][(c>>5)&0x3F];
+          uint8_t b = ditherRedBlue[t][c&0x1F];
+          *dst = (r<<11) | (g<<5) | b;
+          load += ((r+b)<<1)+g;
+          dst += step;
+        }
+      }
+    }
+    return load;
+  }
+  // Brightness lookup tables for each of the 565 channels, cheaper than
+  // scaling every pixel
+  uint8_t red[32], green[64], blue[32];
+  for(int i=0;i<64;i++){
+    if(i<32){
+      red[i] = (i*brightness)/maxBrightness;
+      blue[i] = red[i];
+    }
+    green[i] = (i*brightness)/maxBrightness;
+  }
+  if(frame.bits!=16){
+    // A palette frame only has its colors scaled, every pixel is then a
+    // lookup of its index
+    for(uint16_t i=0;i<frame.colors;i++){
+      uint16_t c = frame.palette[i];
+      uint8_t r = red[c>>11];
+      uint8_t g = green[(c>>5)&0x3F];
+      uint8_t b = blue[c&0x1F];
+      paletteShown[i] = (r<<11) | (g<<5) | b;
+      paletteLoad[i] = ((r+b)<<1)+g;
+    }
+    for(int16_t y=0;y<rows;y++){
+      const canvasRun *runs = canvas->rowRuns(y);
+      for(int16_t tile=0;tile*panelTileWidth<columns;tile++){
+        uint16_t *dst = &out[runs[tile].start];
+        int32_t step = runs[tile].step;
+        int16_t end = min((int16_t)((tile+1)*panelTileWidth),columns);
+        uint32_t i = (uint32_t)y*width+tile*panelTileWidth;
+        for(int16_t x=tile*panelTileWidth;x<end;x++,i++){
+          uint8_t index = frameCache::indexAt(&frame,i);
+          *dst = paletteShown[index];
+          load += paletteLoad[index];
+          dst += step;
+        }
+      }
+    }
+    return load;
+  }
+  for(int16_t y=0;y<rows;y++){
+    const uint16_t *src = &colors[y*width];
+    const canvasRun *runs = canvas->rowRuns(y);
+    for(int16_t tile=0;tile*panelTileWidth<columns;tile++){
+      uint16_t *dst = &out[runs[tile].start];
+      int32_t step = runs[tile].step;
+      int16_t end = min((int16_t)((tile+1)*panelTileWidth),columns);
+      for(int16_t x=tile*panelTileWidth;x<end;x++){
+        uint16_t c = src[x];
+        uint8_t r = red[c>>11];
+        uint8_t g = green[(c>>5)&0x3F];
+        uint8_t b = blue[c&0x1F];
+        *dst = (r<<11) | (g<<5) | b;
+        load += ((r+b)<<1)+g;
+        dst += step;
+      }
+    }
+  }
+  return load;
+}
 
+// Reads the image from the SD card one sector at a time and decodes it
+// into the passed frame. Returns 0 on success.
+int bmpImageDisp::decodeImage(const char *imgPath, uint16_t *frame, uint16_t width, uint16_t height, Adafruit_Protomatter &matrix){
   // Check if the file exists
   if(!imageExists(imgPath)){
     errorShow("BMP image does not exist",matrix);
@@ -140,156 +333,122 @@ int bmpImageDisp::displayImage(char *imgPath,Adafruit_Protomatter &matrix){
     return 1;
   }
 
-  // The read function of adafruit's SD read implementation
-  // automatically accounts for little endian formatting int he 
-  // FAT32 file structure in multi-byte reads.
-  // Read the image header
-  image.read(&bmpFile.fileType,2); // FileType (will be backwards)
-  sprintf(buffer,"\nfile Header: %x\n",bmpFile.fileType);
-  image.read(&bmpFile.fileSize,4); // File Size
-  sprintf(buffer,"\nfile Size: %i\n",bmpFile.fileSize);
-  image.read(&bmpFile.reserved,4); // Skip the reserved area
-  sprintf(buffer,"resrved area (4 bytes)\n");
-  image.read(&bmpFile.pixelDataOffset,4); // Offset
-  sprintf(buffer,"pixel Data Offset: %i\n",bmpFile.pixelDataOffset);
-  // read the info header
-  image.read(&bmpFile.headerSize,4); // Header Size
-  sprintf(buffer,"header Size: %i\n",bmpFile.headerSize);
-  if(bmpFile.headerSize<40){
-    //cout<<"BMP File not supported, please use a BMP version";
+  decoder.begin(frame,width,height);
+  bmpDecodeStatus status = bmpDecodeOk;
+  int bytesRead;
+  while(status==bmpDecodeOk && !decoder.done() &&
+        (bytesRead = image.read(fileBuffer,sizeof(fileBuffer)))>0){
+    readCalls++;
+    readBytes += bytesRead;
+    status = decoder.feed((uint8_t*)fileBuffer,bytesRead);
   }
-  image.read(&bmpFile.imageWidth,4); // Image Width
-  sprintf(buffer,"image Width: %i\n",bmpFile.imageWidth);
-  image.read(&bmpFile.imageHeight,4); // Image Height
-  sprintf(buffer,"image Height: %i\n",bmpFile.imageHeight);
-  image.read(&bmpFile.planes,2); // Planes
-  sprintf(buffer,"planes: %i\n",bmpFile.planes);
-  image.read(&bmpFile.bitsPerPixel,2); // Bits per Pixel
-  sprintf(buffer,"bits Per Pixel: %i\n",bmpFile.bitsPerPixel);
-  image.read(&bmpFile.compression,4); // Compression
-  sprintf(buffer,"compression: %i\n",bmpFile.compression);
-  image.read(&bmpFile.imageSize,4); // Image Size
-  sprintf(buffer,"image Size: %i\n",bmpFile.imageSize);
-  image.read(&bmpFile.xPixelsPerMeter,4); // XPixelsPerMeter
-  sprintf(buffer,"xPixelsPerMeter: %i\n",bmpFile.xPixelsPerMeter);
-  image.read(&bmpFile.yPixeslPerMeter,4); // YPixelsPerMeter
-  sprintf(buffer,"yPixelesPerMeter: %i\n",bmpFile.yPixeslPerMeter);
-  image.read(&bmpFile.totalColors,4); // Total Colors
-  sprintf(buffer,"total Colors: %i\n",bmpFile.totalColors);
-  image.read(&bmpFile.importantColors,4); // Important Colors
-  sprintf(buffer,"important Colors: %i\n",bmpFile.importantColors);
-  // Skip the rest of the header (contains bit fields and other information)
-  // Start reading the pixel data until the end of the file
-  matrix.setCursor(0,0); 
-  if(bmpFile.bitsPerPixel==32){
-    image.seek(bmpFile.pixelDataOffset);
-    // Image width must be divisible by 4!
-    for(int y=bmpFile.imageHeight-1;y>=0;y--){
-        for(int x=0;x<bmpFile.imageWidth;x++){
-          // Get the number of bytes for each pixel, this only works for 
-          // bpp 32.
-          int bytesRead = image.read(&bpp32Format.pixelBytes,bmpFile.bitsPerPixel/8);
-          //cout << bytesRead<<"\n";
-          //sprintf(buffer,"Alpha: %x red: %x green: %x blue: %x \n",bpp32Format.fields.alpha,bpp32Format.fields.red,
-          //                              bpp32Format.fields.green,bpp32Format.fields.blue);
-          //cout<<buffer;
-
-          matrix.drawPixel(x,y,matrix.color565((uint8_t)bpp32Format.fields.red*brightnessModifier,
-                          (uint8_t)bpp32Format.fields.green*brightnessModifier,
-                          (uint8_t)bpp32Format.fields.blue*brightnessModifier));
-        }
-    }
-  } else if(bmpFile.bitsPerPixel==8 && bmpFile.compression==1){
-      // Implementation of 8 bit pixel depth, 8 bit RLE compression
-      // No field masks based on spec!
-      //cout<<"implementation of rle\n";
-      // Color table offset includes the size of the bitmap file headr (14 bytes)
-      int colorTableOffset = bmpFile.headerSize+14; 
-      //cout<<colorTableOffset<<"\n";
-      // Build the color table:
-      bpp8Format colorTable[bmpFile.totalColors];
-      bpp8Format tableEntry;
-      image.seek(colorTableOffset);
-      // Read the color Table
-      for(int x=0;x<bmpFile.totalColors;x++){
-          // For the majority of applications each color in the table is 4 bytes long
-          // Documentation is a bit confusing on this...
-          // Plus the alpha channel may always be 0x00
-          // but as its not used here we don't worry about it
-          int bytesRead = image.read(&tableEntry.pixelBytes,4);
-          colorTable[x] = tableEntry;
-          //cout << bytesRead<<"\n";
-          //sprintf(buffer,"Alpha: %x red: %x green: %x blue: %x \n",colorTable[x].fields.alpha,colorTable[x].fields.red,
-          //                              colorTable[x].fields.green,colorTable[x].fields.blue);
-          //cout<<buffer;
-          //delay(10000);
-      }
-
-      // Now go the pixel portion of the, read it and display it
-      image.seek(bmpFile.pixelDataOffset);
-      // Decode the 8-Bit RLE compression
-      // first byte is the number of times that the pixel will show
-      // the second byte is the index in the table
-      // 0x00 0x00 defines the end of lines and
-      // 0x00 0x01 defines the end of the bitmap
-      union rle8BitEntry{
-        uint16_t pixelBytes;
-        struct{
-          uint8_t reps;
-          uint8_t index;
-          //uint8_t index;
-          //uint8_t reps;
-        } fields;
-      } rle8BitEntry;
-      if(!bmpFile.imageSize==0){
-        
-        // For now we need to make sure the max size
-        // of the bitmap is no greater than the matrix 
-        // size
-        int x_cord = 0;
-        int y_cord = bmpFile.imageHeight-1;
+  image.close();
+  if(status==bmpDecodeOk){
+    status = decoder.finish();
+  }
+  if(status==bmpDecodeUnsupported){
+    errorShow("bpp not supported!",matrix,matrixBrightness);
+    return 1;
+  }
+  if(status!=bmpDecodeOk){
+    errorShow("BMP image is corrupt!",matrix,matrixBrightness);
+    return 1;
+  }
+  return 0;
+}
 
-        // variable to exit when we are done reading the
-        // matrix
-        bool exitFlag = 1;
-        while(exitFlag){
-         if(y_cord==0){
-          exitFlag;
-         }
-         int bytesRead = image.read(&rle8BitEntry.pixelBytes,2);
-         //cout<<(int)rle8BitEntry.fields.reps<<"\n";
-         //cout<<(int)rle8BitEntry.fields.index<<"\n";
-         //delay(2000);
-         uint8_t reps = rle8BitEntry.fields.reps;
-         uint8_t index = rle8BitEntry.fields.index;
-         for(int x=0;x<reps;x++){
-            matrix.drawPixel(x_cord,y_cord,matrix.color565(
-                            (uint8_t)colorTable[index].fields.red*brightnessModifier,
-                            (uint8_t)colorTable[index].fields.green*brightnessModifier,
-                            (uint8_t)colorTable[index].fields.blue*brightnessModifier));
-            x_cord++;
-            if(x_cord==bmpFile.imageWidth){
-              x_cord=0;
-            }
-         }
+// Reads the image passed and displays it on the protomatter matrix passed.
+// Can read bitmap images that have a bit depth of 32, 24, 16 and 8 bits,
+// bitfield encoded for the 16 and 32 bit images and RLE encoded for the
+// 8 bit images. Images already in the cache are shown without touching
+// the SD card.
+int bmpImageDisp::displayImage(const char *imgPath,Adafruit_Protomatter &matrix){
+  if(prepareImage(imgPath,matrix)){
+    return 1;
+  }
+  uint32_t start = micros();
+  matrix.show();
+  showMicros = micros()-start;
+  return 0;
+}
 
-         if(reps==0x00 && index==0x00){
-          y_cord--;
-         }
-         if(reps==0x00 && index==0x01){
-          exitFlag=0;
-         }
+// Reads and decodes the image like displayImage() and draws it into the
+// matrix buffer, but doesn't show it, so the caller can show it exactly
+// when it is due. Returns 0 on success.
+int bmpImageDisp::prepareImage(const char *imgPath,Adafruit_Protomatter &matrix){
 
-        }
+  // Save the parameters for a redraw on brightness change
+  if(imgPath!=currentImgPath){
+    strncpy(currentImgPath,imgPath,sizeof(currentImgPath)-1);
+    currentImgPath[sizeof(currentImgPath)-1] = '\0';
+  }
+  currentMatrix = &matrix;
+  currentFrame = NULL;
+  decodeMicros = 0;
+  composeMicros = 0;
+  showMicros = 0;
+  readCalls = 0;
+  readBytes = 0;
 
+  const cachedFrame *frame = (cache!=NULL) ? cache->lookup(imgPath) : NULL;
+  const uint16_t *uncached = NULL; // Decoded, but the cache had no room for it
+  uint32_t start = micros();
+  if(frame==NULL && cache!=NULL){
+    // Not cached yet, decode it into the fill buffer of the cache, which
+    // packs it
+    uint16_t *fill = cache->beginFill(imgPath);
+    if(fill!=NULL){
+      if(decodeImage(imgPath,fill,frameWidth,frameHeight,matrix)){
+        cache->abortFill();
+        return 1;
       }
-  
-  } else {
-      errorShow("bpp not supported!",matrix,matrixBrightness);
+      if(cache->commitFill()){
+        frame = cache->lookup(imgPath);
+      }else{
+        uncached = fill;
+      }
+      decodeMicros = micros()-start;
+    }
   }
 
-  image.close();
-  matrix.show();
+  if(frame!=NULL){
+    start = micros();
+    drawFrame(frame,matrix);
+  }else if(uncached!=NULL){
+    // Still in the fill buffer, shown from there without caching it
+    start = micros();
+    drawFrame(uncached,frameWidth,frameHeight,matrix);
+  }else if(canvas->isDirect()){
+    // No cache available, decode straight into the matrix buffer
+    uint16_t *out = matrix.getBuffer();
+    if(decodeImage(imgPath,out,canvasWidth,canvasHeight,matrix)){
+      return 1;
+    }
+    decodeMicros = micros()-start;
+    start = micros();
+    drawFrame(out,canvasWidth,canvasHeight,matrix);
+  }else{
+    // The panels need the frame rearranged, which can't be done in place
+    errorShow("No frame buffer free",matrix,matrixBrightness);
+    return 1;
+  }
+  composeMicros = micros()-start;
   return 0;
 }
 
+// Draws a full brightness frame that doesn't come from an image file
+// (an animation pack frame) into the matrix buffer without showing it.
+// The frame must stay valid while it is shown, brightness changes and
+// the dither draw it again.
+void bmpImageDisp::prepareFrame(const uint16_t *frame, Adafruit_Protomatter &matrix){
+  currentImgPath[0] = '\0';
+  currentFrame = frame;
+  currentMatrix = &matrix;
+  decodeMicros = 0;
+  showMicros = 0;
+  readCalls = 0;
+  readBytes = 0;
+  uint32_t start = micros();
+  drawFrame(frame,frameWidth,frameHeight,matrix);
+  composeMicros = micros()-start;
+}
@@ -0,0 +1,505 @@
+/*
+ Incremental BMP decoder. Bytes can be fed in arbitrarily sized chunks
+ (upload packets or SD card sectors) and decoded pixels are converted to
+ RGB565 and written straight into a display sized frame, so an image can
+ be ready to show as soon as its last byte arrives.
+*/
+#pragma once
+#include <Arduino.h>
+
+// Result codes of the decoder
+enum bmpDecodeStatus : uint8_t {
+  bmpDecodeOk = 0,
+  bmpDecodeNotBmp,      // Missing "BM" signature or broken header
+  bmpDecodeUnsupported, // Valid BMP, but a format we can't display
+  bmpDecodeCorrupt      // Pixel data is inconsistent with the header
+};
+
+// Largest image accepted, anything bigger is rejected before decoding
+// since the header comes from untrusted files
+#define bmpMaxDimension 2048
+
+class bmpStreamDecoder{
+  private:
+    // Decoder states, in the order they appear in the file
+    enum decoderState : uint8_t {
+      stFileHeader, stInfoHeader, stSkip, stPalette, stPixels, stRle, stDone, stError
+    };
+    decoderState state = stError;
+    decoderState stateAfterSkip = stError;
+    bmpDecodeStatus status = bmpDecodeNotBmp;
+    uint32_t filePos = 0; // Number of bytes consumed so far
+    uint32_t skipTo = 0; // File offset stSkip advances to
+
+    // Raw header bytes, enough for the file header, BITMAPINFOHEADER and
+    // the bit field masks that follow it
+    uint8_t header[66];
+    uint8_t headerLen = 0;
+    uint32_t pixelDataOffset = 0;
+    uint32_t headerSize = 0;
+    int32_t imageWidth = 0;
+    int32_t imageHeight = 0;
+    bool bottomUp = true;
+    uint16_t bitsPerPixel = 0;
+    uint32_t compression = 0;
+    uint16_t paletteColors = 0;
+    uint8_t maskShift[3]; // red,green,blue shifts for BI_BITFIELDS
+    uint8_t maskBits[3];
+
+    // 8 bit palette already converted to RGB565
+    uint16_t palette[256];
+    uint16_t paletteIndex = 0;
+
+    // Pixel stream position
+    int32_t row = 0; // Row in file order (0 is the first row stored)
+    uint32_t rowByte = 0; // Byte index inside the current row
+    uint32_t rowBytes = 0; // Stored bytes per row including padding
+    int32_t column = 0;
+    uint8_t pixel[4]; // Bytes of the pixel being assembled
+    uint8_t pixelLen = 0;
+
+    // RLE8 stream state
+    uint8_t rleBytes[2];
+    uint8_t rleLen = 0;
+    uint8_t rleAbsolute = 0; // Literal pixels left in an absolute run
+    bool rlePad = false; // Absolute runs are padded to 16 bits
+    uint8_t rleDelta = 0; // Delta escape bytes still expected
+
+    // Destination frame and scaling ratio (dest = src*scaleNum/scaleDen)
+    uint16_t *frame = NULL;
+    uint16_t frameWidth = 0;
+    uint16_t frameHeight = 0;
+    uint32_t scaleNum = 1;
+    uint32_t scaleDen = 1;
+
+    static uint32_t readLE32(const uint8_t *p);
+    static uint16_t readLE16(const uint8_t *p);
+    static uint16_t toRGB565(uint8_t r, uint8_t g, uint8_t b);
+    bool parseFileHeader();
+    bool parseInfoHeader();
+    void startPixels();
+    void fail(bmpDecodeStatus why);
+    void nextRow();
+    void putPixel(int32_t x, uint16_t color);
+    size_t feedPixels(const uint8_t *data, size_t len);
+    size_t feedRle(const uint8_t *data, size_t len);
+
+  public:
+    bmpStreamDecoder();
+    void begin(uint16_t *frameOut, uint16_t width, uint16_t height);
+    bmpDecodeStatus feed(const uint8_t *data, size_t len);
+    bmpDecodeStatus finish();
+    bool done() const { return state == stDone; }
+    bool failed() const { return state == stError; }
+    int32_t width() const { return imageWidth; }
+    int32_t height() const { return imageHeight; }
+};
+
+bmpStreamDecoder::bmpStreamDecoder(){
+}
+
+uint32_t bmpStreamDecoder::readLE32(const uint8_t *p){
+  return (uint32_t)p[0] | ((uint32_t)p[1]<<8) | ((uint32_t)p[2]<<16) | ((uint32_t)p[3]<<24);
+}
+
+uint16_t bmpStreamDecoder::readLE16(const uint8_t *p){
+  return (uint16_t)p[0] | ((uint16_t)p[1]<<8);
+}
+
+// Same packing as Adafruit_Protomatter::color565()
+uint16_t bmpStreamDecoder::toRGB565(uint8_t r, uint8_t g, uint8_t b){
+  return ((r & 0xF8) << 8) | ((g & 0xFC) << 3) | (b >> 3);
+}
+
+// Start decoding a new image into the passed frame, the frame is cleared
+// so images smaller than the frame show on a black background. Nothing of
+// the previous image is kept, it may have been aborted half way through.
+void bmpStreamDecoder::begin(uint16_t *frameOut, uint16_t width, uint16_t height){
+  frame = frameOut;
+  frameWidth = width;
+  frameHeight = height;
+  memset(frame,0,(size_t)width*height*sizeof(uint16_t));
+  state = stFileHeader;
+  stateAfterSkip = stError;
+  status = bmpDecodeOk;
+  filePos = 0;
+  skipTo = 0;
+  headerLen = 0;
+  pixelDataOffset = 0;
+  headerSize = 0;
+  imageWidth = 0;
+  imageHeight = 0;
+  bottomUp = true;
+  bitsPerPixel = 0;
+  compression = 0; // Decides how much of the info header is read
+  paletteColors = 0;
+  paletteIndex = 0;
+  row = 0;
+  rowByte = 0;
+  rowBytes = 0;
+  column = 0;
+  pixelLen = 0; // Shared by the palette and the pixels
+  scaleNum = 1;
+  scaleDen = 1;
+  rleLen = 0;
+  rleAbsolute = 0;
+  rlePad = false;
+  rleDelta = 0;
+}
+
+void bmpStreamDecoder::fail(bmpDecodeStatus why){
+  state = stError;
+  status = why;
+}
+
+// Bitmap File Header (14 bytes) plus the size field of the info header
+bool bmpStreamDecoder::parseFileHeader(){
+  if(header[0]!='B' || header[1]!='M'){
+    fail(bmpDecodeNotBmp);
+    return false;
+  }
+  pixelDataOffset = readLE32(&header[10]);
+  headerSize = readLE32(&header[14]);
+  // Only BITMAPINFOHEADER (40 bytes) and its newer supersets are supported
+  if(headerSize<40){
+    fail(bmpDecodeUnsupported);
+    return false;
+  }
+  return true;
+}
+
+// BITMAPINFOHEADER fields, and the channel masks if the image uses them
+bool bmpStreamDecoder::parseInfoHeader(){
+  imageWidth = (int32_t)readLE32(&header[18]);
+  imageHeight = (int32_t)readLE32(&header[22]);
+  bitsPerPixel = readLE16(&header[28]);
+  compression = readLE32(&header[30]);
+  paletteColors = readLE32(&header[46]);
+  // A negative height means the rows are stored top to bottom
+  bottomUp = imageHeight>0;
+  if(imageHeight<0){
+    imageHeight = -imageHeight;
+  }
+  if(imageWidth<=0 || imageHeight==0 || imageWidth>bmpMaxDimension || imageHeight>bmpMaxDimension){
+    fail(bmpDecodeCorrupt);
+    return false;
+  }
+
+  // Default masks for 24/32 bpp are plain BGR(A) bytes
+  const uint32_t defaultMasks[3] = {0x00FF0000,0x0000FF00,0x000000FF};
+  for(int c=0;c<3;c++){
+    uint32_t mask = defaultMasks[c];
+    if(compression==3){
+      // BI_BITFIELDS, the masks are stored right after the 40 byte header
+      mask = readLE32(&header[54+4*c]);
+    }
+    maskShift[c] = 0;
+    maskBits[c] = 0;
+    while(mask && !(mask&1)){
+      mask >>= 1;
+      maskShift[c]++;
+    }
+    while(mask&1){
+      mask >>= 1;
+      maskBits[c]++;
+    }
+    if(maskBits[c]==0 || maskBits[c]>8){
+      fail(bmpDecodeUnsupported);
+      return false;
+    }
+  }
+
+  bool rawOk = (bitsPerPixel==32 || bitsPerPixel==24 || bitsPerPixel==16) && (compression==0 || compression==3);
+  bool palOk = bitsPerPixel==8 && (compression==0 || compression==1);
+  if(!rawOk && !palOk){
+    fail(bmpDecodeUnsupported);
+    return false;
+  }
+  if(bitsPerPixel==16 && compression==0){
+    // 16 bpp without masks is X1R5G5B5
+    maskShift[0] = 10; maskShift[1] = 5; maskShift[2] = 0;
+    maskBits[0] = 5; maskBits[1] = 5; maskBits[2] = 5;
+  }
+  if(bitsPerPixel==8 && (paletteColors==0 || paletteColors>256)){
+    paletteColors = 256;
+  }
+
+  // Images bigger than the frame are shrunk keeping their aspect ratio,
+  // smaller ones are drawn 1:1 from the top left corner
+  scaleNum = 1;
+  scaleDen = 1;
+  if((uint32_t)imageWidth>frameWidth || (uint32_t)imageHeight>frameHeight){
+    if((uint32_t)imageWidth*frameHeight > (uint32_t)imageHeight*frameWidth){
+      scaleNum = frameWidth;
+      scaleDen = imageWidth;
+    }else{
+      scaleNum = frameHeight;
+      scaleDen = imageHeight;
+    }
+  }
+  return true;
+}
+
+void bmpStreamDecoder::startPixels(){
+  row = 0;
+  rowByte = 0;
+  column = 0;
+  pixelLen = 0;
+  rowBytes = (((uint32_t)bitsPerPixel*imageWidth+31)/32)*4;
+  state = (compression==1) ? stRle : stPixels;
+}
+
+// Moves on to the next stored row, the image is done after the last one
+void bmpStreamDecoder::nextRow(){
+  row++;
+  rowByte = 0;
+  column = 0;
+  pixelLen = 0;
+  if(row>=imageHeight){
+    state = stDone;
+  }
+}
+
+// Writes a decoded pixel of the current row into the frame, scaling it
+// down if needed. Only the first source pixel mapping to each frame pixel
+// is kept (nearest neighbour).
+void bmpStreamDecoder::putPixel(int32_t x, uint16_t color){
+  if(x<0 || x>=imageWidth){
+    return;
+  }
+  int32_t y = bottomUp ? imageHeight-1-row : row;
+  if(((uint32_t)x*scaleNum)%scaleDen>=scaleNum || ((uint32_t)y*scaleNum)%scaleDen>=scaleNum){
+    return;
+  }
+  uint32_t fx = (uint32_t)x*scaleNum/scaleDen;
+  uint32_t fy = (uint32_t)y*scaleNum/scaleDen;
+  if(fx<frameWidth && fy<frameHeight){
+    frame[fy*frameWidth+fx] = color;
+  }
+}
+
+// Uncompressed rows, returns the number of bytes used
+size_t bmpStreamDecoder::feedPixels(const uint8_t *data, size_t len){
+  const uint8_t bytesPerPixel = bitsPerPixel/8;
+  const uint32_t pixelBytes = (uint32_t)imageWidth*bytesPerPixel;
+  size_t used = 0;
+  while(used<len && state==stPixels){
+    if(rowByte>=pixelBytes){
+      // Skip the row padding
+      uint32_t pad = rowBytes-rowByte;
+      uint32_t n = (len-used<pad) ? len-used : pad;
+      used += n;
+      rowByte += n;
+      if(rowByte==rowBytes){
+        nextRow();
+      }
+      continue;
+    }
+    pixel[pixelLen++] = data[used++];
+    rowByte++;
+    if(pixelLen<bytesPerPixel){
+      continue;
+    }
+    pixelLen = 0;
+    uint16_t color;
+    if(bytesPerPixel==1){
+      color = palette[pixel[0]];
+    }else{
+      uint32_t raw = pixel[0] | (pixel[1]<<8);
+      if(bytesPerPixel>=3){
+        raw |= (uint32_t)pixel[2]<<16;
+      }
+      if(bytesPerPixel==4){
+        raw |= (uint32_t)pixel[3]<<24;
+      }
+      uint8_t ch[3];
+      for(int c=0;c<3;c++){
+        ch[c] = ((raw>>maskShift[c]) & ((1u<<maskBits[c])-1)) << (8-maskBits[c]);
+      }
+      color = toRGB565(ch[0],ch[1],ch[2]);
+    }
+    putPixel(column++,color);
+    if(rowByte==rowBytes){
+      nextRow();
+    }
+  }
+  return used;
+}
+
+// 8 bit RLE pixel data, returns the number of bytes used
+// Encoded runs are (count,index) pairs, a zero count is an escape:
+// 0 0 end of line, 0 1 end of bitmap, 0 2 dx dy delta, 0 n n literal indexes
+size_t bmpStreamDecoder::feedRle(const uint8_t *data, size_t len){
+  size_t used = 0;
+  while(used<len && state==stRle){
+    uint8_t b = data[used++];
+    if(rleAbsolute){
+      putPixel(column++,palette[b]);
+      rleAbsolute--;
+      continue;
+    }
+    if(rlePad){
+      rlePad = false;
+      continue;
+    }
+    if(rleDelta){
+      rleBytes[2-rleDelta] = b;
+      rleDelta--;
+      if(!rleDelta){
+        column += rleBytes[0];
+        for(uint8_t i=0;i<rleBytes[1] && state==stRle;i++){
+          int32_t keep = column;
+          nextRow();
+          column = keep;
+        }
+      }
+      continue;
+    }
+    rleBytes[rleLen++] = b;
+    if(rleLen<2){
+      continue;
+    }
+    rleLen = 0;
+    uint8_t count = rleBytes[0];
+    uint8_t value = rleBytes[1];
+    if(count){
+      uint16_t color = palette[value];
+      for(uint8_t i=0;i<count;i++){
+        putPixel(column++,color);
+      }
+    }else if(value==0){
+      nextRow();
+    }else if(value==1){
+      state = stDone;
+    }else if(value==2){
+      rleDelta = 2;
+    }else{
+      rleAbsolute = value;
+      rlePad = value&1;
+    }
+  }
+  return used;
+}
+
+// Feed the next chunk of the file, chunks must be passed in order.
+bmpDecodeStatus bmpStreamDecoder::feed(const uint8_t *data, size_t len){
+  size_t i = 0;
+  while(i<len){
+    switch(state){
+      case stFileHeader:
+      case stInfoHeader: {
+        // Gather the fixed size headers before parsing them
+        uint32_t want = (state==stFileHeader) ? 18 : 14+40;
+        if(state==stInfoHeader && compression==3){
+          want = sizeof(header);
+        }
+        while(i<len && headerLen<want){
+          header[headerLen++] = data[i++];
+          filePos++;
+        }
+        if(headerLen<want){
+          break;
+        }
+        if(state==stFileHeader){
+          if(parseFileHeader()){
+            state = stInfoHeader;
+          }
+          break;
+        }
+        // Compression is needed to know if the masks must be read too
+        compression = readLE32(&header[30]);
+        if(compression==3 && headerLen<sizeof(header)){
+          break;
+        }
+        if(!parseInfoHeader()){
+          break;
+        }
+        if(bitsPerPixel==8){
+          // The palette follows the info header (and any masks)
+          skipTo = 14+headerSize;
+          stateAfterSkip = stPalette;
+        }else{
+          skipTo = pixelDataOffset;
+          stateAfterSkip = stPixels;
+        }
+        state = stSkip;
+        break;
+      }
+      case stSkip: {
+        if(filePos>skipTo){
+          // The header overlaps the data it points at
+          fail(bmpDecodeCorrupt);
+          break;
+        }
+        uint32_t n = skipTo-filePos;
+        if(n>len-i){
+          n = len-i;
+        }
+        i += n;
+        filePos += n;
+        if(filePos==skipTo){
+          state = stateAfterSkip;
+          if(state==stPixels){
+            startPixels();
+          }
+        }
+        break;
+      }
+      case stPalette: {
+        // Palette entries are stored as B,G,R,reserved
+        while(i<len && paletteIndex<paletteColors){
+          pixel[pixelLen++] = data[i++];
+          filePos++;
+          if(pixelLen==4){
+            palette[paletteIndex++] = toRGB565(pixel[2],pixel[1],pixel[0]);
+            pixelLen = 0;
+          }
+        }
+        if(paletteIndex==paletteColors){
+          // Unused palette slots show as black in broken files
+          for(uint16_t p=paletteColors;p<256;p++){
+            palette[p] = 0;
+          }
+          skipTo = pixelDataOffset;
+          stateAfterSkip = stPixels;
+          state = stSkip;
+        }
+        break;
+      }
+      case stPixels: {
+        size_t n = feedPixels(&data[i],len-i);
+        i += n;
+        filePos += n;
+        break;
+      }
+      case stRle: {
+        size_t n = feedRle(&data[i],len-i);
+        i += n;
+        filePos += n;
+        break;
+      }
+      case stDone:
+        // Anything after the pixel data is ignored
+        return bmpDecodeOk;
+      case stError:
+        return status;
+    }
+  }
+  return (state==stError) ? status : bmpDecodeOk;
+}
+
+// Call after the last chunk, reports if the whole image was decoded.
+// RLE images that end without the end of bitmap escape are accepted
+// once every row has been written.
+bmpDecodeStatus bmpStreamDecoder::finish(){
+  if(state==stError){
+    return status;
+  }
+  if(state==stRle && row>=imageHeight-1){
+    state = stDone;
+  }
+  if(state!=stDone){
+    fail(bmpDecodeCorrupt);
+  }
+  return status;
+}
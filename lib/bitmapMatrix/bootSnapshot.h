@@ -0,0 +1,159 @@
+/*
+ Snapshot of the image on the matrix and the settings it was shown with,
+ so the next boot can put it back on the panel right after the SD card
+ is mounted, before the Wi-Fi, the playlist and the settings journal are
+ set up. The file has a fixed size and is always rewritten in place: a
+ header sector followed by the full brightness frame, read back in one
+ sequential pass.
+ The size of the image file is kept too, a snapshot of an image that was
+ deleted or replaced by another file is not shown. The snapshot must be
+ removed when its image is written again, the size may stay the same.
+*/
+#pragma once
+#include <Arduino.h>
+#include <SdFat.h> // Adafruit's Fork of SD
+#include <frameCache.h> // frameWidth, frameHeight and the cache the frame goes into
+
+#define snapshotMagic "IMPSNAP2"
+#define snapshotHeaderSize 512
+#define snapshotFrameSize (frameWidth*frameHeight*2)
+#define snapshotFileSize (snapshotHeaderSize+snapshotFrameSize)
+
+// What the snapshot holds besides the frame
+struct snapshotInfo{
+  uint8_t brightness = 0;
+  uint8_t mode = 0;
+  int32_t slideShowDelay = 0;
+  uint32_t fileSize = 0; // Size of the image file when the frame was decoded
+  char path[frameCachePathLen] = ""; // Image the frame was decoded from
+};
+
+class bootSnapshot{
+  private:
+    SdFat32 *SDCard;
+    const char *filePath = NULL;
+
+    static uint32_t checksum(const uint8_t *data, size_t len, uint32_t sum);
+
+  public:
+    bootSnapshot(SdFat32 *SDOpen) { SDCard = SDOpen; }
+    void begin(const char *path) { filePath = path; }
+    int load(frameCache &cache, snapshotInfo &info);
+    int save(const snapshotInfo &info, const uint16_t *frame);
+    void remove();
+};
+
+// Rotate and xor checksum, words at a time so checking the frame takes
+// a few microseconds
+uint32_t bootSnapshot::checksum(const uint8_t *data, size_t len, uint32_t sum){
+  for(size_t i=0;i+4<=len;i+=4){
+    uint32_t word = data[i] | (data[i+1] << 8) | ((uint32_t)data[i+2] << 16) | ((uint32_t)data[i+3] << 24);
+    sum = ((sum << 5) | (sum >> 27)) ^ word;
+  }
+  return sum;
+}
+
+// Header layout: magic (8 bytes), width and height (16 bit), brightness,
+// mode, the delay (32 bit), the image file size (32 bit), the image path,
+// and the checksum of the header and the frame in the last 4 bytes.
+// Everything little endian.
+
+// Reads the snapshot and puts its frame in the cache under the image
+// path, so showing that image draws it without decoding.
+// Returns 0 on success, 1 if there is no valid snapshot.
+int bootSnapshot::load(frameCache &cache, snapshotInfo &info){
+  File32 file;
+  if(filePath==NULL || !file.open(filePath,O_RDONLY)){
+    return 1;
+  }
+  uint8_t header[snapshotHeaderSize];
+  if(file.read(header,sizeof(header))!=(int)sizeof(header) ||
+     memcmp(header,snapshotMagic,8)!=0 ||
+     (header[8] | (header[9] << 8))!=frameWidth ||
+     (header[10] | (header[11] << 8))!=frameHeight){
+    file.close();
+    return 1;
+  }
+  info.brightness = header[12];
+  info.mode = header[13];
+  info.slideShowDelay = (int32_t)(header[16] | (header[17] << 8) | ((uint32_t)header[18] << 16) | ((uint32_t)header[19] << 24));
+  info.fileSize = header[20] | (header[21] << 8) | ((uint32_t)header[22] << 16) | ((uint32_t)header[23] << 24);
+  memcpy(info.path,&header[24],sizeof(info.path));
+  info.path[sizeof(info.path)-1] = '\0';
+  // The image must still be the file the frame was decoded from
+  File32 image;
+  bool current = image.open(info.path,O_RDONLY) && image.isFile() && image.fileSize()==info.fileSize;
+  image.close();
+  if(!current){
+    file.close();
+    return 1;
+  }
+  uint16_t *frame = cache.beginFill(info.path);
+  if(frame==NULL){
+    file.close();
+    return 1;
+  }
+  // The frame sectors follow the header, read straight into the cache
+  bool ok = file.read(frame,snapshotFrameSize)==snapshotFrameSize;
+  file.close();
+  uint32_t stored = header[508] | (header[509] << 8) | ((uint32_t)header[510] << 16) | ((uint32_t)header[511] << 24);
+  if(!ok || checksum((const uint8_t*)frame,snapshotFrameSize,checksum(header,snapshotHeaderSize-4,0))!=stored){
+    cache.abortFill();
+    return 1;
+  }
+  return cache.commitFill() ? 0 : 1;
+}
+
+// Writes the snapshot, creating the file the first time.
+// Returns 0 on success.
+int bootSnapshot::save(const snapshotInfo &info, const uint16_t *frame){
+  if(filePath==NULL){
+    return 1;
+  }
+  File32 file;
+  if(file.open(filePath,O_RDWR)){
+    if(file.fileSize()!=snapshotFileSize){
+      file.close();
+      SDCard->remove(filePath);
+    }
+  }
+  if(!file.isOpen()){
+    // Contiguous clusters, the next boot reads it in one pass
+    if(!file.open(filePath,O_RDWR | O_CREAT)){
+      return 1;
+    }
+    file.preAllocate(snapshotFileSize);
+  }
+  uint8_t header[snapshotHeaderSize];
+  memset(header,0,sizeof(header));
+  memcpy(header,snapshotMagic,8);
+  header[8] = frameWidth & 0xFF;
+  header[9] = frameWidth >> 8;
+  header[10] = frameHeight & 0xFF;
+  header[11] = frameHeight >> 8;
+  header[12] = info.brightness;
+  header[13] = info.mode;
+  for(uint8_t i=0;i<4;i++){
+    header[16+i] = (uint32_t)info.slideShowDelay >> (8*i);
+    header[20+i] = info.fileSize >> (8*i);
+  }
+  strncpy((char*)&header[24],info.path,frameCachePathLen-1);
+  uint32_t sum = checksum((const uint8_t*)frame,snapshotFrameSize,checksum(header,snapshotHeaderSize-4,0));
+  for(uint8_t i=0;i<4;i++){
+    header[508+i] = sum >> (8*i);
+  }
+  bool ok = file.seekSet(0) &&
+            file.write(header,sizeof(header))==sizeof(header) &&
+            file.write(frame,snapshotFrameSize)==snapshotFrameSize;
+  if(!file.close() || !ok){
+    return 1;
+  }
+  return 0;
+}
+
+// Removes the snapshot, the next boot starts without one
+void bootSnapshot::remove(){
+  if(filePath!=NULL && SDCard->exists(filePath)){
+    SDCard->remove(filePath);
+  }
+}
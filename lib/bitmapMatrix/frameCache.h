@@ -0,0 +1,387 @@
+/*
+ Small RAM cache of decoded frames, keyed by the image path on the SD card.
+ Frames are stored display ready at full brightness so showing a cached
+ image needs no SD card access and no decoding. Most images have few
+ colors, those are kept as palette indexes: 4 bits per pixel with up to
+ 16 colors, 8 bits with up to 256, RGB565 only above that. The colors are
+ only expanded when the frame is drawn into the matrix (see
+ bmpImageDisp::drawFrame), so a 4 bit frame takes a quarter of the RAM.
+ Frames are decoded as RGB565 into the fill buffer and packed into the
+ pool when they are committed.
+*/
+#pragma once
+#include <Arduino.h>
+#include <panelLayout.h> // canvasWidth and canvasHeight
+
+// Size of the frames kept in the cache, the logical picture of the panels
+#ifndef frameWidth
+#define frameWidth canvasWidth
+#endif
+#ifndef frameHeight
+#define frameHeight canvasHeight
+#endif
+#define framePixels (frameWidth*frameHeight)
+// Bytes of packed frames, together with the fill buffer the cache takes
+// 32 KB unless that leaves room for less than 2 full color frames. That
+// is 7 RGB565 frames of 64x32, 11 with 8 bit pixels or 27 with 4 bit.
+#ifndef frameCacheBytes
+#define frameCacheBytes (framePixels<=8192 ? 32768-framePixels*2 : framePixels*2)
+#endif
+// Most frames kept at once, enough to fill the pool with 4 bit frames
+#define frameCacheEntriesFit (frameCacheBytes/(framePixels/2+32))
+#define frameCacheEntries (frameCacheEntriesFit<64 ? frameCacheEntriesFit : 64)
+#define frameCachePathLen 64
+#define frameCacheMaxColors 256
+
+// Frame as it is kept in the cache
+struct cachedFrame{
+  uint8_t bits = 16; // Bits per pixel: 4 or 8 for palette indexes, 16 for RGB565
+  uint16_t colors = 0; // Palette entries, 0 for RGB565 frames
+  const uint16_t *palette = NULL; // RGB565 colors of the indexes
+  // Rows from the top left. 4 bit pixels are two per byte, the left one
+  // in the high nibble. 16 bit pixels are uint16_t.
+  const uint8_t *pixels = NULL;
+};
+
+class frameCache{
+  private:
+    struct cacheEntry{
+      char path[frameCachePathLen];
+      bool valid;
+      uint32_t lastUsed; // Use counter value of the last lookup, for LRU eviction
+      uint32_t offset; // Start of the palette and the pixels in the pool
+      uint32_t size; // Bytes taken in the pool, a multiple of 4
+      cachedFrame frame;
+    };
+    cacheEntry entries[frameCacheEntries];
+    uint32_t pool[frameCacheBytes/4]; // Packed frames, word aligned
+    uint32_t poolEnd = 0; // Bytes of the pool in use, free space follows
+    uint16_t fill[framePixels]; // RGB565 frame being decoded
+    uint16_t fillColors[frameCacheMaxColors]; // Colors of the fill frame, sorted
+    char fillPath[frameCachePathLen] = "";
+    bool filling = false;
+    uint32_t useCounter = 0;
+    volatile int8_t pinnedEntry = -1; // Entry being shown, never evicted
+
+    int8_t find(const char *path);
+    uint16_t countColors();
+    uint8_t colorIndex(uint16_t color, uint16_t colors);
+    int8_t allocate(uint32_t size);
+    bool evictOldest();
+    void compact();
+    void setPointers(cacheEntry &entry);
+
+  public:
+    frameCache();
+    const cachedFrame* lookup(const char *path);
+    uint16_t* beginFill(const char *path);
+    bool commitFill();
+    void abortFill();
+    const uint16_t* unpack(const char *path);
+    void invalidate(const char *path);
+    void clear();
+    uint16_t frameCount();
+    uint32_t bytesUsed();
+    static uint16_t pixelAt(const cachedFrame *frame, uint32_t i);
+    // Palette index of pixel i (counted row by row) of a 4 or 8 bit frame
+    static uint8_t indexAt(const cachedFrame *frame, uint32_t i) {
+      return frame->bits==8 ? frame->pixels[i] : (frame->pixels[i>>1] >> ((~i&1)<<2)) & 0x0F;
+    }
+};
+
+frameCache::frameCache(){
+  for(int i=0;i<frameCacheEntries;i++){
+    entries[i].valid = false;
+    entries[i].path[0] = '\0';
+    entries[i].lastUsed = 0;
+    entries[i].size = 0;
+  }
+}
+
+int8_t frameCache::find(const char *path){
+  for(int i=0;i<frameCacheEntries;i++){
+    if(entries[i].valid && strncmp(entries[i].path,path,frameCachePathLen)==0){
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Returns the cached frame of the image or NULL if it isn't cached.
+// The returned frame stays pinned (it won't be evicted) until the
+// next lookup, and valid until the next commitFill().
+const cachedFrame* frameCache::lookup(const char *path){
+  int8_t entry = find(path);
+  pinnedEntry = entry;
+  if(entry<0){
+    return NULL;
+  }
+  entries[entry].lastUsed = ++useCounter;
+  return &entries[entry].frame;
+}
+
+// Starts caching a new frame of the image and returns the RGB565 buffer
+// to decode it into. The frame only becomes visible to lookup() after
+// commitFill(). Only one frame is filled at a time, starting another
+// drops the first.
+uint16_t* frameCache::beginFill(const char *path){
+  if(strlen(path)>=frameCachePathLen){
+    return NULL; // Path too long to be used as a key
+  }
+  abortFill();
+  invalidate(path);
+  strncpy(fillPath,path,frameCachePathLen);
+  filling = true;
+  return fill;
+}
+
+// Packs the frame of beginFill() with as few bits per pixel as its
+// colors allow and publishes it. Returns false if there was no frame
+// filled or no room for it (every entry pinned), the frame then stays in
+// the fill buffer until the next beginFill().
+bool frameCache::commitFill(){
+  if(!filling){
+    return false;
+  }
+  filling = false;
+  uint16_t colors = countColors();
+  uint8_t bits = colors==0 ? 16 : (colors<=16 ? 4 : 8);
+  uint32_t paletteBytes = ((uint32_t)colors*2+3) & ~3UL;
+  uint32_t pixelBytes = (((uint32_t)framePixels*bits+7)/8+3) & ~3UL;
+  int8_t entry = allocate(paletteBytes+pixelBytes);
+  if(entry<0){
+    return false;
+  }
+  cacheEntry &e = entries[entry];
+  strncpy(e.path,fillPath,frameCachePathLen);
+  e.frame.bits = bits;
+  e.frame.colors = colors;
+  setPointers(e);
+  uint8_t *base = (uint8_t*)pool+e.offset;
+  if(bits==16){
+    memcpy(base,fill,sizeof(fill));
+  }else{
+    memcpy(base,fillColors,colors*2);
+    uint8_t *pixels = base+paletteBytes;
+    // Neighbouring pixels often share a color, the last one is kept
+    uint16_t lastColor = fill[0];
+    uint8_t lastIndex = colorIndex(lastColor,colors);
+    for(uint32_t i=0;i<framePixels;i++){
+      if(fill[i]!=lastColor){
+        lastColor = fill[i];
+        lastIndex = colorIndex(lastColor,colors);
+      }
+      if(bits==8){
+        pixels[i] = lastIndex;
+      }else if(i&1){
+        pixels[i>>1] |= lastIndex;
+      }else{
+        pixels[i>>1] = lastIndex << 4;
+      }
+    }
+  }
+  e.lastUsed = ++useCounter;
+  e.valid = true;
+  return true;
+}
+
+// Drops the frame of beginFill(), used when decoding fails
+void frameCache::abortFill(){
+  filling = false;
+}
+
+// Collects the colors of the fill frame into fillColors, sorted.
+// Returns how many there are, 0 if there are more than the palette holds.
+uint16_t frameCache::countColors(){
+  uint16_t colors = 0;
+  uint16_t lastColor = 0;
+  for(uint32_t i=0;i<framePixels;i++){
+    uint16_t color = fill[i];
+    if(i>0 && color==lastColor){
+      continue;
+    }
+    lastColor = color;
+    // Binary search for the insertion point
+    uint16_t low = 0, high = colors;
+    while(low<high){
+      uint16_t mid = (low+high)/2;
+      if(fillColors[mid]<color){
+        low = mid+1;
+      }else{
+        high = mid;
+      }
+    }
+    if(low<colors && fillColors[low]==color){
+      continue;
+    }
+    if(colors==frameCacheMaxColors){
+      return 0;
+    }
+    memmove(&fillColors[low+1],&fillColors[low],(colors-low)*2);
+    fillColors[low] = color;
+    colors++;
+  }
+  return colors;
+}
+
+// Index of a color of the fill frame in fillColors
+uint8_t frameCache::colorIndex(uint16_t color, uint16_t colors){
+  uint16_t low = 0, high = colors-1;
+  while(low<high){
+    uint16_t mid = (low+high)/2;
+    if(fillColors[mid]<color){
+      low = mid+1;
+    }else{
+      high = mid;
+    }
+  }
+  return low;
+}
+
+// Finds room for size bytes, evicting the least recently used frames
+// and moving the others together as needed. Returns the entry, or -1 if
+// the frame can't fit.
+int8_t frameCache::allocate(uint32_t size){
+  if(size>sizeof(pool)){
+    return -1;
+  }
+  int8_t entry = -1;
+  for(int i=0;i<frameCacheEntries && entry<0;i++){
+    if(!entries[i].valid){
+      entry = i;
+    }
+  }
+  if(entry<0){
+    if(!evictOldest()){
+      return -1;
+    }
+    return allocate(size);
+  }
+  if(sizeof(pool)-poolEnd<size){
+    uint32_t used = bytesUsed();
+    while(sizeof(pool)-used<size){
+      if(!evictOldest()){
+        return -1;
+      }
+      used = bytesUsed();
+    }
+    compact();
+  }
+  entries[entry].offset = poolEnd;
+  entries[entry].size = size;
+  poolEnd += size;
+  return entry;
+}
+
+// Drops the least recently used frame that isn't pinned.
+// Returns false if there is none.
+bool frameCache::evictOldest(){
+  int8_t victim = -1;
+  for(int i=0;i<frameCacheEntries;i++){
+    if(!entries[i].valid || i==pinnedEntry){
+      continue;
+    }
+    if(victim<0 || entries[i].lastUsed<entries[victim].lastUsed){
+      victim = i;
+    }
+  }
+  if(victim<0){
+    return false;
+  }
+  entries[victim].valid = false;
+  return true;
+}
+
+// Moves the frames to the start of the pool, in the order they are in,
+// so all the free space is at the end
+void frameCache::compact(){
+  uint32_t end = 0;
+  while(true){
+    // The next frame after end
+    int8_t next = -1;
+    for(int i=0;i<frameCacheEntries;i++){
+      if(entries[i].valid && entries[i].offset>=end &&
+         (next<0 || entries[i].offset<entries[next].offset)){
+        next = i;
+      }
+    }
+    if(next<0){
+      break;
+    }
+    cacheEntry &e = entries[next];
+    if(e.offset!=end){
+      memmove((uint8_t*)pool+end,(uint8_t*)pool+e.offset,e.size);
+      e.offset = end;
+      setPointers(e);
+    }
+    end += e.size;
+  }
+  poolEnd = end;
+}
+
+// Points the frame of the entry at its data in the pool
+void frameCache::setPointers(cacheEntry &entry){
+  uint8_t *base = (uint8_t*)pool+entry.offset;
+  uint32_t paletteBytes = ((uint32_t)entry.frame.colors*2+3) & ~3UL;
+  entry.frame.palette = entry.frame.colors>0 ? (const uint16_t*)base : NULL;
+  entry.frame.pixels = base+paletteBytes;
+}
+
+// Color of pixel i (counted row by row) of the frame
+uint16_t frameCache::pixelAt(const cachedFrame *frame, uint32_t i){
+  if(frame->bits==16){
+    return ((const uint16_t*)frame->pixels)[i];
+  }
+  return frame->palette[indexAt(frame,i)];
+}
+
+// Expands the cached frame of the image to RGB565 in the fill buffer,
+// for the code that needs the whole frame in color. Returns NULL if it
+// isn't cached or a frame is being filled. Valid until beginFill().
+const uint16_t* frameCache::unpack(const char *path){
+  int8_t entry = find(path);
+  if(entry<0 || filling){
+    return NULL;
+  }
+  const cachedFrame *frame = &entries[entry].frame;
+  for(uint32_t i=0;i<framePixels;i++){
+    fill[i] = pixelAt(frame,i);
+  }
+  return fill;
+}
+
+// Removes the image from the cache, used when its file changes
+void frameCache::invalidate(const char *path){
+  int8_t entry = find(path);
+  if(entry>=0){
+    entries[entry].valid = false;
+  }
+}
+
+// Empties the cache, used when the image folder is cleared
+void frameCache::clear(){
+  for(int i=0;i<frameCacheEntries;i++){
+    entries[i].valid = false;
+  }
+  poolEnd = 0;
+}
+
+// Frames in the cache
+uint16_t frameCache::frameCount(){
+  uint16_t count = 0;
+  for(int i=0;i<frameCacheEntries;i++){
+    count += entries[i].valid;
+  }
+  return count;
+}
+
+// Bytes of the pool taken by the frames in the cache
+uint32_t frameCache::bytesUsed(){
+  uint32_t used = 0;
+  for(int i=0;i<frameCacheEntries;i++){
+    if(entries[i].valid){
+      used += entries[i].size;
+    }
+  }
+  return used;
+}
@@ -0,0 +1,153 @@
+/*
+ Receives live RGB565 frames pushed by a client and hands the newest one
+ to the render loop. Frames are triple buffered: the network side writes
+ one buffer, the newest complete frame waits in a second one and the
+ render loop reads the third, so neither side ever waits on the other.
+ If a new frame completes before the previous one was shown, the old one
+ is dropped (latest frame wins).
+*/
+#pragma once
+#include <Arduino.h>
+#include <frameCache.h> // frameWidth and frameHeight
+
+#define frameStreamPixels (frameWidth*frameHeight)
+#define frameStreamBytes (frameStreamPixels*2)
+
+// Encodings accepted for a frame
+enum frameEncoding : uint8_t {
+  frameRaw = 0, // frameStreamPixels little endian RGB565 values, row by row
+  frameRle = 1  // Runs of (count 1-255, RGB565 low byte, RGB565 high byte)
+};
+
+class frameStream{
+  private:
+    uint16_t buffers[3][frameStreamPixels];
+    volatile uint8_t writeIndex = 0; // Buffer being received
+    volatile uint8_t readyIndex = 1; // Newest complete frame
+    volatile uint8_t readIndex = 2; // Buffer the render loop shows
+    volatile bool frameReady = false;
+    volatile uint32_t lastFrameMillis = 0;
+
+    // Decoding state of the frame being received
+    bool receiving = false;
+    frameEncoding encoding = frameRaw;
+    uint32_t pixelIndex = 0;
+    uint8_t partial[3]; // Bytes of an unfinished pixel or run
+    uint8_t partialLen = 0;
+
+    // Statistics
+    volatile uint32_t framesReceived = 0;
+    volatile uint32_t framesShown = 0;
+    volatile uint32_t framesDropped = 0;
+    volatile uint32_t framesRejected = 0;
+
+  public:
+    void begin(frameEncoding enc);
+    bool write(const uint8_t *data, size_t len);
+    bool end();
+    void cancel();
+    bool isReceiving() { return receiving; }
+    const uint16_t* takeFrame();
+    bool hasFrame() { return frameReady; }
+    uint32_t millisSinceLastFrame() { return millis()-lastFrameMillis; }
+    uint32_t received() { return framesReceived; }
+    uint32_t shown() { return framesShown; }
+    uint32_t dropped() { return framesDropped; }
+    uint32_t rejected() { return framesRejected; }
+};
+
+// Starts receiving a new frame
+void frameStream::begin(frameEncoding enc){
+  encoding = enc;
+  pixelIndex = 0;
+  partialLen = 0;
+  receiving = true;
+}
+
+// Decodes the next piece of the frame into the write buffer.
+// Returns false (and drops the frame) if the data doesn't fit the frame.
+bool frameStream::write(const uint8_t *data, size_t len){
+  if(!receiving){
+    return false;
+  }
+  uint16_t *frame = buffers[writeIndex];
+  for(size_t i=0;i<len;i++){
+    partial[partialLen++] = data[i];
+    if(encoding==frameRaw){
+      if(partialLen<2){
+        continue;
+      }
+      if(pixelIndex>=frameStreamPixels){
+        cancel();
+        return false;
+      }
+      frame[pixelIndex++] = partial[0] | (partial[1]<<8);
+    }else{
+      if(partialLen<3){
+        continue;
+      }
+      uint8_t count = partial[0];
+      if(count==0 || pixelIndex+count>frameStreamPixels){
+        cancel();
+        return false;
+      }
+      uint16_t color = partial[1] | (partial[2]<<8);
+      for(uint8_t n=0;n<count;n++){
+        frame[pixelIndex++] = color;
+      }
+    }
+    partialLen = 0;
+  }
+  return true;
+}
+
+// Finishes the frame and makes it the newest one. Returns false if the
+// frame was incomplete.
+bool frameStream::end(){
+  if(!receiving){
+    return false;
+  }
+  if(pixelIndex!=frameStreamPixels || partialLen!=0){
+    cancel();
+    return false;
+  }
+  receiving = false;
+  // This runs in the network context, which the render loop can't
+  // interrupt, so the swap is atomic for takeFrame()
+  uint8_t done = writeIndex;
+  writeIndex = readyIndex;
+  readyIndex = done;
+  if(frameReady){
+    framesDropped++; // The previous frame was never shown
+  }
+  frameReady = true;
+  framesReceived++;
+  lastFrameMillis = millis();
+  return true;
+}
+
+// Drops the frame being received
+void frameStream::cancel(){
+  if(receiving){
+    framesRejected++;
+  }
+  receiving = false;
+}
+
+// Returns the newest frame for the render loop to show, or NULL if no
+// new frame arrived since the last call. The frame stays valid until
+// the next call.
+const uint16_t* frameStream::takeFrame(){
+  if(!frameReady){
+    return NULL;
+  }
+  // Keep the network side from swapping buffers while we do
+  noInterrupts();
+  uint8_t newest = readyIndex;
+  readyIndex = readIndex;
+  readIndex = newest;
+  frameReady = false;
+  interrupts();
+  framesShown++;
+  return buffers[readIndex];
+}
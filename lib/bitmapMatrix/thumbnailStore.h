@@ -0,0 +1,174 @@
+/*
+ Tiny previews of the images on the SD card, for the gallery of the app.
+ A thumbnail is made the first time it is asked for, by decoding the image
+ and averaging blocks of pixels, and saved as a small 16 bit BMP file in
+ the thumbnail folder so it is only made once.
+*/
+#pragma once
+#include <Arduino.h>
+#include <SdFat.h> // Adafruit's Fork of SD
+#include <bmpStreamDecoder.h>
+#include <frameCache.h> // frameWidth and frameHeight
+
+// Each thumbnail pixel is the average of a block of thumbnailScale by
+// thumbnailScale frame pixels (16x8 for a 64x32 matrix), larger panel
+// arrangements use bigger blocks so the thumbnail fits a sector
+#define thumbnailScale ((frameWidth*frameHeight>2048) ? 8 : 4)
+#define thumbnailWidth (frameWidth/thumbnailScale)
+#define thumbnailHeight (frameHeight/thumbnailScale)
+#define thumbnailPathLen 100
+// 14 byte file header, 40 byte info header and three 4 byte color masks
+#define thumbnailHeaderSize 66
+#define thumbnailRowSize (((thumbnailWidth*2)+3)&~3)
+#define thumbnailFileSize (thumbnailHeaderSize+thumbnailRowSize*thumbnailHeight)
+
+class thumbnailStore{
+  private:
+    SdFat32 *SDCard;
+    char folder[thumbnailPathLen/2];
+    bmpStreamDecoder decoder;
+    uint16_t frame[frameWidth*frameHeight]; // Full size image being shrunk
+    uint8_t readBuffer[512]; // Own buffer, the slideshow may be using the shared one
+
+    int decode(const char *imagePath);
+    int save(const char *thumbPath);
+
+  public:
+    thumbnailStore(SdFat32 *SDOpen);
+    int begin(const char *thumbFolder);
+    int prepare(const char *imageFolder, const char *name, char *thumbPath, size_t thumbPathLen);
+    void invalidate(const char *name);
+    const char* getFolder() { return folder; }
+};
+
+thumbnailStore::thumbnailStore(SdFat32 *SDOpen){
+  SDCard = SDOpen;
+  folder[0] = '\0';
+}
+
+// Sets the folder holding the thumbnails, creating it if needed.
+// Returns 0 on success.
+int thumbnailStore::begin(const char *thumbFolder){
+  strncpy(folder,thumbFolder,sizeof(folder)-1);
+  folder[sizeof(folder)-1] = '\0';
+  if(!SDCard->exists(folder) && !SDCard->mkdir(folder)){
+    return 1;
+  }
+  return 0;
+}
+
+// Decodes the full size image into frame. Returns 0 on success.
+int thumbnailStore::decode(const char *imagePath){
+  File32 image;
+  if(!image.open(imagePath,O_RDONLY)){
+    return 1;
+  }
+  decoder.begin(frame,frameWidth,frameHeight);
+  bmpDecodeStatus status = bmpDecodeOk;
+  int bytesRead;
+  while(status==bmpDecodeOk && !decoder.done() &&
+        (bytesRead = image.read(readBuffer,sizeof(readBuffer)))>0){
+    status = decoder.feed(readBuffer,bytesRead);
+  }
+  image.close();
+  if(status==bmpDecodeOk){
+    status = decoder.finish();
+  }
+  return status==bmpDecodeOk ? 0 : 1;
+}
+
+// Writes 16 bit little endian value into the buffer
+static void putLE16(uint8_t *p, uint16_t v){
+  p[0] = v & 0xFF;
+  p[1] = v >> 8;
+}
+
+// Writes 32 bit little endian value into the buffer
+static void putLE32(uint8_t *p, uint32_t v){
+  putLE16(p,v & 0xFFFF);
+  putLE16(p+2,v >> 16);
+}
+
+// Shrinks frame and writes it as a top-down RGB565 BMP file.
+// Returns 0 on success.
+int thumbnailStore::save(const char *thumbPath){
+  uint8_t *out = readBuffer; // The decoding is done, reuse its buffer
+  memset(out,0,thumbnailHeaderSize);
+  out[0] = 'B';
+  out[1] = 'M';
+  putLE32(&out[2],thumbnailFileSize);
+  putLE32(&out[10],thumbnailHeaderSize);
+  putLE32(&out[14],40);
+  putLE32(&out[18],thumbnailWidth);
+  putLE32(&out[22],(uint32_t)(-(int32_t)thumbnailHeight)); // Top-down rows
+  putLE16(&out[26],1);
+  putLE16(&out[28],16);
+  putLE32(&out[30],3); // BI_BITFIELDS
+  putLE32(&out[34],thumbnailRowSize*thumbnailHeight);
+  putLE32(&out[54],0xF800);
+  putLE32(&out[58],0x07E0);
+  putLE32(&out[62],0x001F);
+  size_t len = thumbnailHeaderSize;
+
+  // Average every block of pixels, channel by channel
+  for(uint16_t ty=0;ty<thumbnailHeight;ty++){
+    uint8_t *row = &out[len];
+    memset(row,0,thumbnailRowSize);
+    for(uint16_t tx=0;tx<thumbnailWidth;tx++){
+      uint16_t r = 0, g = 0, b = 0;
+      for(uint8_t y=0;y<thumbnailScale;y++){
+        const uint16_t *src = &frame[(ty*thumbnailScale+y)*frameWidth+tx*thumbnailScale];
+        for(uint8_t x=0;x<thumbnailScale;x++){
+          r += src[x]>>11;
+          g += (src[x]>>5)&0x3F;
+          b += src[x]&0x1F;
+        }
+      }
+      const uint8_t n = thumbnailScale*thumbnailScale;
+      putLE16(&row[tx*2],((r/n)<<11) | ((g/n)<<5) | (b/n));
+    }
+    len += thumbnailRowSize;
+  }
+
+  File32 thumb;
+  if(!thumb.open(thumbPath,O_WRONLY | O_CREAT | O_TRUNC)){
+    return 1;
+  }
+  bool ok = thumb.write(out,len)==len;
+  if(!thumb.close() || !ok){
+    SDCard->remove(thumbPath);
+    return 1;
+  }
+  return 0;
+}
+
+// Finds the thumbnail of the image, making it if it doesn't exist yet.
+// The path of the thumbnail file is written into thumbPath.
+// Returns 0 on success, 1 if the image is missing or can't be decoded.
+int thumbnailStore::prepare(const char *imageFolder, const char *name, char *thumbPath, size_t thumbPathLen){
+  static_assert(thumbnailHeaderSize+thumbnailRowSize*thumbnailHeight<=sizeof(readBuffer),
+                "Thumbnail must fit the read buffer");
+  // Names with a path in them could reach outside the folders
+  if(name[0]=='\0' || strchr(name,'/')!=NULL){
+    return 1;
+  }
+  snprintf(thumbPath,thumbPathLen,"%s/%s",folder,name);
+  if(SDCard->exists(thumbPath)){
+    return 0;
+  }
+  char imagePath[thumbnailPathLen];
+  snprintf(imagePath,sizeof(imagePath),"%s/%s",imageFolder,name);
+  if(decode(imagePath)){
+    return 1;
+  }
+  return save(thumbPath);
+}
+
+// Removes the thumbnail of the image, used when the image is replaced
+void thumbnailStore::invalidate(const char *name){
+  char thumbPath[thumbnailPathLen];
+  snprintf(thumbPath,sizeof(thumbPath),"%s/%s",folder,name);
+  if(SDCard->exists(thumbPath)){
+    SDCard->remove(thumbPath);
+  }
+}
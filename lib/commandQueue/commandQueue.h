@@ -0,0 +1,126 @@
+/*
+ Bounded single producer, single consumer queues used to hand work from
+ the web server callbacks to the render loop. The producer only writes
+ the head and the consumer only writes the tail, so neither side ever
+ waits for the other or needs to turn interrupts off.
+*/
+#pragma once
+#include <Arduino.h>
+
+// Makes the writes to the items visible before the index that publishes them
+#define queueBarrier() __sync_synchronize()
+
+// Queue of up to capacity-1 items of type T, capacity must be a power of two
+template <typename T, uint16_t capacity>
+class commandQueue{
+  private:
+    static_assert((capacity & (capacity-1))==0, "capacity must be a power of two");
+    T items[capacity];
+    volatile uint16_t head = 0; // Next item to be written, producer only
+    volatile uint16_t tail = 0; // Next item to be read, consumer only
+  public:
+    // Producer side
+    bool push(const T &item);
+    uint16_t space() { return (capacity-1)-((head-tail)&(capacity-1)); }
+    // Consumer side
+    bool pop(T &item);
+    bool isEmpty() { return head==tail; }
+};
+
+// Adds the item, returns false if the queue is full
+template <typename T, uint16_t capacity>
+bool commandQueue<T,capacity>::push(const T &item){
+  uint16_t next = (head+1)&(capacity-1);
+  if(next==tail){
+    return false;
+  }
+  items[head] = item;
+  queueBarrier();
+  head = next;
+  return true;
+}
+
+// Takes the oldest item, returns false if the queue is empty
+template <typename T, uint16_t capacity>
+bool commandQueue<T,capacity>::pop(T &item){
+  if(head==tail){
+    return false;
+  }
+  queueBarrier();
+  item = items[tail];
+  queueBarrier();
+  tail = (tail+1)&(capacity-1);
+  return true;
+}
+
+// Byte stream with the same rules, used to pass bulk data such as
+// uploaded files. capacity must be a power of two.
+template <uint32_t capacity>
+class byteQueue{
+  private:
+    static_assert((capacity & (capacity-1))==0, "capacity must be a power of two");
+    alignas(4) uint8_t data[capacity]; // Aligned so whole sectors can be read into it
+    volatile uint32_t head = 0; // Bytes ever written, producer only
+    volatile uint32_t tail = 0; // Bytes ever read, consumer only
+  public:
+    // Producer side
+    uint32_t space() { return capacity-(head-tail); }
+    bool write(const uint8_t *src, uint32_t len);
+    uint32_t reserve(uint8_t **dst);
+    void commit(uint32_t len);
+    // Only while neither side is using the queue
+    void reset(uint32_t position) { head = position; tail = position; }
+    // Consumer side
+    uint32_t available() { return head-tail; }
+    uint32_t peek(const uint8_t **src);
+    void consume(uint32_t len);
+};
+
+// Adds all len bytes, or none of them if they don't fit
+template <uint32_t capacity>
+bool byteQueue<capacity>::write(const uint8_t *src, uint32_t len){
+  if(len>space()){
+    return false;
+  }
+  uint32_t index = head&(capacity-1);
+  uint32_t first = min(len,capacity-index);
+  memcpy(&data[index],src,first);
+  memcpy(data,&src[first],len-first);
+  queueBarrier();
+  head += len;
+  return true;
+}
+
+// Points dst at the free space after the newest byte and returns how
+// much of it can be written in one piece, for writing in place. Nothing
+// is added until commit().
+template <uint32_t capacity>
+uint32_t byteQueue<capacity>::reserve(uint8_t **dst){
+  uint32_t index = head&(capacity-1);
+  *dst = &data[index];
+  return min(space(),capacity-index);
+}
+
+// Adds the bytes written through reserve()
+template <uint32_t capacity>
+void byteQueue<capacity>::commit(uint32_t len){
+  queueBarrier();
+  head += len;
+}
+
+// Points src at the oldest bytes and returns how many can be read there
+// in one piece (the rest wraps around to the start of the buffer)
+template <uint32_t capacity>
+uint32_t byteQueue<capacity>::peek(const uint8_t **src){
+  uint32_t index = tail&(capacity-1);
+  queueBarrier();
+  *src = &data[index];
+  return min(available(),capacity-index);
+}
+
+// Drops bytes that were read through peek()
+template <uint32_t capacity>
+void byteQueue<capacity>::consume(uint32_t len){
+  queueBarrier();
+  tail += len;
+}
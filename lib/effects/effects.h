@@ -0,0 +1,292 @@
+/*
+ Procedural effects drawn every frame without reading anything from the
+ SD card: plasma, fire and a starfield. Only integer math is used, the
+ RP2040 has no FPU. Sines come from a quarter wave table, angles are in
+ 256ths of a turn and the motion is kept in fixed point with 8 fraction
+ bits, so the effects move at the same pace whatever the frame rate.
+ Every effect picks palette indexes, the palette holds the colors at the
+ current brightness and is only made again when that changes. The
+ frames are written straight into the matrix buffer through the runs of
+ the virtual canvas.
+*/
+#pragma once
+#include <Arduino.h>
+#include <virtualCanvas.h> // The panels the effects are drawn on
+
+#define effectPlasma 0
+#define effectFire 1
+#define effectStarfield 2
+#define effectCount 3
+// Time of one step of the effects at the normal speed (128), 60 a second
+#define effectStepMicros 16667
+// Longest time one frame moves the effects on by, after a pause they
+// carry on instead of jumping
+#define effectMaxElapsedMicros 100000
+#define effectStarsMax 96
+#define effectStarDepth 16384 // Farthest a star starts, in 16ths of a depth unit
+
+class proceduralEffects{
+  private:
+    virtualCanvas *canvas;
+    uint8_t effect = effectPlasma;
+    uint8_t speed = 128; // Pace of the motion, 128 is the normal pace
+    uint8_t scale = 128; // Size of the waves, height of the flames or number of stars
+    uint32_t elapsedSteps = 0; // Steps since the effect started, 8 fraction bits
+    uint32_t stepFraction = 0; // Part of a step not taken yet, 8 fraction bits
+    uint32_t randState = 0x2545F491;
+    uint16_t palette[256]; // Colors of the indexes at the current brightness
+    uint8_t row[canvasWidth]; // Palette indexes of the row being drawn
+    // Fire: heat of every pixel, the two rows below the picture are the fuel
+    uint8_t heat[canvasHeight+2][canvasWidth];
+    uint8_t coolMax = 1; // Most heat a pixel loses per row it rises
+    // Starfield, x and y from -1024 to 1023 at the depth of the picture
+    struct star{
+      int16_t x;
+      int16_t y;
+      uint16_t z; // Depth in 16ths of a unit, smaller is nearer
+    };
+    star stars[effectStarsMax];
+    uint8_t starCount = 0;
+
+    uint32_t nextRandom();
+    void writeRow(int16_t y);
+    void spawnStar(star &s, bool anyDepth);
+    void renderPlasma();
+    void stepFire();
+    void renderFire(uint32_t steps);
+    void renderStarfield(uint32_t stepsQ8);
+    static uint32_t paletteColor(uint8_t effect, uint8_t i);
+
+  public:
+    static const char* const names[effectCount];
+    proceduralEffects(virtualCanvas *canvasIn) { canvas = canvasIn; }
+    static int8_t sin8(uint8_t angle);
+    static int8_t cos8(uint8_t angle) { return sin8(angle+64); }
+    static int8_t find(const char *name);
+    void setParameters(uint8_t effectIn, uint8_t speedIn, uint8_t scaleIn);
+    void restart();
+    void shadePalette(uint16_t (*shade)(uint32_t rgb));
+    void render(uint32_t elapsedMicros);
+};
+
+const char* const proceduralEffects::names[effectCount] = {"plasma","fire","starfield"};
+
+// Sine of angle (256ths of a turn) from -127 to 127
+int8_t proceduralEffects::sin8(uint8_t angle){
+  // First quarter of the wave, the others are mirrored from it
+  static const uint8_t quarter[65] = {
+      0,  3,  6,  9, 12, 16, 19, 22, 25, 28, 31, 34, 37, 40, 43, 46,
+     49, 51, 54, 57, 60, 63, 65, 68, 71, 73, 76, 78, 81, 83, 85, 88,
+     90, 92, 94, 96, 98,100,102,104,106,107,109,111,112,113,115,116,
+    117,118,120,121,122,122,123,124,125,125,126,126,126,127,127,127,
+    127
+  };
+  uint8_t i = angle & 0x3F;
+  int8_t value = (angle & 0x40) ? quarter[64-i] : quarter[i];
+  return (angle & 0x80) ? -value : value;
+}
+
+// Index of the effect with the name, -1 if there is none
+int8_t proceduralEffects::find(const char *name){
+  for(int8_t i=0;i<effectCount;i++){
+    if(strcmp(names[i],name)==0){
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Switches to the effect, it starts over if it is another one
+void proceduralEffects::setParameters(uint8_t effectIn, uint8_t speedIn, uint8_t scaleIn){
+  bool changed = effectIn!=effect || scaleIn!=scale;
+  effect = effectIn<effectCount ? effectIn : effectPlasma;
+  speed = speedIn;
+  scale = scaleIn;
+  if(changed){
+    restart();
+  }
+}
+
+// Starts the effect from scratch
+void proceduralEffects::restart(){
+  elapsedSteps = 0;
+  stepFraction = 0;
+  memset(heat,0,sizeof(heat));
+  // The flames rise from 4 rows to the whole height as the scale grows,
+  // losing on average half of coolMax per row
+  uint16_t flameRows = 4+(uint32_t)scale*canvasHeight/256;
+  coolMax = min(2*255/flameRows+1,255);
+  starCount = 16+(uint32_t)scale*(effectStarsMax-16)/255;
+  for(uint8_t i=0;i<starCount;i++){
+    spawnStar(stars[i],true);
+  }
+}
+
+// Xorshift, the same sequence on every run
+uint32_t proceduralEffects::nextRandom(){
+  randState ^= randState << 13;
+  randState ^= randState >> 17;
+  randState ^= randState << 5;
+  return randState;
+}
+
+// Full brightness color (0xRRGGBB) of palette index i of the effect
+uint32_t proceduralEffects::paletteColor(uint8_t effect, uint8_t i){
+  uint8_t r, g, b;
+  if(effect==effectFire){
+    // Black, red, yellow, white
+    r = i<85 ? i*3 : 255;
+    g = i<85 ? 0 : (i<170 ? (i-85)*3 : 255);
+    b = i<170 ? 0 : (i-170)*3;
+  }else if(effect==effectStarfield){
+    // Black to a bluish white
+    r = i;
+    g = i;
+    b = min(i+i/4,255);
+  }else{
+    // Hues going round, one turn over the palette
+    r = 128+sin8(i);
+    g = 128+sin8(i+85);
+    b = 128+sin8(i+170);
+  }
+  return ((uint32_t)r << 16) | ((uint32_t)g << 8) | b;
+}
+
+// Makes the palette of the effect with the colors shade returns for it,
+// call it again when the effect or the brightness changed
+void proceduralEffects::shadePalette(uint16_t (*shade)(uint32_t rgb)){
+  for(uint16_t i=0;i<256;i++){
+    palette[i] = shade(paletteColor(effect,i));
+  }
+}
+
+// Draws the next frame into the matrix buffer, elapsedMicros after the
+// last one
+void proceduralEffects::render(uint32_t elapsedMicros){
+  elapsedMicros = min(elapsedMicros,(uint32_t)effectMaxElapsedMicros);
+  // Steps to move on by, with 8 fraction bits
+  uint32_t stepsQ8 = stepFraction+(uint64_t)elapsedMicros*speed*2/effectStepMicros;
+  stepFraction = stepsQ8 & 0xFF;
+  elapsedSteps += stepsQ8 & ~0xFFUL;
+  if(effect==effectFire){
+    renderFire(stepsQ8 >> 8);
+  }else if(effect==effectStarfield){
+    renderStarfield(stepsQ8 & ~0xFFUL);
+  }else{
+    renderPlasma();
+  }
+}
+
+// Writes the palette colors of row into logical row y of the matrix buffer
+void proceduralEffects::writeRow(int16_t y){
+  uint16_t *out = canvas->buffer();
+  const canvasRun *runs = canvas->rowRuns(y);
+  for(uint16_t tile=0;tile<panelsAcross;tile++){
+    uint16_t *dst = &out[runs[tile].start];
+    int32_t step = runs[tile].step;
+    const uint8_t *src = &row[tile*panelTileWidth];
+    for(uint16_t x=0;x<panelTileWidth;x++){
+      *dst = palette[src[x]];
+      dst += step;
+    }
+  }
+}
+
+// Sum of three waves moving at different paces: along the rows, along
+// the columns and along the diagonal. The hues go round slowly too.
+void proceduralEffects::renderPlasma(){
+  uint8_t t = elapsedSteps >> 8;
+  uint8_t k = 1+(255-scale)/32; // Angle step per pixel, smaller waves with a smaller scale
+  int8_t columns[canvasWidth];
+  int8_t diagonals[canvasWidth+canvasHeight];
+  for(uint16_t x=0;x<canvasWidth;x++){
+    columns[x] = sin8(x*k+t);
+  }
+  for(uint16_t i=0;i<canvasWidth+canvasHeight;i++){
+    diagonals[i] = sin8(((i*k) >> 1)-2*t);
+  }
+  uint8_t hue = t >> 1;
+  for(uint16_t y=0;y<canvasHeight;y++){
+    int16_t rowWave = sin8(y*k+(3*t >> 1));
+    for(uint16_t x=0;x<canvasWidth;x++){
+      // From -381 to 381, scaled to 0 to 255 (171/512 is about 1/3)
+      int16_t v = columns[x]+rowWave+diagonals[x+y]+384;
+      row[x] = ((v*171) >> 9)+hue;
+    }
+    writeRow(y);
+  }
+}
+
+// One step of the fire: new fuel flickers below the picture and every
+// pixel takes the average heat of the pixels below it, less some cooling
+void proceduralEffects::stepFire(){
+  for(uint16_t x=0;x<canvasWidth;x++){
+    uint32_t r = nextRandom();
+    heat[canvasHeight][x] = 128+(r & 0x7F);
+    heat[canvasHeight+1][x] = 128+((r >> 8) & 0x7F);
+  }
+  // Top to bottom, so the rows below still hold the previous step
+  for(uint16_t y=0;y<canvasHeight;y++){
+    for(uint16_t x=0;x<canvasWidth;x++){
+      uint16_t left = x>0 ? x-1 : x;
+      uint16_t right = x+1<canvasWidth ? x+1 : x;
+      uint16_t sum = heat[y+1][left]+heat[y+1][x]+heat[y+1][right]+heat[y+2][x];
+      uint8_t cool = (nextRandom() & 0xFF)%coolMax;
+      uint8_t value = sum >> 2;
+      heat[y][x] = value>cool ? value-cool : 0;
+    }
+  }
+}
+
+void proceduralEffects::renderFire(uint32_t steps){
+  // A slow frame only catches up a few steps
+  for(uint32_t i=0;i<steps && i<4;i++){
+    stepFire();
+  }
+  for(uint16_t y=0;y<canvasHeight;y++){
+    memcpy(row,heat[y],canvasWidth);
+    writeRow(y);
+  }
+}
+
+// Puts the star back at a random place, at the far end or anywhere
+// along the way (to fill the field when it starts)
+void proceduralEffects::spawnStar(star &s, bool anyDepth){
+  uint32_t r = nextRandom();
+  s.x = (int16_t)(r & 0x7FF)-1024;
+  s.y = (int16_t)((r >> 11) & 0x7FF)-1024;
+  s.z = anyDepth ? 256+(r >> 22)*(effectStarDepth-256)/1024 : effectStarDepth;
+}
+
+// Stars fly towards the viewer, they are projected onto the picture by
+// dividing by their depth, get brighter as they come nearer and bigger
+// once they are close
+void proceduralEffects::renderStarfield(uint32_t stepsQ8){
+  // 8 depth units (128 sixteenths) per step, a star comes all the way in
+  // about 2 seconds at the normal speed
+  uint32_t dz = stepsQ8 >> 1;
+  canvas->fillScreen(palette[0]);
+  const int32_t focal = canvasWidth/2;
+  for(uint8_t i=0;i<starCount;i++){
+    star &s = stars[i];
+    if(s.z<=dz+16){
+      spawnStar(s,false);
+    }else{
+      s.z -= dz;
+    }
+    int32_t sx = canvasWidth/2+(int32_t)s.x*focal*16/s.z;
+    int32_t sy = canvasHeight/2+(int32_t)s.y*focal*16/s.z;
+    if(sx<0 || sy<0 || sx>=canvasWidth || sy>=canvasHeight){
+      spawnStar(s,false);
+      continue;
+    }
+    uint8_t level = 255-((s.z-1) >> 6);
+    uint16_t color = palette[level];
+    canvas->drawPixel(sx,sy,color);
+    if(s.z<effectStarDepth/4){
+      canvas->drawPixel(sx+1,sy,color);
+      canvas->drawPixel(sx,sy+1,color);
+      canvas->drawPixel(sx+1,sy+1,color);
+    }
+  }
+}
@@ -0,0 +1,68 @@
+/*
+ Paces the frames of a slideshow or an animation on absolute deadlines.
+ Every frame is due one interval after the previous one was due, not
+ after it was shown, so the time spent decoding and drawing a frame is
+ taken out of the wait instead of added to it. The frame is made ready
+ early by the longest time that recently took, then shown on time.
+ Times are in microseconds.
+*/
+#pragma once
+#include <Arduino.h>
+
+// Extra time allowed for the background work that runs while waiting
+// to overshoot the time to prepare the frame
+#ifndef frameScheduleMarginMicros
+#define frameScheduleMarginMicros 4000
+#endif
+
+class frameScheduler{
+  private:
+    uint32_t deadline = 0; // Time the next frame is due
+    uint32_t prepareEstimate = 0; // Longest recent time to prepare a frame
+    bool started = false; // A frame was shown since restart()
+
+  public:
+    // The next frame is shown right away and the pace starts over from it
+    void restart() { started = false; }
+    uint32_t prepareAt();
+    void prepared(uint32_t prepareMicros);
+    int32_t slack(uint32_t now);
+    void shown(uint32_t now, uint32_t intervalMicros);
+};
+
+// Time from which the next frame should be prepared
+uint32_t frameScheduler::prepareAt(){
+  if(!started){
+    return micros();
+  }
+  return deadline-prepareEstimate-frameScheduleMarginMicros;
+}
+
+// Takes the time the last frame took to prepare. The estimate follows a
+// longer time right away and decays slowly after it, so one slow image
+// (not cached yet) isn't followed by a late one.
+void frameScheduler::prepared(uint32_t prepareMicros){
+  prepareEstimate -= prepareEstimate/8;
+  if(prepareMicros>prepareEstimate){
+    prepareEstimate = prepareMicros;
+  }
+}
+
+// Time left until the frame is due, negative if it is late
+int32_t frameScheduler::slack(uint32_t now){
+  if(!started){
+    return 0;
+  }
+  return (int32_t)(deadline-now);
+}
+
+// The frame was shown at now, the next one is due intervalMicros after
+// this one was. When a frame is more than an interval late the pace
+// starts over from it, late frames are not made up by rushing the next.
+void frameScheduler::shown(uint32_t now, uint32_t intervalMicros){
+  if(!started || (int32_t)(now-deadline)>(int32_t)intervalMicros){
+    deadline = now;
+    started = true;
+  }
+  deadline += intervalMicros;
+}
@@ -0,0 +1,85 @@
+// Host stand-in for the subset of Adafruit_GFX used by the firmware.
+// Text is drawn as solid 5x7 cells since the real glyph table is not bundled.
+#pragma once
+#include <Arduino.h>
+
+class Adafruit_GFX : public Print {
+  public:
+    Adafruit_GFX(int16_t w, int16_t h) : _width(w), _height(h) {}
+    virtual void drawPixel(int16_t x, int16_t y, uint16_t color) = 0;
+    virtual void fillScreen(uint16_t color) {
+      for (int16_t y = 0; y < _height; y++)
+        for (int16_t x = 0; x < _width; x++) drawPixel(x, y, color);
+    }
+    void fillRect(int16_t x, int16_t y, int16_t w, int16_t h, uint16_t color) {
+      for (int16_t j = y; j < y + h; j++)
+        for (int16_t i = x; i < x + w; i++) drawPixel(i, j, color);
+    }
+    void setCursor(int16_t x, int16_t y) { cursor_x = x; cursor_y = y; }
+    void setTextColor(uint16_t c) { textcolor = c; }
+    void setTextSize(uint8_t s) { textsize = s ? s : 1; }
+    void setTextWrap(bool w) { wrap = w; }
+    int16_t width(void) const { return _width; }
+    int16_t height(void) const { return _height; }
+    int16_t getCursorX(void) const { return cursor_x; }
+    size_t write(uint8_t c) override {
+      if (c == '\n') {
+        cursor_x = 0;
+        cursor_y += 8 * textsize;
+        return 1;
+      }
+      if (c == '\r') return 1;
+      if (wrap && cursor_x + 6 * textsize > _width) {
+        cursor_x = 0;
+        cursor_y += 8 * textsize;
+      }
+      if (c != ' ') fillRect(cursor_x, cursor_y, 5 * textsize, 7 * textsize, textcolor);
+      cursor_x += 6 * textsize;
+      return 1;
+    }
+    using Print::write;
+
+  protected:
+    int16_t _width, _height;
+    int16_t cursor_x = 0, cursor_y = 0;
+    uint16_t textcolor = 0xFFFF;
+    uint8_t textsize = 1;
+    bool wrap = true;
+};
+
+class GFXcanvas1 : public Adafruit_GFX {
+  public:
+    GFXcanvas1(uint16_t w, uint16_t h) : Adafruit_GFX(w, h) {
+      buffer = (uint8_t *)calloc(((w + 7) / 8) * h, 1);
+    }
+    ~GFXcanvas1() { free(buffer); }
+    void drawPixel(int16_t x, int16_t y, uint16_t color) override {
+      if (!buffer || x < 0 || y < 0 || x >= _width || y >= _height) return;
+      uint8_t *p = &buffer[(x / 8) + y * ((_width + 7) / 8)];
+      if (color) *p |= 0x80 >> (x & 7);
+      else *p &= ~(0x80 >> (x & 7));
+    }
+    uint8_t *getBuffer(void) const { return buffer; }
+
+  private:
+    uint8_t *buffer;
+};
+
+class GFXcanvas16 : public Adafruit_GFX {
+  public:
+    GFXcanvas16(uint16_t w, uint16_t h) : Adafruit_GFX(w, h) {
+      buffer = (uint16_t *)calloc((size_t)w * h, 2);
+    }
+    ~GFXcanvas16() { free(buffer); }
+    void drawPixel(int16_t x, int16_t y, uint16_t color) override {
+      if (!buffer || x < 0 || y < 0 || x >= _width || y >= _height) return;
+      buffer[x + y * _width] = color;
+    }
+    void fillScreen(uint16_t color) override {
+      for (size_t i = 0; i < (size_t)_width * _height; i++) buffer[i] = color;
+    }
+    uint16_t *getBuffer(void) const { return buffer; }
+
+  protected:
+    uint16_t *buffer;
+};
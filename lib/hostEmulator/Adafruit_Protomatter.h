@@ -0,0 +1,37 @@
+// Host stand-in for Adafruit_Protomatter: an in-memory canvas whose
+// show() snapshots the frame and, when enabled, dumps it as a PPM file.
+// getFrameCount() counts panel refreshes in virtual time.
+#pragma once
+#include <Adafruit_GFX.h>
+
+typedef enum {
+  PROTOMATTER_OK,
+  PROTOMATTER_ERR_PINS,
+  PROTOMATTER_ERR_MALLOC,
+  PROTOMATTER_ERR_ARG,
+} ProtomatterStatus;
+
+class Adafruit_Protomatter : public GFXcanvas16 {
+  public:
+    Adafruit_Protomatter(uint16_t bitWidth, uint8_t bitDepth, uint8_t rgbCount,
+                         uint8_t *rgbList, uint8_t addrCount, uint8_t *addrList,
+                         uint8_t clockPin, uint8_t latchPin, uint8_t oePin,
+                         bool doubleBuffer, int8_t tile = 1, void *timer = NULL);
+    ~Adafruit_Protomatter();
+    ProtomatterStatus begin(void);
+    void show(void);
+    uint32_t getFrameCount(void);
+    static uint16_t color565(uint8_t red, uint8_t green, uint8_t blue) {
+      return ((red & 0xF8) << 8) | ((green & 0xFC) << 3) | (blue >> 3);
+    }
+    uint8_t bitDepth;
+    bool doubleBuffered;
+};
+
+// Emulator access to the frames shown on the panels
+namespace hostDisplay {
+  extern uint32_t framesShown;
+  extern const char *dumpDir; // If set, every show() writes frameNNNNN.ppm here
+  const uint16_t *lastFrame(); // Last frame shown, as the LEDs get it
+  bool writePPM(const char *path);
+}
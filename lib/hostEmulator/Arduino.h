@@ -0,0 +1,159 @@
+// Host stand-in for the Arduino core (earlephilhower RP2040 flavour)
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <math.h>
+#include <string>
+#include <functional>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define PROGMEM
+#define F(s) (s)
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define HIGH 1
+#define LOW 0
+
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void yield(void);
+void pinMode(uint8_t pin, uint8_t mode);
+int digitalRead(uint8_t pin);
+void digitalWrite(uint8_t pin, uint8_t val);
+int analogRead(uint8_t pin);
+long random(long max);
+long random(long min, long max);
+void randomSeed(unsigned long seed);
+void noInterrupts(void);
+void interrupts(void);
+
+template <class T> static inline T min(T a, T b) { return a < b ? a : b; }
+template <class T> static inline T max(T a, T b) { return a > b ? a : b; }
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+class String {
+  public:
+    std::string s;
+    String() {}
+    String(const char *c) : s(c ? c : "") {}
+    String(const std::string &c) : s(c) {}
+    String(char c) : s(1, c) {}
+    String(int v) : s(std::to_string(v)) {}
+    String(unsigned int v) : s(std::to_string(v)) {}
+    String(long v) : s(std::to_string(v)) {}
+    String(unsigned long v) : s(std::to_string(v)) {}
+    const char *c_str() const { return s.c_str(); }
+    unsigned int length() const { return s.size(); }
+    bool concat(const String &o) { s += o.s; return true; }
+    bool concat(const char *o) { s += o; return true; }
+    bool concat(char c) { s += c; return true; }
+    String &operator+=(const String &o) { s += o.s; return *this; }
+    String &operator+=(const char *o) { s += o; return *this; }
+    String &operator+=(char c) { s += c; return *this; }
+    String &operator+=(int v) { s += std::to_string(v); return *this; }
+    String &operator+=(unsigned int v) { s += std::to_string(v); return *this; }
+    String &operator+=(size_t v) { s += std::to_string(v); return *this; }
+    bool equals(const String &o) const { return s == o.s; }
+    bool equalsIgnoreCase(const String &o) const { return strcasecmp(s.c_str(), o.s.c_str()) == 0; }
+    bool operator==(const String &o) const { return s == o.s; }
+    bool operator==(const char *o) const { return s == o; }
+    bool operator!=(const String &o) const { return s != o.s; }
+    char operator[](unsigned int i) const { return i < s.size() ? s[i] : 0; }
+    bool startsWith(const String &p) const { return s.compare(0, p.s.size(), p.s) == 0; }
+    bool endsWith(const String &p) const { return s.size() >= p.s.size() && s.compare(s.size() - p.s.size(), p.s.size(), p.s) == 0; }
+    int indexOf(char c, unsigned int from = 0) const { size_t p = s.find(c, from); return p == std::string::npos ? -1 : (int)p; }
+    int indexOf(const String &c, unsigned int from = 0) const { size_t p = s.find(c.s, from); return p == std::string::npos ? -1 : (int)p; }
+    String substring(unsigned int b) const { return b >= s.size() ? String() : String(s.substr(b)); }
+    String substring(unsigned int b, unsigned int e) const { return b >= s.size() || e <= b ? String() : String(s.substr(b, e - b)); }
+    long toInt() const { return atol(s.c_str()); }
+    void toCharArray(char *buf, unsigned int len) const {
+      if (!len) return;
+      size_t n = s.size() < len - 1 ? s.size() : len - 1;
+      memcpy(buf, s.c_str(), n);
+      buf[n] = 0;
+    }
+    void toLowerCase() { for (auto &c : s) c = tolower(c); }
+    void trim() {
+      size_t b = s.find_first_not_of(" \t\r\n");
+      size_t e = s.find_last_not_of(" \t\r\n");
+      s = (b == std::string::npos) ? std::string() : s.substr(b, e - b + 1);
+    }
+    bool reserve(unsigned int n) { s.reserve(n); return true; }
+};
+static inline String operator+(const String &a, const String &b) { return String(a.s + b.s); }
+static inline String operator+(const String &a, const char *b) { return String(a.s + b); }
+static inline String operator+(const char *a, const String &b) { return String(a + b.s); }
+static inline String operator+(const String &a, char b) { return String(a.s + b); }
+static inline String operator+(const String &a, int b) { return String(a.s + std::to_string(b)); }
+static inline String operator+(const String &a, unsigned int b) { return String(a.s + std::to_string(b)); }
+static inline String operator+(const String &a, long b) { return String(a.s + std::to_string(b)); }
+static inline String operator+(const String &a, unsigned long b) { return String(a.s + std::to_string(b)); }
+
+class Print {
+  public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t *buf, size_t len) {
+      size_t n = 0;
+      while (len--) n += write(*buf++);
+      return n;
+    }
+    size_t write(const char *str) { return write((const uint8_t *)str, strlen(str)); }
+    size_t print(const char *s) { return write(s); }
+    size_t print(const String &s) { return write(s.c_str()); }
+    size_t print(char c) { return write((uint8_t)c); }
+    size_t print(int v) { return printf("%d", v); }
+    size_t print(unsigned int v) { return printf("%u", v); }
+    size_t print(long v) { return printf("%ld", v); }
+    size_t print(unsigned long v) { return printf("%lu", v); }
+    size_t print(double v, int d = 2) { return printf("%.*f", d, v); }
+    size_t println() { return write("\r\n"); }
+    template <class T> size_t println(T v) { size_t n = print(v); return n + println(); }
+    size_t printf(const char *fmt, ...) __attribute__((format(printf, 2, 3))) {
+      char buf[256];
+      va_list ap;
+      va_start(ap, fmt);
+      int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+      va_end(ap);
+      if (n < 0) return 0;
+      return write((const uint8_t *)buf, n < (int)sizeof(buf) ? n : sizeof(buf) - 1);
+    }
+    virtual int availableForWrite() { return 0; }
+    virtual void flush() {}
+};
+
+class Stream : public Print {
+  public:
+    virtual int available() { return 0; }
+    virtual int read() { return -1; }
+};
+
+class HostSerial : public Stream {
+  public:
+    void begin(unsigned long) {}
+    operator bool() const { return true; }
+    size_t write(uint8_t c) override;
+    size_t write(const uint8_t *buf, size_t len) override;
+    int availableForWrite() override { return 256; }
+    using Print::write;
+};
+extern HostSerial Serial;
+
+// Subset of the RP2040 helper object used by the firmware
+class RP2040Host {
+  public:
+    int getFreeHeap();
+    int getUsedHeap();
+    int getTotalHeap();
+    uint32_t getCycleCount();
+    uint32_t hwrand32();
+};
+extern RP2040Host rp2040;
@@ -0,0 +1,181 @@
+// Host stand-in for AsyncWebServer_RP2040W: a loopback server that
+// dispatches scripted requests to the registered handlers synchronously.
+#pragma once
+#include <Arduino.h>
+#include <vector>
+#include <memory>
+
+#define RESPONSE_TRY_AGAIN 0xFFFFFFFF
+
+typedef enum {
+  HTTP_GET = 0b00000001,
+  HTTP_POST = 0b00000010,
+  HTTP_DELETE = 0b00000100,
+  HTTP_PUT = 0b00001000,
+  HTTP_PATCH = 0b00010000,
+  HTTP_HEAD = 0b00100000,
+  HTTP_OPTIONS = 0b01000000,
+  HTTP_ANY = 0b01111111,
+} WebRequestMethod;
+typedef uint8_t WebRequestMethodComposite;
+
+class IPAddress {
+  public:
+    IPAddress(uint8_t a = 0, uint8_t b = 0, uint8_t c = 0, uint8_t d = 0) { bytes[0] = a; bytes[1] = b; bytes[2] = c; bytes[3] = d; }
+    uint8_t bytes[4];
+};
+
+#define WIFI_AP 2
+class HostWiFi {
+  public:
+    void mode(int) {}
+    void config(IPAddress) {}
+    int begin(const char *, const char *) { return 1; }
+};
+extern HostWiFi WiFi;
+
+class AsyncWebHeader {
+  public:
+    AsyncWebHeader(const String &n, const String &v) : _name(n), _value(v) {}
+    const String &name() const { return _name; }
+    const String &value() const { return _value; }
+    String toString() const { return _name + ": " + _value + "\r\n"; }
+
+  private:
+    String _name, _value;
+};
+
+class AsyncWebParameter {
+  public:
+    AsyncWebParameter(const String &n, const String &v) : _name(n), _value(v) {}
+    const String &name() const { return _name; }
+    const String &value() const { return _value; }
+    bool isPost() const { return false; } // Only query parameters are emulated
+    bool isFile() const { return false; }
+
+  private:
+    String _name, _value;
+};
+
+typedef std::function<size_t(uint8_t *, size_t, size_t)> AwsResponseFiller;
+typedef std::function<String(const String &)> AwsTemplateProcessor;
+
+class AsyncWebServerResponse {
+  public:
+    virtual ~AsyncWebServerResponse() {}
+    void setCode(int code) { _code = code; }
+    void setContentLength(size_t len) { _contentLength = len; }
+    void setContentType(const String &type) { _contentType = type; }
+    void addHeader(const String &name, const String &value) { _headers.push_back(AsyncWebHeader(name, value)); }
+    int _code = 200;
+    String _contentType;
+    size_t _contentLength = 0;
+    bool _chunked = false;
+    std::vector<AsyncWebHeader> _headers;
+    std::string _content;
+    AwsResponseFiller _filler;
+};
+
+class AsyncResponseStream : public AsyncWebServerResponse, public Print {
+  public:
+    size_t write(uint8_t c) override { _content.push_back((char)c); _contentLength = _content.size(); return 1; }
+    size_t write(const uint8_t *buf, size_t len) override { _content.append((const char *)buf, len); _contentLength = _content.size(); return len; }
+    using Print::write;
+};
+
+class AsyncWebServerRequest;
+typedef std::function<void(void)> ArDisconnectHandler;
+typedef std::function<void(AsyncWebServerRequest *request)> ArRequestHandlerFunction;
+typedef std::function<void(AsyncWebServerRequest *request, const String &filename, size_t index, uint8_t *data, size_t len, bool final)> ArUploadHandlerFunction;
+typedef std::function<void(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total)> ArBodyHandlerFunction;
+
+class AsyncWebServerRequest {
+  public:
+    ~AsyncWebServerRequest();
+    WebRequestMethodComposite method() const { return _method; }
+    const String &url() const { return _url; }
+    const String &contentType() const { return _contentType; }
+    size_t contentLength() const { return _contentLength; }
+    size_t headers() const { return _headers.size(); }
+    bool hasHeader(const String &name) const;
+    AsyncWebHeader *getHeader(const String &name);
+    AsyncWebHeader *getHeader(size_t num) { return num < _headers.size() ? &_headers[num] : NULL; }
+    const String &header(const char *name) const;
+    size_t params() const { return _params.size(); }
+    bool hasParam(const String &name, bool post = false, bool file = false) const;
+    AsyncWebParameter *getParam(const String &name, bool post = false, bool file = false);
+    AsyncWebParameter *getParam(size_t num) { return num < _params.size() ? &_params[num] : NULL; }
+    size_t args() const { return _params.size(); }
+    const String &arg(const String &name) const;
+    const String &arg(size_t i) const { return _params[i].value(); }
+    const String &argName(size_t i) const { return _params[i].name(); }
+    bool hasArg(const char *name) const { return hasParam(name); }
+    void onDisconnect(ArDisconnectHandler fn) { _onDisconnect = fn; }
+    void send(AsyncWebServerResponse *response);
+    void send(int code, const String &contentType = String(), const String &content = String());
+    AsyncWebServerResponse *beginResponse(int code, const String &contentType = String(), const String &content = String());
+    AsyncWebServerResponse *beginResponse(const String &contentType, size_t len, AwsResponseFiller callback, AwsTemplateProcessor templateCallback = nullptr);
+    AsyncWebServerResponse *beginResponse_P(int code, const String &contentType, const uint8_t *content, size_t len, AwsTemplateProcessor callback = nullptr);
+    AsyncResponseStream *beginResponseStream(const String &contentType, size_t = 1460) {
+      AsyncResponseStream *r = new AsyncResponseStream();
+      r->_contentType = contentType;
+      return r;
+    }
+    AsyncWebServerResponse *beginChunkedResponse(const String &contentType, AwsResponseFiller callback, AwsTemplateProcessor templateCallback = nullptr);
+    void *_tempObject = NULL;
+
+    // Loopback plumbing
+    WebRequestMethodComposite _method = HTTP_GET;
+    String _url;
+    String _contentType;
+    size_t _contentLength = 0;
+    std::vector<AsyncWebHeader> _headers;
+    std::vector<AsyncWebParameter> _params;
+    AsyncWebServerResponse *_response = NULL;
+    ArDisconnectHandler _onDisconnect;
+};
+
+class AsyncWebServer {
+  public:
+    AsyncWebServer(uint16_t port);
+    void begin() {}
+    void on(const char *uri, WebRequestMethodComposite method, ArRequestHandlerFunction onRequest);
+    void on(const char *uri, WebRequestMethodComposite method, ArRequestHandlerFunction onRequest, ArUploadHandlerFunction onUpload);
+    void on(const char *uri, WebRequestMethodComposite method, ArRequestHandlerFunction onRequest, ArUploadHandlerFunction onUpload, ArBodyHandlerFunction onBody);
+    void onNotFound(ArRequestHandlerFunction fn) { _notFound = fn; }
+
+    struct route {
+      String uri;
+      WebRequestMethodComposite method;
+      ArRequestHandlerFunction onRequest;
+      ArUploadHandlerFunction onUpload;
+      ArBodyHandlerFunction onBody;
+    };
+    std::vector<route> _routes;
+    ArRequestHandlerFunction _notFound;
+
+  private:
+    uint16_t _port;
+};
+
+// Loopback client used by the emulator scripts
+namespace hostWeb {
+  extern AsyncWebServer *server; // The server requests go to
+  extern bool idleBetweenChunks; // Run the render loop's background work between chunks
+  struct filePart {
+    std::string filename;
+    std::string data;
+  };
+  struct response {
+    int code = 0;
+    std::string contentType;
+    std::vector<std::pair<std::string, std::string>> headers;
+    std::string body;
+  };
+  // Sends a request to the registered handlers; bodies and file parts
+  // are delivered in chunkSize pieces like the TCP stack would.
+  response request(WebRequestMethodComposite method, const std::string &url,
+                   const std::vector<std::pair<std::string, std::string>> &headers,
+                   const std::string &body, const std::vector<filePart> &files,
+                   size_t chunkSize = 1436);
+}
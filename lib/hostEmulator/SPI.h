@@ -0,0 +1,2 @@
+// Host stand-in for the SPI driver
+#pragma once
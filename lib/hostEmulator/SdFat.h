@@ -0,0 +1,140 @@
+// Host stand-in for the Adafruit SdFat fork: SdFat32/File32 backed by a
+// directory on the host filesystem (hostSd::rootDir).
+#pragma once
+#include <Arduino.h>
+
+typedef int oflag_t;
+#define O_RDONLY 0x00
+#define O_WRONLY 0x01
+#define O_RDWR 0x02
+#define O_ACCMODE 0x03
+#define O_APPEND 0x08
+#define O_CREAT 0x10
+#define O_TRUNC 0x20
+#define O_EXCL 0x40
+#define O_READ O_RDONLY
+#define O_WRITE O_WRONLY
+#define O_AT_END 0x4000
+#define LS_DATE 1
+#define LS_SIZE 2
+#define LS_R 4
+#define DEDICATED_SPI 1
+#define SHARED_SPI 0
+#define SD_SCK_MHZ(maxMhz) (1000000UL * (maxMhz))
+#define SD_CARD_TYPE_SD1 1
+#define SD_CARD_TYPE_SD2 2
+#define SD_CARD_TYPE_SDHC 3
+
+class SdSpiConfig {
+  public:
+    SdSpiConfig(uint8_t cs, uint8_t opt, uint32_t maxSpeed) : csPin(cs), options(opt), maxSck(maxSpeed) {}
+    uint8_t csPin;
+    uint8_t options;
+    uint32_t maxSck;
+};
+
+typedef struct CID {
+  uint8_t mid;
+  char oid[2];
+  char pnm[5];
+  uint8_t prv;
+  uint8_t psn8[4];
+  uint8_t mdt[2];
+  uint8_t crc;
+  uint32_t psn() const { return (uint32_t)psn8[0] << 24 | (uint32_t)psn8[1] << 16 | (uint32_t)psn8[2] << 8 | psn8[3]; }
+  int prvN() const { return prv >> 4; }
+  int prvM() const { return prv & 0XF; }
+} cid_t;
+
+class SdCard {
+  public:
+    bool readSector(uint32_t sector, uint8_t *dst) { return readSectors(sector, dst, 1); }
+    bool readSectors(uint32_t sector, uint8_t *dst, size_t ns);
+    bool writeSector(uint32_t sector, const uint8_t *src) { return writeSectors(sector, src, 1); }
+    bool writeSectors(uint32_t sector, const uint8_t *src, size_t ns);
+    bool readCID(cid_t *cid);
+    uint32_t sectorCount();
+    uint8_t type() { return SD_CARD_TYPE_SDHC; }
+    uint8_t errorCode() { return 0; }
+};
+
+class File32 : public Stream {
+  public:
+    File32() {}
+    ~File32() { close(); }
+    File32(const File32 &) = delete;
+    File32 &operator=(const File32 &) = delete;
+    bool open(const char *path, oflag_t oflag = O_RDONLY);
+    bool open(File32 *dirFile, const char *path, oflag_t oflag = O_RDONLY);
+    bool openNext(File32 *dirFile, oflag_t oflag = O_RDONLY);
+    bool close();
+    bool isOpen() const { return fp != NULL || dp != NULL; }
+    bool isDir() const { return dp != NULL; }
+    bool isFile() const { return fp != NULL; }
+    bool isContiguous() const { return isFile(); }
+    size_t getName(char *name, size_t size);
+    int read(void *buf, size_t count);
+    int read() override;
+    int available() override;
+    size_t write(const void *buf, size_t count);
+    size_t write(uint8_t b) override { return write(&b, 1); }
+    size_t write(const uint8_t *buf, size_t count) override { return write((const void *)buf, count); }
+    bool seek(uint64_t pos) { return seekSet(pos); }
+    bool seekSet(uint32_t pos);
+    bool seekCur(int32_t offset) { return seekSet(curPosition() + offset); }
+    uint32_t curPosition() const;
+    uint64_t position() const { return curPosition(); }
+    uint32_t fileSize() const;
+    uint64_t size() const { return fileSize(); }
+    bool preAllocate(uint32_t length);
+    bool contiguousRange(uint32_t *bgnSector, uint32_t *endSector);
+    uint32_t firstSector() const;
+    bool sync();
+    bool truncate(uint32_t length);
+    bool truncate() { return truncate(curPosition()); }
+    bool remove();
+    bool rmdir();
+    bool rmRfStar();
+    bool rename(const char *newPath);
+    bool exists(const char *path);
+    void rewind() { seekSet(0); }
+    void flush() override { sync(); }
+
+  private:
+    friend class SdFat32;
+    friend class SdCard;
+    FILE *fp = NULL;
+    void *dp = NULL; // DIR*
+    std::string hostPath;
+    std::string name;
+};
+
+class SdFat32 {
+  public:
+    bool begin(SdSpiConfig config);
+    void end() {}
+    bool exists(const char *path);
+    bool remove(const char *path);
+    bool rename(const char *oldPath, const char *newPath);
+    bool mkdir(const char *path, bool pFlag = true);
+    bool rmdir(const char *path);
+    void ls(uint8_t flags = 0);
+    SdCard *card() { return &sdCard; }
+    uint32_t freeClusterCount();
+    uint8_t sectorsPerCluster() { return 64; }
+    uint32_t clusterCount();
+    uint8_t fatType() { return 32; }
+
+  private:
+    SdCard sdCard;
+};
+
+// Emulator access to the card
+namespace hostSd {
+  extern std::string rootDir; // Host directory that backs the card
+  std::string hostPath(const char *path);
+  extern uint32_t readCalls; // Transfers, for the reports of the script runs
+  extern uint32_t writeCalls;
+  extern uint64_t bytesRead;
+  extern uint32_t configuredSck; // SPI clock asked for in begin()
+}
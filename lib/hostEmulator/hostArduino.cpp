@@ -0,0 +1,53 @@
+// Host implementation of the Arduino core stand-in
+#include <Arduino.h>
+#include <malloc.h>
+#include "hostClock.h"
+
+namespace hostClock{
+  uint64_t now = 0;
+}
+
+unsigned long micros(void) { return (unsigned long)(hostClock::now++); }
+unsigned long millis(void) { return (unsigned long)(hostClock::now++/1000); }
+void delay(unsigned long ms) { hostClock::advance((uint64_t)ms*1000); }
+void delayMicroseconds(unsigned int us) { hostClock::advance(us); }
+void yield(void) { hostClock::advance(10); }
+void pinMode(uint8_t, uint8_t) {}
+int digitalRead(uint8_t) { return HIGH; }
+void digitalWrite(uint8_t, uint8_t) {}
+int analogRead(uint8_t) { return 512; }
+void noInterrupts(void) {}
+void interrupts(void) {}
+
+// Same sequence on every run
+static uint32_t randState = 1;
+void randomSeed(unsigned long seed) { randState = seed ? seed : 1; }
+long random(long maxVal){
+  randState = randState*1103515245+12345;
+  return maxVal>0 ? (long)((randState >> 8)%(uint32_t)maxVal) : 0;
+}
+long random(long minVal, long maxVal) { return minVal+random(maxVal-minVal); }
+
+// The serial log goes to stderr when HOST_SERIAL is set in the environment
+static bool serialEcho = getenv("HOST_SERIAL")!=NULL;
+HostSerial Serial;
+size_t HostSerial::write(uint8_t c){
+  if(serialEcho){
+    fputc(c,stderr);
+  }
+  return 1;
+}
+size_t HostSerial::write(const uint8_t *buf, size_t len){
+  if(serialEcho){
+    fwrite(buf,1,len,stderr);
+  }
+  return len;
+}
+
+// The heap figures are the host allocator's, against the RP2040's 256 KB
+RP2040Host rp2040;
+int RP2040Host::getUsedHeap() { return mallinfo2().uordblks; }
+int RP2040Host::getTotalHeap() { return 256*1024; }
+int RP2040Host::getFreeHeap() { return getTotalHeap()-getUsedHeap(); }
+uint32_t RP2040Host::getCycleCount() { return (uint32_t)(hostClock::now*133); }
+uint32_t RP2040Host::hwrand32() { return 0x5eed1234; }
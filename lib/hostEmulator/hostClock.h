@@ -0,0 +1,14 @@
+/*
+ Virtual time of the host emulator. The clock only moves forward when
+ the firmware waits (delay, yield) and by the modeled cost of the work the
+ stand-ins do (SD transfers, matrix refresh, network), plus a microsecond
+ per clock read so busy loops end. The same script always gives the same
+ times, whatever the host is doing.
+*/
+#pragma once
+#include <stdint.h>
+
+namespace hostClock{
+  extern uint64_t now; // Microseconds since boot
+  inline void advance(uint64_t micros) { now += micros; }
+}
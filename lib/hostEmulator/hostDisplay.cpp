@@ -0,0 +1,67 @@
+// Host implementation of the Protomatter stand-in
+#include <Adafruit_Protomatter.h>
+#include <vector>
+#include "hostClock.h"
+
+namespace hostDisplay{
+  uint32_t framesShown = 0;
+  const char *dumpDir = NULL;
+  static std::vector<uint16_t> shown;
+  static int16_t shownWidth = 0, shownHeight = 0;
+
+  const uint16_t *lastFrame() { return shown.empty() ? NULL : shown.data(); }
+
+  // Binary PPM, the 565 channels widened to 8 bits
+  bool writePPM(const char *path){
+    FILE *f = fopen(path,"wb");
+    if(!f){
+      return false;
+    }
+    fprintf(f,"P6\n%d %d\n255\n",shownWidth,shownHeight);
+    for(uint16_t c : shown){
+      uint8_t r = c >> 11, g = (c >> 5) & 0x3F, b = c & 0x1F;
+      uint8_t rgb[3] = {(uint8_t)((r << 3) | (r >> 2)),(uint8_t)((g << 2) | (g >> 4)),(uint8_t)((b << 3) | (b >> 2))};
+      fwrite(rgb,1,3,f);
+    }
+    return fclose(f)==0;
+  }
+}
+
+// The buffer is as tall as the panels the address lines reach
+Adafruit_Protomatter::Adafruit_Protomatter(uint16_t bitWidth, uint8_t depth, uint8_t rgbCount,
+                                           uint8_t *, uint8_t addrCount, uint8_t *,
+                                           uint8_t, uint8_t, uint8_t, bool doubleBuffer, int8_t tile, void *)
+    : GFXcanvas16(bitWidth,(2 << addrCount)*rgbCount*(tile<0 ? -tile : tile)),
+      bitDepth(depth), doubleBuffered(doubleBuffer) {}
+Adafruit_Protomatter::~Adafruit_Protomatter() {}
+ProtomatterStatus Adafruit_Protomatter::begin(void) { return buffer ? PROTOMATTER_OK : PROTOMATTER_ERR_MALLOC; }
+// The panels are refreshed by an interrupt, independent of show(): every
+// row pair is shifted out once per bit plane weight, about 4us a time.
+// A 64x32 panel at bit depth 6 refreshes about 250 times a second.
+uint32_t Adafruit_Protomatter::getFrameCount(void) {
+  uint64_t refreshMicros = (uint64_t)(_height/2)*((1 << bitDepth)-1)*4;
+  return hostClock::now/refreshMicros;
+}
+
+void Adafruit_Protomatter::show(void){
+  // Converting to bit planes costs about 1us per 32 pixels per plane
+  hostClock::advance((uint64_t)_width*_height*bitDepth/32);
+  hostDisplay::shown.assign(buffer,buffer+(size_t)_width*_height);
+  // Only the top bitDepth bits of each channel reach the LEDs
+  uint8_t redBlueBits = bitDepth<5 ? bitDepth : 5;
+  uint8_t greenBits = bitDepth<6 ? bitDepth : 6;
+  uint16_t redBlue = (0x1F >> (5-redBlueBits)) << (5-redBlueBits);
+  uint16_t green = (0x3F >> (6-greenBits)) << (6-greenBits);
+  uint16_t mask = (redBlue << 11) | (green << 5) | redBlue;
+  for(uint16_t &c : hostDisplay::shown){
+    c &= mask;
+  }
+  hostDisplay::shownWidth = _width;
+  hostDisplay::shownHeight = _height;
+  hostDisplay::framesShown++;
+  if(hostDisplay::dumpDir){
+    char path[512];
+    snprintf(path,sizeof(path),"%s/frame%05u.ppm",hostDisplay::dumpDir,(unsigned)hostDisplay::framesShown);
+    hostDisplay::writePPM(path);
+  }
+}
@@ -0,0 +1,123 @@
+/*
+ Entry point of the native build: boots the firmware with setup(), then
+ runs a script of requests and render loop iterations against it.
+
+   program <sd card dir> <script> [frame dump dir]
+
+ The directory stands in for the SD card. With a dump directory every
+ frame shown is written there as frameNNNNN.ppm. Script commands, one
+ per line, # starts a comment:
+   REQ <METHOD> <url> [Header:Value ...] [@bodyfile | =body]
+   UPLOAD <url> [Header:Value ...] <hostfile> ...   multipart upload
+   LOOP <n>          run loop() n times
+   WAIT <ms>         run loop() until ms of virtual time have passed
+   DUMP <file.ppm>   write the last frame shown
+   SAVE <file>       write the body of the last response
+   IDLE on|off       run the background tasks between upload chunks
+ Responses are printed to stdout, the serial log goes to stderr when
+ HOST_SERIAL is set.
+ Left out of pio test builds, the tests under test/ have their own main.
+*/
+#ifndef PIO_UNIT_TESTING
+#include <Arduino.h>
+#include <Adafruit_Protomatter.h>
+#include <SdFat.h>
+#include <AsyncWebServer_RP2040W.h>
+#include <fstream>
+#include <sstream>
+
+void setup(void);
+void loop(void);
+
+static std::string readHostFile(const std::string &path) {
+  std::ifstream f(path, std::ios::binary);
+  std::stringstream ss;
+  ss << f.rdbuf();
+  return ss.str();
+}
+
+static WebRequestMethodComposite methodFromName(const std::string &m) {
+  if (m == "GET") return HTTP_GET;
+  if (m == "POST") return HTTP_POST;
+  if (m == "PUT") return HTTP_PUT;
+  if (m == "DELETE") return HTTP_DELETE;
+  if (m == "HEAD") return HTTP_HEAD;
+  return HTTP_ANY;
+}
+
+// Runs the script, the commands are listed at the top of the file
+static std::string lastBody;
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s <sdcard dir> <script> [frame dump dir]\n", argv[0]);
+    return 2;
+  }
+  hostSd::rootDir = argv[1];
+  if (argc > 3) hostDisplay::dumpDir = argv[3];
+  std::ifstream script(argv[2]);
+  setup();
+  std::string line;
+  while (std::getline(script, line)) {
+    std::stringstream ss(line);
+    std::string cmd;
+    ss >> cmd;
+    if (cmd.empty() || cmd[0] == '#') continue;
+    if (cmd == "REQ" || cmd == "UPLOAD") {
+      std::string method = "POST", url, tok, body;
+      if (cmd == "REQ") ss >> method;
+      ss >> url;
+      std::vector<std::pair<std::string, std::string>> headers;
+      std::vector<hostWeb::filePart> files;
+      while (ss >> tok) {
+        if (cmd == "UPLOAD" && tok[0] != '/') {
+          size_t c = tok.find(':');
+          headers.push_back({tok.substr(0, c), tok.substr(c + 1)});
+        } else if (cmd == "UPLOAD") {
+          std::string base = tok.substr(tok.find_last_of('/') + 1);
+          files.push_back({base, readHostFile(tok)});
+        } else if (tok[0] == '@') {
+          body = readHostFile(tok.substr(1));
+        } else if (tok[0] == '=') {
+          body = tok.substr(1);
+        } else {
+          size_t c = tok.find(':');
+          headers.push_back({tok.substr(0, c), c == std::string::npos ? "" : tok.substr(c + 1)});
+        }
+      }
+      hostWeb::response r = hostWeb::request(methodFromName(method), url, headers, body, files);
+      lastBody = r.body;
+      printf("%s %s -> %d", method.c_str(), url.c_str(), r.code);
+      for (auto &h : r.headers) printf(" [%s: %s]", h.first.c_str(), h.second.c_str());
+      printf("\n%s\n", r.body.size() > 200000 ? (r.body.substr(0, 200000) + "...").c_str() : r.body.c_str());
+    } else if (cmd == "SAVE") {
+      std::string path;
+      ss >> path;
+      FILE *f = fopen(path.c_str(), "wb");
+      fwrite(lastBody.data(), 1, lastBody.size(), f);
+      fclose(f);
+      printf("SAVE %s %zu bytes\n", path.c_str(), lastBody.size());
+    } else if (cmd == "IDLE") {
+      std::string v;
+      ss >> v;
+      hostWeb::idleBetweenChunks = v != "off";
+    } else if (cmd == "LOOP") {
+      int n = 1;
+      ss >> n;
+      for (int i = 0; i < n; i++) loop();
+    } else if (cmd == "WAIT") {
+      unsigned long ms = 0;
+      ss >> ms;
+      unsigned long start = millis();
+      while (millis() - start < ms) loop();
+    } else if (cmd == "DUMP") {
+      std::string path;
+      ss >> path;
+      printf("DUMP %s %s\n", path.c_str(), hostDisplay::writePPM(path.c_str()) ? "ok" : "failed");
+    }
+  }
+  printf("frames shown: %u, sd read calls: %u, sd bytes read: %llu, virtual ms: %lu\n",
+         (unsigned)hostDisplay::framesShown, (unsigned)hostSd::readCalls,
+         (unsigned long long)hostSd::bytesRead, millis());
+  return 0;
+}
+#endif
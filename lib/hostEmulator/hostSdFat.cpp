@@ -0,0 +1,244 @@
+// Host implementation of the SdFat stand-in. Paths on the card map to
+// paths under hostSd::rootDir. Transfers advance the virtual clock by
+// what they take at the SPI clock the card was mounted at. Above
+// HOST_SD_MAX_MHZ (environment, default no limit) raw sector reads come
+// back corrupted, like a card that can't keep up.
+#include <SdFat.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <map>
+#include "hostClock.h"
+
+namespace hostSd {
+  std::string rootDir = "sdcard";
+  uint32_t readCalls = 0;
+  uint32_t writeCalls = 0;
+  uint64_t bytesRead = 0;
+  uint32_t configuredSck = 16000000;
+  static const char *maxMhz = getenv("HOST_SD_MAX_MHZ");
+  // Time to move the bytes over the bus plus the command overhead
+  static uint64_t transferMicros(size_t bytes) {
+    return 20 + (uint64_t)bytes * 8 * 1000000 / configuredSck;
+  }
+  static bool unstable() { return maxMhz && configuredSck > (uint32_t)atoi(maxMhz) * 1000000UL; }
+  std::string hostPath(const char *path) {
+    std::string p = path ? path : "";
+    while (!p.empty() && p[0] == '/') p.erase(0, 1);
+    return p.empty() ? rootDir : rootDir + "/" + p;
+  }
+  // Every regular file gets a private run of "sectors" so raw sector
+  // access through SdCard can be emulated for contiguous files.
+  static std::map<std::string, uint32_t> sectorBase;
+  static std::map<uint32_t, std::string> sectorOwner;
+  static uint32_t nextBase = 0x10000;
+  static uint32_t baseFor(const std::string &host) {
+    auto it = sectorBase.find(host);
+    if (it != sectorBase.end()) return it->second;
+    uint32_t base = nextBase;
+    nextBase += 0x10000; // 32 MB per file
+    sectorBase[host] = base;
+    sectorOwner[base] = host;
+    return base;
+  }
+}
+
+static bool isDirPath(const std::string &p) {
+  struct stat st;
+  return stat(p.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+static bool existsPath(const std::string &p) {
+  struct stat st;
+  return stat(p.c_str(), &st) == 0;
+}
+
+bool File32::open(const char *path, oflag_t oflag) {
+  close();
+  hostPath = hostSd::hostPath(path);
+  const char *slash = strrchr(path, '/');
+  name = slash ? slash + 1 : path;
+  if (isDirPath(hostPath)) {
+    // SdFat only opens folders for reading, openNext() stops at them too
+    if ((oflag & O_ACCMODE) != O_RDONLY) return false;
+    dp = opendir(hostPath.c_str());
+    return dp != NULL;
+  }
+  bool exists = existsPath(hostPath);
+  if (!exists && !(oflag & O_CREAT)) return false;
+  if (exists && (oflag & O_CREAT) && (oflag & O_EXCL)) return false;
+  int acc = oflag & O_ACCMODE;
+  if (acc == O_RDONLY) {
+    fp = fopen(hostPath.c_str(), "rb");
+  } else {
+    if (!exists || (oflag & O_TRUNC)) {
+      FILE *c = fopen(hostPath.c_str(), "wb");
+      if (!c) return false;
+      fclose(c);
+    }
+    fp = fopen(hostPath.c_str(), "r+b");
+  }
+  if (fp && (oflag & (O_APPEND | O_AT_END))) fseek(fp, 0, SEEK_END);
+  return fp != NULL;
+}
+
+bool File32::open(File32 *dirFile, const char *path, oflag_t oflag) {
+  std::string rel = dirFile->hostPath.substr(hostSd::rootDir.size());
+  return open((rel + "/" + path).c_str(), oflag);
+}
+
+bool File32::openNext(File32 *dirFile, oflag_t oflag) {
+  close();
+  if (!dirFile->dp) return false;
+  struct dirent *e;
+  while ((e = readdir((DIR *)dirFile->dp)) != NULL) {
+    if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..")) continue;
+    return open(dirFile, e->d_name, oflag);
+  }
+  return false;
+}
+
+bool File32::close() {
+  if (fp) fclose(fp);
+  if (dp) closedir((DIR *)dp);
+  fp = NULL;
+  dp = NULL;
+  return true;
+}
+
+size_t File32::getName(char *out, size_t size) {
+  if (!size) return 0;
+  snprintf(out, size, "%s", name.c_str());
+  return strlen(out);
+}
+
+int File32::read(void *buf, size_t count) {
+  if (!fp) return -1;
+  hostSd::readCalls++;
+  size_t n = fread(buf, 1, count, fp);
+  hostSd::bytesRead += n;
+  hostClock::advance(hostSd::transferMicros(n));
+  return (int)n;
+}
+int File32::read() {
+  uint8_t b;
+  return read(&b, 1) == 1 ? b : -1;
+}
+int File32::available() { return fp ? (int)(fileSize() - curPosition()) : 0; }
+size_t File32::write(const void *buf, size_t count) {
+  if (!fp) return 0;
+  // The card is busy programming for a while after the transfer
+  hostClock::advance(hostSd::transferMicros(count) + 100);
+  hostSd::writeCalls++;
+  return fwrite(buf, 1, count, fp);
+}
+bool File32::seekSet(uint32_t pos) { return fp && fseek(fp, pos, SEEK_SET) == 0; }
+uint32_t File32::curPosition() const { return fp ? (uint32_t)ftell(fp) : 0; }
+uint32_t File32::fileSize() const {
+  if (!fp) return 0;
+  struct stat st;
+  fflush(fp);
+  return fstat(fileno(fp), &st) == 0 ? (uint32_t)st.st_size : 0;
+}
+bool File32::preAllocate(uint32_t length) { return fp && fileSize() == 0 && length > 0; }
+uint32_t File32::firstSector() const { return fp ? hostSd::baseFor(hostPath) : 0; }
+bool File32::contiguousRange(uint32_t *bgnSector, uint32_t *endSector) {
+  if (!fp) return false;
+  uint32_t base = hostSd::baseFor(hostPath);
+  if (bgnSector) *bgnSector = base;
+  if (endSector) *endSector = base + (fileSize() + 511) / 512 - 1;
+  return true;
+}
+bool File32::sync() { return fp && fflush(fp) == 0; }
+bool File32::truncate(uint32_t length) { return fp && fflush(fp) == 0 && ftruncate(fileno(fp), length) == 0; }
+bool File32::remove() {
+  std::string p = hostPath;
+  close();
+  return ::unlink(p.c_str()) == 0;
+}
+bool File32::rmdir() {
+  std::string p = hostPath;
+  close();
+  return ::rmdir(p.c_str()) == 0;
+}
+static bool removeTree(const std::string &p) {
+  if (isDirPath(p)) {
+    DIR *d = opendir(p.c_str());
+    struct dirent *e;
+    while (d && (e = readdir(d)) != NULL) {
+      if (strcmp(e->d_name, ".") && strcmp(e->d_name, "..")) removeTree(p + "/" + e->d_name);
+    }
+    if (d) closedir(d);
+    return ::rmdir(p.c_str()) == 0;
+  }
+  return ::unlink(p.c_str()) == 0;
+}
+bool File32::rmRfStar() {
+  std::string p = hostPath;
+  close();
+  return removeTree(p);
+}
+bool File32::rename(const char *newPath) {
+  std::string p = hostPath;
+  close();
+  return ::rename(p.c_str(), hostSd::hostPath(newPath).c_str()) == 0;
+}
+bool File32::exists(const char *path) {
+  if (isDir()) return existsPath(hostPath + "/" + path);
+  return existsPath(hostSd::hostPath(path));
+}
+
+bool SdCard::readSectors(uint32_t sector, uint8_t *dst, size_t ns) {
+  uint32_t base = sector & ~0xFFFFu;
+  auto it = hostSd::sectorOwner.find(base);
+  memset(dst, 0, ns * 512);
+  hostSd::readCalls++;
+  hostClock::advance(hostSd::transferMicros(ns * 512));
+  if (it == hostSd::sectorOwner.end()) return true;
+  FILE *f = fopen(it->second.c_str(), "rb");
+  if (!f) return false;
+  fseek(f, (long)(sector - base) * 512, SEEK_SET);
+  size_t n = fread(dst, 1, ns * 512, f);
+  hostSd::bytesRead += n;
+  fclose(f);
+  if (hostSd::unstable()) dst[(sector * 37) % (ns * 512)] ^= 0x10;
+  return true;
+}
+bool SdCard::writeSectors(uint32_t sector, const uint8_t *src, size_t ns) {
+  uint32_t base = sector & ~0xFFFFu;
+  auto it = hostSd::sectorOwner.find(base);
+  hostClock::advance(hostSd::transferMicros(ns * 512) + 100);
+  if (it == hostSd::sectorOwner.end()) return true;
+  FILE *f = fopen(it->second.c_str(), "r+b");
+  if (!f) return false;
+  fseek(f, (long)(sector - base) * 512, SEEK_SET);
+  fwrite(src, 1, ns * 512, f);
+  fclose(f);
+  return true;
+}
+bool SdCard::readCID(cid_t *cid) {
+  memset(cid, 0, sizeof(*cid));
+  cid->mid = 0x03;
+  memcpy(cid->oid, "SD", 2);
+  memcpy(cid->pnm, "EMU01", 5);
+  cid->psn8[3] = 0x42;
+  return true;
+}
+uint32_t SdCard::sectorCount() { return 15523840; }
+
+bool SdFat32::begin(SdSpiConfig config) {
+  hostSd::configuredSck = config.maxSck;
+  ::mkdir(hostSd::rootDir.c_str(), 0777);
+  return isDirPath(hostSd::rootDir);
+}
+bool SdFat32::exists(const char *path) { return existsPath(hostSd::hostPath(path)); }
+bool SdFat32::remove(const char *path) { return ::unlink(hostSd::hostPath(path).c_str()) == 0; }
+bool SdFat32::rename(const char *oldPath, const char *newPath) {
+  if (existsPath(hostSd::hostPath(newPath))) return false;
+  return ::rename(hostSd::hostPath(oldPath).c_str(), hostSd::hostPath(newPath).c_str()) == 0;
+}
+bool SdFat32::mkdir(const char *path, bool) { return ::mkdir(hostSd::hostPath(path).c_str(), 0777) == 0; }
+bool SdFat32::rmdir(const char *path) { return ::rmdir(hostSd::hostPath(path).c_str()) == 0; }
+void SdFat32::ls(uint8_t) {}
+uint32_t SdFat32::freeClusterCount() { return 1000000; }
+uint32_t SdFat32::clusterCount() { return 1000000; }
+
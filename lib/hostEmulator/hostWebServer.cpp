@@ -0,0 +1,216 @@
+// Host implementation of the AsyncWebServer stand-in. Requests come from
+// hostWeb::request() instead of the network and go through the same
+// handlers, with bodies and uploads cut in TCP sized chunks.
+#include <AsyncWebServer_RP2040W.h>
+#include <sstream>
+#include "hostClock.h"
+
+HostWiFi WiFi;
+static const String emptyString;
+
+AsyncWebServerRequest::~AsyncWebServerRequest() {
+  if (_onDisconnect) _onDisconnect();
+  delete _response;
+  if (_tempObject) free(_tempObject);
+}
+bool AsyncWebServerRequest::hasHeader(const String &name) const {
+  for (auto &h : _headers)
+    if (h.name().equalsIgnoreCase(name)) return true;
+  return false;
+}
+AsyncWebHeader *AsyncWebServerRequest::getHeader(const String &name) {
+  for (auto &h : _headers)
+    if (h.name().equalsIgnoreCase(name)) return &h;
+  return NULL;
+}
+const String &AsyncWebServerRequest::header(const char *name) const {
+  for (auto &h : _headers)
+    if (h.name().equalsIgnoreCase(name)) return h.value();
+  return emptyString;
+}
+bool AsyncWebServerRequest::hasParam(const String &name, bool, bool) const {
+  for (auto &p : _params)
+    if (p.name() == name) return true;
+  return false;
+}
+AsyncWebParameter *AsyncWebServerRequest::getParam(const String &name, bool, bool) {
+  for (auto &p : _params)
+    if (p.name() == name) return &p;
+  return NULL;
+}
+const String &AsyncWebServerRequest::arg(const String &name) const {
+  for (auto &p : _params)
+    if (p.name() == name) return p.value();
+  return emptyString;
+}
+void AsyncWebServerRequest::send(AsyncWebServerResponse *response) {
+  if (_response) {
+    delete response; // only the first response goes out, as on the device
+    return;
+  }
+  _response = response;
+}
+void AsyncWebServerRequest::send(int code, const String &contentType, const String &content) {
+  send(beginResponse(code, contentType, content));
+}
+AsyncWebServerResponse *AsyncWebServerRequest::beginResponse(int code, const String &contentType, const String &content) {
+  AsyncWebServerResponse *r = new AsyncWebServerResponse();
+  r->_code = code;
+  r->_contentType = contentType;
+  r->_content = content.s;
+  r->_contentLength = content.length();
+  return r;
+}
+AsyncWebServerResponse *AsyncWebServerRequest::beginResponse(const String &contentType, size_t len, AwsResponseFiller callback, AwsTemplateProcessor) {
+  AsyncWebServerResponse *r = new AsyncWebServerResponse();
+  r->_contentType = contentType;
+  r->_contentLength = len;
+  r->_filler = callback;
+  return r;
+}
+AsyncWebServerResponse *AsyncWebServerRequest::beginResponse_P(int code, const String &contentType, const uint8_t *content, size_t len, AwsTemplateProcessor) {
+  AsyncWebServerResponse *r = beginResponse(code, contentType, String());
+  r->_content.assign((const char *)content, len);
+  r->_contentLength = len;
+  return r;
+}
+AsyncWebServerResponse *AsyncWebServerRequest::beginChunkedResponse(const String &contentType, AwsResponseFiller callback, AwsTemplateProcessor) {
+  AsyncWebServerResponse *r = new AsyncWebServerResponse();
+  r->_contentType = contentType;
+  r->_chunked = true;
+  r->_filler = callback;
+  return r;
+}
+
+AsyncWebServer::AsyncWebServer(uint16_t port) : _port(port) { hostWeb::server = this; }
+void AsyncWebServer::on(const char *uri, WebRequestMethodComposite method, ArRequestHandlerFunction onRequest) {
+  _routes.push_back({uri, method, onRequest, nullptr, nullptr});
+}
+void AsyncWebServer::on(const char *uri, WebRequestMethodComposite method, ArRequestHandlerFunction onRequest, ArUploadHandlerFunction onUpload) {
+  _routes.push_back({uri, method, onRequest, onUpload, nullptr});
+}
+void AsyncWebServer::on(const char *uri, WebRequestMethodComposite method, ArRequestHandlerFunction onRequest, ArUploadHandlerFunction onUpload, ArBodyHandlerFunction onBody) {
+  _routes.push_back({uri, method, onRequest, onUpload, onBody});
+}
+
+// The firmware's idle work, run while the network "waits" so work handed
+// to the render loop gets done as it would between frames on the device
+bool serviceBackgroundTasks();
+
+namespace hostWeb {
+  AsyncWebServer *server = NULL;
+  bool idleBetweenChunks = true;
+
+  static int hexVal(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    c = tolower(c);
+    return (c >= 'a' && c <= 'f') ? c - 'a' + 10 : 0;
+  }
+  static std::string urlDecode(const std::string &s) {
+    std::string out;
+    for (size_t i = 0; i < s.size(); i++) {
+      if (s[i] == '%' && i + 2 < s.size()) {
+        out += (char)(hexVal(s[i + 1]) * 16 + hexVal(s[i + 2]));
+        i += 2;
+      } else if (s[i] == '+') {
+        out += ' ';
+      } else {
+        out += s[i];
+      }
+    }
+    return out;
+  }
+
+  response request(WebRequestMethodComposite method, const std::string &url,
+                   const std::vector<std::pair<std::string, std::string>> &headers,
+                   const std::string &body, const std::vector<filePart> &files, size_t chunkSize) {
+    response out;
+    AsyncWebServerRequest *req = new AsyncWebServerRequest();
+    req->_method = method;
+    std::string path = url;
+    size_t q = url.find('?');
+    if (q != std::string::npos) {
+      path = url.substr(0, q);
+      std::stringstream ss(url.substr(q + 1));
+      std::string kv;
+      while (std::getline(ss, kv, '&')) {
+        size_t eq = kv.find('=');
+        req->_params.push_back(AsyncWebParameter(urlDecode(kv.substr(0, eq)).c_str(),
+                                                 eq == std::string::npos ? "" : urlDecode(kv.substr(eq + 1)).c_str()));
+      }
+    }
+    req->_url = path.c_str();
+    for (auto &h : headers) {
+      req->_headers.push_back(AsyncWebHeader(h.first.c_str(), h.second.c_str()));
+      if (!strcasecmp(h.first.c_str(), "Content-Type")) req->_contentType = h.second.c_str();
+    }
+    req->_contentLength = body.size();
+    for (auto &f : files) req->_contentLength += f.data.size() + 200;
+    if (!files.empty()) req->_contentType = "multipart/form-data";
+
+    AsyncWebServer::route *match = NULL;
+    for (auto &r : server->_routes) {
+      bool uriOk = r.uri == req->_url || req->_url.startsWith(r.uri + "/");
+      if (uriOk && (r.method & method)) {
+        match = &r;
+        break;
+      }
+    }
+    if (!match) {
+      if (server->_notFound) server->_notFound(req);
+    } else {
+      for (auto &f : files) {
+        if (!match->onUpload) break;
+        std::string data = f.data;
+        size_t index = 0;
+        do {
+          size_t n = std::min(chunkSize, data.size() - index);
+          bool final = index + n >= data.size();
+          match->onUpload(req, f.filename.c_str(), index, (uint8_t *)&data[index], n, final);
+          index += n;
+          hostClock::advance(n / 2); // ~2 MB/s soft AP link
+          if (idleBetweenChunks) serviceBackgroundTasks();
+        } while (index < data.size());
+      }
+      if (!body.empty() && match->onBody) {
+        std::string data = body;
+        for (size_t index = 0; index < data.size(); index += chunkSize) {
+          size_t n = std::min(chunkSize, data.size() - index);
+          match->onBody(req, (uint8_t *)&data[index], n, index, data.size());
+          hostClock::advance(n / 2);
+        }
+      }
+      if (match->onRequest) match->onRequest(req);
+    }
+    // Deferred answers come from the render loop
+    for (int i = 0; i < 1000 && !req->_response; i++) serviceBackgroundTasks();
+    AsyncWebServerResponse *r = req->_response;
+    if (r) {
+      out.code = r->_code;
+      out.contentType = r->_contentType.s;
+      for (auto &h : r->_headers) out.headers.push_back({h.name().s, h.value().s});
+      if (r->_filler) {
+        uint8_t buf[1460];
+        size_t index = 0;
+        int stalls = 0;
+        while (r->_chunked || index < r->_contentLength) {
+          size_t want = r->_chunked ? sizeof(buf) : std::min(sizeof(buf), r->_contentLength - index);
+          size_t n = r->_filler(buf, want, index);
+          if (n == RESPONSE_TRY_AGAIN) {
+            if (++stalls > 1000) break;
+            serviceBackgroundTasks(); // The render loop fills the buffer
+            continue;
+          }
+          if (n == 0) break;
+          out.body.append((const char *)buf, n);
+          index += n;
+        }
+      } else {
+        out.body = r->_content;
+      }
+    }
+    delete req;
+    return out;
+  }
+}
+
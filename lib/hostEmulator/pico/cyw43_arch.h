@@ -0,0 +1,5 @@
+// Host stand-in: the CYW43 driver is not needed off-target
+#pragma once
+// Locks out the network stack, nothing to lock on the host
+inline void cyw43_arch_lwip_begin(void) {}
+inline void cyw43_arch_lwip_end(void) {}
@@ -0,0 +1,19 @@
+// Host stand-in for SdFat's minimal ostream
+#pragma once
+#include <Arduino.h>
+
+class ArduinoOutStream {
+  public:
+    explicit ArduinoOutStream(Print &pr) : pr(&pr) {}
+    ArduinoOutStream &operator<<(const char *s) { pr->print(s); return *this; }
+    ArduinoOutStream &operator<<(const String &s) { pr->print(s); return *this; }
+    ArduinoOutStream &operator<<(char c) { pr->print(c); return *this; }
+    ArduinoOutStream &operator<<(int v) { pr->print(v); return *this; }
+    ArduinoOutStream &operator<<(unsigned int v) { pr->print(v); return *this; }
+    ArduinoOutStream &operator<<(long v) { pr->print(v); return *this; }
+    ArduinoOutStream &operator<<(unsigned long v) { pr->print(v); return *this; }
+    ArduinoOutStream &operator<<(double v) { pr->print(v); return *this; }
+
+  private:
+    Print *pr;
+};
@@ -0,0 +1,88 @@
+/*
+ Minimal helpers to read values out of small, flat JSON objects such as
+ {"brightness":120,"mode":1}. There is no allocation and no DOM, the
+ body is searched for the key each time a value is read.
+*/
+#pragma once
+#include <Arduino.h>
+
+// Result of reading a value
+enum jsonResult : uint8_t {
+  jsonFound = 0,
+  jsonMissing,  // The key is not in the object
+  jsonBadValue  // The key is there but its value has the wrong type
+};
+
+// Returns a pointer to the first character of the value of the key, or
+// NULL if the key is not in the object
+const char* jsonFindValue(const char *json, const char *key){
+  size_t keyLen = strlen(key);
+  const char *p = json;
+  while((p = strchr(p,'"'))!=NULL){
+    p++;
+    if(strncmp(p,key,keyLen)==0 && p[keyLen]=='"'){
+      const char *v = p+keyLen+1;
+      while(*v==' ' || *v=='\t' || *v=='\r' || *v=='\n'){
+        v++;
+      }
+      if(*v==':'){
+        v++;
+        while(*v==' ' || *v=='\t' || *v=='\r' || *v=='\n'){
+          v++;
+        }
+        return v;
+      }
+    }
+    // Skip the rest of this string
+    while(*p && *p!='"'){
+      if(*p=='\\' && p[1]){
+        p++;
+      }
+      p++;
+    }
+    if(*p=='"'){
+      p++;
+    }
+  }
+  return NULL;
+}
+
+// Reads an integer value
+jsonResult jsonReadInt(const char *json, const char *key, long &value){
+  const char *v = jsonFindValue(json,key);
+  if(v==NULL){
+    return jsonMissing;
+  }
+  char *end;
+  long parsed = strtol(v,&end,10);
+  if(end==v || (*end!=',' && *end!='}' && *end!=' ' && *end!='\r' && *end!='\n' && *end!='\0')){
+    return jsonBadValue;
+  }
+  value = parsed;
+  return jsonFound;
+}
+
+// Reads a string value into out (always terminated). Escaped quotes and
+// backslashes are unescaped, other escapes are kept as they are.
+jsonResult jsonReadString(const char *json, const char *key, char *out, size_t outLen){
+  const char *v = jsonFindValue(json,key);
+  if(v==NULL){
+    return jsonMissing;
+  }
+  if(*v!='"' || outLen==0){
+    return jsonBadValue;
+  }
+  v++;
+  size_t n = 0;
+  while(*v && *v!='"'){
+    if(*v=='\\' && (v[1]=='"' || v[1]=='\\')){
+      v++;
+    }
+    if(n+1>=outLen){
+      return jsonBadValue; // Too long
+    }
+    out[n++] = *v++;
+  }
+  out[n] = '\0';
+  return (*v=='"') ? jsonFound : jsonBadValue;
+}
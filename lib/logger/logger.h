@@ -0,0 +1,163 @@
+/*
+ Logging that never blocks the caller. Messages are formatted into a RAM
+ ring buffer, the idle time of the loop copies them to the serial port
+ as fast as it takes them and /API/log reads the buffer back.
+ Levels and modules are filtered at compile time, a disabled message
+ compiles to nothing (its arguments are not even evaluated).
+ Set the build flags -DlogLevel=<level> and -DlogModules=<mask> to change
+ what is kept, e.g. -DlogModules="(logBit(logModuleUpload))".
+*/
+#pragma once
+#include <Arduino.h>
+
+// Log levels, a message is kept if its level is at most logLevel
+#define logLevelNone 0
+#define logLevelError 1
+#define logLevelWarn 2
+#define logLevelInfo 3
+#define logLevelDebug 4
+#ifndef logLevel
+#define logLevel logLevelInfo
+#endif
+
+// Modules, used to pick which parts of the firmware log
+#define logModuleMain 0
+#define logModuleWeb 1
+#define logModuleUpload 2
+#define logModuleDisplay 3
+#define logModuleSd 4
+#define logModuleSettings 5
+#define logBit(module) (1UL<<(module))
+#ifndef logModules
+#define logModules 0xFFFFFFFFUL // Every module
+#endif
+
+// Size of the ring buffer, the oldest messages are overwritten when full
+#ifndef logRingSize
+#define logRingSize 4096
+#endif
+#define logLineMax 120 // Longer messages are cut
+
+#define logEnabled(level,module) ((level)<=logLevel && (logModules & logBit(module)))
+
+#if logLevel >= logLevelError
+#define logError(module,...) do{ if(logEnabled(logLevelError,module)) logger.record(logLevelError,module,__VA_ARGS__); }while(0)
+#else
+#define logError(module,...) do{}while(0)
+#endif
+#if logLevel >= logLevelWarn
+#define logWarn(module,...) do{ if(logEnabled(logLevelWarn,module)) logger.record(logLevelWarn,module,__VA_ARGS__); }while(0)
+#else
+#define logWarn(module,...) do{}while(0)
+#endif
+#if logLevel >= logLevelInfo
+#define logInfo(module,...) do{ if(logEnabled(logLevelInfo,module)) logger.record(logLevelInfo,module,__VA_ARGS__); }while(0)
+#else
+#define logInfo(module,...) do{}while(0)
+#endif
+#if logLevel >= logLevelDebug
+#define logDebug(module,...) do{ if(logEnabled(logLevelDebug,module)) logger.record(logLevelDebug,module,__VA_ARGS__); }while(0)
+#else
+#define logDebug(module,...) do{}while(0)
+#endif
+
+class ringLogger{
+  private:
+    char ring[logRingSize];
+    // Positions count every byte ever written, the ring index is
+    // position % logRingSize
+    volatile uint32_t head = 0; // Next byte to be written
+    uint32_t drained = 0; // Next byte to go out on the serial port
+    volatile uint32_t lost = 0; // Messages overwritten before they were drained
+
+    void append(const char *text, size_t len);
+
+  public:
+    void record(uint8_t level, uint8_t module, const char *format, ...) __attribute__((format(printf,4,5)));
+    size_t drain(Print &out, size_t maxBytes);
+    uint32_t copy(uint32_t since, Print &out);
+    uint32_t position() { return head; }
+    uint32_t lostCount() { return lost; }
+};
+
+// Copies the text into the ring. Both the loop and the network side log,
+// interrupts are held off for the copy so lines don't get mixed up.
+void ringLogger::append(const char *text, size_t len){
+  noInterrupts();
+  uint32_t pos = head;
+  if(pos+len-drained>logRingSize){
+    lost++;
+  }
+  for(size_t i=0;i<len;i++){
+    ring[(pos+i)%logRingSize] = text[i];
+  }
+  head = pos+len;
+  interrupts();
+}
+
+// Formats a message into the ring buffer as "<millis> <level> <module>: <text>"
+void ringLogger::record(uint8_t level, uint8_t module, const char *format, ...){
+  static const char levels[] = "-EWID";
+  static const char *modules[] = {"main","web","upload","display","sd","settings"};
+  char line[logLineMax];
+  int len = snprintf(line,sizeof(line),"%lu %c %s: ",(unsigned long)millis(),
+                     levels[level<=logLevelDebug ? level : 0],
+                     module<sizeof(modules)/sizeof(modules[0]) ? modules[module] : "?");
+  va_list args;
+  va_start(args,format);
+  int textLen = vsnprintf(&line[len],sizeof(line)-len-1,format,args);
+  va_end(args);
+  if(textLen<0){
+    textLen = 0;
+  }
+  len = min(len+textLen,(int)sizeof(line)-2);
+  line[len++] = '\n';
+  append(line,len);
+}
+
+// Writes waiting messages to out, without ever blocking: no more than
+// maxBytes, and no more than out can take right away.
+// Returns the number of bytes written.
+size_t ringLogger::drain(Print &out, size_t maxBytes){
+  uint32_t end = head;
+  if(end-drained>logRingSize){
+    drained = end-logRingSize; // Skip what was overwritten
+  }
+  size_t count = min((size_t)(end-drained),maxBytes);
+  count = min(count,(size_t)out.availableForWrite());
+  size_t written = 0;
+  while(written<count){
+    // Write up to the end of the ring at a time
+    uint32_t index = (drained+written)%logRingSize;
+    size_t len = min(count-written,(size_t)(logRingSize-index));
+    size_t n = out.write((const uint8_t*)&ring[index],len);
+    written += n;
+    if(n<len){
+      break;
+    }
+  }
+  drained += written;
+  return written;
+}
+
+// Writes everything logged since the position that is still in the ring
+// to out. Returns the position to pass next time for only new messages.
+uint32_t ringLogger::copy(uint32_t since, Print &out){
+  uint32_t end = head;
+  if(since>end){
+    since = 0; // Position from before a reboot
+  }
+  if(end-since>logRingSize){
+    since = end-logRingSize;
+  }
+  while(since<end){
+    uint32_t index = since%logRingSize;
+    size_t len = min((size_t)(end-since),(size_t)(logRingSize-index));
+    out.write((const uint8_t*)&ring[index],len);
+    since += len;
+  }
+  return end;
+}
+
+// The one logger of the firmware, used by the log macros
+ringLogger logger;
@@ -0,0 +1,208 @@
+/*
+ Counters, gauges and histograms describing how the matrix performs,
+ written out in the Prometheus text format.
+ Recording a value is a handful of instructions with no locks: every
+ metric must have a single writer (the render loop or the network
+ context), readers may see a sample half recorded, which is fine for
+ statistics. Histograms use fixed power of two buckets, so finding the
+ bucket is a single count-leading-zeros instruction.
+*/
+#pragma once
+#include <Arduino.h>
+
+// Bucket i counts values up to 2^i-1, the last one also counts everything
+// larger (values up to about 8 million per bucket range)
+#define metricBuckets 24
+
+// Common part of every metric, metrics link themselves into a list when
+// they are constructed so they can all be written out
+class metric{
+  private:
+    static metric *first;
+    static metric *last;
+    metric *next = NULL;
+  protected:
+    const char *name;
+    const char *help;
+    const char *label; // Optional label such as route="/API/id", or NULL
+    metric(const char *nameIn, const char *helpIn, const char *labelIn);
+    virtual void writeValues(Print &out) = 0;
+    virtual const char* type() = 0;
+    void writeName(Print &out, const char *suffix, const char *extraLabel);
+  public:
+    static void writeAll(Print &out);
+};
+
+metric *metric::first = NULL;
+metric *metric::last = NULL;
+
+metric::metric(const char *nameIn, const char *helpIn, const char *labelIn){
+  name = nameIn;
+  help = helpIn;
+  label = labelIn;
+  if(last==NULL){
+    first = this;
+  }else{
+    last->next = this;
+  }
+  last = this;
+}
+
+// Writes name{labels} with an optional suffix and extra label
+void metric::writeName(Print &out, const char *suffix, const char *extraLabel){
+  out.print(name);
+  out.print(suffix);
+  if(label==NULL && extraLabel==NULL){
+    out.print(' ');
+    return;
+  }
+  out.print('{');
+  if(label!=NULL){
+    out.print(label);
+    if(extraLabel!=NULL){
+      out.print(',');
+    }
+  }
+  if(extraLabel!=NULL){
+    out.print(extraLabel);
+  }
+  out.print("} ");
+}
+
+// Writes every metric. Metrics sharing a name (with different labels)
+// must be constructed one after the other, HELP and TYPE are only
+// written for the first one.
+void metric::writeAll(Print &out){
+  const char *previous = NULL;
+  for(metric *m=first;m!=NULL;m=m->next){
+    if(previous==NULL || strcmp(previous,m->name)!=0){
+      out.printf("# HELP %s %s\n# TYPE %s %s\n",m->name,m->help,m->name,m->type());
+    }
+    previous = m->name;
+    m->writeValues(out);
+  }
+}
+
+// Value that only goes up
+class metricCounter : public metric{
+  private:
+    volatile uint32_t value = 0;
+  protected:
+    void writeValues(Print &out);
+    const char* type() { return "counter"; }
+  public:
+    metricCounter(const char *nameIn, const char *helpIn, const char *labelIn = NULL)
+      : metric(nameIn,helpIn,labelIn) {}
+    void add(uint32_t n) { value += n; }
+    uint32_t get() { return value; }
+};
+
+void metricCounter::writeValues(Print &out){
+  writeName(out,"",NULL);
+  out.println((unsigned long)value);
+}
+
+// Value that goes up and down, set when it is sampled
+class metricGauge : public metric{
+  private:
+    volatile int32_t value = 0;
+  protected:
+    void writeValues(Print &out);
+    const char* type() { return "gauge"; }
+  public:
+    metricGauge(const char *nameIn, const char *helpIn, const char *labelIn = NULL)
+      : metric(nameIn,helpIn,labelIn) {}
+    void set(int32_t v) { value = v; }
+    // Keeps the lowest value set, for low water marks
+    void setMin(int32_t v) { if(v<value) value = v; }
+    int32_t get() { return value; }
+};
+
+void metricGauge::writeValues(Print &out){
+  writeName(out,"",NULL);
+  out.println((long)value);
+}
+
+// Distribution of values, counted in power of two buckets
+class metricHistogram : public metric{
+  private:
+    volatile uint32_t counts[metricBuckets] = {};
+    volatile uint32_t total = 0;
+    volatile uint64_t sum = 0;
+  protected:
+    void writeValues(Print &out);
+    const char* type() { return "histogram"; }
+  public:
+    metricHistogram(const char *nameIn, const char *helpIn, const char *labelIn = NULL)
+      : metric(nameIn,helpIn,labelIn) {}
+    void record(uint32_t value){
+      uint8_t bucket = value==0 ? 0 : 32-__builtin_clz(value);
+      if(bucket>=metricBuckets){
+        bucket = metricBuckets-1;
+      }
+      counts[bucket]++;
+      total++;
+      sum += value;
+    }
+    uint32_t count() { return total; }
+};
+
+void metricHistogram::writeValues(Print &out){
+  // Prometheus buckets are cumulative
+  uint32_t cumulative = 0;
+  char le[24];
+  for(uint8_t i=0;i<metricBuckets-1;i++){
+    cumulative += counts[i];
+    snprintf(le,sizeof(le),"le=\"%lu\"",(unsigned long)((1UL<<i)-1));
+    writeName(out,"_bucket",le);
+    out.println((unsigned long)cumulative);
+  }
+  writeName(out,"_bucket","le=\"+Inf\"");
+  out.println((unsigned long)total);
+  writeName(out,"_sum",NULL);
+  out.printf("%llu\n",(unsigned long long)sum);
+  writeName(out,"_count",NULL);
+  out.println((unsigned long)total);
+}
+
+// Measures the time of a block into a histogram, in microseconds
+class metricTimer{
+  private:
+    metricHistogram &histogram;
+    uint32_t start;
+  public:
+    metricTimer(metricHistogram &h) : histogram(h) { start = micros(); }
+    ~metricTimer() { histogram.record(micros()-start); }
+};
+
+// Stack high water mark of core 0. The unused part of the stack is filled
+// with a pattern at boot, the mark is found by looking for the first
+// overwritten word.
+#define stackPaintPattern 0xA5A5A5A5
+#if defined(ARDUINO_ARCH_RP2040)
+extern uint32_t __StackBottom;
+extern uint32_t __StackTop;
+
+void paintStack(){
+  uint32_t here;
+  uint32_t *end = &here - 64; // Leave the frames in use alone
+  // Interrupts share this stack, keep them from landing in the painting
+  noInterrupts();
+  for(uint32_t *p=&__StackBottom;p<end;p++){
+    *p = stackPaintPattern;
+  }
+  interrupts();
+}
+
+// Returns the most stack ever used, in bytes
+uint32_t stackHighWater(){
+  uint32_t *p = &__StackBottom;
+  while(p<&__StackTop && *p==stackPaintPattern){
+    p++;
+  }
+  return (uint32_t)((uint8_t*)&__StackTop-(uint8_t*)p);
+}
+#else
+void paintStack(){}
+uint32_t stackHighWater(){ return 0; }
+#endif
@@ -0,0 +1,101 @@
+/*
+ Buffered SD card file writer that only ever writes whole 512 byte
+ sectors (except for the last one), so the card never has to do a
+ read-modify-write of a partially written sector.
+*/
+#pragma once
+#include <Arduino.h>
+#include <SdFat.h> // Adafruit's Fork of SD
+
+#define sdSectorSize 512
+
+class alignedWriter{
+  private:
+    File32 file;
+    uint8_t sector[sdSectorSize]; // Bytes not yet forming a full sector
+    uint16_t sectorFill = 0;
+    uint32_t bytesWritten = 0;
+    bool writeError = false;
+
+  public:
+    bool open(const char *path);
+    bool write(const uint8_t *data, size_t len);
+    bool close();
+    void abort();
+    bool isOpen() { return file.isOpen(); }
+    uint32_t size() const { return bytesWritten; }
+};
+
+// Creates (or truncates) the file and starts writing it from the beginning
+bool alignedWriter::open(const char *path){
+  abort();
+  sectorFill = 0;
+  bytesWritten = 0;
+  writeError = false;
+  return file.open(path,O_WRONLY|O_CREAT|O_TRUNC);
+}
+
+// Appends data to the file. Full sectors coming straight from the caller
+// are written without copying them into the sector buffer.
+bool alignedWriter::write(const uint8_t *data, size_t len){
+  if(!file.isOpen() || writeError){
+    return false;
+  }
+  bytesWritten += len;
+  // Top up a partially filled sector first
+  if(sectorFill>0){
+    size_t n = min(len,(size_t)(sdSectorSize-sectorFill));
+    memcpy(&sector[sectorFill],data,n);
+    sectorFill += n;
+    data += n;
+    len -= n;
+    if(sectorFill==sdSectorSize){
+      if(file.write(sector,sdSectorSize)!=sdSectorSize){
+        writeError = true;
+        return false;
+      }
+      sectorFill = 0;
+    }
+  }
+  // Whole sectors go out directly
+  size_t direct = len-(len%sdSectorSize);
+  if(direct>0){
+    if(file.write(data,direct)!=direct){
+      writeError = true;
+      return false;
+    }
+    data += direct;
+    len -= direct;
+  }
+  // Keep the tail for the next call
+  if(len>0){
+    memcpy(sector,data,len);
+    sectorFill = len;
+  }
+  return true;
+}
+
+// Writes the last partial sector and closes the file.
+// Returns false if any write failed.
+bool alignedWriter::close(){
+  if(!file.isOpen()){
+    return false;
+  }
+  if(sectorFill>0 && !writeError){
+    if(file.write(sector,sectorFill)!=sectorFill){
+      writeError = true;
+    }
+  }
+  sectorFill = 0;
+  file.close();
+  return !writeError;
+}
+
+// Closes the file without writing the buffered bytes, used when an
+// upload fails half way
+void alignedWriter::abort(){
+  sectorFill = 0;
+  if(file.isOpen()){
+    file.close();
+  }
+}
@@ -0,0 +1,176 @@
+/*
+ Streams a byte range of a file on the SD card to a web client. The SD
+ side (open, fill) is run by the render loop, which owns the card, and
+ the network side (read) only takes bytes out of a fixed size buffer, so
+ memory use does not depend on the file size.
+ The buffer index of every byte equals its file position modulo the
+ buffer size, so the card is always read in whole sectors straight into
+ the buffer, several sectors at a time when they fit.
+ A sender is free again as soon as the last byte of its range is taken,
+ keep-alive connections don't hold on to it. Every range gets a transfer
+ number so a client that disconnects late can't stop the next transfer.
+*/
+#pragma once
+#include <Arduino.h>
+#include <SdFat.h> // Adafruit's Fork of SD
+#include <alignedWriter.h> // sdSectorSize
+#include <commandQueue.h> // byteQueue
+
+// Size of the buffer of each sender, a multiple of the sector size
+#ifndef fileSenderBufferSize
+#define fileSenderBufferSize 8192
+#endif
+
+class fileSender{
+  private:
+    File32 file;
+    byteQueue<fileSenderBufferSize> buffer;
+    uint32_t readPosition = 0; // Next file position read from the card
+    uint32_t endPosition = 0; // File position after the last byte sent
+    uint32_t sentPosition = 0; // Next file position sent, network side
+    volatile bool readError = false;
+    volatile bool finished = true; // Set by the network side when it is done
+    volatile uint32_t transferId = 0; // Changes with every range
+
+  public:
+    static bool parseRange(const char *header, int32_t range[3]);
+    int open(const char *path);
+    uint32_t fileSize() { return file.fileSize(); }
+    void setRange(uint32_t first, uint32_t last);
+    bool fill(uint32_t budgetMicros);
+    void close();
+    bool isOpen() { return file.isOpen(); }
+    // Network side
+    size_t read(uint8_t *dst, size_t maxLen, bool &wait);
+    uint32_t transfer() { return transferId; }
+    // The client of the transfer is gone
+    void finish(uint32_t transfer) { if(transfer==transferId) finished = true; }
+    bool isFinished() { return finished; }
+};
+
+// Reads the value of a "Range" header into range: the kind (0 whole
+// file, 1 first-last, 2 suffix) and its two numbers. "bytes=first-last"
+// (last -1 for "first-", to the end) or "bytes=-suffix length". Other
+// units and several ranges are answered with the whole file. Returns
+// false if the header is malformed.
+bool fileSender::parseRange(const char *header, int32_t range[3]){
+  range[0] = 0;
+  if(strncmp(header,"bytes=",6)!=0 || strchr(header,',')!=NULL){
+    return true;
+  }
+  const char *spec = header+6;
+  const char *dash = strchr(spec,'-');
+  char *end = NULL;
+  bool valid = dash!=NULL && dash[1]!='-';
+  if(valid && dash==spec){
+    range[0] = 2;
+    range[1] = strtol(dash+1,&end,10);
+    valid = end!=dash+1;
+  }else if(valid){
+    range[0] = 1;
+    range[1] = strtol(spec,&end,10);
+    valid = end==dash;
+    range[2] = -1;
+    if(valid && dash[1]!='\0'){
+      range[2] = strtol(dash+1,&end,10);
+    }else{
+      end = (char*)dash+1;
+    }
+  }
+  return valid && *end=='\0';
+}
+
+// Opens the file, returns 0 on success
+int fileSender::open(const char *path){
+  close();
+  if(!file.open(path,O_RDONLY)){
+    return 1;
+  }
+  if(file.isDir()){
+    file.close();
+    return 1;
+  }
+  setRange(0,file.fileSize()-1);
+  return 0;
+}
+
+// Sets the bytes to send, first to last inclusive. Must be called before
+// the network side starts reading.
+void fileSender::setRange(uint32_t first, uint32_t last){
+  readPosition = first;
+  sentPosition = first;
+  endPosition = last+1;
+  buffer.reset(first);
+  readError = false;
+  transferId++;
+  finished = false;
+}
+
+// Reads the next sectors of the range into the buffer until it is full,
+// the range is read or the time budget is used. Render loop side.
+// Returns true if there is more to read.
+bool fileSender::fill(uint32_t budgetMicros){
+  if(!file.isOpen() || finished || readError){
+    return false;
+  }
+  uint32_t start = micros();
+  while(readPosition<endPosition){
+    uint8_t *dst;
+    uint32_t space = buffer.reserve(&dst);
+    // Up to the next sector boundary, then whole sectors only
+    uint32_t len = sdSectorSize-(readPosition%sdSectorSize);
+    if(len==sdSectorSize){
+      len = space-(space%sdSectorSize);
+    }
+    len = min(len,endPosition-readPosition);
+    if(len==0 || len>space){
+      return true; // Wait for the network side to make room
+    }
+    if(!file.seekSet(readPosition) || file.read(dst,len)!=(int)len){
+      readError = true;
+      return false;
+    }
+    buffer.commit(len);
+    readPosition += len;
+    if(micros()-start>=budgetMicros){
+      break;
+    }
+  }
+  return readPosition<endPosition;
+}
+
+// Closes the file, the sender can be used again
+void fileSender::close(){
+  if(file.isOpen()){
+    file.close();
+  }
+  finished = true;
+}
+
+// Copies the next bytes into dst. Returns 0 and sets wait when the render
+// loop hasn't read them yet, returns 0 without wait at the end of the
+// range or after a read error. Network side.
+// Once the last byte of the range is copied the sender is finished, the
+// render loop then closes it.
+size_t fileSender::read(uint8_t *dst, size_t maxLen, bool &wait){
+  wait = false;
+  size_t copied = 0;
+  while(copied<maxLen){
+    const uint8_t *src;
+    uint32_t len = min((uint32_t)(maxLen-copied),buffer.peek(&src));
+    if(len==0){
+      break;
+    }
+    memcpy(&dst[copied],src,len);
+    buffer.consume(len);
+    copied += len;
+  }
+  sentPosition += copied;
+  if(sentPosition>=endPosition){
+    finished = true;
+  }
+  if(copied==0 && !readError && !finished){
+    wait = true;
+  }
+  return copied;
+}
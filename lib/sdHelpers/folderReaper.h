@@ -0,0 +1,138 @@
+/*
+ Deletes folders in the background. A folder is cleared in constant time
+ by renaming it into a trash folder and creating an empty one in its
+ place, the files are then removed a few at a time by calling step()
+ whenever there is spare time.
+ Entries are only opened to list them: SdFat won't open a folder for
+ writing, so files are removed by their path and folders once they are
+ empty, nested ones first.
+*/
+#pragma once
+#include <Arduino.h>
+#include <SdFat.h> // Adafruit's Fork of SD
+#include <pathBuilder.h> // Paths of the entries being removed
+
+#define reaperPathLen 48
+
+class folderReaper{
+  private:
+    SdFat32 *SDCard;
+    char trashPath[reaperPathLen]; // Folder holding everything to be deleted
+    pathBuilder folderPath; // Folder being emptied, the trash or one inside it
+    File32 folder;
+    uint32_t swapCount = 0; // Used to build unique trash names
+    volatile bool pending = false; // The trash may not be empty
+    uint32_t filesRemoved = 0;
+
+    void stop();
+
+  public:
+    folderReaper(SdFat32 *SDOpen);
+    int begin(const char *trashFolder);
+    int swapOut(const char *path);
+    bool step(uint32_t budgetMicros);
+    bool busy() { return pending; }
+    uint32_t removedCount() { return filesRemoved; }
+};
+
+folderReaper::folderReaper(SdFat32 *SDOpen){
+  SDCard = SDOpen;
+  trashPath[0] = '\0';
+}
+
+// Sets the trash folder, creating it if needed. Anything left in it from
+// before a reboot is deleted again. Returns 0 on success.
+int folderReaper::begin(const char *trashFolder){
+  strncpy(trashPath,trashFolder,reaperPathLen-1);
+  trashPath[reaperPathLen-1] = '\0';
+  if(!SDCard->exists(trashPath) && !SDCard->mkdir(trashPath)){
+    return 1;
+  }
+  folderPath.clear();
+  folderPath.append(trashPath);
+  pending = true;
+  return 0;
+}
+
+// Replaces the folder with a new empty one. The old folder is moved into
+// the trash, which only rewrites two directory entries no matter how many
+// files it holds. Returns 0 on success.
+int folderReaper::swapOut(const char *path){
+  char trashName[reaperPathLen+12];
+  if(SDCard->exists(path)){
+    // Find a free name in the trash
+    do{
+      snprintf(trashName,sizeof(trashName),"%s/d%lu",trashPath,(unsigned long)swapCount++);
+    }while(SDCard->exists(trashName));
+    if(!SDCard->rename(path,trashName)){
+      return 1;
+    }
+    pending = true;
+  }
+  if(!SDCard->mkdir(path)){
+    return 1;
+  }
+  return 0;
+}
+
+// Gives up on what is left in the trash until the next swapOut(), and
+// starts over from the trash then
+void folderReaper::stop(){
+  folder.close();
+  folderPath.clear();
+  folderPath.append(trashPath);
+  pending = false;
+}
+
+// Deletes trashed files until the time budget runs out, at least one file
+// or folder is removed per call. The trash is walked depth first: files
+// are removed as they are listed, a folder is emptied before it is
+// removed and the walk goes back up to its parent. Returns true if there
+// is work left.
+bool folderReaper::step(uint32_t budgetMicros){
+  if(!pending){
+    return false;
+  }
+  uint32_t start = micros();
+  do{
+    if(!folder.isOpen() && !folder.open(folderPath.c_str(),O_RDONLY)){
+      stop();
+      return false;
+    }
+    File32 entry;
+    if(entry.openNext(&folder,O_RDONLY)){
+      char name[pathBuilderLen];
+      bool isDir = entry.isDir();
+      bool named = entry.getName(name,sizeof(name))>0;
+      entry.close();
+      if(!named || !folderPath.append("/") || !folderPath.append(name)){
+        // The name doesn't fit a path, the entry can't be removed
+        stop();
+        return false;
+      }
+      if(isDir){
+        // Listed again from its start once it is opened
+        folder.close();
+        continue;
+      }
+      if(SDCard->remove(folderPath.c_str())){
+        filesRemoved++;
+      }
+      folderPath.parent();
+      continue;
+    }
+    // The folder is empty, remove it and go back to its parent
+    folder.close();
+    if(strcmp(folderPath.c_str(),trashPath)==0){
+      // Nothing left to delete
+      pending = false;
+      return false;
+    }
+    if(!SDCard->rmdir(folderPath.c_str())){
+      stop(); // Don't retry a broken folder forever
+      return false;
+    }
+    folderPath.parent();
+  }while(micros()-start<budgetMicros);
+  return true;
+}
@@ -0,0 +1,65 @@
+/*
+ Path on the card built in a fixed buffer, so joining a folder and a file
+ name in the render loop never touches the heap. A path that doesn't fit
+ is cut short and marked as such, it must not be opened since it names
+ another file.
+*/
+#pragma once
+#include <Arduino.h>
+
+#ifndef pathBuilderLen
+#define pathBuilderLen 100 // Longest path plus its terminator
+#endif
+
+class pathBuilder{
+  private:
+    char path[pathBuilderLen] = "";
+    uint16_t len = 0;
+    bool truncated = false;
+
+  public:
+    pathBuilder() {}
+    pathBuilder(const char *folder, const char *name) { join(folder,name); }
+    bool join(const char *folder, const char *name);
+    bool append(const char *part);
+    bool parent();
+    void clear() { path[0] = '\0'; len = 0; truncated = false; }
+    const char* c_str() { return path; }
+    uint16_t length() { return len; }
+    // Something was left out, the path is not usable
+    bool isTruncated() { return truncated; }
+};
+
+// Sets the path to folder/name, returns true if it fit
+bool pathBuilder::join(const char *folder, const char *name){
+  clear();
+  return append(folder) && append("/") && append(name);
+}
+
+// Adds part to the end of the path, returns true if it fit
+bool pathBuilder::append(const char *part){
+  if(truncated){
+    return false;
+  }
+  while(*part!='\0'){
+    if(len+1>=pathBuilderLen){
+      truncated = true;
+      break;
+    }
+    path[len++] = *part++;
+  }
+  path[len] = '\0';
+  return !truncated;
+}
+
+// Drops the last part of the path and the '/' before it, returns false if
+// there is no '/' to go up from
+bool pathBuilder::parent(){
+  char *slash = strrchr(path,'/');
+  if(slash==NULL){
+    return false;
+  }
+  *slash = '\0';
+  len = slash-path;
+  return true;
+}
@@ -0,0 +1,329 @@
+/*
+ Finds the fastest SPI clock the SD card works at. A test file is
+ written at the safe clock, then the card is mounted again at rising
+ clocks and at each one the file is read through raw sector transfers:
+ sequential multi-sector reads and single sectors at random, every byte
+ checked. Nothing is written at a clock that wasn't checked: SPI mode
+ runs without CRCs, so a garbled write command could land on the FAT.
+ The fastest clock that passed (with every slower one passing too) is
+ kept, and only there the write speed is measured.
+ The result is stored on the card with its CID, so it is only used by
+ the card it was measured on and a card moved to another unit or
+ replaced is tuned again at the next boot.
+ Mounting the card again invalidates nothing on the card, but no file
+ may be open while tuning.
+*/
+#pragma once
+#include <Arduino.h>
+#include <SdFat.h> // Adafruit's Fork of SD
+#include <alignedWriter.h> // sdSectorSize
+
+// Clock the card is mounted at before it is tuned, and the one it falls
+// back to, in MHz. Works with every card.
+#ifndef sdClockSafeMhz
+#define sdClockSafeMhz 16
+#endif
+// Clocks tried in rising order, in MHz. The RP2040 divides its peripheral
+// clock by an even number, so the actual clock is the nearest one below.
+#ifndef sdClockSteps
+#define sdClockSteps 16,20,25,32,40,50
+#endif
+#define sdClockStepsMax 8
+#define sdTuneFileSectors 128 // 64 KB test file
+#define sdTuneChunkSectors 4 // Sectors per multi-sector transfer
+#define sdTuneRandomReads 64
+#define sdTuneRounds 2 // Every clock is checked this many times
+#define sdTuneMagic "IMPSDCLK"
+
+// Benchmark of one clock
+struct sdClockResult{
+  uint8_t mhz = 0;
+  bool ok = false; // Every byte read back was right
+  uint32_t readKBps = 0; // Sequential multi-sector reads
+  uint32_t randomReadsPerSecond = 0; // Single sectors at random places
+  uint32_t writeKBps = 0; // Sequential multi-sector writes, only measured at the clock kept
+};
+
+class sdClockTuner{
+  private:
+    SdFat32 *SDCard;
+    uint8_t csPin;
+    const char *resultPath = NULL;
+    const char *testPath = NULL;
+    cid_t cid;
+    uint8_t clockMhz = sdClockSafeMhz;
+    bool tuned = false; // clockMhz was measured on this card
+    volatile bool tuning = false;
+    sdClockResult results[sdClockStepsMax];
+    uint8_t resultCount = 0;
+    uint32_t testSector = 0; // First sector of the test file
+    uint8_t buffer[sdTuneChunkSectors*sdSectorSize];
+
+    bool mountAt(uint8_t mhz);
+    static void fillPattern(uint8_t *dst, uint32_t sector, uint32_t seed);
+    static bool checkPattern(const uint8_t *src, uint32_t sector, uint32_t seed);
+    int prepareTestFile();
+    bool benchmark(sdClockResult &result);
+    bool benchmarkWrites(sdClockResult &result);
+    int loadResults();
+    int saveResults();
+
+  public:
+    sdClockTuner(SdFat32 *SDOpen, uint8_t cs) { SDCard = SDOpen; csPin = cs; }
+    int begin(const char *resultFile, const char *testFile);
+    int tune();
+    uint8_t clock() { return clockMhz; }
+    bool isTuned() { return tuned; }
+    bool isTuning() { return tuning; }
+    uint8_t resultsCount() { return resultCount; }
+    const sdClockResult& result(uint8_t i) { return results[i]; }
+    const cid_t& cardId() { return cid; }
+};
+
+// Mounts the card at the clock, returns true on success
+bool sdClockTuner::mountAt(uint8_t mhz){
+  return SDCard->begin(SdSpiConfig(csPin,DEDICATED_SPI,SD_SCK_MHZ(mhz)));
+}
+
+// Test data of a sector, different for every sector and every seed so a
+// transfer that went to the wrong place or didn't happen is noticed
+void sdClockTuner::fillPattern(uint8_t *dst, uint32_t sector, uint32_t seed){
+  uint32_t x = sector*2654435761UL ^ seed;
+  for(uint16_t i=0;i<sdSectorSize;i+=4){
+    x = x*1664525+1013904223;
+    memcpy(&dst[i],&x,4);
+  }
+}
+
+bool sdClockTuner::checkPattern(const uint8_t *src, uint32_t sector, uint32_t seed){
+  uint32_t x = sector*2654435761UL ^ seed;
+  for(uint16_t i=0;i<sdSectorSize;i+=4){
+    x = x*1664525+1013904223;
+    if(memcmp(&src[i],&x,4)!=0){
+      return false;
+    }
+  }
+  return true;
+}
+
+// Mounts the card at the clock stored for it, or tunes it if there is
+// none (a new card or another one than last time). The card must have
+// been mounted at sdClockSafeMhz. Returns 0 on success, the card stays
+// mounted at sdClockSafeMhz otherwise.
+int sdClockTuner::begin(const char *resultFile, const char *testFile){
+  resultPath = resultFile;
+  testPath = testFile;
+  if(!SDCard->card()->readCID(&cid)){
+    return 1;
+  }
+  if(loadResults()==0){
+    if(mountAt(clockMhz)){
+      return 0;
+    }
+    // Worked when it was tuned, not anymore
+    clockMhz = sdClockSafeMhz;
+    tuned = false;
+    if(!mountAt(clockMhz)){
+      return 1;
+    }
+  }
+  return tune();
+}
+
+// Benchmarks the card at every clock of sdClockSteps, stops at the first
+// that fails, and mounts it at the fastest that passed. The results are
+// stored on the card. Returns 0 on success.
+int sdClockTuner::tune(){
+  static const uint8_t steps[] = {sdClockSteps};
+  tuning = true;
+  resultCount = 0;
+  uint8_t best = sdClockSafeMhz;
+  int8_t bestResult = -1;
+  if(!mountAt(sdClockSafeMhz) || prepareTestFile()){
+    mountAt(sdClockSafeMhz);
+    tuning = false;
+    return 1;
+  }
+  for(uint8_t i=0;i<sizeof(steps) && i<sdClockStepsMax;i++){
+    sdClockResult &result = results[resultCount++];
+    result = sdClockResult();
+    result.mhz = steps[i];
+    if(!mountAt(steps[i]) || !benchmark(result)){
+      break;
+    }
+    best = steps[i];
+    bestResult = resultCount-1;
+  }
+  clockMhz = best;
+  tuned = true;
+  if(!mountAt(clockMhz)){
+    clockMhz = sdClockSafeMhz;
+    tuned = false;
+    mountAt(clockMhz);
+  }
+  else if(bestResult>=0 && !benchmarkWrites(results[bestResult])){
+    // Reads passed but writes don't, keep to the safe clock
+    results[bestResult].ok = false;
+    clockMhz = sdClockSafeMhz;
+    mountAt(clockMhz);
+  }
+  SDCard->remove(testPath);
+  int status = saveResults();
+  tuning = false;
+  return status;
+}
+
+// Creates the test file in contiguous sectors, written at the safe clock.
+// Returns 0 on success.
+int sdClockTuner::prepareTestFile(){
+  File32 file;
+  SDCard->remove(testPath);
+  if(!file.open(testPath,O_RDWR | O_CREAT | O_TRUNC)){
+    return 1;
+  }
+  file.preAllocate(sdTuneFileSectors*sdSectorSize);
+  bool ok = true;
+  for(uint32_t i=0;i<sdTuneFileSectors && ok;i++){
+    fillPattern(buffer,i,0);
+    ok = file.write(buffer,sdSectorSize)==sdSectorSize;
+  }
+  uint32_t endSector = 0;
+  ok = ok && file.contiguousRange(&testSector,&endSector) &&
+       endSector+1-testSector>=sdTuneFileSectors;
+  if(!file.close() || !ok){
+    return 1;
+  }
+  return 0;
+}
+
+// Times reads of the test file at the clock the card is mounted at,
+// checking all the data. Nothing is written. Returns result.ok.
+bool sdClockTuner::benchmark(sdClockResult &result){
+  SdCard *card = SDCard->card();
+  uint32_t readMicros = 0, randomMicros = 0;
+  result.ok = true;
+  for(uint8_t round=0;round<sdTuneRounds && result.ok;round++){
+    // Sequential reads
+    for(uint32_t i=0;i<sdTuneFileSectors && result.ok;i+=sdTuneChunkSectors){
+      uint32_t start = micros();
+      result.ok = card->readSectors(testSector+i,buffer,sdTuneChunkSectors);
+      readMicros += micros()-start;
+      for(uint8_t s=0;s<sdTuneChunkSectors && result.ok;s++){
+        result.ok = checkPattern(&buffer[s*sdSectorSize],i+s,0);
+      }
+    }
+    // Single sectors all over the file
+    uint32_t x = ((uint32_t)result.mhz << 8) | (round+1);
+    for(uint16_t i=0;i<sdTuneRandomReads && result.ok;i++){
+      x = x*1664525+1013904223;
+      uint32_t sector = (x >> 8)%sdTuneFileSectors;
+      uint32_t start = micros();
+      result.ok = card->readSector(testSector+sector,buffer) &&
+                  checkPattern(buffer,sector,0);
+      randomMicros += micros()-start;
+    }
+  }
+  if(result.ok){
+    uint32_t bytes = (uint32_t)sdTuneRounds*sdTuneFileSectors*sdSectorSize;
+    result.readKBps = readMicros>0 ? (uint64_t)bytes*1000000/1024/readMicros : 0;
+    result.randomReadsPerSecond = randomMicros>0 ? (uint64_t)sdTuneRounds*sdTuneRandomReads*1000000/randomMicros : 0;
+  }
+  return result.ok;
+}
+
+// Times sequential writes over the test file at the clock the card is
+// mounted at, which must have passed benchmark() first, and reads them
+// back. Returns true if every byte was right.
+bool sdClockTuner::benchmarkWrites(sdClockResult &result){
+  SdCard *card = SDCard->card();
+  uint32_t writeMicros = 0;
+  uint32_t seed = ((uint32_t)result.mhz << 8) | 0xFF;
+  bool ok = true;
+  for(uint32_t i=0;i<sdTuneFileSectors && ok;i+=sdTuneChunkSectors){
+    for(uint8_t s=0;s<sdTuneChunkSectors;s++){
+      fillPattern(&buffer[s*sdSectorSize],i+s,seed);
+    }
+    uint32_t start = micros();
+    ok = card->writeSectors(testSector+i,buffer,sdTuneChunkSectors);
+    writeMicros += micros()-start;
+  }
+  for(uint32_t i=0;i<sdTuneFileSectors && ok;i+=sdTuneChunkSectors){
+    ok = card->readSectors(testSector+i,buffer,sdTuneChunkSectors);
+    for(uint8_t s=0;s<sdTuneChunkSectors && ok;s++){
+      ok = checkPattern(&buffer[s*sdSectorSize],i+s,seed);
+    }
+  }
+  if(ok){
+    uint32_t bytes = (uint32_t)sdTuneFileSectors*sdSectorSize;
+    result.writeKBps = writeMicros>0 ? (uint64_t)bytes*1000000/1024/writeMicros : 0;
+  }
+  return ok;
+}
+
+// Result file: magic (8 bytes), CID (16 bytes), clock, result count,
+// then 16 bytes per result: clock, passed, read KB/s, random reads per
+// second and write KB/s (32 bit each). Everything little endian.
+
+// Reads the stored clock if it was measured on this card.
+// Returns 0 if it was.
+int sdClockTuner::loadResults(){
+  File32 file;
+  uint8_t sector[sdSectorSize];
+  if(!file.open(resultPath,O_RDONLY)){
+    return 1;
+  }
+  bool ok = file.read(sector,sizeof(sector))>=26+16;
+  file.close();
+  if(!ok || memcmp(sector,sdTuneMagic,8)!=0 || memcmp(&sector[8],&cid,16)!=0 ||
+     sector[24]==0 || sector[25]>sdClockStepsMax){
+    return 1;
+  }
+  clockMhz = sector[24];
+  resultCount = sector[25];
+  for(uint8_t i=0;i<resultCount;i++){
+    const uint8_t *entry = &sector[26+i*16];
+    uint32_t values[3];
+    for(uint8_t v=0;v<3;v++){
+      const uint8_t *b = &entry[4+v*4];
+      values[v] = b[0] | (b[1] << 8) | ((uint32_t)b[2] << 16) | ((uint32_t)b[3] << 24);
+    }
+    results[i].mhz = entry[0];
+    results[i].ok = entry[1]!=0;
+    results[i].readKBps = values[0];
+    results[i].randomReadsPerSecond = values[1];
+    results[i].writeKBps = values[2];
+  }
+  tuned = true;
+  return 0;
+}
+
+// Stores the clock and the results with the CID of the card.
+// Returns 0 on success.
+int sdClockTuner::saveResults(){
+  File32 file;
+  uint8_t sector[sdSectorSize];
+  memset(sector,0,sizeof(sector));
+  memcpy(sector,sdTuneMagic,8);
+  memcpy(&sector[8],&cid,16);
+  sector[24] = tuned ? clockMhz : 0;
+  sector[25] = resultCount;
+  for(uint8_t i=0;i<resultCount;i++){
+    uint8_t *entry = &sector[26+i*16];
+    uint32_t values[3] = {results[i].readKBps,results[i].randomReadsPerSecond,results[i].writeKBps};
+    entry[0] = results[i].mhz;
+    entry[1] = results[i].ok;
+    for(uint8_t v=0;v<3;v++){
+      for(uint8_t b=0;b<4;b++){
+        entry[4+v*4+b] = values[v] >> (8*b);
+      }
+    }
+  }
+  if(!file.open(resultPath,O_WRONLY | O_CREAT | O_TRUNC)){
+    return 1;
+  }
+  bool ok = file.write(sector,sizeof(sector))==sizeof(sector);
+  if(!file.close() || !ok){
+    return 1;
+  }
+  return 0;
+}
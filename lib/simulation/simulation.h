@@ -1,15 +1,16 @@
 // This file contains the entire class for the conway's game of life simulation
 #include <Adafruit_Protomatter.h>
+#include <virtualCanvas.h> // The panels the game is drawn on
 
 // Define how big of a game arena we want
-#define gameRows 32 // Total number of rows in the matrix
-#define gameColumns 64 // Total number of colors in the matrix
+#define gameRows canvasHeight // Total number of rows in the matrix
+#define gameColumns canvasWidth // Total number of columns in the matrix
 
 // Class definition
 class ConwaysGame {
     private:
         uint16_t simColor;
-        Adafruit_Protomatter* matrix;
+        virtualCanvas* canvas;
         byte genMap_1[gameRows][gameColumns]; // Used to store the current and next generations
         byte genMap_2[gameRows][gameColumns];
         byte (*currentGenMap)[gameRows][gameColumns];
@@ -17,12 +18,12 @@ class ConwaysGame {
 
         // Checks all the neighbors of a specific cell
         // and returns true if its alive or false if its dead.
-        bool checkNeighbors(uint8_t y, uint8_t x, 
-                            uint8_t totalRows, uint8_t totalColumns);
+        bool checkNeighbors(uint16_t y, uint16_t x, 
+                            uint16_t totalRows, uint16_t totalColumns);
     public:
-        // Matrix only constructor
-        ConwaysGame(Adafruit_Protomatter* disp);
-        ConwaysGame(Adafruit_Protomatter* disp, uint16_t color);
+        // Canvas only constructor
+        ConwaysGame(virtualCanvas* disp);
+        ConwaysGame(virtualCanvas* disp, uint16_t color);
         uint32_t calcNextGen();
         void initSeed(boolean rand); 
         void drawCurGen();
@@ -31,17 +32,17 @@ class ConwaysGame {
 
 // Class implementation
 
-// Matrix only constructor, by default the simulation
+// Canvas only constructor, by default the simulation
 // is the color red
-ConwaysGame::ConwaysGame(Adafruit_Protomatter* disp){
-    matrix = disp;
-    simColor = matrix->color565(255,0,0);
+ConwaysGame::ConwaysGame(virtualCanvas* disp){
+    canvas = disp;
+    simColor = Adafruit_Protomatter::color565(255,0,0);
 };
 
 // Overloaded constructor, ability to change the color 
 // of the simulation.
-ConwaysGame::ConwaysGame(Adafruit_Protomatter* disp,uint16_t color){
-    matrix = disp;
+ConwaysGame::ConwaysGame(virtualCanvas* disp,uint16_t color){
+    canvas = disp;
     simColor = color;
 };
 
@@ -69,8 +70,8 @@ void ConwaysGame::initSeed(boolean rand){
         }
         // Cordinates are in y,x for the arrays
         // due to the way two dimensional matrices work.
-        uint8_t centerY = (gameRows/2)-1;
-        uint8_t centerX = (gameColumns/2)-1;
+        uint16_t centerY = (gameRows/2)-1;
+        uint16_t centerX = (gameColumns/2)-1;
         genMap_1[centerY-1][centerX-1] = 1;
         genMap_1[centerY-1][centerX] = 1;
         genMap_1[centerY-1][centerX+1] = 1;
@@ -137,7 +138,7 @@ uint32_t ConwaysGame::calcNextGen(){
 
 // Internal helper function to check all the living neighbors of a cell
 // and return if the cell being checked is alive or dead. 
-bool ConwaysGame::checkNeighbors(uint8_t y, uint8_t x, uint8_t totalRows, uint8_t totalColumns){
+bool ConwaysGame::checkNeighbors(uint16_t y, uint16_t x, uint16_t totalRows, uint16_t totalColumns){
     // Checks all neighbors of a cell, if they are out of bounds
     // do not check them and just ignore them
     
@@ -217,18 +218,14 @@ bool ConwaysGame::checkNeighbors(uint8_t y, uint8_t x, uint8_t totalRows, uint8_
 // but for clarity I keep it seperate. 
 void ConwaysGame::drawCurGen(){
     // Draws the current gameMap (also called the current generation)
-    // on to the LED matrix.
+    // on to the LED matrix, a row at a time through the canvas.
+    uint16_t row[gameColumns];
     for(int i=0;i<gameRows;i++){
         for(int j=0;j<gameColumns;j++){
-            if( (*currentGenMap)[i][j] ){
-                // turn the LED to the simulations color
-                matrix->drawPixel(j,i,simColor);
-            }else{
-                // turns the LED off
-                matrix->drawPixel(j,i,matrix->color565(0,0,0));
-            }
-
+            // The simulations color if alive, off otherwise
+            row[j] = (*currentGenMap)[i][j] ? simColor : 0;
         }
+        canvas->writeRow(i,row);
     }
 };
 
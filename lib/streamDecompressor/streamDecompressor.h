@@ -0,0 +1,702 @@
+/*
+ Incremental decompressor for files uploaded compressed, as zlib streams
+ (the "deflate" HTTP content coding) or LZ4 frames. Like the BMP decoder
+ it takes its input in chunks of any size, so nothing has to wait for the
+ whole file. Output goes into a fixed ring buffer which is also the
+ history back references copy from: a stream may only refer back
+ decompressWindowSize bytes. That covers a whole 64x32 24 bit BMP, larger
+ files have to be compressed with a window that fits (zlib wbits).
+*/
+#pragma once
+#include <Arduino.h>
+
+enum decompressFormat : uint8_t {
+  decompressNone = 0,
+  decompressDeflate,
+  decompressLz4
+};
+
+// Result codes of the decompressor
+enum decompressStatus : uint8_t {
+  decompressOk = 0,
+  decompressCorrupt,     // Broken or truncated stream, or a bad check value
+  decompressUnsupported, // Valid stream using a preset dictionary
+  decompressTooFar       // Back reference further than the window
+};
+
+// Size of the output ring, a power of two
+#ifndef decompressWindowSize
+#define decompressWindowSize 16384
+#endif
+
+class streamDecompressor{
+  private:
+    static_assert((decompressWindowSize & (decompressWindowSize-1))==0, "window size must be a power of two");
+    enum decompressState : uint8_t {
+      // zlib
+      stZlibHeader, stBlockHeader, stStoredHeader, stStored, stTableHeader,
+      stCodeLengthCodes, stCodeLengths, stLiteral, stLengthExtra, stDistance,
+      stDistanceExtra, stZlibTrailer,
+      // LZ4 frame
+      stLz4Header, stLz4BlockSize, stLz4Raw, stLz4Token, stLz4LiteralLength,
+      stLz4Literals, stLz4Offset, stLz4MatchLength,
+      // Both
+      stCopy, stSkip, stDone, stError
+    };
+    decompressFormat format = decompressNone;
+    decompressState state = stError;
+    decompressState stateAfter = stError; // Where stCopy and stSkip go next
+    decompressStatus status = decompressCorrupt;
+
+    uint8_t window[decompressWindowSize];
+    uint32_t written = 0; // Bytes ever decompressed
+    uint32_t released = 0; // Bytes ever taken by the caller
+    uint32_t copyLength = 0; // Back reference being copied
+    uint32_t copyDistance = 0;
+
+    // Input of the current feed() call
+    const uint8_t *in = NULL;
+    const uint8_t *inEnd = NULL;
+
+    // zlib bit reader, deflate packs codes starting at the lowest bit
+    uint32_t bitBuffer = 0;
+    uint8_t bitCount = 0;
+    uint32_t adler = 1; // Adler-32 of the released output
+    uint32_t expectedAdler = 0;
+
+    // Canonical Huffman code: number of codes of each length and the
+    // symbols sorted by code
+    struct huffmanTable{
+      uint16_t counts[16];
+      uint16_t symbols[288];
+    };
+    huffmanTable literals;
+    huffmanTable distances; // Also holds the code length code while a dynamic table is read
+    uint8_t lengths[320];
+    bool finalBlock = false;
+    uint16_t literalCodes = 0;
+    uint16_t distanceCodes = 0;
+    uint16_t lengthCodes = 0;
+    uint16_t index = 0; // Entry of lengths being read
+    int16_t symbol = -1; // Symbol waiting for its extra bits, -1 if none
+
+    // LZ4 frame state
+    uint8_t header[16];
+    uint8_t headerLen = 0;
+    bool blockChecksums = false;
+    bool contentChecksum = false;
+    uint32_t blockRemaining = 0; // Bytes of the current block still to read
+    uint32_t literalLength = 0;
+    uint32_t skipCount = 0;
+
+    bool step();
+    bool stepZlib();
+    bool stepLz4();
+    bool fail(decompressStatus failure);
+    void fillBits();
+    bool needBits(uint8_t n);
+    uint32_t getBits(uint8_t n);
+    int buildTable(huffmanTable &table, const uint8_t *codeLengths, uint16_t n);
+    void buildFixedTables();
+    int decodeSymbol(const huffmanTable &table);
+    void endBlock();
+    bool collect(uint8_t n);
+    bool startCopy(uint32_t length, uint32_t distance, decompressState next);
+    void endLz4Block();
+    uint32_t windowSpace() { return decompressWindowSize-(written-released); }
+    void put(uint8_t b) { window[written & (decompressWindowSize-1)] = b; written++; }
+    void updateAdler(const uint8_t *data, uint32_t len);
+
+  public:
+    void begin(decompressFormat formatIn);
+    uint32_t feed(const uint8_t *src, uint32_t len);
+    uint32_t output(const uint8_t **dst);
+    void release(uint32_t len);
+    decompressStatus finish();
+    decompressStatus getStatus() { return status; }
+    uint32_t totalOut() { return written; }
+};
+
+// Tables of the deflate length and distance codes (RFC 1951 3.2.5)
+static const uint16_t deflateLengthBase[29] = {
+  3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+  35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t deflateLengthExtra[29] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t deflateDistanceBase[30] = {
+  1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+  257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const uint8_t deflateDistanceExtra[30] = {
+  0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+// Order the code length code lengths are stored in
+static const uint8_t deflateCodeLengthOrder[19] = {
+  16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+#define lz4Magic 0x184D2204UL
+
+// Starts a new stream
+void streamDecompressor::begin(decompressFormat formatIn){
+  format = formatIn;
+  state = format==decompressLz4 ? stLz4Header : stZlibHeader;
+  status = decompressOk;
+  written = 0;
+  released = 0;
+  bitBuffer = 0;
+  bitCount = 0;
+  adler = 1;
+  headerLen = 0;
+  symbol = -1;
+}
+
+// Decompresses as much of the input as the free space of the window
+// allows. Returns the number of input bytes used, the caller takes the
+// output with output() and release() and feeds the rest again.
+uint32_t streamDecompressor::feed(const uint8_t *src, uint32_t len){
+  in = src;
+  inEnd = src+len;
+  while(state!=stDone && state!=stError && step()){}
+  if(state==stDone || state==stError){
+    in = inEnd; // Anything after the end of the stream is ignored
+  }
+  return in-src;
+}
+
+// Points dst at the oldest output not yet taken and returns how much of
+// it can be read in one piece
+uint32_t streamDecompressor::output(const uint8_t **dst){
+  uint32_t start = released & (decompressWindowSize-1);
+  *dst = &window[start];
+  return min(written-released,decompressWindowSize-start);
+}
+
+// Frees output read through output()
+void streamDecompressor::release(uint32_t len){
+  if(format==decompressDeflate){
+    updateAdler(&window[released & (decompressWindowSize-1)],len);
+  }
+  released += len;
+}
+
+// Checks that the stream ended properly, once all the input is fed and
+// all the output released
+decompressStatus streamDecompressor::finish(){
+  if(status!=decompressOk){
+    return status;
+  }
+  if(state!=stDone || written!=released ||
+     (format==decompressDeflate && adler!=expectedAdler)){
+    fail(decompressCorrupt);
+  }
+  return status;
+}
+
+bool streamDecompressor::fail(decompressStatus failure){
+  status = failure;
+  state = stError;
+  return false;
+}
+
+// Runs the state machine one step. Returns false when it needs more input
+// or more space in the window.
+bool streamDecompressor::step(){
+  if(state==stCopy){
+    while(copyLength>0){
+      if(windowSpace()==0){
+        return false;
+      }
+      put(window[(written-copyDistance) & (decompressWindowSize-1)]);
+      copyLength--;
+    }
+    state = stateAfter;
+    return true;
+  }
+  if(state==stSkip){
+    uint32_t n = min(skipCount,(uint32_t)(inEnd-in));
+    in += n;
+    skipCount -= n;
+    if(skipCount>0){
+      return false;
+    }
+    state = stateAfter;
+    return true;
+  }
+  return format==decompressLz4 ? stepLz4() : stepZlib();
+}
+
+// Checks the back reference and starts copying it
+bool streamDecompressor::startCopy(uint32_t length, uint32_t distance, decompressState next){
+  if(distance==0 || distance>written){
+    return fail(decompressCorrupt);
+  }
+  if(distance>decompressWindowSize){
+    return fail(decompressTooFar);
+  }
+  copyLength = length;
+  copyDistance = distance;
+  stateAfter = next;
+  state = stCopy;
+  return true;
+}
+
+// Adds the output to the Adler-32 check value of zlib, taking the modulo
+// only as often as needed to keep the sums from overflowing
+void streamDecompressor::updateAdler(const uint8_t *data, uint32_t len){
+  uint32_t a = adler & 0xFFFF;
+  uint32_t b = adler >> 16;
+  while(len>0){
+    uint32_t n = min(len,(uint32_t)5552);
+    len -= n;
+    while(n--){
+      a += *data++;
+      b += a;
+    }
+    a %= 65521;
+    b %= 65521;
+  }
+  adler = (b << 16) | a;
+}
+
+// Moves input bytes into the bit buffer
+void streamDecompressor::fillBits(){
+  while(bitCount<=24 && in<inEnd){
+    bitBuffer |= (uint32_t)(*in++) << bitCount;
+    bitCount += 8;
+  }
+}
+
+bool streamDecompressor::needBits(uint8_t n){
+  fillBits();
+  return bitCount>=n;
+}
+
+// Takes n bits from the bit buffer, needBits(n) must have returned true
+uint32_t streamDecompressor::getBits(uint8_t n){
+  uint32_t value = bitBuffer & ((1UL << n)-1);
+  bitBuffer >>= n;
+  bitCount -= n;
+  return value;
+}
+
+// Builds the decoding table of a canonical Huffman code from the code
+// length of every symbol. Returns 0 on success, 1 if the lengths describe
+// more codes than there are.
+int streamDecompressor::buildTable(huffmanTable &table, const uint8_t *codeLengths, uint16_t n){
+  memset(table.counts,0,sizeof(table.counts));
+  for(uint16_t i=0;i<n;i++){
+    table.counts[codeLengths[i]]++;
+  }
+  table.counts[0] = 0;
+  int32_t left = 1;
+  uint16_t offsets[16];
+  offsets[1] = 0;
+  for(uint8_t len=1;len<16;len++){
+    left = (left << 1)-table.counts[len];
+    if(left<0){
+      return 1;
+    }
+    if(len<15){
+      offsets[len+1] = offsets[len]+table.counts[len];
+    }
+  }
+  for(uint16_t i=0;i<n;i++){
+    if(codeLengths[i]!=0){
+      table.symbols[offsets[codeLengths[i]]++] = i;
+    }
+  }
+  return 0;
+}
+
+// Builds the codes of fixed Huffman blocks
+void streamDecompressor::buildFixedTables(){
+  uint16_t i = 0;
+  for(;i<144;i++) lengths[i] = 8;
+  for(;i<256;i++) lengths[i] = 9;
+  for(;i<280;i++) lengths[i] = 7;
+  for(;i<288;i++) lengths[i] = 8;
+  buildTable(literals,lengths,288);
+  memset(lengths,5,30);
+  buildTable(distances,lengths,30);
+}
+
+// Decodes one symbol without taking any bits unless it is complete.
+// Returns the symbol, -1 if more input is needed or -2 for a bad code.
+int streamDecompressor::decodeSymbol(const huffmanTable &table){
+  fillBits();
+  int code = 0;
+  int first = 0;
+  int symbolIndex = 0;
+  for(uint8_t len=1;len<16;len++){
+    if(len>bitCount){
+      return -1;
+    }
+    code |= (bitBuffer >> (len-1)) & 1;
+    int count = table.counts[len];
+    if(code-count<first){
+      getBits(len);
+      return table.symbols[symbolIndex+(code-first)];
+    }
+    symbolIndex += count;
+    first = (first+count) << 1;
+    code <<= 1;
+  }
+  return -2;
+}
+
+void streamDecompressor::endBlock(){
+  state = finalBlock ? stZlibTrailer : stBlockHeader;
+}
+
+// One step of a zlib stream (RFC 1950 and 1951)
+bool streamDecompressor::stepZlib(){
+  switch(state){
+    case stZlibHeader:{
+      if(!needBits(16)){
+        return false;
+      }
+      uint8_t cmf = getBits(8);
+      uint8_t flg = getBits(8);
+      if((cmf & 0x0F)!=8 || ((cmf << 8) | flg)%31!=0){
+        return fail(decompressCorrupt);
+      }
+      if(flg & 0x20){
+        return fail(decompressUnsupported);
+      }
+      state = stBlockHeader;
+      return true;
+    }
+    case stBlockHeader:{
+      if(!needBits(3)){
+        return false;
+      }
+      finalBlock = getBits(1);
+      uint8_t type = getBits(2);
+      if(type==0){
+        state = stStoredHeader;
+      }else if(type==1){
+        buildFixedTables();
+        state = stLiteral;
+      }else if(type==2){
+        state = stTableHeader;
+      }else{
+        return fail(decompressCorrupt);
+      }
+      return true;
+    }
+    case stStoredHeader:{
+      getBits(bitCount%8); // Stored blocks start on a byte boundary
+      if(!needBits(32)){
+        return false;
+      }
+      uint16_t len = getBits(16);
+      uint16_t inverse = getBits(16);
+      if(len!=(uint16_t)~inverse){
+        return fail(decompressCorrupt);
+      }
+      blockRemaining = len;
+      state = stStored;
+      return true;
+    }
+    case stStored:
+      while(blockRemaining>0){
+        if(windowSpace()==0){
+          return false;
+        }
+        // Bytes already in the bit buffer come first
+        if(bitCount>=8){
+          put(getBits(8));
+        }else if(in<inEnd){
+          put(*in++);
+        }else{
+          return false;
+        }
+        blockRemaining--;
+      }
+      endBlock();
+      return true;
+    case stTableHeader:
+      if(!needBits(14)){
+        return false;
+      }
+      literalCodes = getBits(5)+257;
+      distanceCodes = getBits(5)+1;
+      lengthCodes = getBits(4)+4;
+      if(literalCodes>286 || distanceCodes>30){
+        return fail(decompressCorrupt);
+      }
+      memset(lengths,0,19);
+      index = 0;
+      state = stCodeLengthCodes;
+      return true;
+    case stCodeLengthCodes:
+      while(index<lengthCodes){
+        if(!needBits(3)){
+          return false;
+        }
+        lengths[deflateCodeLengthOrder[index++]] = getBits(3);
+      }
+      if(buildTable(distances,lengths,19)){
+        return fail(decompressCorrupt);
+      }
+      index = 0;
+      symbol = -1;
+      state = stCodeLengths;
+      return true;
+    case stCodeLengths:
+      while(index<literalCodes+distanceCodes){
+        if(symbol<0){
+          int s = decodeSymbol(distances);
+          if(s==-1){
+            return false;
+          }
+          if(s<0){
+            return fail(decompressCorrupt);
+          }
+          if(s<16){
+            lengths[index++] = s;
+            continue;
+          }
+          symbol = s;
+        }
+        // Repeat codes, with their count in the extra bits
+        uint8_t extra = symbol==16 ? 2 : (symbol==17 ? 3 : 7);
+        if(!needBits(extra)){
+          return false;
+        }
+        uint8_t value = 0;
+        uint16_t repeat = getBits(extra)+(symbol==18 ? 11 : 3);
+        if(symbol==16){
+          if(index==0){
+            return fail(decompressCorrupt);
+          }
+          value = lengths[index-1];
+        }
+        if(index+repeat>literalCodes+distanceCodes){
+          return fail(decompressCorrupt);
+        }
+        while(repeat--){
+          lengths[index++] = value;
+        }
+        symbol = -1;
+      }
+      if(lengths[256]==0 || buildTable(literals,lengths,literalCodes) ||
+         buildTable(distances,&lengths[literalCodes],distanceCodes)){
+        return fail(decompressCorrupt);
+      }
+      state = stLiteral;
+      return true;
+    case stLiteral:{
+      if(windowSpace()==0){
+        return false;
+      }
+      int s = decodeSymbol(literals);
+      if(s==-1){
+        return false;
+      }
+      if(s<0 || s>285){
+        return fail(decompressCorrupt);
+      }
+      if(s<256){
+        put(s);
+      }else if(s==256){
+        endBlock();
+      }else{
+        symbol = s-257;
+        state = stLengthExtra;
+      }
+      return true;
+    }
+    case stLengthExtra:
+      if(!needBits(deflateLengthExtra[symbol])){
+        return false;
+      }
+      copyLength = deflateLengthBase[symbol]+getBits(deflateLengthExtra[symbol]);
+      state = stDistance;
+      return true;
+    case stDistance:{
+      int s = decodeSymbol(distances);
+      if(s==-1){
+        return false;
+      }
+      if(s<0 || s>29){
+        return fail(decompressCorrupt);
+      }
+      symbol = s;
+      state = stDistanceExtra;
+      return true;
+    }
+    case stDistanceExtra:{
+      if(!needBits(deflateDistanceExtra[symbol])){
+        return false;
+      }
+      uint32_t distance = deflateDistanceBase[symbol]+getBits(deflateDistanceExtra[symbol]);
+      symbol = -1;
+      return startCopy(copyLength,distance,stLiteral);
+    }
+    case stZlibTrailer:
+      getBits(bitCount%8);
+      if(!needBits(32)){
+        return false;
+      }
+      // The check value is stored big endian
+      expectedAdler = 0;
+      for(uint8_t i=0;i<4;i++){
+        expectedAdler = (expectedAdler << 8) | getBits(8);
+      }
+      state = stDone;
+      return true;
+    default:
+      return fail(decompressCorrupt);
+  }
+}
+
+// Copies input bytes into header until it holds n bytes
+bool streamDecompressor::collect(uint8_t n){
+  while(headerLen<n && in<inEnd){
+    header[headerLen++] = *in++;
+  }
+  return headerLen==n;
+}
+
+void streamDecompressor::endLz4Block(){
+  skipCount = blockChecksums ? 4 : 0;
+  stateAfter = stLz4BlockSize;
+  state = stSkip;
+}
+
+// One step of an LZ4 frame. The checksums of the frame are skipped, a
+// broken file still fails the checks of the BMP decoder.
+bool streamDecompressor::stepLz4(){
+  switch(state){
+    case stLz4Header:{
+      // Magic number, flags and block size byte
+      if(!collect(6)){
+        return false;
+      }
+      uint32_t magic = header[0] | (header[1] << 8) | ((uint32_t)header[2] << 16) | ((uint32_t)header[3] << 24);
+      uint8_t flags = header[4];
+      if(magic!=lz4Magic || (flags >> 6)!=1){
+        return fail(decompressCorrupt);
+      }
+      if(flags & 0x01){
+        return fail(decompressUnsupported); // Needs a dictionary
+      }
+      blockChecksums = flags & 0x10;
+      contentChecksum = flags & 0x04;
+      headerLen = 0;
+      // Content size and the header checksum
+      skipCount = ((flags & 0x08) ? 8 : 0)+1;
+      stateAfter = stLz4BlockSize;
+      state = stSkip;
+      return true;
+    }
+    case stLz4BlockSize:{
+      if(!collect(4)){
+        return false;
+      }
+      uint32_t size = header[0] | (header[1] << 8) | ((uint32_t)header[2] << 16) | ((uint32_t)header[3] << 24);
+      headerLen = 0;
+      if(size==0){
+        // End mark
+        skipCount = contentChecksum ? 4 : 0;
+        stateAfter = stDone;
+        state = stSkip;
+      }else if(size & 0x80000000UL){
+        blockRemaining = size & 0x7FFFFFFFUL;
+        state = stLz4Raw;
+      }else{
+        blockRemaining = size;
+        state = stLz4Token;
+      }
+      return true;
+    }
+    case stLz4Raw:
+      while(blockRemaining>0){
+        if(windowSpace()==0 || in==inEnd){
+          return false;
+        }
+        put(*in++);
+        blockRemaining--;
+      }
+      endLz4Block();
+      return true;
+    case stLz4Token:
+      if(blockRemaining==0){
+        endLz4Block();
+        return true;
+      }
+      if(in==inEnd){
+        return false;
+      }
+      header[0] = *in++; // Keep the token for the match length
+      blockRemaining--;
+      literalLength = header[0] >> 4;
+      state = literalLength==15 ? stLz4LiteralLength : stLz4Literals;
+      return true;
+    case stLz4LiteralLength:
+    case stLz4MatchLength:{
+      // Lengths of 15 and more continue in bytes of up to 255
+      if(blockRemaining==0){
+        return fail(decompressCorrupt);
+      }
+      if(in==inEnd){
+        return false;
+      }
+      uint8_t b = *in++;
+      blockRemaining--;
+      if(state==stLz4LiteralLength){
+        literalLength += b;
+        if(b!=255){
+          state = stLz4Literals;
+        }
+        return true;
+      }
+      copyLength += b;
+      if(b!=255){
+        return startCopy(copyLength,copyDistance,stLz4Token);
+      }
+      return true;
+    }
+    case stLz4Literals:
+      while(literalLength>0){
+        if(blockRemaining==0){
+          return fail(decompressCorrupt);
+        }
+        if(windowSpace()==0 || in==inEnd){
+          return false;
+        }
+        put(*in++);
+        blockRemaining--;
+        literalLength--;
+      }
+      // The last sequence of a block has no match
+      if(blockRemaining==0){
+        endLz4Block();
+      }else{
+        headerLen = 1; // After the token
+        state = stLz4Offset;
+      }
+      return true;
+    case stLz4Offset:
+      // Two byte offset, after the token kept in header[0]
+      while(headerLen<3){
+        if(blockRemaining==0){
+          return fail(decompressCorrupt);
+        }
+        if(in==inEnd){
+          return false;
+        }
+        header[headerLen++] = *in++;
+        blockRemaining--;
+      }
+      headerLen = 0;
+      copyDistance = header[1] | (header[2] << 8);
+      copyLength = (header[0] & 0x0F)+4;
+      if((header[0] & 0x0F)==15){
+        state = stLz4MatchLength;
+        return true;
+      }
+      return startCopy(copyLength,copyDistance,stLz4Token);
+    default:
+      return fail(decompressCorrupt);
+  }
+}
@@ -0,0 +1,84 @@
+/*
+ Scrolling text of the ticker mode. The message is drawn once with the
+ GFX font into a strip of 1 bit per pixel, every frame then copies a
+ window of the strip as wide as the canvas into the matrix, reading the
+ strip a byte (8 pixels) at a time. Scrolling never draws a glyph, so a
+ frame costs about as much as clearing the matrix.
+*/
+#pragma once
+#include <Arduino.h>
+#include <Adafruit_GFX.h> // GFXcanvas1 and the font the strip is drawn with
+#include <virtualCanvas.h> // The panels the message is drawn on
+
+#define tickerTextMax 128 // Longest message, in characters
+#define tickerTextSize 2 // GFX text size, the font is 6x8 pixels at size 1
+#define tickerCharWidth (6*tickerTextSize)
+#define tickerHeight (8*tickerTextSize)
+#define tickerStripWidth (tickerTextMax*tickerCharWidth)
+#define tickerRowBytes ((tickerStripWidth+7)/8)
+
+class textTicker{
+  private:
+    GFXcanvas1 strip;
+    uint16_t textWidth = 0; // Columns of the strip the message uses
+    uint16_t color = 0xFFFF;
+    uint16_t background = 0;
+
+  public:
+    textTicker() : strip(tickerStripWidth,tickerHeight) {}
+    void setText(const char *text);
+    void setColors(uint16_t foreground, uint16_t back) { color = foreground; background = back; }
+    // Positions in one pass of the message, from entering on the right
+    // until it has left on the left
+    uint32_t cycleLength() { return textWidth+canvasWidth; }
+    void draw(virtualCanvas &canvas, int32_t start);
+};
+
+// Draws the message into the strip, longer messages are cut at
+// tickerTextMax characters
+void textTicker::setText(const char *text){
+  strip.fillScreen(0);
+  strip.setTextWrap(false);
+  strip.setTextSize(tickerTextSize);
+  strip.setTextColor(1);
+  strip.setCursor(0,0);
+  size_t len = strnlen(text,tickerTextMax);
+  strip.write((const uint8_t*)text,len);
+  textWidth = len*tickerCharWidth;
+}
+
+// Draws the window of the strip whose left edge is the strip column
+// start, the text centered vertically. start may be negative or past the
+// message, the columns without text get the background color.
+void textTicker::draw(virtualCanvas &canvas, int32_t start){
+  const uint16_t colors[2] = {background,color};
+  uint16_t line[canvasWidth];
+  int16_t top = (canvasHeight-tickerHeight)/2;
+  // Canvas columns the message covers
+  int32_t first = constrain(-start,(int32_t)0,(int32_t)canvasWidth);
+  int32_t last = constrain((int32_t)textWidth-start,first,(int32_t)canvasWidth);
+  const uint8_t *bits = strip.getBuffer();
+  for(int16_t y=0;y<canvasHeight;y++){
+    int32_t x = 0;
+    if(y>=top && y<top+tickerHeight){
+      const uint8_t *row = &bits[(y-top)*tickerRowBytes];
+      for(;x<first;x++){
+        line[x] = background;
+      }
+      // The top bit of byte is the pixel at column col
+      uint32_t col = start+x;
+      uint8_t byte = x<last ? row[col>>3] << (col&7) : 0;
+      for(;x<last;x++,col++){
+        if((col&7)==0){
+          byte = row[col>>3];
+        }
+        line[x] = colors[byte>>7];
+        byte <<= 1;
+      }
+    }
+    for(;x<canvasWidth;x++){
+      line[x] = background;
+    }
+    canvas.writeRow(y,line);
+  }
+}
@@ -0,0 +1,43 @@
+/*
+ Arrangement of the HUB75 panels making up the display. The panels are
+ chained into one long strip (what Protomatter drives), the virtual
+ canvas (see virtualCanvas.h) maps the logical picture onto it.
+ Everything can be changed with build flags, e.g. a 2x2 arrangement:
+ -DpanelsAcross=2 -DpanelsDown=2 -DpanelSerpentine=true
+*/
+#pragma once
+
+// Size of a single panel as wired, in pixels
+#ifndef panelWidth
+#define panelWidth 64
+#endif
+#ifndef panelHeight
+#define panelHeight 32
+#endif
+// Panels of the logical picture, left to right and top to bottom
+#ifndef panelsAcross
+#define panelsAcross 1
+#endif
+#ifndef panelsDown
+#define panelsDown 1
+#endif
+// The chain starts at the top left panel and goes along each row. With a
+// serpentine chain every other row runs back right to left, those panels
+// are mounted upside down.
+#ifndef panelSerpentine
+#define panelSerpentine false
+#endif
+// Quarter turns clockwise every panel is mounted with (0 to 3)
+#ifndef panelRotation
+#define panelRotation 0
+#endif
+
+#define panelCount (panelsAcross*panelsDown)
+// Length of the chain as Protomatter sees it
+#define chainWidth (panelWidth*panelCount)
+// Size of each panel in the logical picture
+#define panelTileWidth ((panelRotation & 1) ? panelHeight : panelWidth)
+#define panelTileHeight ((panelRotation & 1) ? panelWidth : panelHeight)
+// Size of the logical picture
+#define canvasWidth (panelTileWidth*panelsAcross)
+#define canvasHeight (panelTileHeight*panelsDown)
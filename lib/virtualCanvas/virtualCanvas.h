@@ -0,0 +1,120 @@
+/*
+ Logical picture spread over the chained panels of panelLayout.h. Every
+ logical row crosses panelsAcross panels, and inside a panel it is a
+ straight line of the matrix buffer whatever the rotation, so it is
+ kept as one run per panel: the buffer index of its first pixel and the
+ distance to the next one. The runs are worked out once, renderers then
+ copy whole rows with a single add per pixel.
+ It is also a GFX surface, for drawing text and shapes in logical
+ coordinates (slower, pixel by pixel).
+*/
+#pragma once
+#include <Arduino.h>
+#include <Adafruit_Protomatter.h>
+#include <panelLayout.h>
+
+// Part of a logical row that falls on one panel, panelTileWidth pixels
+struct canvasRun{
+  uint32_t start; // Index of the first pixel in the matrix buffer
+  int32_t step; // Index distance to the next pixel
+};
+
+class virtualCanvas : public Adafruit_GFX{
+  private:
+    Adafruit_Protomatter *matrix;
+    canvasRun runs[canvasHeight][panelsAcross];
+    bool direct = true; // Logical and matrix buffer layouts are the same
+
+    static uint32_t physicalIndex(uint16_t x, uint16_t y);
+
+  public:
+    virtualCanvas(Adafruit_Protomatter *disp);
+    // Runs of a logical row, panelsAcross of them left to right
+    const canvasRun* rowRuns(int16_t y) { return runs[y]; }
+    bool isDirect() { return direct; }
+    uint16_t* buffer() { return matrix->getBuffer(); }
+    void writeRow(int16_t y, const uint16_t *pixels);
+    void drawPixel(int16_t x, int16_t y, uint16_t color) override;
+    void fillScreen(uint16_t color) override;
+};
+
+// Works out the run of every logical row on every panel
+virtualCanvas::virtualCanvas(Adafruit_Protomatter *disp) : Adafruit_GFX(canvasWidth,canvasHeight){
+  matrix = disp;
+  for(uint16_t y=0;y<canvasHeight;y++){
+    for(uint16_t tile=0;tile<panelsAcross;tile++){
+      uint16_t x = tile*panelTileWidth;
+      runs[y][tile].start = physicalIndex(x,y);
+      runs[y][tile].step = (int32_t)physicalIndex(x+1,y)-(int32_t)runs[y][tile].start;
+      if(runs[y][tile].start!=(uint32_t)y*chainWidth+x || runs[y][tile].step!=1){
+        direct = false;
+      }
+    }
+  }
+}
+
+// Index in the matrix buffer of the logical pixel (x,y)
+uint32_t virtualCanvas::physicalIndex(uint16_t x, uint16_t y){
+  uint16_t tileX = x/panelTileWidth;
+  uint16_t tileY = y/panelTileHeight;
+  uint16_t tx = x%panelTileWidth;
+  uint16_t ty = y%panelTileHeight;
+  uint16_t panel = tileY*panelsAcross+tileX;
+  uint8_t rotation = panelRotation & 3;
+  if(panelSerpentine && (tileY & 1)){
+    // Runs back along the row, upside down
+    panel = tileY*panelsAcross+(panelsAcross-1-tileX);
+    rotation = (rotation+2) & 3;
+  }
+  uint16_t px, py; // Position on the panel as wired
+  switch(rotation){
+    case 1:
+      px = ty;
+      py = panelHeight-1-tx;
+      break;
+    case 2:
+      px = panelWidth-1-tx;
+      py = panelHeight-1-ty;
+      break;
+    case 3:
+      px = panelWidth-1-ty;
+      py = tx;
+      break;
+    default:
+      px = tx;
+      py = ty;
+      break;
+  }
+  return (uint32_t)py*chainWidth+panel*panelWidth+px;
+}
+
+// Copies a logical row of canvasWidth pixels into the matrix buffer
+void virtualCanvas::writeRow(int16_t y, const uint16_t *pixels){
+  uint16_t *out = matrix->getBuffer();
+  for(uint16_t tile=0;tile<panelsAcross;tile++){
+    const canvasRun &run = runs[y][tile];
+    uint16_t *dst = &out[run.start];
+    const uint16_t *src = &pixels[tile*panelTileWidth];
+    for(uint16_t x=0;x<panelTileWidth;x++){
+      *dst = src[x];
+      dst += run.step;
+    }
+  }
+}
+
+// GFX drawing in logical coordinates. The GFX rotation is not used, see
+// panelRotation.
+void virtualCanvas::drawPixel(int16_t x, int16_t y, uint16_t color){
+  if(x<0 || y<0 || x>=canvasWidth || y>=canvasHeight){
+    return;
+  }
+  const canvasRun &run = runs[y][x/panelTileWidth];
+  matrix->getBuffer()[run.start+(x%panelTileWidth)*run.step] = color;
+}
+
+void virtualCanvas::fillScreen(uint16_t color){
+  uint16_t *out = matrix->getBuffer();
+  for(uint32_t i=0;i<(uint32_t)chainWidth*panelHeight;i++){
+    out[i] = color;
+  }
+}
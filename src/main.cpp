@@ -8,6 +8,7 @@
 #include <Adafruit_Protomatter.h>
 #include <sdios.h>
 #include <string.h>
+#include <new> // Placement new, the matrix is re-created in place
 #include <SdFat.h> // Adafruit's Fork of SD
 
 // Error definition library
@@ -15,6 +16,23 @@
 
 // Bitmap reader and display library
 #include <bmpMatrixDisp.h>
+// Logical picture spread over the chained panels
+#include <virtualCanvas.h>
+// Receives live frames pushed by a client
+#include <frameStream.h>
+// Small previews of the bitmaps for the gallery of the app
+#include <thumbnailStore.h>
+// Last image shown, put back on the matrix first thing at boot
+#include <bootSnapshot.h>
+// Animations stored as one file of frames
+#include <animationPack.h>
+
+// Conway's game of life, shown in the simulation mode
+#include <simulation.h>
+// Scrolling text of the ticker mode
+#include <ticker.h>
+// Plasma, fire and starfield of the effects mode
+#include <effects.h>
 
 // Include the wifi library and cyw43 library for running
 // the wifi hardware.
@@ -22,16 +40,77 @@
 #include <SPI.h>
 #include <AsyncWebServer_RP2040W.h>
 
+// Non blocking logging into a RAM ring buffer, served at /API/log
+#include <logger.h>
+
+// Performance counters and histograms, served at /API/metrics
+#include <metrics.h>
+
+// Queues that hand the work of the web handlers to the render loop
+#include <commandQueue.h>
+
+// Reads the JSON bodies sent to the API
+#include <jsonLite.h>
+
 // Include the settings maager helper class to help save/retrive settings
 #include <settingsManager.h>
+// Slideshow list of images and the sector aligned writer used for uploads
+#include <playlist.h>
+#include <alignedWriter.h>
+// Deletes cleared folders in the background
+#include <folderReaper.h>
+// Paces the slideshow and the animation frames on deadlines
+#include <frameScheduler.h>
+// Streams files from the SD card to web clients
+#include <fileSender.h>
+// Finds the fastest SPI clock the SD card works at
+#include <sdClockTuner.h>
+// Decompresses uploads sent with a Content-Encoding
+#include <streamDecompressor.h>
+// Card paths joined in fixed buffers instead of on the heap
+#include <pathBuilder.h>
 
 // C definitions for the LED matrix and the simulation
-#define matrix_chain_width 64 // total matrix chain width (width of the array)
-#define bit_depth 6 // Number of bit depth of the color plane, higher = greater color fidelity
+#define matrix_chain_width chainWidth // total matrix chain width, see lib/virtualCanvas/panelLayout.h
 #define address_lines_num 4 // Number of address lines of the LED matrix
-#define double_buffered true // Makes animation smother if true, at the cost of twice the RAM usage
 // See Adafruits documentation for more details
 
+// Bit depth of the color planes (higher = greater color fidelity, lower =
+// faster refresh and less time in the Protomatter interrupt) and double
+// buffering (smoother animation, at the cost of twice the RAM) of each
+// mode. The matrix is re-created with them when the mode changes.
+// They can be changed with build flags, e.g. -DsimulationBitDepth=2
+#ifndef bitmapBitDepth
+#define bitmapBitDepth 6
+#endif
+#ifndef bitmapDoubleBuffered
+#define bitmapDoubleBuffered true
+#endif
+#ifndef animationBitDepth
+#define animationBitDepth 5
+#endif
+#ifndef animationDoubleBuffered
+#define animationDoubleBuffered true
+#endif
+#ifndef simulationBitDepth
+#define simulationBitDepth 3 // The cells are a single color
+#endif
+#ifndef simulationDoubleBuffered
+#define simulationDoubleBuffered false
+#endif
+#ifndef tickerBitDepth
+#define tickerBitDepth 3 // Text in a single color
+#endif
+#ifndef tickerDoubleBuffered
+#define tickerDoubleBuffered true // A half drawn frame shows as a tear in the text
+#endif
+#ifndef effectsBitDepth
+#define effectsBitDepth 5 // Smooth gradients
+#endif
+#ifndef effectsDoubleBuffered
+#define effectsDoubleBuffered true
+#endif
+
 // Arrays for the Raspberry Pi pinouts.
 // These are in GP number format, which is different from
 // the silkscreen numbers, please see the picos pinout diagram.
@@ -51,34 +130,58 @@ const uint8_t modeButton = 15; // GPIO of the mode button
 // GPIO 26 is unconnected and used as the seed for randomInit()
 
 // Definition of control settings for the LED matrix
-String matrixId = "IMP0001"; // Unique string identifier for the matrix
+const char* matrixId = "IMP0001"; // Unique string identifier for the matrix
 const int maxBrightness = 255;
 volatile uint8_t matrixBrigthness = 50; // should only be from 0 to 255 inclusive
-volatile uint8_t matrixMode = 1; // int representation of the current mode, 1:bitmap,2:animation,3:simulation
+volatile uint8_t matrixMode = 1; // int representation of the current mode, 1:bitmap,2:animation,3:simulation,4:ticker,5:effects
+// Values of matrixMode
+#define modeBitmap 1
+#define modeAnimation 2
+#define modeSimulation 3
+#define modeTicker 4
+#define modeEffects 5
+// Set by the render loop while frames pushed through /API/frame are shown
+volatile bool liveStreaming = false;
+// Changes every time a setting or the mode changes, used as the ETag of /API/state
+volatile uint32_t stateVersion = 1;
+// Random per boot, part of every ETag so tags from before a reboot never match
+uint32_t etagBoot = 0;
+// Changes every time a bitmap is written or the folder is cleared, used as
+// the ETag of the thumbnails. The playlist version doesn't change when a
+// file is uploaded again under the same name.
+volatile uint32_t bitmapContentVersion = 1;
 
 
 // SD card variables and instantiation
 // We will be using the FAT16/FAT32 and exFAT class for higher compatibility
 SdFat32 SD;         // SD card filesystem
-File32 file;
-File32 dir;
 const uint8_t SD_CS_PIN = 17; // For the our purposes GP 17 is the correct pin
 // File locations to be used for storing files
-String animationsFilePath = "animations";
-String bitmapFilePath =  "bitmaps";
-String jpegsFilepath =  "jpegs";
+const char* animationsFilePath = "animations";
+const char* bitmapFilePath = "bitmaps";
+const char* jpegsFilepath = "jpegs";
+const char* trashFilePath = "trash"; // Cleared folders wait here to be deleted
+const char* thumbnailFilePath = "thumbs"; // Thumbnails of the bitmaps
+const char* settingsFilePath = "settings.dat"; // Journal of the saved settings
+const char* snapshotFilePath = "boot.snap"; // Image shown at boot, see bootSnapshot.h
+const char* sdClockFilePath = "sdclock.dat"; // SPI clock tuned for the card, see sdClockTuner.h
+const char* sdTuneFilePath = "sdtune.tmp"; // Written and read back while tuning
 // SD card setup and pin definitions
 // The SD card is connected to the default SPI0 pins (16:?,17:CS,18:?,19:?)
-#define SD_CONFIG SdSpiConfig(SD_CS_PIN, DEDICATED_SPI, SD_SCK_MHZ(16)) // Can be changed up to 25 Mhz
+// It is mounted at a clock every card works at, then at the one tuned for it
+#define SD_CONFIG SdSpiConfig(SD_CS_PIN, DEDICATED_SPI, SD_SCK_MHZ(sdClockSafeMhz))
+sdClockTuner sdClock(&SD,SD_CS_PIN);
 
 // Wifi variable definitions
 // Sets the value of the static IP address of the pico.
 IPAddress gatewayIP(192,168,128,1);
 // Set AsyncServer to serve listen on port 80
 AsyncWebServer    server(80);
-// Set the Buffer size for files sent and read by the async
-// wifi routines
-#define BUFFER_SIZE         64
+// Files sent through /files/... at the same time, each one has a
+// buffer of fileSenderBufferSize bytes
+#define fileSendersMax 2
+// Time the render loop spends reading files to send per slice, in microseconds
+#define fileSendBudgetMicros 2000
 // Set the gateway SSID and password (hardcoded for now)
 const char* gatewaySSID = "Imp's Matrix";
 const char* gatewayPassword = "matrix12345";
@@ -87,10 +190,10 @@ const char uploadPage[] PROGMEM = R"rawliteral(
 <!DOCTYPE html>
 <html>
   <body>
-    <h2>Upload a File</h2>
+    <h2>Upload Files</h2>
     <form method="POST" action="/bitmaps" enctype="multipart/form-data">
-      <input type="file" name="file" /><br><br>
-      <input type="submit" value="Upload Bitmap">
+      <input type="file" name="file" multiple /><br><br>
+      <input type="submit" value="Upload Bitmaps">
     </form>
   </body>
 </html>
@@ -99,32 +202,477 @@ const char uploadPage[] PROGMEM = R"rawliteral(
 // Variables to control the image slideshow
 // Controls the delay between images of the slideshow
 int slideShowDelay = 1000;
+// Delay between the frames of the animation mode
+int animationFrameDelay = 100;
+// Time between generations of the simulation mode
+#define simulationStepMillis 100
+// The simulation is restarted when fewer cells than this change
+#define simulationMinUpdates 35
+// Shortest time between the frames of the ticker mode (60 fps)
+#define tickerFrameMillis 16
+// Scrolling speed limits of the ticker, in pixels per second
+#define tickerSpeedMin 1
+#define tickerSpeedMax 240
+// Time between the frames of the effects mode (60 fps)
+#define effectFrameMillis 16
+// Time an effect may take to draw a frame, the rest of the frame is left
+// for showing it and the background work. Slower frames are counted.
+#ifndef effectBudgetMicros
+#define effectBudgetMicros 8000
+#endif
+
+// Ticker message as the API reports it
+char tickerMessage[tickerTextMax+1] = "Imp's LED Matrix!";
+uint32_t tickerColor = 0xFFFFFF; // 0xRRGGBB
+int tickerSpeed = 30; // Pixels per second
+// Message on its way to the render loop. The web side only writes it
+// while no message is pending, the render loop clears the flag once it
+// has drawn the message into the ticker strip.
+char tickerPosted[tickerTextMax+1];
+volatile bool tickerPending = false;
+
+// Effect as the API reports it, see proceduralEffects::setParameters()
+uint8_t effectChoice = effectPlasma;
+uint8_t effectSpeed = 128;
+uint8_t effectScale = 128;
+
+// Settings as the render loop uses them. The variables above are what the
+// API reports, the web handlers send their changes here through the
+// command queue so they take effect between frames.
+struct renderSettings{
+  uint8_t brightness = 50;
+  int slideShowDelay = 1000;
+  uint8_t mode = modeBitmap;
+  uint32_t tickerColor = 0xFFFFFF;
+  int tickerSpeed = 30;
+} render;
 
 
 // For details on the constructor arguments please see:
 // https://learn.adafruit.com/adafruit-matrixportal-m4/protomatter-arduino-library
 Adafruit_Protomatter matrix(
-  matrix_chain_width, bit_depth, 1, rgbPins, 
+  matrix_chain_width, bitmapBitDepth, 1, rgbPins, 
   address_lines_num, addrPins, clockPin, latchPin, 
-  oePin, double_buffered);
+  oePin, bitmapDoubleBuffered);
+
+// Configuration the matrix was created with
+struct matrixConfig{
+  uint8_t bitDepth;
+  bool doubleBuffered;
+};
+matrixConfig matrixCurrent = {bitmapBitDepth,bitmapDoubleBuffered};
+// A mode switch whose configuration failed to start keeps the one before,
+// and isn't tried again for matrixRetryMillis
+bool matrixRunning = true; // False if not even the one before started again
+bool matrixFailed = false;
+uint32_t matrixFailedMillis = 0;
+#define matrixRetryMillis 10000
+
+// Optional temporal dithering of the images down to the bit depth of the
+// matrix, it shows the levels in between as a pattern that moves on with
+// every refresh of the panels (see bmpImageDisp::drawFrame). Costs a
+// redraw per refresh while an image is shown. Off by default, e.g.
+// -DimageDither=true -DbitmapBitDepth=5 gets 6 bits out of 5 bit planes.
+#ifndef imageDither
+#define imageDither false
+#endif
+
+// Most current the panels may draw, in milliamps (0 for no limit).
+// Images that would draw more are shown dimmer, the current is estimated
+// from the pixels written and the current of a panel showing full white.
+#ifndef powerBudgetMilliamps
+#define powerBudgetMilliamps 3000
+#endif
+#ifndef panelWhiteMilliamps
+#define panelWhiteMilliamps 4000
+#endif
+
+// Everything is drawn in logical coordinates through the canvas, which
+// maps them onto the panel arrangement
+virtualCanvas canvas(&matrix);
+
+// Game of life shown in the simulation mode
+ConwaysGame lifeGame(&canvas);
+uint32_t lifeCellsUpdated = 0; // Cells changed by the last generation
+uint8_t lastLoopMode = 0; // Mode the loop ran last, to detect mode changes
+
+// Message scrolled by the ticker mode
+textTicker ticker;
+uint32_t tickerStartMillis = 0; // Time the message entered the matrix
+int32_t tickerShown = 0; // Strip column on the left edge of the matrix
+uint16_t tickerShownColor = 0; // Color the message was drawn with
+bool tickerRedraw = true; // The next frame must be drawn even if it didn't move
+
+// Generated content of the effects mode
+proceduralEffects effects(&canvas);
+uint32_t effectFrameStart = 0; // Time the last effect frame was drawn
+uint32_t effectPaletteKey = 0xFFFFFFFF; // Effect, brightness and depth of the palette
+
+// Decoded images kept in RAM, filled on first display or while uploading
+frameCache imageCache;
 
 // Instantiate Bitmap reader class
-bmpImageDisp bmpImageDisplay(&SD,false);
+bmpImageDisp bmpImageDisplay(&SD,&imageCache,&canvas,false);
+
+// Image on the matrix saved for the next boot. It is rewritten at most
+// this often (in milliseconds) so a fast slideshow doesn't wear the card
+bootSnapshot snapshot(&SD);
+#define snapshotIntervalMillis 30000
+uint32_t snapshotMillis = 0; // Time of the last snapshot
+char snapshotImage[frameCachePathLen] = ""; // Image in the last snapshot
+
+// Deletes the contents of cleared folders a few files at a time
+folderReaper trashReaper(&SD);
+// Time the trash reaper may use each time it runs, in microseconds
+#define reaperBudgetMicros 2000
+// Most log bytes sent to the serial port per background slice
+#define logDrainBytes 64
+
+// Live frames pushed by a client through /API/frame
+frameStream liveFrames;
+AsyncWebServerRequest* frameOwner = NULL; // Request whose frame is being received
+int frameResult = 200; // Result of the last frame received by frameOwner
+// The stream ends when no frame arrives for this long
+#define streamTimeoutMillis 3000
+
+// Deadlines of the images of the slideshow and the animation
+frameScheduler imagePace;
+
+// Images shown by the slideshow, read from the bitmap folder
+playlist bitmapPlaylist;
+// Frames of the animation mode, read from the animations folder. Its
+// entries are single images or animation packs played through.
+playlist animationPlaylist;
+// Animation pack being played, see animationPack.h
+animationPack animationFrames(&SD);
+// Thumbnails of the bitmaps, made on first request and kept on the SD card
+thumbnailStore thumbnails(&SD);
+
+// JSON listing of the bitmap folder, serialized once per playlist version
+// FAT names can't hold quotes or backslashes so they need no escaping
+#define bitmapListingMax (playlistMaxEntries*(playlistNameLen+3)+64)
+char bitmapListing[bitmapListingMax];
+size_t bitmapListingLen = 0;
+uint32_t bitmapListingVersion = 0;
+bool bitmapListingValid = false;
+
+// Small request bodies (JSON) are gathered here until they are complete
+#define requestBodyMax 256
+struct requestBody{
+  AsyncWebServerRequest *owner = NULL;
+  char data[requestBodyMax];
+  size_t len = 0;
+  bool tooLarge = false;
+} apiBody;
+
+// Work the web handlers hand to the render loop, which owns the SD card
+// and the matrix. See applyCommands().
+enum commandType : uint8_t {
+  cmdSettings,     // args: brightness, slideshow delay, mode
+  cmdUploadBegin,  // A new upload request starts, args: content encoding of its files
+  cmdUploadFile,   // A new file starts, name: file name, text: folder
+  cmdUploadData,   // args[0]: bytes of the file waiting in uploadData
+  cmdUploadEnd,    // The file is complete
+  cmdUploadDone,   // The request is complete, args[0]: status found by the web side, text: its message
+  cmdUploadAbort,  // The client went away
+  cmdClearBitmaps, // Empty the bitmap folder
+  cmdThumbnail,    // Send the thumbnail of the image in name
+  cmdSendFile,     // Send the file at the path in name, args: range kind, first, last (see handleFiles)
+  cmdTicker,       // New ticker settings, text: message (see tickerPosted) or NULL, args: color, speed
+  cmdSdTune,       // Tune the SD clock again and answer with the results
+  cmdEffects       // New effect settings, args: effect, speed, scale
+};
+#define commandNameLen 64
+struct matrixCommand{
+  commandType type;
+  int8_t reply = -1; // Request to answer, see holdReply(), -1 if none
+  int32_t args[3] = {};
+  const char* text = NULL;
+  char name[commandNameLen] = "";
+};
+#define commandQueueSize 32
+commandQueue<matrixCommand,commandQueueSize> commands;
+// Commands that can wait leave this many slots free, so the end of an
+// upload can always be queued
+#define commandReserve 2
+// Uploaded data on its way to the SD card
+#define uploadBufferSize 16384
+byteQueue<uploadBufferSize> uploadData;
+// Time the render loop spends on commands per slice, in microseconds
+#define commandBudgetMicros 4000
+// Requests answered by the render loop once their command is done
+#define heldRepliesMax 8
+AsyncWebServerRequest* volatile heldReplies[heldRepliesMax];
+
+// Files being sent to web clients, filled by the render loop
+fileSender fileSenders[fileSendersMax];
+
+// Web side of the upload in progress. Only one upload request is handled
+// at a time, but a request can carry several files (multipart parts)
+struct uploadRequest{
+  AsyncWebServerRequest *owner = NULL; // Request being received, NULL if idle
+  AsyncWebServerRequest *rejected = NULL; // Last request turned away while busy
+  int8_t reply = -1; // Held reply of the owner
+  int status = 200; // Failure found by the web side
+  const char* message = "";
+} uploadWeb;
+
+// Render loop side of the upload, writing the files to the SD card
+struct uploadSession{
+  alignedWriter writer; // File being written
+  // Bitmaps are converted into the cache as they arrive so they can be
+  // shown without reading them back
+  bmpStreamDecoder decoder;
+  uint16_t* frame = NULL; // Cache frame being filled, NULL if none
+  // Files of the request are compressed with this format (Content-Encoding)
+  decompressFormat encoding = decompressNone;
+  streamDecompressor decompressor;
+  bool bitmapFolder = false;
+  char fileName[playlistNameLen];
+  char filePath[100];
+  uint16_t filesDone = 0;
+  int status = 200;
+  const char* message = "";
+  uint32_t startMicros = 0; // Used to measure the upload throughput
+  uint32_t bytes = 0; // As received, compressed or not
+} upload;
+
+// Performance metrics, see /API/metrics
+// All times are in microseconds
+metricHistogram decodeTime("matrix_decode_microseconds","Time to read and decode an image that was not cached");
+metricHistogram showTime("matrix_show_microseconds","Time spent in matrix.show()");
+metricHistogram composeTime("matrix_compose_microseconds","Time to draw an image into the matrix buffer");
+metricHistogram frameSlack("matrix_frame_slack_microseconds","Time left before an image was due once it was ready");
+metricCounter framesLate("matrix_frames_late_total","Images that were ready after they were due");
+metricHistogram packReadTime("animation_frame_read_microseconds","Time to read a frame of an animation pack");
+metricHistogram sdReadCalls("sd_read_calls_per_frame","SD card reads needed to show a frame");
+metricHistogram sdReadBytes("sd_read_bytes_per_frame","Bytes read from the SD card to show a frame");
+metricCounter framesShown("matrix_frames_total","Frames shown on the matrix");
+metricCounter uploadBytes("upload_bytes_total","Bytes received by file uploads");
+metricHistogram uploadRate("upload_bytes_per_second","Throughput of each upload request");
+metricGauge freeHeap("heap_free_bytes","Free heap when the metrics were read");
+metricGauge freeHeapLow("heap_free_low_bytes","Lowest free heap seen by the background tasks");
+metricGauge heapUsedHigh("heap_used_high_bytes","Most heap ever in use");
+metricCounter heapGrowth("heap_high_water_raises_total","Times the heap in use went past its high water mark after boot");
+bool heapBaselineTaken = false; // Set at the end of setup
+metricGauge cachedImages("image_cache_frames","Images kept decoded in RAM");
+metricGauge cachedImageBytes("image_cache_bytes","RAM taken by the images kept decoded");
+metricGauge stackUsed("stack_high_water_bytes","Most stack ever used on core 0");
+metricGauge sdClockMhz("sd_clock_mhz","SPI clock the SD card runs at");
+metricGauge matrixBitDepth("matrix_bit_depth","Bit depth the matrix is refreshed at");
+metricGauge frameCurrent("matrix_current_milliamps","Estimated current of the last image drawn");
+metricHistogram effectRenderTime("effect_render_microseconds","Time to draw a frame of the effects mode");
+metricCounter effectOverBudget("effect_frames_over_budget_total","Effect frames that took longer than effectBudgetMicros to draw");
+metricCounter powerLimited("matrix_power_limited_frames_total","Images drawn dimmer to stay under the current budget");
+// Handler latency of every route, must stay together (same metric name)
+metricHistogram routeRoot("http_handler_microseconds","Time spent in the request handler","route=\"/\"");
+metricHistogram routeUpload("http_handler_microseconds","","route=\"/bitmaps\"");
+metricHistogram routeAnimations("http_handler_microseconds","","route=\"/animations\"");
+metricHistogram routeId("http_handler_microseconds","","route=\"/API/id\"");
+metricHistogram routeBrightness("http_handler_microseconds","","route=\"/API/brightness\"");
+metricHistogram routeDelete("http_handler_microseconds","","route=\"/API/delete/bitmaps\"");
+metricHistogram routeDelay("http_handler_microseconds","","route=\"/API/slideshowdelay\"");
+metricHistogram routeState("http_handler_microseconds","","route=\"/API/state\"");
+metricHistogram routeBitmaps("http_handler_microseconds","","route=\"/API/bitmaps\"");
+metricHistogram routeThumbnails("http_handler_microseconds","","route=\"/API/thumbnails\"");
+metricHistogram routeFrame("http_handler_microseconds","","route=\"/API/frame\"");
+metricHistogram routeMetrics("http_handler_microseconds","","route=\"/API/metrics\"");
+metricHistogram routeLog("http_handler_microseconds","","route=\"/API/log\"");
+metricHistogram routeFiles("http_handler_microseconds","","route=\"/files\"");
+metricHistogram routeTicker("http_handler_microseconds","","route=\"/API/ticker\"");
+metricHistogram routeSd("http_handler_microseconds","","route=\"/API/sd\"");
+metricHistogram routeEffects("http_handler_microseconds","","route=\"/API/effects\"");
 
 // Create a Serial output stream.
 ArduinoOutStream cout(Serial);
 
 // Create the settings manager class
-settingsManager settingsFile;
+settingsManager settingsFile(&SD);
 
 //~~~~~~~~~~ Wifi Server Helper Functions~~~~~~~~~~~~~~~~~~~~~
+// Logs the request headers, only when debug logging is built in
 void printHttpHeaders(AsyncWebServerRequest *request){
+#if logLevel >= logLevelDebug
+    if(!logEnabled(logLevelDebug,logModuleWeb)){
+      return;
+    }
     int headers = request->headers();
     int i;
     for(i=0;i<headers;i++){
       AsyncWebHeader* h = request->getHeader(i);
-      Serial.printf("HEADER[%s]: %s\n", h->name().c_str(), h->value().c_str());
+      logDebug(logModuleWeb,"HEADER[%s]: %s", h->name().c_str(), h->value().c_str());
+    }
+#else
+    (void)request;
+#endif
+}
+
+// Value of the request header or NULL if it wasn't sent. The library's
+// own lookups build a String from the name on every call.
+const char* findHeader(AsyncWebServerRequest *request, const char *name){
+  for(size_t i=0;i<request->headers();i++){
+    AsyncWebHeader *h = request->getHeader(i);
+    if(strcasecmp(h->name().c_str(),name)==0){
+      return h->value().c_str();
+    }
+  }
+  return NULL;
+}
+
+// Same for a parameter of the query string
+const char* findParam(AsyncWebServerRequest *request, const char *name){
+  for(size_t i=0;i<request->params();i++){
+    AsyncWebParameter *p = request->getParam(i);
+    if(!p->isPost() && !p->isFile() && strcmp(p->name().c_str(),name)==0){
+      return p->value().c_str();
+    }
+  }
+  return NULL;
+}
+
+// Marks that a setting or the mode changed, so clients polling
+// /API/state get the new values
+void stateChanged(){
+  // Both the web side and the render loop change the state
+  noInterrupts();
+  stateVersion++;
+  interrupts();
+}
+
+// Queues a command for the render loop, from the web side.
+// Commands that can wait (reserve true) leave room for the critical ones.
+// Returns false if the queue is full.
+bool postCommand(const matrixCommand &command, bool reserve){
+  if(reserve && commands.space()<=commandReserve){
+    return false;
+  }
+  return commands.push(command);
+}
+
+// Sends the settings as the API sees them to the render loop
+bool postSettings(){
+  matrixCommand command;
+  command.type = cmdSettings;
+  command.args[0] = matrixBrigthness;
+  command.args[1] = slideShowDelay;
+  command.args[2] = matrixMode;
+  return postCommand(command,true);
+}
+
+// Forgets a held request whose client went away. A request can only have
+// one disconnect handler, handlers set after holdReply() must call this.
+void heldReplyGone(AsyncWebServerRequest *request, int8_t slot){
+  // The request is gone, it must not be answered anymore
+  if(heldReplies[slot]==request){
+    heldReplies[slot] = NULL;
+  }
+  // An upload cut short is cleaned up by the render loop
+  if(uploadWeb.owner==request){
+    uploadWeb.owner = NULL;
+    matrixCommand command;
+    command.type = cmdUploadAbort;
+    postCommand(command,false);
+  }
+}
+
+// Keeps the request open so the render loop can answer it once its
+// command is done. Returns the reply slot or -1 if too many are waiting.
+int8_t holdReply(AsyncWebServerRequest *request){
+  for(int8_t i=0;i<heldRepliesMax;i++){
+    if(heldReplies[i]==NULL){
+      heldReplies[i] = request;
+      request->onDisconnect([request,i](){
+        heldReplyGone(request,i);
+      });
+      return i;
     }
+  }
+  return -1;
+}
+
+// Returns the held request so the render loop can answer it, or NULL if
+// the client went away. The network stack stays locked until
+// endHeldReply(), which must be called if a request was returned.
+AsyncWebServerRequest* beginHeldReply(int8_t slot){
+  if(slot<0){
+    return NULL;
+  }
+  cyw43_arch_lwip_begin();
+  AsyncWebServerRequest *request = heldReplies[slot];
+  if(request==NULL){
+    cyw43_arch_lwip_end();
+  }
+  return request;
+}
+
+// Frees the reply slot and unlocks the network stack
+void endHeldReply(int8_t slot){
+  heldReplies[slot] = NULL;
+  cyw43_arch_lwip_end();
+}
+
+// Answers a held request with a text response, from the render loop
+void sendHeldReply(int8_t slot, int status, const char *text){
+  AsyncWebServerRequest *request = beginHeldReply(slot);
+  if(request!=NULL){
+    request->send(status,"text/plain",text);
+    endHeldReply(slot);
+  }
+}
+
+// Writes the quoted ETag of the version of a resource into tag
+void makeETag(char *tag, size_t len, uint32_t version){
+  snprintf(tag,len,"\"%08lx-%lu\"",(unsigned long)etagBoot,(unsigned long)version);
+}
+
+// Answers 304 if the client already has this version of the resource.
+// Returns true if the request was answered.
+bool sendNotModified(AsyncWebServerRequest *request, const char *etag){
+  const char *match = findHeader(request,"If-None-Match");
+  if(match==NULL || strcmp(match,etag)!=0){
+    return false;
+  }
+  AsyncWebServerResponse *response = request->beginResponse(304);
+  response->addHeader("ETag",etag);
+  request->send(response);
+  return true;
+}
+
+// Gathers the body of an API request into apiBody, it is complete when
+// the request handler runs. Bodies that don't fit are flagged.
+void collectApiBody(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total){
+  if(index==0){
+    apiBody.owner = request;
+    apiBody.len = 0;
+    apiBody.tooLarge = total>=requestBodyMax;
+  }
+  if(apiBody.owner!=request || apiBody.tooLarge){
+    return;
+  }
+  memcpy(&apiBody.data[apiBody.len],data,len);
+  apiBody.len += len;
+  apiBody.data[apiBody.len] = '\0';
+}
+
+// Returns the complete body of the request or NULL if there is none
+// (or it was too large). Must be called from the request handler.
+const char* takeApiBody(AsyncWebServerRequest *request){
+  if(apiBody.owner!=request){
+    return NULL;
+  }
+  apiBody.owner = NULL;
+  if(apiBody.tooLarge){
+    return NULL;
+  }
+  return apiBody.data;
+}
+
+// Wraps a request handler so its run time is recorded in the histogram
+ArRequestHandlerFunction timed(ArRequestHandlerFunction handler, metricHistogram &histogram){
+  return [handler,&histogram](AsyncWebServerRequest *request){
+    metricTimer timer(histogram);
+    handler(request);
+  };
 }
 
 //~~~~~~~~~~ Declaration of WiFi callback functions~~~~~~~~~~~~
@@ -139,9 +687,7 @@ void handleRoot(AsyncWebServerRequest *request)
 void handleAPIMatrixId(AsyncWebServerRequest *request){
     // Filter out GET requests (data being sent to client)
     if(request->method() == WebRequestMethod::HTTP_GET){
-      char strBuff[50];
-      matrixId.toCharArray(strBuff,50);
-      request->send(200,"text/plain",strBuff);
+      request->send(200,"text/plain",matrixId);
     }
 
 }
@@ -162,23 +708,31 @@ void handleAPIMatrixBrightness(AsyncWebServerRequest *request){
       // The PUT request must have a header named "Brightness" that 
       // contains the brightness value of the LED from 0 to 255
       const char* headerName = "Brightness";
-      if(request->hasHeader(headerName)){
-        Serial.println(request->getHeader(headerName)->toString());
-        if(request->header(headerName).length()>3){
+      const char *value = findHeader(request,headerName);
+      if(value!=NULL){
+        logDebug(logModuleWeb,"%s: %s",headerName,value);
+        if(strlen(value)>3){
           snprintf(strBuff,50,"Brightness too large");
           request->send(400,"text/plain",strBuff);
           return;
         }
-        int tempBrigthness = atoi(request->header("Brightness").c_str());
+        int tempBrigthness = atoi(value);
         if(tempBrigthness>maxBrightness || tempBrigthness<0){
           snprintf(strBuff,50,"Illegal brightness value");
           request->send(400,"text/plain",strBuff);
           return;
         }
         
-        // Set all the brightness settings here
+        // Set all the brightness settings here, the render loop
+        // applies them before its next frame
+        uint8_t oldBrigthness = matrixBrigthness;
         matrixBrigthness = tempBrigthness;
-        bmpImageDisplay.setBrightness(matrixBrigthness);
+        if(!postSettings()){
+          matrixBrigthness = oldBrigthness;
+          request->send(503,"text/plain","Matrix is busy");
+          return;
+        }
+        stateChanged();
       }
       snprintf(strBuff,50,"%i",matrixBrigthness);
       request->send(200,"text/plain",strBuff);
@@ -205,14 +759,15 @@ void handleAPIMatrixSlideShowDelay(AsyncWebServerRequest *request){
       // contains the brightness value of the LED in milliseconds
       // up to 5 digits
       const char* headerName = "Delay";
-      if(request->hasHeader(headerName)){
-        Serial.println(request->getHeader(headerName)->toString());
-        if(request->header(headerName).length()>5){
+      const char *value = findHeader(request,headerName);
+      if(value!=NULL){
+        logDebug(logModuleWeb,"%s: %s",headerName,value);
+        if(strlen(value)>5){
           snprintf(strBuff,50,"Delay too large");
           request->send(400,"text/plain",strBuff);
           return;
         }
-        int tempDelay = atoi(request->header("Delay").c_str());
+        int tempDelay = atoi(value);
         if(tempDelay<0){
           snprintf(strBuff,50,"Illegal delay value");
           request->send(400,"text/plain",strBuff);
@@ -220,142 +775,1340 @@ void handleAPIMatrixSlideShowDelay(AsyncWebServerRequest *request){
         }
         
         // Set all delay values here
+        int oldDelay = slideShowDelay;
         slideShowDelay = tempDelay;
+        if(!postSettings()){
+          slideShowDelay = oldDelay;
+          request->send(503,"text/plain","Matrix is busy");
+          return;
+        }
+        stateChanged();
       }
       snprintf(strBuff,50,"%i",slideShowDelay);
       request->send(200,"text/plain",strBuff);
     }
 
 }
-// Handles the API callback to delete all images in the animation
+// Handles 404 errors
+void handleNotFound(AsyncWebServerRequest *request)
+{
+	char message[256];
+	size_t len = snprintf(message, sizeof(message), "File Not Found\n\nURI: %s\nMethod: %s\nArguments: %u\n",
+	                      request->url().c_str(), (request->method() == HTTP_GET) ? "GET" : "POST", (unsigned)request->args());
+	for (uint8_t i = 0; i < request->args() && len < sizeof(message); i++)
+	{
+		len += snprintf(&message[len], sizeof(message) - len, " %s: %s\n", request->argName(i).c_str(), request->arg(i).c_str());
+	}
+	request->send(404, "text/plain", message);
+}
+
+// Removes the boot snapshot if it shows the image, or whatever image it
+// shows if imagePath is NULL. Called before the image is written again
+// or deleted, so the next boot doesn't show what was there before.
+void forgetSnapshot(const char *imagePath){
+  if(imagePath!=NULL && strcmp(imagePath,snapshotImage)!=0){
+    return;
+  }
+  snapshotImage[0] = '\0';
+  snapshot.remove();
+}
+
+// Ends the upload session, closing any file left half written
+// Render loop side
+void endUploadSession(){
+  if(upload.writer.isOpen()){
+    upload.writer.abort();
+    SD.remove(upload.filePath);
+  }
+  if(upload.frame!=NULL){
+    imageCache.abortFill();
+    upload.frame = NULL;
+  }
+  // Every file that finished uploading becomes visible at once
+  bitmapPlaylist.publish();
+  if(upload.bitmapFolder){
+    // Thumbnails asked for while the files were written are stale
+    bitmapContentVersion++;
+  }
+  if(upload.status==200 && upload.bytes>0){
+    uint32_t elapsed = micros()-upload.startMicros;
+    uploadRate.record(elapsed==0 ? upload.bytes : (uint64_t)upload.bytes*1000000/elapsed);
+  }
+  if(upload.filesDone>0 && !upload.bitmapFolder){
+    animationPlaylist.markDirty();
+  }
+}
+
+// Marks the upload as failed, the rest of the request is ignored
+// Render loop side
+void failUpload(int status, const char* message){
+  logWarn(logModuleUpload,"%s",message);
+  upload.status = status;
+  upload.message = message;
+  if(upload.writer.isOpen()){
+    upload.writer.abort();
+    SD.remove(upload.filePath);
+  }
+  if(upload.frame!=NULL){
+    imageCache.abortFill();
+    upload.frame = NULL;
+  }
+}
+
+// Starts writing the next file of the request into the folder
+// Render loop side
+void startUploadFile(const char *folder, const char *fileName){
+  strncpy(upload.fileName,fileName,sizeof(upload.fileName));
+  snprintf(upload.filePath,sizeof(upload.filePath),"/%s/%s",folder,upload.fileName);
+  upload.bitmapFolder = strcmp(bitmapFilePath,folder)==0;
+  logDebug(logModuleUpload,"%s",upload.filePath);
+  if(!upload.bitmapFolder){
+    // The pack being played may be the file rewritten, it is opened
+    // again from the next playlist entry
+    animationFrames.close();
+  }
+  // The boot snapshot may show the file that is rewritten
+  pathBuilder imagePath(folder,upload.fileName);
+  forgetSnapshot(imagePath.c_str());
+
+  if(!upload.writer.open(upload.filePath)){
+    failUpload(500,"File failed to be opened");
+    return;
+  }
+  if(upload.encoding!=decompressNone){
+    upload.decompressor.begin(upload.encoding);
+  }
+
+  // Bitmaps are decoded into the image cache while they are uploaded
+  upload.frame = NULL;
+  if(upload.bitmapFolder){
+    thumbnails.invalidate(upload.fileName);
+    bitmapContentVersion++;
+    pathBuilder cacheKey(bitmapFilePath,upload.fileName);
+    upload.frame = cacheKey.length()<frameCachePathLen ? imageCache.beginFill(cacheKey.c_str()) : NULL;
+    if(upload.frame!=NULL){
+      upload.decoder.begin(upload.frame,frameWidth,frameHeight);
+    }
+  }
+}
+
+// Writes file data to the card and the image cache
+// Render loop side
+void storeUploadData(const uint8_t *data, uint32_t len){
+  if(!upload.writer.write(data,len)){
+    failUpload(500,"File failed to be written");
+  }else if(upload.frame!=NULL && upload.decoder.feed(data,len)!=bmpDecodeOk){
+    // A decoding error only means the image won't be cached, the
+    // file itself is still stored
+    imageCache.abortFill();
+    upload.frame = NULL;
+  }
+}
+
+// Marks the upload as failed because of a broken compressed file
+// Render loop side
+void failDecompression(decompressStatus status){
+  if(status==decompressTooFar){
+    failUpload(413,"Compressed file needs a larger window");
+  }else if(status==decompressUnsupported){
+    failUpload(415,"Compressed file uses a preset dictionary");
+  }else{
+    failUpload(400,"Compressed file is corrupt");
+  }
+}
+
+// Decompresses data into the file, a window full at a time
+// Render loop side
+void storeCompressedData(const uint8_t *data, uint32_t len){
+  while(upload.status==200){
+    uint32_t used = upload.decompressor.feed(data,len);
+    data += used;
+    len -= used;
+    const uint8_t *out;
+    uint32_t outLen;
+    while(upload.status==200 && (outLen = upload.decompressor.output(&out))>0){
+      storeUploadData(out,outLen);
+      upload.decompressor.release(outLen);
+    }
+    if(upload.decompressor.getStatus()!=decompressOk){
+      failDecompression(upload.decompressor.getStatus());
+    }
+    if(len==0){
+      break;
+    }
+  }
+}
+
+// Writes the next len bytes of the upload buffer to the file
+// Render loop side
+void writeUploadData(uint32_t len){
+  while(len>0){
+    const uint8_t *data;
+    uint32_t piece = min(len,uploadData.peek(&data));
+    // Failed uploads still drain their data
+    if(upload.status==200){
+      if(upload.encoding!=decompressNone){
+        storeCompressedData(data,piece);
+      }else{
+        storeUploadData(data,piece);
+      }
+    }
+    uploadData.consume(piece);
+    upload.bytes += piece;
+    len -= piece;
+  }
+}
+
+// Finishes the file being written
+// Render loop side
+void finishUploadFile(){
+  if(upload.status!=200){
+    return;
+  }
+  if(upload.encoding!=decompressNone){
+    decompressStatus status = upload.decompressor.finish();
+    if(status!=decompressOk){
+      failDecompression(status);
+      return;
+    }
+    logDebug(logModuleUpload,"Decompressed to %lu bytes",(unsigned long)upload.decompressor.totalOut());
+  }
+  if(!upload.writer.close()){
+    failUpload(500,"File failed to be written");
+    return;
+  }
+  if(upload.frame!=NULL){
+    if(upload.decoder.finish()==bmpDecodeOk){
+      if(!imageCache.commitFill()){
+        logDebug(logModuleUpload,"No room to cache %s",upload.fileName);
+      }
+    }else{
+      imageCache.abortFill();
+    }
+    upload.frame = NULL;
+  }
+  if(upload.bitmapFolder && !bitmapPlaylist.stage(upload.fileName)){
+    // The file is stored, it just won't be part of the slideshow
+    logWarn(logModuleUpload,"Playlist is full");
+  }
+  upload.filesDone++;
+  logDebug(logModuleUpload,"File finished uploading!");
+}
+
+// Answers the upload request once all its files are written
+// Render loop side
+void finishUpload(const matrixCommand &command){
+  int status = upload.status;
+  const char *message = upload.message;
+  if(command.args[0]!=200){
+    // The web side turned the upload down
+    status = command.args[0];
+    message = command.text;
+  }
+  char strBuff[50];
+  if(status==200){
+    snprintf(strBuff,50,"%u file(s) succesfully uploaded",upload.filesDone);
+  }else{
+    snprintf(strBuff,50,"%s",message);
+  }
+  endUploadSession();
+  sendHeldReply(command.reply,status,strBuff);
+}
+
+// Marks the upload as failed on the web side, the rest of the request is
+// ignored and the failure is reported when it is done
+void rejectUpload(int status, const char *message){
+  logWarn(logModuleUpload,"%s",message);
+  uploadWeb.status = status;
+  uploadWeb.message = message;
+}
+
+// Handles the file parts of "/bitmaps" uploads
+// This function is CRITICAL for file upload
+// A request can carry any number of files. Their data is only copied into
+// the upload buffer here, the render loop writes it to the SD card and
+// adds the files to the playlist together once the request is done
+// (see handleUploadDone)
+// With "Content-Encoding: deflate" (zlib) or "lz4" (LZ4 frame) every
+// file part is compressed and the render loop decompresses it on the way
+// to the card, so only the compressed bytes cross the network.
+void onUpload(AsyncWebServerRequest *request, const String &filename, size_t index, uint8_t *data, size_t len, bool final){
+  // Only one upload request is handled at a time
+  if(uploadWeb.owner!=request){
+    if(uploadWeb.owner!=NULL){
+      uploadWeb.rejected = request;
+      return;
+    }
+    uploadWeb.status = 200;
+    uploadWeb.message = "";
+    // The file parts may be compressed, the multipart framing never is
+    int8_t encoding = decompressNone;
+    const char *coding = findHeader(request,"Content-Encoding");
+    if(coding!=NULL){
+      if(strcasecmp(coding,"deflate")==0){
+        encoding = decompressDeflate;
+      }else if(strcasecmp(coding,"lz4")==0){
+        encoding = decompressLz4;
+      }else if(strcasecmp(coding,"identity")!=0){
+        encoding = -1;
+      }
+    }
+    uploadWeb.reply = holdReply(request);
+    matrixCommand command;
+    command.type = cmdUploadBegin;
+    command.args[0] = encoding<0 ? (int8_t)decompressNone : encoding;
+    if(uploadWeb.reply<0 || !postCommand(command,true)){
+      uploadWeb.rejected = request;
+      return;
+    }
+    uploadWeb.owner = request;
+    if(encoding<0){
+      rejectUpload(415,"Unsupported Content-Encoding");
+    }
+  }
+  if(uploadWeb.status!=200){
+    return;
+  }
+
+  matrixCommand command;
+  if(index==0){
+    // Determine which folder the upload needs to go in
+    const char *folder = request->url().c_str()+1;
+    if(strcmp(folder,bitmapFilePath)==0){
+      command.text = bitmapFilePath;
+    }else if(strcmp(folder,animationsFilePath)==0){
+      command.text = animationsFilePath;
+    }else if(strcmp(folder,jpegsFilepath)==0){
+      command.text = jpegsFilepath;
+    }else{
+      rejectUpload(404,"Unknown upload folder");
+      return;
+    }
+    // The name is used as a path on the card and as a playlist entry
+    if(filename.length()==0 || filename.length()>=playlistNameLen || filename.indexOf('/')>=0){
+      rejectUpload(400,"Illegal file name");
+      return;
+    }
+    command.type = cmdUploadFile;
+    filename.toCharArray(command.name,sizeof(command.name));
+    if(!postCommand(command,true)){
+      rejectUpload(503,"Upload buffer is full");
+      return;
+    }
+  }
+
+  // The data only counts once its command is queued too
+  if(commands.space()<=commandReserve || !uploadData.write(data,len)){
+    rejectUpload(503,"Upload buffer is full");
+    return;
+  }
+  command.type = cmdUploadData;
+  command.args[0] = len;
+  postCommand(command,true);
+  uploadBytes.add(len);
+
+  if(final == true){
+    command.type = cmdUploadEnd;
+    if(!postCommand(command,true)){
+      rejectUpload(503,"Upload buffer is full");
+    }
+  }
+}
+
+// Called once the whole upload request has been received, the render
+// loop sends the result once it has written the files and published
+// them to the playlist
+void handleUploadDone(AsyncWebServerRequest *request){
+  if(uploadWeb.rejected==request){
+    uploadWeb.rejected = NULL;
+    request->send(503,"text/plain","Another upload is in progress");
+    return;
+  }
+  if(uploadWeb.owner!=request){
+    request->send(400,"text/plain","No file was uploaded");
+    return;
+  }
+  matrixCommand command;
+  command.type = cmdUploadDone;
+  command.reply = uploadWeb.reply;
+  command.args[0] = uploadWeb.status;
+  command.text = uploadWeb.message;
+  uploadWeb.owner = NULL;
+  // There is always room for this one (see commandReserve)
+  postCommand(command,false);
+}
+
+// Sends the whole state of the matrix as one JSON object, with the state
+// version as its ETag
+void sendState(AsyncWebServerRequest *request, int status){
+  char strBuff[160];
+  char etag[24];
+  makeETag(etag,sizeof(etag),stateVersion);
+  snprintf(strBuff,160,"{\"id\":\"%s\",\"brightness\":%u,\"slideshowdelay\":%i,\"mode\":%u,\"streaming\":%s}",
+           matrixId,matrixBrigthness,slideShowDelay,matrixMode,liveStreaming ? "true" : "false");
+  AsyncWebServerResponse *response = request->beginResponse(status,"application/json",strBuff);
+  response->addHeader("ETag",etag);
+  response->addHeader("Cache-Control","no-cache");
+  request->send(response);
+}
+
+// Handles the API call for the state of the matrix, all settings and
+// the current mode in a single round trip
+// GET: returns the state, or 304 if it matches the If-None-Match header
+// PUT/POST: JSON object with any of "brightness", "slideshowdelay" and
+// "mode". Every value is checked before any is applied, so either all
+// of them change or none. An If-Match header makes the write conditional.
+void handleAPIState(AsyncWebServerRequest *request){
+  char etag[24];
+  makeETag(etag,sizeof(etag),stateVersion);
+  if(request->method() == WebRequestMethod::HTTP_GET){
+    if(sendNotModified(request,etag)){
+      return;
+    }
+    sendState(request,200);
+    return;
+  }
+
+  const char* body = takeApiBody(request);
+  if(body==NULL){
+    request->send(400,"text/plain","Missing or too large JSON body");
+    return;
+  }
+  const char *match = findHeader(request,"If-Match");
+  if(match!=NULL && strcmp(match,etag)!=0){
+    request->send(412,"text/plain","State changed since it was read");
+    return;
+  }
+
+  // Read and check everything first
+  long newBrightness = matrixBrigthness;
+  long newDelay = slideShowDelay;
+  long newMode = matrixMode;
+  if(jsonReadInt(body,"brightness",newBrightness)==jsonBadValue ||
+     newBrightness<0 || newBrightness>maxBrightness){
+    request->send(400,"text/plain","Illegal brightness value");
+    return;
+  }
+  if(jsonReadInt(body,"slideshowdelay",newDelay)==jsonBadValue ||
+     newDelay<0 || newDelay>99999){
+    request->send(400,"text/plain","Illegal delay value");
+    return;
+  }
+  if(jsonReadInt(body,"mode",newMode)==jsonBadValue ||
+     newMode<modeBitmap || newMode>modeEffects){
+    request->send(400,"text/plain","Illegal mode value");
+    return;
+  }
+
+  // Then apply it all at once, the render loop gets every value in a
+  // single command
+  if(commands.space()<=commandReserve){
+    request->send(503,"text/plain","Matrix is busy");
+    return;
+  }
+  matrixBrigthness = newBrightness;
+  slideShowDelay = newDelay;
+  matrixMode = newMode;
+  postSettings();
+  stateChanged();
+  sendState(request,200);
+}
+
+// Sends the ticker settings as one JSON object
+void sendTicker(AsyncWebServerRequest *request){
+  // Every character of the message may need escaping
+  char strBuff[2*tickerTextMax+64];
+  size_t len = snprintf(strBuff,sizeof(strBuff),"{\"text\":\"");
+  for(const char *c=tickerMessage;*c!='\0';c++){
+    if(*c=='"' || *c=='\\'){
+      strBuff[len++] = '\\';
+    }
+    strBuff[len++] = *c;
+  }
+  snprintf(&strBuff[len],sizeof(strBuff)-len,"\",\"color\":\"#%06lx\",\"speed\":%i}",
+           (unsigned long)tickerColor,tickerSpeed);
+  request->send(200,"application/json",strBuff);
+}
+
+// Handles the API call for the ticker mode (mode 4)
+// GET: returns the message, its color and the scrolling speed
+// PUT/POST: JSON object with any of "text" (printable ASCII, up to
+// tickerTextMax characters), "color" ("#rrggbb") and "speed" (pixels
+// per second). Every value is checked before any is applied.
+void handleAPITicker(AsyncWebServerRequest *request){
+  if(request->method() == WebRequestMethod::HTTP_GET){
+    sendTicker(request);
+    return;
+  }
+
+  const char* body = takeApiBody(request);
+  if(body==NULL){
+    request->send(400,"text/plain","Missing or too large JSON body");
+    return;
+  }
+  char text[tickerTextMax+1];
+  jsonResult textResult = jsonReadString(body,"text",text,sizeof(text));
+  if(textResult==jsonBadValue){
+    request->send(400,"text/plain","Illegal text value");
+    return;
+  }
+  if(textResult==jsonFound){
+    for(const char *c=text;*c!='\0';c++){
+      if(*c<' ' || *c>'~'){
+        request->send(400,"text/plain","Illegal text value");
+        return;
+      }
+    }
+  }
+  char colorText[8];
+  uint32_t newColor = tickerColor;
+  jsonResult colorResult = jsonReadString(body,"color",colorText,sizeof(colorText));
+  if(colorResult==jsonFound){
+    bool hex = colorText[0]=='#' && strlen(colorText)==7;
+    for(uint8_t i=1;i<7 && hex;i++){
+      hex = isxdigit(colorText[i]);
+    }
+    if(hex){
+      newColor = strtoul(&colorText[1],NULL,16);
+    }else{
+      colorResult = jsonBadValue;
+    }
+  }
+  if(colorResult==jsonBadValue){
+    request->send(400,"text/plain","Illegal color value");
+    return;
+  }
+  long newSpeed = tickerSpeed;
+  if(jsonReadInt(body,"speed",newSpeed)==jsonBadValue ||
+     newSpeed<tickerSpeedMin || newSpeed>tickerSpeedMax){
+    request->send(400,"text/plain","Illegal speed value");
+    return;
+  }
+
+  // The render loop draws the message into the strip, only one message
+  // can be on its way at a time
+  if((textResult==jsonFound && tickerPending) || commands.space()<=commandReserve){
+    request->send(503,"text/plain","Matrix is busy");
+    return;
+  }
+  matrixCommand command;
+  command.type = cmdTicker;
+  command.args[0] = newColor;
+  command.args[1] = newSpeed;
+  if(textResult==jsonFound){
+    strcpy(tickerPosted,text);
+    strcpy(tickerMessage,text);
+    tickerPending = true;
+    command.text = tickerPosted;
+  }
+  tickerColor = newColor;
+  tickerSpeed = newSpeed;
+  postCommand(command,true);
+  sendTicker(request);
+}
+
+// Sends the effect settings as one JSON object, with the names of the
+// effects there are
+void sendEffects(AsyncWebServerRequest *request){
+  char strBuff[160];
+  size_t len = snprintf(strBuff,sizeof(strBuff),"{\"effect\":\"%s\",\"speed\":%u,\"scale\":%u,\"effects\":[",
+                        proceduralEffects::names[effectChoice],effectSpeed,effectScale);
+  for(uint8_t i=0;i<effectCount && len<sizeof(strBuff);i++){
+    len += snprintf(&strBuff[len],sizeof(strBuff)-len,"%s\"%s\"",i==0 ? "" : ",",proceduralEffects::names[i]);
+  }
+  if(len<sizeof(strBuff)){
+    snprintf(&strBuff[len],sizeof(strBuff)-len,"]}");
+  }
+  request->send(200,"application/json",strBuff);
+}
+
+// Handles the API call for the effects mode (mode 5)
+// GET: returns the effect, its speed and scale, and the effects there are
+// PUT/POST: JSON object with any of "effect" (one of the names), "speed"
+// (1 to 255, 128 is the normal pace) and "scale" (0 to 255: the size of
+// the plasma waves, the height of the flames or the number of stars).
+// Every value is checked before any is applied.
+void handleAPIEffects(AsyncWebServerRequest *request){
+  if(request->method() == WebRequestMethod::HTTP_GET){
+    sendEffects(request);
+    return;
+  }
+
+  const char* body = takeApiBody(request);
+  if(body==NULL){
+    request->send(400,"text/plain","Missing or too large JSON body");
+    return;
+  }
+  char name[16];
+  long newEffect = effectChoice;
+  jsonResult nameResult = jsonReadString(body,"effect",name,sizeof(name));
+  if(nameResult==jsonFound){
+    newEffect = proceduralEffects::find(name);
+  }
+  if(nameResult==jsonBadValue || newEffect<0){
+    request->send(400,"text/plain","Illegal effect value");
+    return;
+  }
+  long newSpeed = effectSpeed;
+  if(jsonReadInt(body,"speed",newSpeed)==jsonBadValue || newSpeed<1 || newSpeed>255){
+    request->send(400,"text/plain","Illegal speed value");
+    return;
+  }
+  long newScale = effectScale;
+  if(jsonReadInt(body,"scale",newScale)==jsonBadValue || newScale<0 || newScale>255){
+    request->send(400,"text/plain","Illegal scale value");
+    return;
+  }
+
+  matrixCommand command;
+  command.type = cmdEffects;
+  command.args[0] = newEffect;
+  command.args[1] = newSpeed;
+  command.args[2] = newScale;
+  if(!postCommand(command,true)){
+    request->send(503,"text/plain","Matrix is busy");
+    return;
+  }
+  effectChoice = newEffect;
+  effectSpeed = newSpeed;
+  effectScale = newScale;
+  sendEffects(request);
+}
+
+// Writes the SD clock and the benchmark results as one JSON object,
+// returns its length
+size_t formatSdClock(char *out, size_t outLen){
+  const cid_t &cid = sdClock.cardId();
+  const uint8_t *id = (const uint8_t*)&cid;
+  size_t len = snprintf(out,outLen,"{\"clock\":%u,\"tuned\":%s,\"tuning\":%s,\"card\":\"",
+                        sdClock.clock(),sdClock.isTuned() ? "true" : "false",
+                        sdClock.isTuning() ? "true" : "false");
+  for(uint8_t i=0;i<16 && len<outLen;i++){
+    len += snprintf(&out[len],outLen-len,"%02x",id[i]);
+  }
+  len += snprintf(&out[len],outLen-len,"\",\"results\":[");
+  for(uint8_t i=0;i<sdClock.resultsCount() && len<outLen;i++){
+    const sdClockResult &result = sdClock.result(i);
+    len += snprintf(&out[len],outLen-len,
+                    "%s{\"mhz\":%u,\"ok\":%s,\"readKBps\":%lu,\"randomReadsPerSecond\":%lu,\"writeKBps\":%lu}",
+                    i==0 ? "" : ",",result.mhz,result.ok ? "true" : "false",(unsigned long)result.readKBps,
+                    (unsigned long)result.randomReadsPerSecond,(unsigned long)result.writeKBps);
+  }
+  if(len<outLen){
+    len += snprintf(&out[len],outLen-len,"]}");
+  }
+  return min(len,outLen-1);
+}
+
+// Handles the API call for the SPI clock of the SD card
+// GET: returns the clock, whether it was tuned for the card in it (its
+// CID) and the results of the benchmark of every clock tried, the write
+// speed only for the clock kept
+// POST: benchmarks the card again and answers with the new results. The
+// card can't be used meanwhile (about a second), uploads, downloads and
+// the clearing of folders must be done first.
+void handleAPISd(AsyncWebServerRequest *request){
+  if(request->method() == WebRequestMethod::HTTP_GET){
+    char report[768];
+    formatSdClock(report,sizeof(report));
+    request->send(200,"application/json",report);
+    return;
+  }
+  matrixCommand command;
+  command.type = cmdSdTune;
+  command.reply = holdReply(request);
+  if(command.reply<0 || !postCommand(command,true)){
+    request->send(503,"text/plain","Matrix is busy");
+  }
+}
+
+// Serializes the bitmap playlist into bitmapListing
+void buildBitmapListing(){
+  size_t len = snprintf(bitmapListing,bitmapListingMax,
+                        "{\"thumbnails\":\"/API/thumbnails/\",\"files\":[");
+  for(uint16_t i=0;i<bitmapPlaylist.size();i++){
+    len += snprintf(&bitmapListing[len],bitmapListingMax-len,"%s\"%s\"",
+                    i==0 ? "" : ",",bitmapPlaylist.entry(i));
+  }
+  len += snprintf(&bitmapListing[len],bitmapListingMax-len,"]}");
+  bitmapListingLen = len;
+  bitmapListingVersion = bitmapPlaylist.getVersion();
+  bitmapListingValid = true;
+}
+
+// Handles the API call listing the images of the bitmap folder.
+// The listing comes from the playlist in RAM and is only serialized again
+// when the folder changed, so a request costs no SD card access.
+void handleAPIBitmaps(AsyncWebServerRequest *request){
+  if(bitmapPlaylist.isDirty()){
+    // The render loop reads the folder again before its next image
+    AsyncWebServerResponse *response = request->beginResponse(503,"text/plain","Listing is being updated");
+    response->addHeader("Retry-After","1");
+    request->send(response);
+    return;
+  }
+  if(!bitmapListingValid || bitmapListingVersion!=bitmapPlaylist.getVersion()){
+    buildBitmapListing();
+  }
+  char etag[24];
+  makeETag(etag,sizeof(etag),bitmapListingVersion);
+  if(sendNotModified(request,etag)){
+    return;
+  }
+  // The buffer is sent as it is, without copying it. Should the listing
+  // be rebuilt before it is all sent, the response is cut short and the
+  // client has to ask again.
+  uint32_t version = bitmapListingVersion;
+  AsyncWebServerResponse *response = request->beginResponse("application/json",bitmapListingLen,
+    [version](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+      if(version!=bitmapListingVersion || index>=bitmapListingLen){
+        return 0;
+      }
+      size_t len = min(maxLen,bitmapListingLen-index);
+      memcpy(buffer,&bitmapListing[index],len);
+      return len;
+    });
+  response->addHeader("ETag",etag);
+  response->addHeader("Cache-Control","no-cache");
+  request->send(response);
+}
+
+// Handles the API call for the thumbnail of an image of the bitmap
+// folder, GET /API/thumbnails/<file name>. The thumbnail is made the
+// first time and served from the SD card afterwards.
+void handleAPIThumbnail(AsyncWebServerRequest *request){
+  const char *prefix = "/API/thumbnails/";
+  const char *url = request->url().c_str();
+  const char *name = strncmp(url,prefix,strlen(prefix))==0 ? url+strlen(prefix) : "";
+  if(strlen(name)==0 || strlen(name)>=playlistNameLen){
+    request->send(404,"text/plain","No such image");
+    return;
+  }
+  // A thumbnail only changes when its image is written again or the
+  // folder is cleared
+  char etag[24];
+  makeETag(etag,sizeof(etag),bitmapContentVersion);
+  if(sendNotModified(request,etag)){
+    return;
+  }
+  // The render loop reads (or makes) the thumbnail and answers
+  matrixCommand command;
+  command.type = cmdThumbnail;
+  strncpy(command.name,name,sizeof(command.name));
+  command.reply = holdReply(request);
+  if(command.reply<0 || !postCommand(command,true)){
+    request->send(503,"text/plain","Matrix is busy");
+  }
+}
+
+// Handles the API callback to delete all images in the bitmap
 // folder in the SD card
-// It does this by deleting the entire folder and making a new one
+// It does this by swapping the folder for a new empty one, the old
+// folder is deleted in the background by the trash reaper, so the
+// response takes the same time no matter how many files there are
 void handleAPIDeleteBitmaps(AsyncWebServerRequest *request){
   // Just making the GET request is sufficient to trigger the 
-  // file deletion
+  // file deletion, it is done by the render loop which then answers
   if(request->method() == WebRequestMethod::HTTP_GET){
-    
-    // Remove the bitmap folder
-    file.close();
-    dir.close();
-
-    //deleteBitmapFolder = true;
-    File32 dirBmp;
-    File32 fileEntry;
-    char strBuffer[100]; // buffer to store file paths
-    bitmapFilePath.toCharArray(strBuffer,100);
-
-    cout<<strBuffer;
-    // Open the folder to be deleted to delete every file in it
-    if(!dirBmp.open(strBuffer,O_READ)){
-      request->send(500,"text/plain","bitmap folder could not be opened!");
-      dirBmp.close(); // close in case there is a floating file resource
+    matrixCommand command;
+    command.type = cmdClearBitmaps;
+    command.reply = holdReply(request);
+    if(command.reply<0 || !postCommand(command,true)){
+      request->send(503,"text/plain","Matrix is busy");
+    }
+  }
+}
+
+// Receives the body of a "/API/frame" POST, a raw or RLE compressed
+// RGB565 frame (see frameStream.h) that is decoded as it arrives
+void onFrameBody(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total){
+  if(index==0){
+    if(frameOwner!=NULL && frameOwner!=request && liveFrames.isReceiving()){
+      // Another client is mid-frame, this one loses
       return;
     }
-    // Delete every file in the folder
-    while(fileEntry.openNext(&dirBmp,O_READ)){
-      // Get the file path name
-      fileEntry.getName(strBuffer,100);
-      String path = bitmapFilePath+"/"+strBuffer;
-      // skip subdirectories
-      if(fileEntry.isDir()){
-        fileEntry.close();
-        continue;
-      }
-      // Delete the file
-      path.toCharArray(strBuffer,100);
-      cout<<strBuffer;
-      if (!SD.remove(strBuffer)){
-        request->send(500,"text/plain","Bitmap folder could not be cleared!");
-        fileEntry.close();
-        dirBmp.close(); // close in case there is a floating file resource
-        return;
-      }
-      fileEntry.close();
+    frameOwner = request;
+    frameResult = 200;
+    bool rle = strcmp(request->contentType().c_str(),"application/x-rle565")==0;
+    if(!rle && total!=frameStreamBytes){
+      frameResult = 400;
+      return;
+    }
+    liveFrames.begin(rle ? frameRle : frameRaw);
+  }
+  if(frameOwner!=request || frameResult!=200){
+    return;
+  }
+  if(!liveFrames.write(data,len)){
+    frameResult = 400;
+    return;
+  }
+  if(index+len==total && !liveFrames.end()){
+    frameResult = 400;
+  }
+}
+
+// Handles the API call for live frames
+// POST: the frame was received by onFrameBody, GET: statistics only
+// Both respond with the frame counters so a client can see frames
+// being dropped and slow down
+void handleAPIFrame(AsyncWebServerRequest *request){
+  int status = 200;
+  if(request->method() == WebRequestMethod::HTTP_POST){
+    if(frameOwner!=request){
+      status = (request->contentLength()==0) ? 400 : 409;
+    }else{
+      status = frameResult;
+      liveFrames.cancel(); // In case the body was cut short
+      frameOwner = NULL;
     }
-    dirBmp.close();
-    // Send response to the app
-    request->send(200,"text/plain","Bitmap folder is cleared!");
   }
+  char strBuff[120];
+  snprintf(strBuff,120,"{\"received\":%lu,\"shown\":%lu,\"dropped\":%lu,\"rejected\":%lu}",
+           (unsigned long)liveFrames.received(),(unsigned long)liveFrames.shown(),
+           (unsigned long)liveFrames.dropped(),(unsigned long)liveFrames.rejected());
+  request->send(status,"application/json",strBuff);
 }
 
-// Handles 404 errors
-void handleNotFound(AsyncWebServerRequest *request)
-{
-	String message = "File Not Found\n\n";
-
-	message += "URI: ";
-	//message += server.uri();
-	message += request->url();
-	message += "\nMethod: ";
-	message += (request->method() == HTTP_GET) ? "GET" : "POST";
-	message += "\nArguments: ";
-	message += request->args();
-	message += "\n";
-	for (uint8_t i = 0; i < request->args(); i++)
-	{
-		message += " " + request->argName(i) + ": " + request->arg(i) + "\n";
-	}
-	request->send(404, "text/plain", message);
+// Handles downloads of any file on the SD card, GET /files/<path>
+// A "Range: bytes=first-last" header (or "first-", or "-suffix length")
+// asks for part of the file, which lets clients resume transfers.
+// The file is read by the render loop, which answers the request.
+void handleFiles(AsyncWebServerRequest *request){
+  const char *path = request->url().c_str()+strlen("/files");
+  if(strlen(path)<2 || strlen(path)>=commandNameLen || strstr(path,"..")!=NULL){
+    request->send(404,"text/plain","No such file");
+    return;
+  }
+  matrixCommand command;
+  command.type = cmdSendFile;
+  strncpy(command.name,path,sizeof(command.name));
+  // Range kind: 0 whole file, 1 first-last (last -1 for the end), 2 suffix
+  command.args[0] = 0;
+  const char *range = findHeader(request,"Range");
+  if(range!=NULL && !fileSender::parseRange(range,command.args)){
+    request->send(416,"text/plain","Bad range");
+    return;
+  }
+  command.reply = holdReply(request);
+  if(command.reply<0 || !postCommand(command,true)){
+    request->send(503,"text/plain","Matrix is busy");
+  }
 }
 
-// Handles when "/upload" is requested
-// This function is CRITICAL for file upload
-void onUpload(AsyncWebServerRequest *request, String filename, size_t index, uint8_t *data, size_t len, bool final){
-  //Handle upload
-  Serial.println("~~~~");
-  Serial.println(request->url());
-	Serial.println(filename);
-	Serial.println(index);
-	Serial.println(len);
-	Serial.println(final);
-	Serial.println("");
-  Serial.println("~~~~");
-
-  // Folder to store files in
-  String fileFolder = "/";
-
-  File32 file;// = SD.open("/" + filename, O_WRONLY|O_CREAT);
-	//file.close();
-  
-  // Determine which folder the upload needs to go in
-  String requestUrl = String(request->url());
-  if(requestUrl.equals("/"+bitmapFilePath)){
-    fileFolder.concat(bitmapFilePath);
-  }
-  if(requestUrl.equals("/"+animationsFilePath)){
-    fileFolder.concat(animationsFilePath);
-  }
-  if(requestUrl.equals("/"+jpegsFilepath)){
-    fileFolder.concat(jpegsFilepath);
-  }
-  Serial.println(fileFolder);
-  Serial.println(fileFolder+"/"+filename);
-
-	file.open((fileFolder+"/"+filename).c_str(),O_RDWR|O_CREAT);
-	if(file.isOpen()){
-		file.seek(index);
-		file.write(data,len);
-		file.close();
-	}else{
-		file.close();
-		Serial.println("File failed to open");
-		request->send(500,"text/plain","File failed to be opened");
-		return;
-	}
+// Handles the API call for the performance metrics, in the Prometheus
+// text format
+void handleAPIMetrics(AsyncWebServerRequest *request){
+  freeHeap.set(rp2040.getFreeHeap());
+  stackUsed.set(stackHighWater());
+  cachedImages.set(imageCache.frameCount());
+  cachedImageBytes.set(imageCache.bytesUsed());
+  AsyncResponseStream *response = request->beginResponseStream("text/plain; version=0.0.4");
+  metric::writeAll(*response);
+  request->send(response);
+}
 
-	if(final == true){
-		Serial.println("File finished uploading!");
-		request->send(200,"text/plain","File succesfully uploaded");
-		return;
-	}
+// Handles the API call for the log messages kept in RAM
+// GET /API/log?since=<position> only returns the messages logged after
+// the position, which is sent back in the X-Log-Position header
+void handleAPILog(AsyncWebServerRequest *request){
+  uint32_t since = 0;
+  const char *sinceParam = findParam(request,"since");
+  if(sinceParam!=NULL){
+    since = strtoul(sinceParam,NULL,10);
+  }
+  AsyncResponseStream *response = request->beginResponseStream("text/plain");
+  uint32_t position = logger.copy(since,*response);
+  char strBuff[16];
+  snprintf(strBuff,16,"%lu",(unsigned long)position);
+  response->addHeader("X-Log-Position",strBuff);
+  snprintf(strBuff,16,"%lu",(unsigned long)logger.lostCount());
+  response->addHeader("X-Log-Lost",strBuff);
+  request->send(response);
 }
+
 //~~~~~~~~~~~End of WiFI callback functions~~~~~~~~~~~~~~~~~~~~
 
+//~~~~~~~~~~~Commands run by the render loop~~~~~~~~~~~~~~~~~~~~
+
+// Takes the settings sent by the web side
+void applySettings(const matrixCommand &command){
+  bool brightnessChanged = command.args[0]!=render.brightness;
+  render.brightness = command.args[0];
+  render.slideShowDelay = command.args[1];
+  render.mode = command.args[2];
+  if(brightnessChanged){
+    // Only an image on the matrix needs to be redrawn, the other modes
+    // use the new brightness from their next frame
+    bool imageShown = !liveStreaming && (render.mode==modeBitmap || render.mode==modeAnimation);
+    bmpImageDisplay.setBrightness(render.brightness,imageShown);
+  }
+  // Written to the card once the changes stop coming
+  storedSettings saved;
+  saved.brightness = render.brightness;
+  saved.slideShowDelay = render.slideShowDelay;
+  saved.mode = render.mode;
+  settingsFile.save(saved);
+}
+
+// Takes the ticker settings sent by the web side, a new message starts
+// scrolling in from the right
+void applyTicker(const matrixCommand &command){
+  render.tickerColor = command.args[0];
+  render.tickerSpeed = command.args[1];
+  if(command.text!=NULL){
+    ticker.setText(command.text);
+    queueBarrier();
+    tickerPending = false;
+    tickerStartMillis = millis();
+  }
+  tickerRedraw = true;
+}
+
+// Tunes the SD clock again and answers with the results. The card is
+// mounted again at every clock, so no file may be open.
+void tuneSdClock(int8_t reply){
+  bool sending = false;
+  for(uint8_t i=0;i<fileSendersMax;i++){
+    sending |= fileSenders[i].isOpen();
+  }
+  if(upload.writer.isOpen() || sending || trashReaper.busy()){
+    sendHeldReply(reply,409,"SD card is busy");
+    return;
+  }
+  animationFrames.close();
+  settingsFile.flush();
+  int status = sdClock.tune();
+  sdClockMhz.set(sdClock.clock());
+  logInfo(logModuleSd,"SD card at %u MHz",sdClock.clock());
+  char report[768];
+  formatSdClock(report,sizeof(report));
+  AsyncWebServerRequest *request = beginHeldReply(reply);
+  if(request!=NULL){
+    request->send(status ? 500 : 200,"application/json",report);
+    endHeldReply(reply);
+  }
+}
+
+// Empties the bitmap folder and answers the request
+// The folder is swapped for a new empty one, the old folder is deleted
+// in the background by the trash reaper, so this takes the same time no
+// matter how many files there are
+void clearBitmaps(int8_t reply){
+  // An upload into the folder can't finish once it is gone
+  if(upload.writer.isOpen() && upload.bitmapFolder){
+    failUpload(409,"Bitmap folder was cleared");
+  }
+  if(trashReaper.swapOut(bitmapFilePath) || trashReaper.swapOut(thumbnailFilePath)){
+    sendHeldReply(reply,500,"Bitmap folder could not be cleared!");
+    return;
+  }
+  // Cached images of the deleted files must not be shown anymore
+  imageCache.clear();
+  forgetSnapshot(NULL);
+  bitmapPlaylist.clear();
+  bitmapContentVersion++;
+  // Send response to the app
+  sendHeldReply(reply,200,"Bitmap folder is cleared!");
+}
+
+// Reads the thumbnail of the image, making it first if needed, and
+// sends it
+void sendThumbnail(int8_t reply, const char *name){
+  char thumbPath[thumbnailPathLen];
+  uint8_t thumb[thumbnailFileSize];
+  int len = 0;
+  if(!thumbnails.prepare(bitmapFilePath,name,thumbPath,sizeof(thumbPath))){
+    File32 thumbFile;
+    if(thumbFile.open(thumbPath,O_RDONLY)){
+      len = thumbFile.read(thumb,sizeof(thumb));
+      thumbFile.close();
+    }
+  }
+  AsyncWebServerRequest *request = beginHeldReply(reply);
+  if(request==NULL){
+    return;
+  }
+  if(len!=thumbnailFileSize){
+    request->send(404,"text/plain","No such image");
+  }else{
+    char etag[24];
+    makeETag(etag,sizeof(etag),bitmapContentVersion);
+    AsyncResponseStream *response = request->beginResponseStream("image/bmp");
+    response->write(thumb,len);
+    response->addHeader("ETag",etag);
+    request->send(response);
+  }
+  endHeldReply(reply);
+}
+
+// Content type of a file, from its extension
+const char* fileContentType(const char *path){
+  const char *ext = strrchr(path,'.');
+  if(ext==NULL){
+    return "application/octet-stream";
+  }
+  if(strcasecmp(ext,".bmp")==0){
+    return "image/bmp";
+  }
+  if(strcasecmp(ext,".txt")==0){
+    return "text/plain";
+  }
+  if(strcasecmp(ext,".json")==0){
+    return "application/json";
+  }
+  return "application/octet-stream";
+}
+
+// Opens the file and answers the download request, the data is then read
+// into the buffer of a file sender by serviceFileSenders()
+void sendFile(const matrixCommand &command){
+  fileSender *sender = NULL;
+  for(uint8_t i=0;i<fileSendersMax;i++){
+    if(!fileSenders[i].isOpen()){
+      sender = &fileSenders[i];
+      break;
+    }
+  }
+  if(sender==NULL){
+    sendHeldReply(command.reply,503,"Too many downloads");
+    return;
+  }
+  if(sender->open(command.name)){
+    sendHeldReply(command.reply,404,"No such file");
+    return;
+  }
+
+  // Work out the bytes to send
+  uint32_t size = sender->fileSize();
+  uint32_t first = 0;
+  uint32_t last = size-1;
+  if(command.args[0]==1){
+    first = command.args[1];
+    if(command.args[2]>=0 && (uint32_t)command.args[2]<last){
+      last = command.args[2];
+    }
+  }else if(command.args[0]==2){
+    first = (uint32_t)command.args[1]<size ? size-command.args[1] : 0;
+  }
+  bool partial = command.args[0]!=0;
+  if(size==0 || (partial && (first>last || first>=size))){
+    sender->close();
+    AsyncWebServerRequest *request = beginHeldReply(command.reply);
+    if(request!=NULL){
+      if(size==0 && !partial){
+        request->send(200,fileContentType(command.name),"");
+      }else{
+        char strBuff[32];
+        snprintf(strBuff,32,"bytes */%lu",(unsigned long)size);
+        AsyncWebServerResponse *response = request->beginResponse(416,"text/plain","Range not satisfiable");
+        response->addHeader("Content-Range",strBuff);
+        request->send(response);
+      }
+      endHeldReply(command.reply);
+    }
+    return;
+  }
+  sender->setRange(first,last);
+  sender->fill(fileSendBudgetMicros); // Have data ready for the first packet
+
+  AsyncWebServerRequest *request = beginHeldReply(command.reply);
+  if(request==NULL){
+    sender->close();
+    return;
+  }
+  AsyncWebServerResponse *response = request->beginResponse(fileContentType(command.name),last-first+1,
+    [sender](uint8_t *buffer, size_t maxLen, size_t) -> size_t {
+      bool wait;
+      size_t len = sender->read(buffer,maxLen,wait);
+      return wait ? RESPONSE_TRY_AGAIN : len;
+    });
+  response->addHeader("Accept-Ranges","bytes");
+  if(partial){
+    char strBuff[48];
+    snprintf(strBuff,48,"bytes %lu-%lu/%lu",(unsigned long)first,(unsigned long)last,(unsigned long)size);
+    response->setCode(206);
+    response->addHeader("Content-Range",strBuff);
+  }
+  // The sender is free again once the whole range is sent, or once the
+  // client is gone before that. Replaces the handler of holdReply().
+  int8_t slot = command.reply;
+  uint32_t transfer = sender->transfer();
+  request->onDisconnect([request,slot,sender,transfer](){
+    heldReplyGone(request,slot);
+    sender->finish(transfer);
+  });
+  request->send(response);
+  endHeldReply(command.reply);
+}
+
+// Reads the next part of every file being sent, closing the ones that
+// are done. Returns true if there is more to read.
+bool serviceFileSenders(){
+  bool more = false;
+  for(uint8_t i=0;i<fileSendersMax;i++){
+    if(!fileSenders[i].isOpen()){
+      continue;
+    }
+    if(fileSenders[i].isFinished()){
+      fileSenders[i].close();
+      continue;
+    }
+    more |= fileSenders[i].fill(fileSendBudgetMicros);
+  }
+  return more;
+}
+
+// Runs the commands queued by the web handlers until the queue is empty
+// or the time budget is used. Only the render loop calls this, so the
+// SD card and the matrix are never used by two contexts at once.
+// Returns true if commands are left.
+bool applyCommands(uint32_t budgetMicros){
+  uint32_t start = micros();
+  matrixCommand command;
+  while(commands.pop(command)){
+    switch(command.type){
+      case cmdSettings:
+        applySettings(command);
+        break;
+      case cmdUploadBegin:
+        upload.status = 200;
+        upload.message = "";
+        upload.filesDone = 0;
+        upload.frame = NULL;
+        upload.startMicros = micros();
+        upload.bytes = 0;
+        upload.encoding = (decompressFormat)command.args[0];
+        break;
+      case cmdUploadFile:
+        if(upload.status==200){
+          startUploadFile(command.text,command.name);
+        }
+        break;
+      case cmdUploadData:
+        writeUploadData(command.args[0]);
+        break;
+      case cmdUploadEnd:
+        finishUploadFile();
+        break;
+      case cmdUploadDone:
+        finishUpload(command);
+        break;
+      case cmdUploadAbort:
+        failUpload(499,"Upload was cut short");
+        endUploadSession();
+        break;
+      case cmdClearBitmaps:
+        clearBitmaps(command.reply);
+        break;
+      case cmdThumbnail:
+        sendThumbnail(command.reply,command.name);
+        break;
+      case cmdSendFile:
+        sendFile(command);
+        break;
+      case cmdTicker:
+        applyTicker(command);
+        break;
+      case cmdEffects:
+        effects.setParameters(command.args[0],command.args[1],command.args[2]);
+        effectPaletteKey = 0xFFFFFFFF;
+        break;
+      case cmdSdTune:
+        tuneSdClock(command.reply);
+        break;
+    }
+    if(micros()-start>=budgetMicros){
+      return !commands.isEmpty();
+    }
+  }
+  return false;
+}
+
+// Follows the heap in use. Everything the firmware needs is allocated by
+// the end of setup, after that only the web stack allocates (and frees)
+// per request, so the high water mark settles once the busiest moment is
+// seen. A count that keeps going up means something leaks or fragments.
+void sampleHeap(){
+  freeHeapLow.setMin(rp2040.getFreeHeap());
+  int32_t used = rp2040.getUsedHeap();
+  if(used>heapUsedHigh.get()){
+    heapUsedHigh.set(used);
+    if(heapBaselineTaken){
+      heapGrowth.add(1);
+    }
+  }
+}
+
+// Runs one slice of the work that is done in the background,
+// returns true if there is more work waiting
+bool serviceBackgroundTasks(){
+  sampleHeap();
+  bool commandsWaiting = applyCommands(commandBudgetMicros);
+  bool filesWaiting = serviceFileSenders();
+  // Send the waiting log messages, only as much as the port takes at once
+  bool logsWaiting = logger.drain(Serial,logDrainBytes)==logDrainBytes;
+  settingsFile.service(millis());
+  return trashReaper.step(reaperBudgetMicros) || logsWaiting || commandsWaiting || filesWaiting;
+}
+
+// Creates the matrix again with the configuration, in place so every
+// pointer and reference to it stays valid. Returns 0 on success.
+int createMatrix(const matrixConfig &config){
+  matrix.~Adafruit_Protomatter();
+  new (&matrix) Adafruit_Protomatter(
+    matrix_chain_width, config.bitDepth, 1, rgbPins,
+    address_lines_num, addrPins, clockPin, latchPin,
+    oePin, config.doubleBuffered);
+  ProtomatterStatus status = matrix.begin();
+  if(status!=PROTOMATTER_OK){
+    logError(logModuleDisplay,"Matrix failed to start at %u bit depth: %d",config.bitDepth,(int)status);
+    return 1;
+  }
+  logInfo(logModuleDisplay,"Matrix at %u bit depth%s",config.bitDepth,config.doubleBuffered ? ", double buffered" : "");
+  return 0;
+}
+
+// Switches the matrix to the bit depth and buffering of the mode if it
+// isn't using them already. The contents of the matrix are lost, the
+// caller draws the next frame from scratch. If the matrix fails to start
+// with them it goes back to the configuration it had, which the mode is
+// drawn with until the next try.
+// Returns 0 if the matrix is running, 1 if there is nothing to draw on.
+// Render loop side
+int configureMatrix(uint8_t mode){
+  matrixConfig config = {bitmapBitDepth,bitmapDoubleBuffered};
+  if(mode==modeAnimation){
+    config = {animationBitDepth,animationDoubleBuffered};
+  }else if(mode==modeSimulation){
+    config = {simulationBitDepth,simulationDoubleBuffered};
+  }else if(mode==modeTicker){
+    config = {tickerBitDepth,tickerDoubleBuffered};
+  }else if(mode==modeEffects){
+    config = {effectsBitDepth,effectsDoubleBuffered};
+  }
+  bool current = config.bitDepth==matrixCurrent.bitDepth && config.doubleBuffered==matrixCurrent.doubleBuffered;
+  if(current && matrixRunning){
+    return 0;
+  }
+  if(matrixFailed && millis()-matrixFailedMillis<matrixRetryMillis){
+    return matrixRunning ? 0 : 1;
+  }
+  if(!createMatrix(config)){
+    matrixCurrent = config;
+    matrixRunning = true;
+    matrixFailed = false;
+    bmpImageDisplay.setDither(imageDither ? matrixCurrent.bitDepth : 0);
+  }else{
+    matrixFailed = true;
+    matrixFailedMillis = millis();
+    matrixRunning = !current && !createMatrix(matrixCurrent);
+    if(matrixRunning){
+      logWarn(logModuleDisplay,"Keeping the matrix at %u bit depth",matrixCurrent.bitDepth);
+    }else{
+      // Not even the configuration that worked before
+      logError(logModuleDisplay,"No matrix to draw on, trying again in %u s",matrixRetryMillis/1000);
+    }
+  }
+  matrixBitDepth.set(matrixRunning ? matrixCurrent.bitDepth : 0);
+  return matrixRunning ? 0 : 1;
+}
+
+// Shows the matrix buffer, timing it
+void showFrame(){
+  uint32_t start = micros();
+  matrix.show();
+  showTime.record(micros()-start);
+  framesShown.add(1);
+}
+
+// Waits for the slideshow delay, using the time for background work
+// A live frame arriving or the mode changing ends the wait early
+// dither: an image is shown, it is redrawn with the next dither phase
+// once the panels were refreshed with the last one
+// Returns false if the wait ended early.
+bool slideShowWait(uint32_t waitMillis, bool dither = false){
+  uint32_t start = millis();
+  uint32_t refreshes = matrix.getFrameCount();
+  uint8_t mode = render.mode;
+  while(millis()-start<waitMillis){
+    if(liveFrames.hasFrame() || render.mode!=mode){
+      return false;
+    }
+    if(dither && matrix.getFrameCount()!=refreshes){
+      dither = !bmpImageDisplay.refreshDither(matrix);
+      refreshes = matrix.getFrameCount();
+    }
+    if(!serviceBackgroundTasks()){
+      delay(1);
+    }
+  }
+  return true;
+}
+
+
 
+// Reads the playlist again from its folder if it is out of date
+void refreshPlaylist(playlist &list, const char *folder){
+  if(list.isDirty()){
+    if(list.rebuild(folder)){
+      errorShow("Image dir didn't open",matrix);
+    }
+  }
+}
+
+// Saves the image just shown as the boot snapshot, unless it is already
+// in it or the last snapshot is too recent
+void saveSnapshot(const char *imagePath){
+  if(strcmp(imagePath,snapshotImage)==0 || millis()-snapshotMillis<snapshotIntervalMillis){
+    return;
+  }
+  // The full brightness frame, only there if the image could be cached
+  const uint16_t *frame = imageCache.unpack(imagePath);
+  if(frame==NULL){
+    return;
+  }
+  snapshotInfo info;
+  info.brightness = render.brightness;
+  info.mode = render.mode;
+  info.slideShowDelay = render.slideShowDelay;
+  strncpy(info.path,imagePath,sizeof(info.path)-1);
+  snapshotMillis = millis();
+  File32 image;
+  if(!image.open(imagePath,O_RDONLY)){
+    return;
+  }
+  info.fileSize = image.fileSize();
+  image.close();
+  if(snapshot.save(info,frame)){
+    logWarn(logModuleSd,"Boot snapshot failed to be saved");
+    return;
+  }
+  strncpy(snapshotImage,imagePath,sizeof(snapshotImage)-1);
+}
+
+// Puts the image of the boot snapshot on the matrix.
+// Returns true if it was shown.
+bool showBootSnapshot(){
+  snapshot.begin(snapshotFilePath);
+  snapshotInfo info;
+  if(snapshot.load(imageCache,info) || (info.mode!=modeBitmap && info.mode!=modeAnimation)){
+    return false;
+  }
+  bmpImageDisplay.setBrightness(info.brightness,false);
+  if(bmpImageDisplay.displayImage(info.path,matrix)){
+    return false;
+  }
+  strncpy(snapshotImage,info.path,sizeof(snapshotImage)-1);
+  snapshotMillis = millis();
+  logInfo(logModuleMain,"Boot snapshot shown after %lu ms",millis());
+  return true;
+}
 
 // Initial setup
 void setup(void) {
+  // Mark the unused stack so its high water mark can be measured
+  paintStack();
 
   // Start the serial monitor
   Serial.begin(9600);
@@ -371,8 +2124,9 @@ void setup(void) {
 
   // Initialize protolib (matrix control)
   ProtomatterStatus status = matrix.begin();
-  Serial.print("Protomatter begin() status: ");
-  Serial.println((int)status);
+  logInfo(logModuleMain,"Protomatter begin() status: %d",(int)status);
+  bmpImageDisplay.setDither(imageDither ? matrixCurrent.bitDepth : 0);
+  bmpImageDisplay.setCurrentLimit(powerBudgetMilliamps,panelWhiteMilliamps);
   if(status == PROTOMATTER_ERR_PINS) {
     while(true){
       Serial.println("RGB and clock pins are not on the same PORT!\n");
@@ -389,7 +2143,7 @@ void setup(void) {
   // Initialize the SD Card with the config defined earlier
   // If we are ever finished with the SD Card use SD.close
   if(!SD.begin(SD_CONFIG)) { 
-    matrix.println("SD Card Failure!");
+    canvas.println("SD Card Failure!");
     matrix.show();
     while(true){
       Serial.println(F("SD begin() failed"));
@@ -398,15 +2152,77 @@ void setup(void) {
     }
   }
 
-  // Get the saved settings from the matrix
-  settingsFile.createSettingsFile("settings.txt","");
-  //settingsFile.saveBrightness(matrixBrigthness);
+  // Show the last image right away, everything below takes much longer
+  bool snapshotShown = showBootSnapshot();
 
-  // Any function that has color must use matrix.color(uint8_t r,g,b) call to obtain a
-  //16-bit integer with the desired color, which is passed as the color argument.
-  matrix.setTextSize(1);
-  matrix.println("Imp's LED Matrix!"); // Default text color is white
-  matrix.show();
+  // Run the card at the fastest clock it works at, a new card is tuned
+  // first (about a second, once)
+  if(sdClock.begin(sdClockFilePath,sdTuneFilePath)){
+    logError(logModuleSd,"SD clock could not be tuned");
+  }
+  sdClockMhz.set(sdClock.clock());
+  logInfo(logModuleSd,"SD card at %u MHz",sdClock.clock());
+
+  // Restore the settings saved before the last reset, the API and the
+  // render loop start from the same values
+  if(settingsFile.begin(settingsFilePath)){
+    logError(logModuleSettings,"Settings could not be loaded");
+  }
+  const storedSettings &saved = settingsFile.get();
+  if(saved.mode>=modeBitmap && saved.mode<=modeEffects){
+    matrixMode = saved.mode;
+  }
+  if(saved.slideShowDelay>=0 && saved.slideShowDelay<=99999){
+    slideShowDelay = saved.slideShowDelay;
+  }
+  matrixBrigthness = saved.brightness;
+  render.brightness = matrixBrigthness;
+  render.slideShowDelay = slideShowDelay;
+  render.mode = matrixMode;
+  ticker.setText(tickerMessage);
+
+  if(thumbnails.begin(thumbnailFilePath)){
+    logError(logModuleSd,"Thumbnail folder could not be created");
+  }
+  // Animation packs are uploaded into it, cards made before they existed don't have it
+  if(!SD.exists(animationsFilePath) && !SD.mkdir(animationsFilePath)){
+    logError(logModuleSd,"Animation folder could not be created");
+  }
+  etagBoot = rp2040.hwrand32();
+  // The snapshot may be older than the settings, it is redrawn with them
+  bmpImageDisplay.setBrightness(render.brightness,snapshotShown);
+  freeHeapLow.set(rp2040.getFreeHeap());
+  matrixBitDepth.set(matrixCurrent.bitDepth);
+
+  // Resume deleting anything that was cleared before a reboot
+  if(trashReaper.begin(trashFilePath)){
+    logError(logModuleSd,"Trash folder could not be created");
+  }
+
+  // Print the contents of the card for debugging, this blocks for as
+  // long as the serial port takes so it is only done in debug builds
+#if logLevel >= logLevelDebug
+  SD.ls(LS_R);
+  cout<<"\n";
+#endif
+
+  // Read the slideshow images before the API can ask for them
+  refreshPlaylist(bitmapPlaylist,bitmapFilePath);
+
+  if(snapshotShown){
+    // The slideshow carries on from the image on the matrix
+    const char *name = strrchr(snapshotImage,'/');
+    if(name!=NULL && render.mode==modeBitmap){
+      bitmapPlaylist.seek(name+1);
+    }
+  }else{
+    // Any function that has color must use matrix.color(uint8_t r,g,b) call to obtain a
+    //16-bit integer with the desired color, which is passed as the color argument.
+    canvas.setTextSize(1);
+    canvas.setTextColor(matrix.color565(255,255,255));
+    canvas.println("Imp's LED Matrix!");
+    matrix.show();
+  }
 
   // Initialiaze the pico as a soft wifi access point
   // and set a static IP for the access point
@@ -417,24 +2233,38 @@ void setup(void) {
   WiFi.begin(gatewaySSID,gatewayPassword);
 
   // Set WiFi server root ("/") callback
-  server.on("/", HTTP_GET, [](AsyncWebServerRequest * request)
+  // Every handler is timed, see /API/metrics
+  server.on("/", HTTP_GET, timed([](AsyncWebServerRequest * request)
 	{
 		handleRoot(request);
-	});
+	},routeRoot));
 
 	// Set WiFi server "/upload" callback
   // This is the most important callback 
-	server.on("/bitmaps", HTTP_POST, [](AsyncWebServerRequest *request){
-	  request->send(200);
-	 }, onUpload);
+	server.on("/bitmaps", HTTP_POST, timed(handleUploadDone,routeUpload), onUpload);
+  server.on("/animations", HTTP_POST, timed(handleUploadDone,routeAnimations), onUpload);
 
   // Set all HTTP URL API callbacks 
-  server.on("/API/id", HTTP_GET,handleAPIMatrixId);
-  server.on("/API/brightness", HTTP_GET,handleAPIMatrixBrightness);
-  server.on("/API/brightness", HTTP_PUT,handleAPIMatrixBrightness);
-  server.on("/API/delete/bitmaps", HTTP_GET,handleAPIDeleteBitmaps);
-  server.on("/API/slideshowdelay", HTTP_GET,handleAPIMatrixSlideShowDelay);
-  server.on("/API/slideshowdelay", HTTP_PUT,handleAPIMatrixSlideShowDelay);
+  server.on("/API/id", HTTP_GET,timed(handleAPIMatrixId,routeId));
+  server.on("/API/brightness", HTTP_GET,timed(handleAPIMatrixBrightness,routeBrightness));
+  server.on("/API/brightness", HTTP_PUT,timed(handleAPIMatrixBrightness,routeBrightness));
+  server.on("/API/delete/bitmaps", HTTP_GET,timed(handleAPIDeleteBitmaps,routeDelete));
+  server.on("/API/bitmaps", HTTP_GET,timed(handleAPIBitmaps,routeBitmaps));
+  server.on("/API/thumbnails", HTTP_GET,timed(handleAPIThumbnail,routeThumbnails));
+  server.on("/API/slideshowdelay", HTTP_GET,timed(handleAPIMatrixSlideShowDelay,routeDelay));
+  server.on("/API/slideshowdelay", HTTP_PUT,timed(handleAPIMatrixSlideShowDelay,routeDelay));
+  server.on("/API/state", HTTP_GET,timed(handleAPIState,routeState));
+  server.on("/API/state", HTTP_PUT|HTTP_POST,timed(handleAPIState,routeState),NULL,collectApiBody);
+  server.on("/API/frame", HTTP_GET,timed(handleAPIFrame,routeFrame));
+  server.on("/API/frame", HTTP_POST,timed(handleAPIFrame,routeFrame),NULL,onFrameBody);
+  server.on("/API/metrics", HTTP_GET,timed(handleAPIMetrics,routeMetrics));
+  server.on("/API/log", HTTP_GET,timed(handleAPILog,routeLog));
+  server.on("/files", HTTP_GET,timed(handleFiles,routeFiles));
+  server.on("/API/ticker", HTTP_GET,timed(handleAPITicker,routeTicker));
+  server.on("/API/ticker", HTTP_PUT|HTTP_POST,timed(handleAPITicker,routeTicker),NULL,collectApiBody);
+  server.on("/API/sd", HTTP_GET|HTTP_POST,timed(handleAPISd,routeSd));
+  server.on("/API/effects", HTTP_GET,timed(handleAPIEffects,routeEffects));
+  server.on("/API/effects", HTTP_PUT|HTTP_POST,timed(handleAPIEffects,routeEffects),NULL,collectApiBody);
 
   // Set Wifi server default handler if request address is not found
 	server.onNotFound(handleNotFound);
@@ -442,6 +2272,259 @@ void setup(void) {
   // Start listening for connections
 	server.begin();
 
+  // From here on the heap should not grow, see sampleHeap()
+  heapUsedHigh.set(rp2040.getUsedHeap());
+  heapBaselineTaken = true;
+
+}
+
+// Records the estimated current of the image just drawn
+void recordFrameCurrent(){
+  frameCurrent.set(bmpImageDisplay.lastFrameMilliamps());
+  if(bmpImageDisplay.lastFrameLimited()){
+    powerLimited.add(1);
+  }
+}
+
+// Shows live frames as they arrive, returning to the previous mode when
+// the client stops sending
+void showLiveFrames(){
+  if(!liveStreaming){
+    liveStreaming = true;
+    stateChanged();
+  }
+  const uint16_t* frame = liveFrames.takeFrame();
+  if(frame!=NULL){
+    bmpImageDisplay.drawFrame(frame,frameWidth,frameHeight,matrix);
+    recordFrameCurrent();
+    showFrame();
+    return;
+  }
+  if(liveFrames.millisSinceLastFrame()>streamTimeoutMillis){
+    liveStreaming = false;
+    lastLoopMode = 0; // The mode starts over
+    stateChanged();
+    return;
+  }
+  if(!serviceBackgroundTasks()){
+    delayMicroseconds(100);
+  }
+}
+
+// Waits until the next image must be made ready, using the time for
+// background work. Returns false if live frames or another mode took over.
+bool waitToPrepare(bool image = true){
+  int32_t wait = (int32_t)(imagePace.prepareAt()-micros());
+  return wait<=0 || slideShowWait(wait/1000,image && bmpImageDisplay.isDithering());
+}
+
+// Shows the frame drawn into the matrix buffer once it is due, the next
+// one is due delayMillis later. Background work only runs while it fits
+// in the time left, the rest is waited exactly.
+void showWhenDue(uint32_t delayMillis){
+  int32_t slack = imagePace.slack(micros());
+  if(slack>=0){
+    frameSlack.record(slack);
+  }else{
+    framesLate.add(1);
+  }
+  while((slack = imagePace.slack(micros()))>frameScheduleMarginMicros){
+    if(!serviceBackgroundTasks()){
+      delay(1);
+    }
+  }
+  if(slack>0){
+    delayMicroseconds(slack);
+  }
+  imagePace.shown(micros(),delayMillis*1000);
+  showFrame();
+}
+
+// Decodes the image at path and shows it when it is due
+void showImageWhenDue(const char *path, int delayMillis){
+  uint32_t start = micros();
+  if(bmpImageDisplay.prepareImage(path,matrix)){
+    // The error is on the matrix, it stays for a whole delay
+    imagePace.shown(micros(),(uint32_t)delayMillis*1000);
+    return;
+  }
+  imagePace.prepared(micros()-start);
+  if(bmpImageDisplay.lastDecodeMicros()>0){
+    decodeTime.record(bmpImageDisplay.lastDecodeMicros());
+  }
+  composeTime.record(bmpImageDisplay.lastComposeMicros());
+  sdReadCalls.record(bmpImageDisplay.lastReadCalls());
+  sdReadBytes.record(bmpImageDisplay.lastReadBytes());
+  recordFrameCurrent();
+  showWhenDue(delayMillis);
+  saveSnapshot(path);
+}
+
+// Shows the next image of the playlist when it is due, delayMillis after
+// the previous one was due. The time to decode and draw it comes out of
+// the wait, see frameScheduler.h.
+void showNextImage(playlist &list, const char *folder, int delayMillis, bool modeStarted){
+  if(modeStarted){
+    imagePace.restart();
+  }
+  // The image on the matrix stays until the next one must be made ready
+  if(!waitToPrepare()){
+    return; // Live frames or another mode take over
+  }
+  refreshPlaylist(list,folder);
+  const char* name = list.next();
+  if(name==NULL){
+    slideShowWait(delayMillis);
+    return;
+  }
+  pathBuilder path(folder,name);
+  if(path.isTruncated()){
+    logError(logModuleSd,"Path too long: %s",name);
+    imagePace.shown(micros(),(uint32_t)delayMillis*1000);
+    return;
+  }
+  showImageWhenDue(path.c_str(),delayMillis);
+}
+
+// Shows the next frame of the animation mode when it is due. Packs are
+// played through with their own frame delays, single images are shown
+// for animationFrameDelay.
+void showNextAnimationFrame(bool modeStarted){
+  if(modeStarted){
+    imagePace.restart();
+    animationFrames.close();
+  }
+  if(!waitToPrepare()){
+    return; // Live frames or another mode take over
+  }
+  if(!animationFrames.isOpen() || animationFrames.isFinished()){
+    refreshPlaylist(animationPlaylist,animationsFilePath);
+    const char* name = animationPlaylist.next();
+    if(name==NULL){
+      slideShowWait(animationFrameDelay);
+      return;
+    }
+    pathBuilder path(animationsFilePath,name);
+    if(path.isTruncated()){
+      logError(logModuleSd,"Path too long: %s",name);
+      imagePace.shown(micros(),(uint32_t)animationFrameDelay*1000);
+      return;
+    }
+    if(!animationPack::isPackName(name)){
+      animationFrames.close();
+      showImageWhenDue(path.c_str(),animationFrameDelay);
+      return;
+    }
+    if(animationFrames.isOpen() && strcmp(path.c_str(),animationFrames.path())==0){
+      // The same pack again, its index is still loaded
+      animationFrames.rewind();
+    }else if(animationFrames.open(path.c_str())){
+      errorShow("Animation pack is corrupt!",matrix,render.brightness);
+      imagePace.shown(micros(),(uint32_t)animationFrameDelay*1000);
+      return;
+    }
+  }
+  uint16_t delayMillis = animationFrameDelay;
+  uint32_t start = micros();
+  const uint16_t *frame = animationFrames.readNextFrame(delayMillis);
+  uint32_t readMicros = micros()-start;
+  if(frame==NULL){
+    animationFrames.close();
+    errorShow("Animation frame failed to be read",matrix,render.brightness);
+    imagePace.shown(micros(),(uint32_t)animationFrameDelay*1000);
+    return;
+  }
+  bmpImageDisplay.prepareFrame(frame,matrix);
+  imagePace.prepared(micros()-start);
+  packReadTime.record(readMicros);
+  composeTime.record(bmpImageDisplay.lastComposeMicros());
+  sdReadCalls.record(1);
+  sdReadBytes.record(animationFrames.frameBytes());
+  recordFrameCurrent();
+  showWhenDue(delayMillis);
+}
+
+// Returns the 565 color of rgb (0xRRGGBB) at the brightness. Every
+// channel that isn't off is rounded up to a level the bit depth can
+// show, Protomatter only uses the top bits of each channel.
+uint16_t levelColor(uint32_t rgb){
+  uint8_t channels[3];
+  for(uint8_t i=0;i<3;i++){
+    uint32_t value = ((rgb >> (16-8*i)) & 0xFF)*render.brightness;
+    uint8_t levels = (1<<min(matrixCurrent.bitDepth,(uint8_t)(i==1 ? 6 : 5)))-1;
+    uint8_t level = (value*levels+65024)/65025;
+    channels[i] = (level*255)/levels;
+  }
+  return matrix.color565(channels[0],channels[1],channels[2]);
+}
+
+// Draws the next generation of the game of life, starting a new random
+// game when the current one has settled down
+void showNextGeneration(bool modeStarted){
+  if(modeStarted || lifeCellsUpdated<=simulationMinUpdates){
+    lifeGame.setColor(levelColor(0xFF0000));
+    lifeGame.initSeed(true);
+  }
+  lifeCellsUpdated = lifeGame.calcNextGen();
+  lifeGame.drawCurGen();
+  showFrame();
+  slideShowWait(simulationStepMillis);
+}
+
+// Scrolls the ticker message. A frame is only drawn once the message
+// moved by a whole pixel, at most every tickerFrameMillis, and the wait
+// until the next pixel is used for background work.
+void showTickerFrame(bool modeStarted){
+  if(modeStarted){
+    tickerStartMillis = millis();
+    tickerRedraw = true;
+  }
+  uint32_t elapsed = millis()-tickerStartMillis;
+  uint32_t speed = render.tickerSpeed;
+  uint64_t moved = (uint64_t)elapsed*speed/1000;
+  int32_t start = (int32_t)(moved%ticker.cycleLength())-canvasWidth;
+  uint16_t color = levelColor(render.tickerColor);
+  if(tickerRedraw || start!=tickerShown || color!=tickerShownColor){
+    ticker.setColors(color,0);
+    ticker.draw(canvas,start);
+    showFrame();
+    tickerShown = start;
+    tickerShownColor = color;
+    tickerRedraw = false;
+  }
+  // Time at which the message moves by the next pixel
+  uint32_t nextMillis = ((moved+1)*1000+speed-1)/speed;
+  slideShowWait(max(nextMillis-elapsed,(uint32_t)tickerFrameMillis));
+}
+
+// Draws the next frame of the effect straight into the matrix buffer and
+// shows it on the 60 fps pace, like the frames of an animation. The time
+// it took to draw is measured against effectBudgetMicros.
+void showNextEffectFrame(bool modeStarted){
+  if(modeStarted){
+    imagePace.restart();
+    effects.restart();
+    effectFrameStart = micros();
+  }
+  if(!waitToPrepare(false)){
+    return; // Live frames or another mode take over
+  }
+  // The palette holds the colors at the brightness and the bit depth
+  uint32_t key = (render.brightness << 16) | (matrixCurrent.bitDepth << 8);
+  if(key!=effectPaletteKey){
+    effects.shadePalette(levelColor);
+    effectPaletteKey = key;
+  }
+  uint32_t start = micros();
+  effects.render(start-effectFrameStart);
+  effectFrameStart = start;
+  uint32_t renderMicros = micros()-start;
+  effectRenderTime.record(renderMicros);
+  if(renderMicros>effectBudgetMicros){
+    effectOverBudget.add(1);
+  }
+  imagePace.prepared(renderMicros);
+  showWhenDue(effectFrameMillis);
 }
 
 // Run forever!
@@ -452,39 +2535,50 @@ void loop(void) {
   // Same goes for the LED matrix image displaying (protomatter)
   // routines
 
-  SD.ls(LS_R);
-  cout<<"\n";
-  
-  // Open every bitmap image in the "bitmaps" folder
-  // Open bitmaps directory
-  char strBuffer[100]; // buffer to store file paths
-  bitmapFilePath.toCharArray(strBuffer,100);
-  cout<<strBuffer<<"\n";
-  if (!dir.open(strBuffer)){
-    errorShow("Bitmap dir didn't open",matrix);
-    dir.close(); // close in case there is a floating file resource
-  }
-  // Go through every bitmap and display it
-  matrixMode = 1;
-
-  while(file.openNext(&dir,O_RDONLY)){
-    // Get the file path name
-    file.getName(strBuffer,100);
-    String path = bitmapFilePath+"/"+strBuffer;
-    if(file.isDir()){
-      // We do not display directories!
-      file.close();
-      break;
+  // Changes from the web handlers take effect between frames
+  applyCommands(commandBudgetMicros);
+  // The bitmap listing of the API needs the playlist in every mode
+  refreshPlaylist(bitmapPlaylist,bitmapFilePath);
+
+  // Live frames pushed by a client take over the matrix until they stop
+  if(liveFrames.hasFrame() || liveStreaming){
+    // Live frames are images too
+    if(!configureMatrix(modeBitmap)){
+      showLiveFrames();
+    }else if(!serviceBackgroundTasks()){
+      delay(1);
     }
-    file.close();
-    path.toCharArray(strBuffer,100);
-    //cout<<strBuffer<<"\n";
-    bmpImageDisplay.displayImage(strBuffer,matrix);
-    delay(slideShowDelay);
+    return;
   }
 
-  // delete all files in the folder if the delete flag is
-
-  dir.close();
+  uint8_t mode = render.mode;
+  bool modeStarted = mode!=lastLoopMode;
+  lastLoopMode = mode;
+  if(configureMatrix(mode)){
+    // Nothing to draw on until the matrix starts again, the web server
+    // keeps going meanwhile
+    if(!serviceBackgroundTasks()){
+      delay(1);
+    }
+    lastLoopMode = 0; // The mode starts over once it can be drawn
+    return;
+  }
+  switch(mode){
+    case modeAnimation:
+      showNextAnimationFrame(modeStarted);
+      break;
+    case modeSimulation:
+      showNextGeneration(modeStarted);
+      break;
+    case modeTicker:
+      showTickerFrame(modeStarted);
+      break;
+    case modeEffects:
+      showNextEffectFrame(modeStarted);
+      break;
+    default:
+      showNextImage(bitmapPlaylist,bitmapFilePath,render.slideShowDelay,modeStarted);
+      break;
+  }
 
 }
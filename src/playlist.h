@@ -0,0 +1,149 @@
+// Contains the class that keeps the list of images shown by the slideshow
+#include <Arduino.h>
+#include <SdFat.h> // Adafruit's Fork of SD
+
+// Maximum number of images and file name length kept in the playlist
+#define playlistMaxEntries 128
+#define playlistNameLen 48
+
+// In RAM list of the image file names of a folder, so the slideshow does
+// not have to walk the FAT directory for every image.
+// New names are staged first and published together, which lets a batch
+// upload update the playlist once when the whole request is done.
+class playlist{
+    private:
+        char names[playlistMaxEntries][playlistNameLen];
+        volatile uint16_t published = 0; // Entries visible to the slideshow
+        uint16_t staged = 0; // Total entries, including the staged ones
+        uint16_t position = 0; // Next entry to be shown
+        volatile bool dirty = true; // Must be rebuilt from the SD card
+        volatile uint32_t version = 0; // Changes every time the list changes
+        int16_t find(const char *name, uint16_t end);
+    public:
+        int rebuild(const char *folder);
+        bool stage(const char *name);
+        void publish();
+        void discardStaged();
+        void clear();
+        void markDirty() { dirty = true; }
+        bool isDirty() { return dirty; }
+        const char* next();
+        bool seek(const char *name);
+        uint16_t size() { return published; }
+        const char* entry(uint16_t index);
+        uint32_t getVersion() { return version; }
+};
+
+int16_t playlist::find(const char *name, uint16_t end){
+    for(uint16_t i=0;i<end;i++){
+        if(strncmp(names[i],name,playlistNameLen)==0){
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Reads the file names of the folder from the SD card, replacing the
+// current list. Directories and names too long to store are skipped.
+// Returns 0 on success, 1 if the folder could not be opened.
+int playlist::rebuild(const char *folder){
+    File32 dir;
+    File32 entryFile;
+    uint16_t count = 0;
+    dirty = false;
+    published = 0;
+    staged = 0;
+    if(!dir.open(folder,O_RDONLY)){
+        version++;
+        return 1;
+    }
+    while(count<playlistMaxEntries && entryFile.openNext(&dir,O_RDONLY)){
+        if(!entryFile.isDir()){
+            size_t len = entryFile.getName(names[count],playlistNameLen);
+            if(len>0 && len<playlistNameLen-1){
+                count++;
+            }
+        }
+        entryFile.close();
+    }
+    dir.close();
+    staged = count;
+    published = count;
+    if(position>=published){
+        position = 0;
+    }
+    version++;
+    return 0;
+}
+
+// Adds a name after the published entries, it is not shown until
+// publish() is called. Names already in the list are not added twice.
+// Returns false if the list is full or the name is too long.
+bool playlist::stage(const char *name){
+    if(strlen(name)>=playlistNameLen){
+        return false;
+    }
+    if(find(name,staged)>=0){
+        return true;
+    }
+    if(staged>=playlistMaxEntries){
+        return false;
+    }
+    strncpy(names[staged],name,playlistNameLen);
+    staged++;
+    return true;
+}
+
+// Makes every staged entry visible to the slideshow at once
+void playlist::publish(){
+    if(staged!=published){
+        published = staged;
+        version++;
+    }
+}
+
+// Drops the entries staged since the last publish
+void playlist::discardStaged(){
+    staged = published;
+}
+
+// Empties the list, used when the folder is cleared
+void playlist::clear(){
+    published = 0;
+    staged = 0;
+    position = 0;
+    dirty = false;
+    version++;
+}
+
+// Returns the next name of the slideshow, wrapping around at the end,
+// or NULL if the list is empty
+const char* playlist::next(){
+    uint16_t count = published;
+    if(count==0){
+        return NULL;
+    }
+    if(position>=count){
+        position = 0;
+    }
+    return names[position++];
+}
+
+// Makes name the next entry returned by next().
+// Returns false if it isn't in the list.
+bool playlist::seek(const char *name){
+    int16_t index = find(name,published);
+    if(index<0){
+        return false;
+    }
+    position = index;
+    return true;
+}
+
+// Returns the name at the index or NULL if out of range
+const char* playlist::entry(uint16_t index){
+    if(index>=published){
+        return NULL;
+    }
+    return names[index];
+}
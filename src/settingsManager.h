@@ -1,86 +1,253 @@
 // Contains the class that is responsable of managing the settings file in the matrix
 #include <Arduino.h>
 #include <SdFat.h> // Adafruit's Fork of SD
+#include <logger.h>
+
+// The settings kept across reboots
+struct storedSettings{
+    uint8_t brightness = 50;
+    uint8_t mode = 1; // Bitmap slideshow
+    int32_t slideShowDelay = 1000;
+};
+
+// The journal is a file of fixed size holding settingsSlots records, every
+// change is written into the next free slot and the last valid record
+// wins. The file never grows, so a change is a single sector write.
+#define settingsRecordSize 16
+#define settingsSlots 256
+#define settingsJournalSize (settingsRecordSize*settingsSlots)
+#define settingsRecordMagic 0x5E
+// Changes are written once no other change came for this long, so a
+// slider dragged across the app only writes its final value
+#define settingsDebounceMillis 2000
+#define settingsPathLen 50
 
 // Provides support for reading and mantaining the settings files
 // Functions should only be called after the SD card has been initialiazed
+// The settings are read once at boot, after that reading them only
+// touches RAM. Only the render loop may call save() and service().
 class settingsManager{
     private:
-        String rootDir = ""; // Default is root dir
-        String settingsFilename = "settings.txt";
-        String settings = "";
-        File32 settingsFile;
-    public:
-        int createSettingsFile(String name, String dir);
-        int saveArray();
-        int getArrayIndexVal(int index);
-    private:
-        int saveSettingsFile();
+        SdFat32 *SDCard;
+        char journalPath[settingsPathLen];
+        char compactPath[settingsPathLen]; // Journal being rewritten by compact()
+        storedSettings settings; // Current values
+        storedSettings savedSettings; // Values in the newest record on the card
+        uint16_t nextSlot = 0; // Slot the next record goes into
+        bool dirty = false;
+        uint32_t changeMillis = 0; // Time of the last change
+
+        static uint32_t crc32(const uint8_t *data, size_t len);
+        static void encodeRecord(const storedSettings &values, uint8_t *record);
+        static bool decodeRecord(const uint8_t *record, storedSettings &values);
+        bool sameSettings(const storedSettings &a, const storedSettings &b);
+        int load();
+        int compact();
+        int writeRecord();
 
+    public:
+        settingsManager(SdFat32 *SDOpen);
+        int begin(const char *path);
+        const storedSettings& get() { return settings; }
+        void save(const storedSettings &values);
+        void service(uint32_t now);
+        int flush();
 };
 
-// Create the saving file in the SD Card
-int settingsManager::createSettingsFile(String name, String dir){
-   rootDir = dir;
-   settingsFilename = name;
-    char buff[50];
-    String fullPath = rootDir+"/"+settingsFilename;
-    Serial.println(fullPath);
-    fullPath.toCharArray(buff,50);
-    if(!settingsFile.exists(buff)){
-        Serial.println("File created");
-        settingsFile.open(buff,O_WRITE|O_CREAT);
-        settingsFile.close();
+settingsManager::settingsManager(SdFat32 *SDOpen){
+    SDCard = SDOpen;
+    journalPath[0] = '\0';
+    compactPath[0] = '\0';
+}
+
+// CRC-32 (IEEE), bit by bit since records are tiny
+uint32_t settingsManager::crc32(const uint8_t *data, size_t len){
+    uint32_t crc = 0xFFFFFFFF;
+    for(size_t i=0;i<len;i++){
+        crc ^= data[i];
+        for(uint8_t bit=0;bit<8;bit++){
+            crc = (crc >> 1) ^ (0xEDB88320 & (0-(crc & 1)));
+        }
+    }
+    return ~crc;
+}
+
+// Record layout: magic, brightness, mode, a spare byte, the delay (32 bit
+// little endian), 4 spare bytes and the CRC-32 of the first 12 bytes
+void settingsManager::encodeRecord(const storedSettings &values, uint8_t *record){
+    memset(record,0,settingsRecordSize);
+    record[0] = settingsRecordMagic;
+    record[1] = values.brightness;
+    record[2] = values.mode;
+    for(uint8_t i=0;i<4;i++){
+        record[4+i] = (uint32_t)values.slideShowDelay >> (8*i);
+    }
+    uint32_t crc = crc32(record,12);
+    for(uint8_t i=0;i<4;i++){
+        record[12+i] = crc >> (8*i);
     }
-    return 0;
 }
 
-// Save all the settings to the SD Card file
-int settingsManager::saveSettingsFile(){
-    
-    // TODO: Implement save functionality!
+// Returns true if the record is valid, a record cut short by a reset
+// fails the check
+bool settingsManager::decodeRecord(const uint8_t *record, storedSettings &values){
+    if(record[0]!=settingsRecordMagic){
+        return false;
+    }
+    uint32_t crc = 0;
+    for(uint8_t i=0;i<4;i++){
+        crc |= (uint32_t)record[12+i] << (8*i);
+    }
+    if(crc!=crc32(record,12)){
+        return false;
+    }
+    values.brightness = record[1];
+    values.mode = record[2];
+    uint32_t delay = 0;
+    for(uint8_t i=0;i<4;i++){
+        delay |= (uint32_t)record[4+i] << (8*i);
+    }
+    values.slideShowDelay = (int32_t)delay;
+    return true;
+}
 
+bool settingsManager::sameSettings(const storedSettings &a, const storedSettings &b){
+    return a.brightness==b.brightness && a.mode==b.mode && a.slideShowDelay==b.slideShowDelay;
+}
+
+// Opens the journal at path (creating it if needed) and reads the saved
+// settings. The defaults are kept if nothing valid is stored.
+// Returns 0 on success.
+int settingsManager::begin(const char *path){
+    snprintf(journalPath,sizeof(journalPath),"%s",path);
+    snprintf(compactPath,sizeof(compactPath),"%s.new",path);
+    // Finish a compaction cut short by a reset: the new journal is only
+    // complete once the old one is gone
+    if(SDCard->exists(compactPath)){
+        if(SDCard->exists(journalPath)){
+            SDCard->remove(compactPath);
+        }else{
+            SDCard->rename(compactPath,journalPath);
+        }
+    }
+    if(!SDCard->exists(journalPath)){
+        logInfo(logModuleSettings,"Creating %s",journalPath);
+        savedSettings = settings;
+        return compact();
+    }
+    return load();
+}
+
+// Reads the whole journal in one go and keeps the last valid record
+int settingsManager::load(){
+    File32 journal;
+    if(!journal.open(journalPath,O_RDONLY)){
+        logError(logModuleSettings,"Settings file failed to be opened");
+        return 1;
+    }
+    uint8_t sector[512];
+    uint16_t slot = 0;
+    bool end = false;
+    int bytesRead;
+    while(!end && (bytesRead = journal.read(sector,sizeof(sector)))>0){
+        for(int i=0;i+settingsRecordSize<=bytesRead;i+=settingsRecordSize){
+            // Records are written in order, the first bad one is the end
+            if(!decodeRecord(&sector[i],settings)){
+                end = true;
+                break;
+            }
+            slot++;
+        }
+    }
+    uint32_t size = journal.fileSize();
+    journal.close();
+    savedSettings = settings;
+    nextSlot = slot;
+    logInfo(logModuleSettings,"Loaded settings from record %u",slot);
+    if(slot==0 || size!=settingsJournalSize){
+        // Empty or damaged, start over with what was read
+        return compact();
+    }
     return 0;
 }
 
-// The settings in the card are treated as an array, this
-// saves the array in the correct format to the SD Card file
-// TODO: Finish implementation
-int settingsManager::saveArray(){
-    char buff[50];
-    String fullPath = rootDir+"/"+settingsFilename;
-    Serial.println(fullPath);
-    fullPath.toCharArray(buff,50);
-    // Try to open the settings file if it exists
-    if(!settingsFile.open(buff,O_RDWR)){       
-        // Brightness was not saved
-        Serial.println("Settings file failed to be opened");
-        settingsFile.close();
+// Rewrites the journal with the saved settings as its only record.
+// Returns 0 on success.
+int settingsManager::compact(){
+    File32 journal;
+    if(!journal.open(compactPath,O_WRONLY | O_CREAT | O_TRUNC)){
+        logError(logModuleSettings,"Settings file failed to be created");
         return 1;
     }
+    // Contiguous clusters keep every later record a single sector write
+    journal.preAllocate(settingsJournalSize);
+    uint8_t sector[512];
+    bool ok = true;
+    for(uint16_t i=0;i<settingsJournalSize/sizeof(sector) && ok;i++){
+        memset(sector,0,sizeof(sector));
+        if(i==0){
+            encodeRecord(savedSettings,sector);
+        }
+        ok = journal.write(sector,sizeof(sector))==sizeof(sector);
+    }
+    if(!journal.close() || !ok){
+        logError(logModuleSettings,"Settings file failed to be written");
+        SDCard->remove(compactPath);
+        return 1;
+    }
+    SDCard->remove(journalPath);
+    SDCard->rename(compactPath,journalPath);
+    nextSlot = 1;
+    logDebug(logModuleSettings,"Settings journal compacted");
     return 0;
 }
 
-// Get's a value setting based on the index of the array it
-// is stored in
-// TODO: Finish implementation
-int settingsManager::getArrayIndexVal(int val){
-    char buff[50];
-    String fullPath = rootDir+"/"+settingsFilename;
-    Serial.println(fullPath);
-    fullPath.toCharArray(buff,50);
-    // Try to open the settings file if it exists
-    if(!settingsFile.open(buff,O_RDWR)){       
-        // Brightness was not saved
-        Serial.println("Settings file failed to be opened");
-        settingsFile.close();
+// Writes the current settings into the next slot of the journal,
+// compacting it first when it is full
+int settingsManager::writeRecord(){
+    savedSettings = settings;
+    if(nextSlot>=settingsSlots){
+        return compact();
+    }
+    File32 journal;
+    if(!journal.open(journalPath,O_RDWR)){
+        logError(logModuleSettings,"Settings file failed to be opened");
         return 1;
     }
-    while(settingsFile.available()){
-        Serial.print((char)settingsFile.read());
+    uint8_t record[settingsRecordSize];
+    encodeRecord(savedSettings,record);
+    bool ok = journal.seekSet((uint32_t)nextSlot*settingsRecordSize) &&
+              journal.write(record,sizeof(record))==sizeof(record);
+    if(!journal.close() || !ok){
+        logError(logModuleSettings,"Settings failed to be saved");
+        return 1;
     }
-    
-    Serial.println();
-    settingsFile.close();
+    nextSlot++;
+    logDebug(logModuleSettings,"Settings saved in record %u",nextSlot-1);
     return 0;
-}
\ No newline at end of file
+}
+
+// Changes the settings, they are written to the card by service() once
+// the changes stop coming
+void settingsManager::save(const storedSettings &values){
+    settings = values;
+    dirty = !sameSettings(settings,savedSettings);
+    changeMillis = millis();
+}
+
+// Writes the settings if they changed and the debounce time passed
+void settingsManager::service(uint32_t now){
+    if(dirty && now-changeMillis>=settingsDebounceMillis){
+        dirty = false;
+        writeRecord();
+    }
+}
+
+// Writes any waiting change right away
+int settingsManager::flush(){
+    if(!dirty){
+        return 0;
+    }
+    dirty = false;
+    return writeRecord();
+}
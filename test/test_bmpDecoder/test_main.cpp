@@ -0,0 +1,196 @@
+// Tests of the incremental BMP decoder, run with: pio test -e native
+#include <unity.h>
+#include <vector>
+#include <bmpStreamDecoder.h>
+
+#define testFrameWidth 8
+#define testFrameHeight 4
+
+bmpStreamDecoder decoder;
+uint16_t frame[testFrameWidth*testFrameHeight];
+
+static void putLE32(std::vector<uint8_t> &out, uint32_t value){
+  for(uint8_t i=0;i<4;i++){
+    out.push_back(value >> (8*i));
+  }
+}
+
+static void putLE16(std::vector<uint8_t> &out, uint16_t value){
+  out.push_back(value & 0xFF);
+  out.push_back(value >> 8);
+}
+
+// BMP file with a BITMAPINFOHEADER. extra follows the header (bit field
+// masks or the palette), pixels are the stored rows with their padding.
+static std::vector<uint8_t> makeBmp(int32_t width, int32_t height, uint16_t bits, uint32_t compression,
+                                    const std::vector<uint8_t> &extra, const std::vector<uint8_t> &pixels){
+  std::vector<uint8_t> file;
+  uint32_t offset = 14+40+extra.size();
+  file.push_back('B');
+  file.push_back('M');
+  putLE32(file,offset+pixels.size());
+  putLE32(file,0);
+  putLE32(file,offset);
+  putLE32(file,40);
+  putLE32(file,width);
+  putLE32(file,height);
+  putLE16(file,1);
+  putLE16(file,bits);
+  putLE32(file,compression);
+  putLE32(file,pixels.size());
+  putLE32(file,2835);
+  putLE32(file,2835);
+  putLE32(file,bits==8 ? extra.size()/4 : 0);
+  putLE32(file,0);
+  file.insert(file.end(),extra.begin(),extra.end());
+  file.insert(file.end(),pixels.begin(),pixels.end());
+  return file;
+}
+
+// 2x2 24 bit image, bottom row stored first: red green / blue white
+static std::vector<uint8_t> makeBmp24(){
+  std::vector<uint8_t> pixels = {
+    0xFF,0x00,0x00, 0xFF,0xFF,0xFF, 0,0, // blue, white
+    0x00,0x00,0xFF, 0x00,0xFF,0x00, 0,0  // red, green
+  };
+  return makeBmp(2,2,24,0,{},pixels);
+}
+
+// 2x2 8 bit image with a 4 color palette, indexes 0 1 / 2 3 top to bottom
+static std::vector<uint8_t> makeBmp8(){
+  std::vector<uint8_t> palette = {
+    0x00,0x00,0xFF,0, // red
+    0x00,0xFF,0x00,0, // green
+    0xFF,0x00,0x00,0, // blue
+    0xFF,0xFF,0xFF,0  // white
+  };
+  std::vector<uint8_t> pixels = {2,3,0,0, 0,1,0,0};
+  return makeBmp(2,2,8,0,palette,pixels);
+}
+
+static bmpDecodeStatus decode(const std::vector<uint8_t> &file, size_t chunk){
+  decoder.begin(frame,testFrameWidth,testFrameHeight);
+  for(size_t at=0;at<file.size();at+=chunk){
+    size_t len = file.size()-at<chunk ? file.size()-at : chunk;
+    bmpDecodeStatus status = decoder.feed(&file[at],len);
+    if(status!=bmpDecodeOk){
+      return status;
+    }
+  }
+  return decoder.finish();
+}
+
+static uint16_t pixelAt(int x, int y){
+  return frame[y*testFrameWidth+x];
+}
+
+void setUp(void){
+}
+
+void tearDown(void){
+}
+
+void testDecodes24BitBottomUp(void){
+  TEST_ASSERT_EQUAL(bmpDecodeOk,decode(makeBmp24(),4096));
+  TEST_ASSERT_EQUAL(2,decoder.width());
+  TEST_ASSERT_EQUAL(2,decoder.height());
+  TEST_ASSERT_EQUAL_HEX16(0xF800,pixelAt(0,0));
+  TEST_ASSERT_EQUAL_HEX16(0x07E0,pixelAt(1,0));
+  TEST_ASSERT_EQUAL_HEX16(0x001F,pixelAt(0,1));
+  TEST_ASSERT_EQUAL_HEX16(0xFFFF,pixelAt(1,1));
+  // The rest of the frame is cleared
+  TEST_ASSERT_EQUAL_HEX16(0x0000,pixelAt(2,0));
+}
+
+void testDecodesOneByteAtATime(void){
+  TEST_ASSERT_EQUAL(bmpDecodeOk,decode(makeBmp8(),1));
+  TEST_ASSERT_EQUAL_HEX16(0xF800,pixelAt(0,0));
+  TEST_ASSERT_EQUAL_HEX16(0x07E0,pixelAt(1,0));
+  TEST_ASSERT_EQUAL_HEX16(0x001F,pixelAt(0,1));
+  TEST_ASSERT_EQUAL_HEX16(0xFFFF,pixelAt(1,1));
+}
+
+// A BI_BITFIELDS image makes the decoder read the masks after the info
+// header, the next plain image must not be read the same way
+void testBitfieldsThen24Bit(void){
+  std::vector<uint8_t> masks;
+  putLE32(masks,0xF800);
+  putLE32(masks,0x07E0);
+  putLE32(masks,0x001F);
+  std::vector<uint8_t> pixels = {0x00,0xF8, 0xE0,0x07, 0x1F,0x00, 0xFF,0xFF};
+  TEST_ASSERT_EQUAL(bmpDecodeOk,decode(makeBmp(4,1,16,3,masks,pixels),4096));
+  TEST_ASSERT_EQUAL_HEX16(0xF800,pixelAt(0,0));
+  TEST_ASSERT_EQUAL_HEX16(0x07E0,pixelAt(1,0));
+  TEST_ASSERT_EQUAL_HEX16(0x001F,pixelAt(2,0));
+  TEST_ASSERT_EQUAL_HEX16(0xFFFF,pixelAt(3,0));
+
+  TEST_ASSERT_EQUAL(bmpDecodeOk,decode(makeBmp24(),4096));
+  TEST_ASSERT_EQUAL_HEX16(0xF800,pixelAt(0,0));
+  TEST_ASSERT_EQUAL_HEX16(0xFFFF,pixelAt(1,1));
+}
+
+// An image given up half way through its palette leaves nothing behind
+void testAbortedDecodeThenPalette(void){
+  std::vector<uint8_t> file = makeBmp8();
+  decoder.begin(frame,testFrameWidth,testFrameHeight);
+  TEST_ASSERT_EQUAL(bmpDecodeOk,decoder.feed(file.data(),14+40+2));
+  TEST_ASSERT_EQUAL(bmpDecodeOk,decode(file,4096));
+  TEST_ASSERT_EQUAL_HEX16(0xF800,pixelAt(0,0));
+  TEST_ASSERT_EQUAL_HEX16(0x07E0,pixelAt(1,0));
+  TEST_ASSERT_EQUAL_HEX16(0x001F,pixelAt(0,1));
+}
+
+void testDecodesRle8(void){
+  std::vector<uint8_t> palette = {0x00,0x00,0xFF,0, 0x00,0xFF,0x00,0};
+  // Bottom row: 3 of color 1, top row: literal 0 1 0, then end of bitmap
+  std::vector<uint8_t> pixels = {3,1, 0,0, 0,3,0,1,0,0, 0,1};
+  TEST_ASSERT_EQUAL(bmpDecodeOk,decode(makeBmp(3,2,8,1,palette,pixels),5));
+  TEST_ASSERT_EQUAL_HEX16(0xF800,pixelAt(0,0));
+  TEST_ASSERT_EQUAL_HEX16(0x07E0,pixelAt(1,0));
+  TEST_ASSERT_EQUAL_HEX16(0xF800,pixelAt(2,0));
+  TEST_ASSERT_EQUAL_HEX16(0x07E0,pixelAt(0,1));
+  TEST_ASSERT_EQUAL_HEX16(0x07E0,pixelAt(2,1));
+}
+
+// Images larger than the frame are shrunk keeping their aspect ratio
+void testShrinksLargeImages(void){
+  std::vector<uint8_t> pixels;
+  for(int y=0;y<8;y++){
+    for(int x=0;x<16;x++){
+      bool red = x%2==0 && y%2==1; // Bottom up, y 1 is the frame row 3
+      pixels.push_back(0x00);
+      pixels.push_back(0x00);
+      pixels.push_back(red ? 0xFF : 0x00);
+    }
+  }
+  TEST_ASSERT_EQUAL(bmpDecodeOk,decode(makeBmp(16,8,24,0,{},pixels),512));
+  for(int y=0;y<testFrameHeight;y++){
+    for(int x=0;x<testFrameWidth;x++){
+      TEST_ASSERT_EQUAL_HEX16(0xF800,pixelAt(x,y));
+    }
+  }
+}
+
+void testRejectsBrokenFiles(void){
+  std::vector<uint8_t> file = makeBmp24();
+  file[0] = 'X';
+  TEST_ASSERT_EQUAL(bmpDecodeNotBmp,decode(file,4096));
+  TEST_ASSERT_EQUAL(bmpDecodeCorrupt,decode(makeBmp(bmpMaxDimension+1,1,24,0,{},{}),4096));
+  TEST_ASSERT_EQUAL(bmpDecodeUnsupported,decode(makeBmp(2,2,4,0,{},{}),4096));
+  // Cut short before the last row
+  file = makeBmp24();
+  file.resize(file.size()-8);
+  TEST_ASSERT_EQUAL(bmpDecodeCorrupt,decode(file,4096));
+}
+
+int main(void){
+  UNITY_BEGIN();
+  RUN_TEST(testDecodes24BitBottomUp);
+  RUN_TEST(testDecodesOneByteAtATime);
+  RUN_TEST(testBitfieldsThen24Bit);
+  RUN_TEST(testAbortedDecodeThenPalette);
+  RUN_TEST(testDecodesRle8);
+  RUN_TEST(testShrinksLargeImages);
+  RUN_TEST(testRejectsBrokenFiles);
+  return UNITY_END();
+}
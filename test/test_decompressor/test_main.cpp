@@ -0,0 +1,215 @@
+// Tests of the zlib and LZ4 stream decompressor, run with: pio test -e native
+#include <unity.h>
+#include <vector>
+#include <streamDecompressor.h>
+
+streamDecompressor decompressor;
+
+// Made with Python's zlib.compress() and the lz4 command line tool from
+// the text of makeText()
+static const uint8_t zlibDynamic[] = {
+  0x78,0xda,0x6d,0x51,0xd1,0x0e,0xc3,0x20,0x08,0xfc,0x15,0x7f,0xcd,0xcc,0x6e,0x92,
+  0xd4,0xba,0xa8,0x89,0xdb,0xdf,0x4f,0x39,0xac,0xd4,0xee,0x05,0x45,0x8e,0x3b,0x4e,
+  0x28,0xd8,0xd7,0x96,0x4d,0xb5,0x54,0x46,0x7c,0xa6,0x18,0x8c,0x3d,0x9c,0xa1,0x62,
+  0x8a,0xdf,0xda,0x95,0x82,0x2d,0x14,0x8f,0x6c,0xda,0x99,0xe8,0x03,0xc4,0xc3,0x26,
+  0x37,0x1e,0xaa,0xa7,0xfd,0x02,0x6c,0xad,0x5c,0x07,0x23,0x5f,0xdf,0xbb,0xfd,0x66,
+  0x89,0x4c,0x80,0x5a,0x17,0xca,0x3e,0xd6,0xcc,0x5a,0xad,0x4f,0x28,0xe7,0x9b,0xa2,
+  0x5d,0x52,0x60,0x10,0x41,0x7c,0x9f,0x75,0x69,0x61,0xe5,0x19,0x04,0xa4,0x00,0x98,
+  0xaa,0xcd,0x21,0xee,0x27,0x16,0x26,0x11,0x7b,0x45,0x79,0xeb,0x29,0x3f,0x9d,0x45,
+  0x8c,0x33,0x73,0x8c,0x31,0xac,0x32,0x5f,0x13,0xd0,0x3f,0x86,0x45,0x74,0x0c,0x53,
+  0x02,0x28,0x7b,0x51,0xca,0x88,0x9a,0x7e,0x75,0xa7,0x17,0xf3,0xc7,0x9f,0xea,0x17,
+  0x4d,0xfe,0xf8,0x21,0x7f,0x02,0xc7,0x87,0x3a,0xe5,0x42,0xed,0x54,0xaf,0xf3,0x22,
+  0xf6,0x03,0x64,0x04,0xdd,0x9c,
+};
+static const uint8_t zlibFixed[] = {
+  0x78,0xda,0xcb,0x48,0xcd,0xc9,0xc9,0x57,0xc8,0x40,0x27,0x01,0x68,0x03,0x08,0xb1,
+};
+static const uint8_t zlibStored[] = {
+  0x78,0x01,0x01,0x17,0x00,0xe8,0xff,0x68,0x65,0x6c,0x6c,0x6f,0x20,0x68,0x65,0x6c,
+  0x6c,0x6f,0x20,0x68,0x65,0x6c,0x6c,0x6f,0x20,0x68,0x65,0x6c,0x6c,0x6f,0x68,0x03,
+  0x08,0xb1,
+};
+static const uint8_t lz4Frame[] = {
+  0x04,0x22,0x4d,0x18,0x64,0x40,0xa7,0x08,0x01,0x00,0x00,0xb4,0x69,0x6d,0x61,0x67,
+  0x65,0x73,0x20,0x77,0x61,0x69,0x74,0x06,0x00,0xf2,0x12,0x66,0x72,0x6f,0x6d,0x20,
+  0x61,0x6e,0x64,0x20,0x69,0x74,0x20,0x74,0x68,0x65,0x20,0x61,0x6e,0x69,0x6d,0x61,
+  0x74,0x69,0x6f,0x6e,0x73,0x20,0x6d,0x61,0x74,0x72,0x69,0x78,0x22,0x00,0x44,0x63,
+  0x61,0x72,0x64,0x11,0x00,0x49,0x77,0x68,0x69,0x6c,0x29,0x00,0x22,0x69,0x74,0x20,
+  0x00,0x02,0x52,0x00,0x01,0x0b,0x00,0x53,0x70,0x6c,0x61,0x79,0x73,0x06,0x00,0x01,
+  0x41,0x00,0x02,0x1c,0x00,0x00,0x69,0x00,0x51,0x73,0x68,0x6f,0x77,0x73,0x6c,0x00,
+  0x24,0x69,0x74,0x53,0x00,0x06,0x14,0x00,0x07,0x80,0x00,0x0b,0x0f,0x00,0x02,0x24,
+  0x00,0x02,0x06,0x00,0x02,0x59,0x00,0x0e,0xac,0x00,0x0b,0x33,0x00,0x01,0x7a,0x00,
+  0x06,0x05,0x00,0x03,0x25,0x00,0x07,0x21,0x00,0x02,0x96,0x00,0x24,0x69,0x74,0xfe,
+  0x00,0x06,0x2c,0x00,0x02,0xe5,0x00,0x02,0x06,0x00,0x00,0x1a,0x00,0x07,0xdc,0x00,
+  0x23,0x74,0x68,0x13,0x00,0x05,0x1d,0x00,0x02,0x8f,0x00,0x06,0x10,0x00,0x02,0x87,
+  0x00,0x04,0xeb,0x00,0x01,0x50,0x00,0x29,0x69,0x74,0x32,0x01,0x02,0x89,0x01,0x00,
+  0x24,0x00,0x01,0x53,0x00,0x02,0x29,0x00,0x03,0x98,0x01,0x07,0x7a,0x00,0x02,0x06,
+  0x00,0x08,0x5f,0x00,0x0c,0xde,0x00,0x08,0x99,0x01,0x0f,0xe0,0x00,0x00,0x07,0x40,
+  0x00,0x03,0x74,0x00,0x01,0x79,0x01,0x04,0x7f,0x00,0x05,0x40,0x01,0x04,0x51,0x01,
+  0x17,0x64,0xc6,0x00,0x07,0xd4,0x01,0x08,0xcf,0x01,0x04,0x6d,0x00,0x50,0x61,0x74,
+  0x72,0x69,0x78,0x00,0x00,0x00,0x00,0x2a,0xc7,0x8c,0x1c,
+};
+static const uint8_t lz4RawBlock[] = { // "hello" stored uncompressed
+  0x04,0x22,0x4d,0x18,0x60,0x40,0x82,0x05,0x00,0x00,0x80,0x68,0x65,0x6c,0x6c,0x6f,
+  0x00,0x00,0x00,0x00,
+};
+
+// 100 words picked by an LCG, varied enough for zlib to use a dynamic
+// Huffman block
+static std::vector<uint8_t> makeText(){
+  static const char *words[] = {"the","matrix","shows","images","from","the","card",
+                                "and","plays","animations","while","it","waits"};
+  std::vector<uint8_t> text;
+  uint32_t x = 1;
+  for(int i=0;i<100;i++){
+    x = (x*1103515245+12345) & 0x7FFFFFFF;
+    const char *word = words[(x >> 16)%13];
+    if(i>0){
+      text.push_back(' ');
+    }
+    text.insert(text.end(),word,word+strlen(word));
+  }
+  return text;
+}
+
+static std::vector<uint8_t> textOf(const char *text){
+  return std::vector<uint8_t>(text,text+strlen(text));
+}
+
+// Feeds the stream chunk bytes at a time, taking the output as it comes.
+// Returns the status of finish().
+static decompressStatus inflate(decompressFormat format, const uint8_t *src, size_t len, size_t chunk,
+                                std::vector<uint8_t> &out){
+  out.clear();
+  decompressor.begin(format);
+  size_t at = 0;
+  while(at<len){
+    size_t n = len-at<chunk ? len-at : chunk;
+    uint32_t used = decompressor.feed(&src[at],n);
+    at += used;
+    const uint8_t *data;
+    uint32_t ready;
+    while((ready = decompressor.output(&data))>0){
+      out.insert(out.end(),data,data+ready);
+      decompressor.release(ready);
+    }
+    if(decompressor.getStatus()!=decompressOk){
+      break;
+    }
+  }
+  return decompressor.finish();
+}
+
+// zlib stream of stored blocks, for output larger than the window
+static std::vector<uint8_t> makeStoredZlib(const std::vector<uint8_t> &data){
+  std::vector<uint8_t> stream = {0x78,0x01};
+  size_t at = 0;
+  do{
+    size_t n = data.size()-at<65535 ? data.size()-at : 65535;
+    bool last = at+n==data.size();
+    stream.push_back(last ? 1 : 0);
+    stream.push_back(n & 0xFF);
+    stream.push_back(n >> 8);
+    stream.push_back(~n & 0xFF);
+    stream.push_back((~n >> 8) & 0xFF);
+    stream.insert(stream.end(),data.begin()+at,data.begin()+at+n);
+    at += n;
+  }while(at<data.size());
+  uint32_t a = 1, b = 0;
+  for(uint8_t byte : data){
+    a = (a+byte)%65521;
+    b = (b+a)%65521;
+  }
+  uint32_t adler = (b << 16) | a;
+  for(int i=3;i>=0;i--){
+    stream.push_back(adler >> (8*i));
+  }
+  return stream;
+}
+
+void setUp(void){
+}
+
+void tearDown(void){
+}
+
+void testZlibDynamicBlock(void){
+  std::vector<uint8_t> out;
+  TEST_ASSERT_EQUAL(decompressOk,inflate(decompressDeflate,zlibDynamic,sizeof(zlibDynamic),4096,out));
+  TEST_ASSERT_TRUE(out==makeText());
+}
+
+void testZlibFixedAndStoredBlocks(void){
+  std::vector<uint8_t> out;
+  TEST_ASSERT_EQUAL(decompressOk,inflate(decompressDeflate,zlibFixed,sizeof(zlibFixed),4096,out));
+  TEST_ASSERT_TRUE(out==textOf("hello hello hello hello"));
+  TEST_ASSERT_EQUAL(decompressOk,inflate(decompressDeflate,zlibStored,sizeof(zlibStored),4096,out));
+  TEST_ASSERT_TRUE(out==textOf("hello hello hello hello"));
+}
+
+// Every chunk size gives the same output, the state machine can stop
+// anywhere
+void testZlibAnyChunkSize(void){
+  std::vector<uint8_t> out;
+  for(size_t chunk=1;chunk<=17;chunk++){
+    TEST_ASSERT_EQUAL(decompressOk,inflate(decompressDeflate,zlibDynamic,sizeof(zlibDynamic),chunk,out));
+    TEST_ASSERT_TRUE(out==makeText());
+  }
+}
+
+// Output beyond the window is only made once the caller took the output
+// before it
+void testZlibLargerThanWindow(void){
+  std::vector<uint8_t> data;
+  for(uint32_t i=0;i<decompressWindowSize*3+100;i++){
+    data.push_back((i*31+(i >> 8)) & 0xFF);
+  }
+  std::vector<uint8_t> stream = makeStoredZlib(data);
+  std::vector<uint8_t> out;
+  TEST_ASSERT_EQUAL(decompressOk,inflate(decompressDeflate,stream.data(),stream.size(),1000,out));
+  TEST_ASSERT_TRUE(out==data);
+  TEST_ASSERT_EQUAL_UINT32(data.size(),decompressor.totalOut());
+}
+
+void testZlibBadStreams(void){
+  std::vector<uint8_t> out;
+  std::vector<uint8_t> stream(zlibDynamic,zlibDynamic+sizeof(zlibDynamic));
+  stream.back() ^= 0x01; // Adler-32
+  TEST_ASSERT_EQUAL(decompressCorrupt,inflate(decompressDeflate,stream.data(),stream.size(),4096,out));
+  // Cut short
+  TEST_ASSERT_EQUAL(decompressCorrupt,inflate(decompressDeflate,zlibDynamic,sizeof(zlibDynamic)-10,4096,out));
+  // Not zlib at all
+  TEST_ASSERT_EQUAL(decompressCorrupt,inflate(decompressDeflate,lz4Frame,sizeof(lz4Frame),4096,out));
+  // Preset dictionary
+  const uint8_t dictionary[] = {0x78,0xBB,0,0,0,0};
+  TEST_ASSERT_EQUAL(decompressUnsupported,inflate(decompressDeflate,dictionary,sizeof(dictionary),4096,out));
+}
+
+void testLz4Frame(void){
+  std::vector<uint8_t> out;
+  for(size_t chunk=1;chunk<=4096;chunk*=8){
+    TEST_ASSERT_EQUAL(decompressOk,inflate(decompressLz4,lz4Frame,sizeof(lz4Frame),chunk,out));
+    TEST_ASSERT_TRUE(out==makeText());
+  }
+  TEST_ASSERT_EQUAL(decompressOk,inflate(decompressLz4,lz4RawBlock,sizeof(lz4RawBlock),3,out));
+  TEST_ASSERT_TRUE(out==textOf("hello"));
+}
+
+void testLz4BadFrames(void){
+  std::vector<uint8_t> out;
+  TEST_ASSERT_EQUAL(decompressCorrupt,inflate(decompressLz4,zlibDynamic,sizeof(zlibDynamic),4096,out));
+  // No end mark
+  TEST_ASSERT_EQUAL(decompressCorrupt,inflate(decompressLz4,lz4Frame,sizeof(lz4Frame)-8,4096,out));
+}
+
+int main(void){
+  UNITY_BEGIN();
+  RUN_TEST(testZlibDynamicBlock);
+  RUN_TEST(testZlibFixedAndStoredBlocks);
+  RUN_TEST(testZlibAnyChunkSize);
+  RUN_TEST(testZlibLargerThanWindow);
+  RUN_TEST(testZlibBadStreams);
+  RUN_TEST(testLz4Frame);
+  RUN_TEST(testLz4BadFrames);
+  return UNITY_END();
+}
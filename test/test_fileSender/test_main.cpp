@@ -0,0 +1,59 @@
+// Tests of the Range header parsing of the file sender, run with:
+// pio test -e native
+#include <unity.h>
+#include <fileSender.h>
+
+void setUp(void){
+}
+
+void tearDown(void){
+}
+
+void testRangeFirstLast(void){
+  int32_t range[3] = {};
+  TEST_ASSERT_TRUE(fileSender::parseRange("bytes=1000-20999",range));
+  TEST_ASSERT_EQUAL(1,range[0]);
+  TEST_ASSERT_EQUAL(1000,range[1]);
+  TEST_ASSERT_EQUAL(20999,range[2]);
+  // To the end of the file
+  TEST_ASSERT_TRUE(fileSender::parseRange("bytes=39990-",range));
+  TEST_ASSERT_EQUAL(1,range[0]);
+  TEST_ASSERT_EQUAL(39990,range[1]);
+  TEST_ASSERT_EQUAL(-1,range[2]);
+}
+
+void testRangeSuffix(void){
+  int32_t range[3] = {};
+  TEST_ASSERT_TRUE(fileSender::parseRange("bytes=-100",range));
+  TEST_ASSERT_EQUAL(2,range[0]);
+  TEST_ASSERT_EQUAL(100,range[1]);
+}
+
+// Other units and several ranges get the whole file
+void testRangeWholeFile(void){
+  int32_t range[3] = {7,7,7};
+  TEST_ASSERT_TRUE(fileSender::parseRange("items=0-5",range));
+  TEST_ASSERT_EQUAL(0,range[0]);
+  range[0] = 7;
+  TEST_ASSERT_TRUE(fileSender::parseRange("bytes=0-0,5-6",range));
+  TEST_ASSERT_EQUAL(0,range[0]);
+}
+
+void testRangeMalformed(void){
+  int32_t range[3];
+  TEST_ASSERT_FALSE(fileSender::parseRange("bytes=5-x",range));
+  TEST_ASSERT_FALSE(fileSender::parseRange("bytes=x-5",range));
+  TEST_ASSERT_FALSE(fileSender::parseRange("bytes=-",range));
+  TEST_ASSERT_FALSE(fileSender::parseRange("bytes=5",range));
+  TEST_ASSERT_FALSE(fileSender::parseRange("bytes=--5",range));
+  TEST_ASSERT_FALSE(fileSender::parseRange("bytes=1-2 ",range));
+}
+
+int main(void){
+  UNITY_BEGIN();
+  RUN_TEST(testRangeFirstLast);
+  RUN_TEST(testRangeSuffix);
+  RUN_TEST(testRangeWholeFile);
+  RUN_TEST(testRangeMalformed);
+  return UNITY_END();
+}
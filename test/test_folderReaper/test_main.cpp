@@ -0,0 +1,109 @@
+// Tests of the background folder deletion on the host SD card, run with:
+// pio test -e native
+#include <unity.h>
+#include <ftw.h>
+#include <SdFat.h>
+#include <folderReaper.h>
+
+SdFat32 SD;
+
+static int removeEntry(const char *path, const struct stat *, int, struct FTW *){
+  return remove(path);
+}
+
+// A new empty card in a temporary directory for every test
+void setUp(void){
+  char dir[] = "/tmp/folderReaperTestXXXXXX";
+  hostSd::rootDir = mkdtemp(dir);
+  SD.begin(SdSpiConfig(17,DEDICATED_SPI,SD_SCK_MHZ(16)));
+}
+
+void tearDown(void){
+  nftw(hostSd::rootDir.c_str(),removeEntry,8,FTW_DEPTH | FTW_PHYS);
+}
+
+static void makeFile(const char *path){
+  File32 file;
+  TEST_ASSERT_TRUE(file.open(path,O_WRONLY | O_CREAT));
+  file.write((const uint8_t*)"data",4);
+  file.close();
+}
+
+// Number of entries in the folder, -1 if it can't be opened
+static int countEntries(const char *path){
+  File32 dir, entry;
+  if(!dir.open(path,O_RDONLY)){
+    return -1;
+  }
+  int count = 0;
+  while(entry.openNext(&dir,O_RDONLY)){
+    count++;
+    entry.close();
+  }
+  return count;
+}
+
+// Like SdFat, folders can only be opened for reading
+void testFoldersOpenReadOnly(void){
+  TEST_ASSERT_TRUE(SD.mkdir("folder"));
+  File32 dir;
+  TEST_ASSERT_FALSE(dir.open("folder",O_WRONLY));
+  TEST_ASSERT_FALSE(dir.open("folder",O_RDWR));
+  TEST_ASSERT_TRUE(dir.open("folder",O_RDONLY));
+  TEST_ASSERT_TRUE(dir.isDir());
+  dir.close();
+  TEST_ASSERT_TRUE(SD.mkdir("folder/inner"));
+  File32 root, entry;
+  TEST_ASSERT_TRUE(root.open("folder",O_RDONLY));
+  TEST_ASSERT_FALSE(entry.openNext(&root,O_WRONLY));
+}
+
+void testReaperEmptiesSwappedFolders(void){
+  folderReaper reaper(&SD);
+  TEST_ASSERT_EQUAL(0,reaper.begin("trash"));
+  TEST_ASSERT_TRUE(SD.mkdir("bitmaps"));
+  makeFile("bitmaps/a.bmp");
+  makeFile("bitmaps/b.bmp");
+  TEST_ASSERT_TRUE(SD.mkdir("bitmaps/nested"));
+  TEST_ASSERT_TRUE(SD.mkdir("bitmaps/nested/deeper"));
+  makeFile("bitmaps/nested/c.bmp");
+  makeFile("bitmaps/nested/deeper/d.bmp");
+
+  TEST_ASSERT_EQUAL(0,reaper.swapOut("bitmaps"));
+  TEST_ASSERT_EQUAL(0,countEntries("bitmaps"));
+  TEST_ASSERT_TRUE(reaper.busy());
+  int steps = 0;
+  while(reaper.step(0) && steps<100){
+    steps++;
+  }
+  TEST_ASSERT_FALSE(reaper.busy());
+  TEST_ASSERT_EQUAL(0,countEntries("trash"));
+  TEST_ASSERT_EQUAL(4,reaper.removedCount());
+  // Files only go one at a time, the folders once they are empty
+  TEST_ASSERT_TRUE(steps>=6);
+}
+
+// What a reboot left in the trash is deleted again, stray files too
+void testReaperResumesAfterReboot(void){
+  TEST_ASSERT_TRUE(SD.mkdir("trash"));
+  TEST_ASSERT_TRUE(SD.mkdir("trash/d3"));
+  makeFile("trash/d3/a.bmp");
+  makeFile("trash/stray.txt");
+  folderReaper reaper(&SD);
+  TEST_ASSERT_EQUAL(0,reaper.begin("trash"));
+  while(reaper.step(1000000)){}
+  TEST_ASSERT_EQUAL(0,countEntries("trash"));
+  TEST_ASSERT_EQUAL(2,reaper.removedCount());
+  // Nothing to do until the next folder is swapped out
+  TEST_ASSERT_FALSE(reaper.step(1000000));
+  TEST_ASSERT_EQUAL(0,reaper.swapOut("bitmaps"));
+  TEST_ASSERT_EQUAL(0,countEntries("bitmaps"));
+}
+
+int main(void){
+  UNITY_BEGIN();
+  RUN_TEST(testFoldersOpenReadOnly);
+  RUN_TEST(testReaperEmptiesSwappedFolders);
+  RUN_TEST(testReaperResumesAfterReboot);
+  return UNITY_END();
+}
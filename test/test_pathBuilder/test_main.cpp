@@ -0,0 +1,47 @@
+// Tests of the fixed buffer path builder, run with: pio test -e native
+#include <unity.h>
+#include <string.h>
+#include <pathBuilder.h>
+
+void setUp(void){
+}
+
+void tearDown(void){
+}
+
+void testPathJoin(void){
+  pathBuilder path("bitmaps","image.bmp");
+  TEST_ASSERT_EQUAL_STRING("bitmaps/image.bmp",path.c_str());
+  TEST_ASSERT_EQUAL(17,path.length());
+  TEST_ASSERT_FALSE(path.isTruncated());
+  TEST_ASSERT_TRUE(path.parent());
+  TEST_ASSERT_EQUAL_STRING("bitmaps",path.c_str());
+  TEST_ASSERT_FALSE(path.parent());
+}
+
+// A path that doesn't fit is cut at the end of the buffer, marked, and
+// nothing more can be added to it
+void testPathTruncation(void){
+  char name[pathBuilderLen];
+  memset(name,'a',sizeof(name)-1);
+  name[sizeof(name)-1] = '\0';
+  pathBuilder path;
+  TEST_ASSERT_FALSE(path.join("bitmaps",name));
+  TEST_ASSERT_TRUE(path.isTruncated());
+  TEST_ASSERT_EQUAL(pathBuilderLen-1,path.length());
+  TEST_ASSERT_EQUAL(pathBuilderLen-1,strlen(path.c_str()));
+  TEST_ASSERT_FALSE(path.append("b"));
+  TEST_ASSERT_EQUAL(pathBuilderLen-1,path.length());
+  // Exactly full still fits
+  name[pathBuilderLen-1-strlen("bitmaps/")] = '\0';
+  TEST_ASSERT_TRUE(path.join("bitmaps",name));
+  TEST_ASSERT_FALSE(path.isTruncated());
+  TEST_ASSERT_EQUAL(pathBuilderLen-1,path.length());
+}
+
+int main(void){
+  UNITY_BEGIN();
+  RUN_TEST(testPathJoin);
+  RUN_TEST(testPathTruncation);
+  return UNITY_END();
+}
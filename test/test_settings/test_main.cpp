@@ -0,0 +1,161 @@
+// Tests of the settings journal on the host SD card, run with:
+// pio test -e native
+#include <unity.h>
+#include <ftw.h>
+#include <SdFat.h>
+#include <settingsManager.h>
+
+#define journalFile "settings.jnl"
+
+SdFat32 SD;
+
+static int removeEntry(const char *path, const struct stat *, int, struct FTW *){
+  return remove(path);
+}
+
+// A new empty card in a temporary directory for every test
+void setUp(void){
+  char dir[] = "/tmp/settingsTestXXXXXX";
+  hostSd::rootDir = mkdtemp(dir);
+  SD.begin(SdSpiConfig(17,DEDICATED_SPI,SD_SCK_MHZ(16)));
+}
+
+void tearDown(void){
+  nftw(hostSd::rootDir.c_str(),removeEntry,8,FTW_DEPTH | FTW_PHYS);
+}
+
+static storedSettings makeSettings(uint8_t brightness, uint8_t mode, int32_t delay){
+  storedSettings values;
+  values.brightness = brightness;
+  values.mode = mode;
+  values.slideShowDelay = delay;
+  return values;
+}
+
+static void assertSettings(const storedSettings &expected, const storedSettings &actual){
+  TEST_ASSERT_EQUAL_UINT8(expected.brightness,actual.brightness);
+  TEST_ASSERT_EQUAL_UINT8(expected.mode,actual.mode);
+  TEST_ASSERT_EQUAL_INT32(expected.slideShowDelay,actual.slideShowDelay);
+}
+
+// Settings a fresh manager reads back from the card
+static storedSettings reload(){
+  settingsManager manager(&SD);
+  TEST_ASSERT_EQUAL(0,manager.begin(journalFile));
+  return manager.get();
+}
+
+static uint32_t journalSize(const char *path){
+  File32 file;
+  if(!file.open(path,O_RDONLY)){
+    return 0;
+  }
+  return file.fileSize();
+}
+
+void testNewCardGetsDefaults(void){
+  storedSettings defaults;
+  assertSettings(defaults,reload());
+  TEST_ASSERT_EQUAL_UINT32(settingsJournalSize,journalSize(journalFile));
+}
+
+void testLastRecordWins(void){
+  settingsManager manager(&SD);
+  TEST_ASSERT_EQUAL(0,manager.begin(journalFile));
+  for(int i=1;i<=5;i++){
+    manager.save(makeSettings(10*i,2,500*i));
+    TEST_ASSERT_EQUAL(0,manager.flush());
+  }
+  assertSettings(makeSettings(50,2,2500),reload());
+}
+
+// A manager started from a journal carries on after its last record
+void testReplayThenAppend(void){
+  settingsManager first(&SD);
+  first.begin(journalFile);
+  first.save(makeSettings(20,3,100));
+  first.flush();
+
+  settingsManager second(&SD);
+  second.begin(journalFile);
+  assertSettings(makeSettings(20,3,100),second.get());
+  second.save(makeSettings(30,4,200));
+  second.flush();
+  assertSettings(makeSettings(30,4,200),reload());
+}
+
+// A record cut short by a reset ends the replay, the one before it holds
+void testTornRecordIsIgnored(void){
+  settingsManager manager(&SD);
+  manager.begin(journalFile);
+  manager.save(makeSettings(40,2,300));
+  manager.flush();
+  manager.save(makeSettings(41,3,301));
+  manager.flush();
+  // The second record is in slot 2, break its CRC
+  File32 file;
+  TEST_ASSERT_TRUE(file.open(journalFile,O_RDWR));
+  uint8_t byte = 0xAA;
+  file.seekSet(2*settingsRecordSize+13);
+  file.write(&byte,1);
+  file.close();
+  assertSettings(makeSettings(40,2,300),reload());
+}
+
+// The journal never grows: once every slot is used it is rewritten with
+// the newest settings as its only record
+void testCompactsWhenFull(void){
+  settingsManager manager(&SD);
+  manager.begin(journalFile);
+  for(int i=0;i<settingsSlots+10;i++){
+    manager.save(makeSettings(i & 0xFF,1+i%5,i));
+    TEST_ASSERT_EQUAL(0,manager.flush());
+    TEST_ASSERT_EQUAL_UINT32(settingsJournalSize,journalSize(journalFile));
+  }
+  int last = settingsSlots+9;
+  assertSettings(makeSettings(last & 0xFF,1+last%5,last),reload());
+}
+
+// A compaction cut short by a reset is finished at the next boot
+void testInterruptedCompaction(void){
+  settingsManager manager(&SD);
+  manager.begin(journalFile);
+  manager.save(makeSettings(60,5,700));
+  manager.flush();
+  // The new journal was written but the old one not removed yet: the new
+  // one may be incomplete, the old one is kept
+  settingsManager other(&SD);
+  other.begin("other.jnl");
+  TEST_ASSERT_TRUE(SD.rename("other.jnl",journalFile ".new"));
+  assertSettings(makeSettings(60,5,700),reload());
+  TEST_ASSERT_FALSE(SD.exists(journalFile ".new"));
+  // The old journal was removed but the new one not renamed yet
+  TEST_ASSERT_TRUE(SD.rename(journalFile,journalFile ".new"));
+  assertSettings(makeSettings(60,5,700),reload());
+  TEST_ASSERT_TRUE(SD.exists(journalFile));
+  TEST_ASSERT_FALSE(SD.exists(journalFile ".new"));
+}
+
+// Changes are only written once they stop coming
+void testSaveIsDebounced(void){
+  settingsManager manager(&SD);
+  manager.begin(journalFile);
+  manager.save(makeSettings(70,2,800));
+  uint32_t changed = millis();
+  manager.service(changed+settingsDebounceMillis-1);
+  assertSettings(storedSettings(),reload());
+  manager.service(changed+settingsDebounceMillis+1);
+  assertSettings(makeSettings(70,2,800),reload());
+}
+
+int main(void){
+  UNITY_BEGIN();
+  RUN_TEST(testNewCardGetsDefaults);
+  RUN_TEST(testLastRecordWins);
+  RUN_TEST(testReplayThenAppend);
+  RUN_TEST(testTornRecordIsIgnored);
+  RUN_TEST(testCompactsWhenFull);
+  RUN_TEST(testInterruptedCompaction);
+  RUN_TEST(testSaveIsDebounced);
+  return UNITY_END();
+}